@@ -0,0 +1,35 @@
+# Generates DER copies of the Telegram API certificates at build time and embeds them into an ESP-IDF component,
+# so the certificates are not decoded from base64 at runtime and the DER never drifts from certs/*.pem.
+#
+# In the CMakeLists.txt of the component that embeds the certificates:
+#   include(<path to reTgSend>/cmake/reTgSendCerts.cmake)
+#   retgsend_embed_der(${COMPONENT_LIB} <path to reTgSend>/certs/api_telegram_org.pem)
+# and in project_config.h:
+#   #define CONFIG_TELEGRAM_TLS_DER_START "_binary_api_telegram_org_der_start"
+#   #define CONFIG_TELEGRAM_TLS_DER_END "_binary_api_telegram_org_der_end"
+
+set(RETGSEND_PEM2DER "${CMAKE_CURRENT_LIST_DIR}/../tools/pem2der.py")
+
+function(retgsend_embed_der target pem)
+  get_filename_component(name "${pem}" NAME_WE)
+  set(der "${CMAKE_CURRENT_BINARY_DIR}/${name}.der")
+  # ESP-IDF sets PYTHON to the interpreter of its environment
+  if(DEFINED PYTHON)
+    set(python "${PYTHON}")
+  else()
+    find_package(Python3 REQUIRED COMPONENTS Interpreter)
+    set(python "${Python3_EXECUTABLE}")
+  endif()
+  add_custom_command(
+    OUTPUT "${der}"
+    COMMAND "${python}" "${RETGSEND_PEM2DER}" "${pem}" "${der}"
+    DEPENDS "${pem}" "${RETGSEND_PEM2DER}"
+    COMMENT "Converting ${name}.pem to DER"
+    VERBATIM)
+  add_custom_target(${name}_der DEPENDS "${der}")
+  add_dependencies(${target} ${name}_der)
+  if(COMMAND target_add_binary_data)
+    target_add_binary_data(${target} "${der}" BINARY DEPENDS "${der}")
+  endif()
+  set_property(DIRECTORY APPEND PROPERTY ADDITIONAL_CLEAN_FILES "${der}")
+endfunction()
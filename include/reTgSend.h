@@ -35,12 +35,140 @@
   #define CONFIG_TELEGRAM_OUTBOX_ENABLE 0
 #endif // CONFIG_TELEGRAM_OUTBOX_SIZE
 
+#if defined(CONFIG_TELEGRAM_DEDUP_SIZE) && (CONFIG_TELEGRAM_DEDUP_SIZE > 0) && CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #define CONFIG_TELEGRAM_DEDUP_ENABLE 1
+#else
+  #define CONFIG_TELEGRAM_DEDUP_ENABLE 0
+#endif // CONFIG_TELEGRAM_DEDUP_SIZE
+
+#if defined(CONFIG_TELEGRAM_LIVE_SLOTS) && (CONFIG_TELEGRAM_LIVE_SLOTS > 0) && CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #define CONFIG_TELEGRAM_LIVE_ENABLE 1
+#else
+  #define CONFIG_TELEGRAM_LIVE_ENABLE 0
+#endif // CONFIG_TELEGRAM_LIVE_SLOTS
+
+#if defined(CONFIG_TELEGRAM_SPILL_SIZE) && (CONFIG_TELEGRAM_SPILL_SIZE > 0) && CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #define CONFIG_TELEGRAM_SPILL_ENABLE 1
+#else
+  #define CONFIG_TELEGRAM_SPILL_ENABLE 0
+#endif // CONFIG_TELEGRAM_SPILL_SIZE
+
+#if defined(CONFIG_TELEGRAM_OUTBOX_COMPRESS) && CONFIG_TELEGRAM_OUTBOX_COMPRESS && CONFIG_TELEGRAM_OUTBOX_ENABLE && !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  #define CONFIG_TELEGRAM_COMPRESS_ENABLE 1
+#else
+  #define CONFIG_TELEGRAM_COMPRESS_ENABLE 0
+#endif // CONFIG_TELEGRAM_OUTBOX_COMPRESS
+
+#if defined(CONFIG_TELEGRAM_COMMANDS) && (CONFIG_TELEGRAM_COMMANDS > 0)
+  #define CONFIG_TELEGRAM_COMMANDS_ENABLE 1
+#else
+  #define CONFIG_TELEGRAM_COMMANDS_ENABLE 0
+#endif // CONFIG_TELEGRAM_COMMANDS
+
+#ifndef CONFIG_TELEGRAM_COMMAND_SIZE
+  #define CONFIG_TELEGRAM_COMMAND_SIZE 128
+#endif // CONFIG_TELEGRAM_COMMAND_SIZE
+
+// HTML envelope of the message title
+#define API_TELEGRAM_TITLE_BEGIN "<b>"
+#define API_TELEGRAM_TITLE_END "</b>\r\n\r\n"
+
 typedef enum {
   TG_NOTIFY_OFF    = 0,
   TG_NOTIFY_SILENT = 1,
   TG_NOTIFY_SOUND  = 2
 } tg_notify_mode_t;
 
+/**
+ * Delivery callback, called by the send task when the message has been delivered (result ESP_OK, message_id 
+ * assigned by Telegram) or finally dropped (an error code, message_id is 0). Must return quickly
+ * */
+typedef void (*tg_send_cb_t)(esp_err_t result, int64_t message_id, void* ctx);
+
+/**
+ * Latency class: how soon the message should be delivered. Among the messages that can be sent, the one with 
+ * the earliest deadline (time queued + target of the class) goes first
+ * */
+typedef enum {
+  TG_LATENCY_DEFAULT = 0,    // Target by the message priority
+  TG_LATENCY_URGENT,         // Alerts, 1 s
+  TG_LATENCY_NORMAL,         // Notifications, 30 s
+  TG_LATENCY_BULK,           // Readings and reports that can wait, 10 min
+  TG_LATENCY_MAX
+} tg_latency_t;
+
+typedef struct {
+  msg_options_t options;     // Message options (kind, priority and notification)
+  tg_send_cb_t callback;     // Delivery callback (can be NULL)
+  void* ctx;                 // Callback context
+  uint8_t live;              // Live message slot + 1 (see tgSendLive()), 0 - regular message
+  uint32_t ttl;              // Time to live, ms: the message is dropped if it has not been sent by then (0 - until sent)
+  tg_latency_t latency;      // Latency class
+} tg_send_params_t;
+
+// Send path statistics
+#define TG_STATS_KINDS 4
+#define TG_STATS_BUCKETS 20  // Bucket i counts latencies below (128 << i) us, the last one counts everything longer
+
+typedef enum {
+  TG_COUNTER_ENQUEUED = 0,   // Messages accepted by tgSendMsg()
+  TG_COUNTER_DROPPED,        // Messages rejected (queue full, no memory) or discarded after errors
+  TG_COUNTER_EVICTED,        // Messages pushed out of the full outbox by more important ones
+  TG_COUNTER_RETRIED,        // Failed attempts that will be repeated
+  TG_COUNTER_SENT,           // Messages delivered
+  TG_COUNTER_COLLAPSED,      // Repeated messages collapsed into an identical pending one
+  TG_COUNTER_SUPERSEDED,     // Live message updates dropped without a request (replaced by a newer one or unchanged)
+  TG_COUNTER_SPILLED,        // Messages moved from the full outbox to the spill buffer, they are sent later as a document
+  TG_COUNTER_EXPIRED,        // Messages dropped unsent because their time to live has passed
+  TG_COUNTER_LATE,           // Messages delivered after the deadline of their latency class
+  TG_COUNTER_MAX
+} tg_counter_t;
+
+typedef enum {
+  TG_STAGE_FORMAT = 0,       // Formatting the message in tgSendMsg()
+  TG_STAGE_QUEUE,            // From tgSendMsg() until the task takes the message
+  TG_STAGE_CONNECT,          // Opening the request, including TCP connect and TLS handshake if the connection is not reused
+  TG_STAGE_REQUEST,          // HTTP round trip: sending the body and receiving the response headers
+  TG_STAGE_TOTAL,            // From tgSendMsg() until 200 OK
+  TG_STAGE_MAX
+} tg_stage_t;
+
+typedef struct {
+  uint32_t counters[TG_STATS_KINDS][TG_COUNTER_MAX];      // By msg_kind_t
+  uint32_t latency[TG_STAGE_MAX][TG_STATS_BUCKETS];
+  uint16_t queue_high;                                    // High-water mark of the queue
+  uint16_t outbox_high;                                   // High-water mark of the outbox
+  uint32_t heap_bytes;                                    // Heap used by message buffers
+} tg_stats_t;
+
+// Message being written by the C++ API (tg::send()), filled by tgMsgBegin()
+typedef struct {
+  void* message;
+  char* text;
+  size_t size;
+  int64_t started;
+} tg_msg_buffer_t;
+
+// Command received from one of the configured chats (CONFIG_TELEGRAM_COMMANDS)
+typedef struct {
+  int64_t update_id;
+  int64_t chat_id;
+  int64_t from_id;                          // Sender, 0 - a channel post
+  char text[CONFIG_TELEGRAM_COMMAND_SIZE];  // "/command@bot arguments", truncated to the buffer
+} tg_command_t;
+
+/**
+ * Command handler, called from the event loop task. args points to the text after the command (an empty string if 
+ * there are no arguments)
+ * */
+typedef void (*tg_command_cb_t)(const tg_command_t* command, const char* args, void* ctx);
+
+// Event base for periodic publication of statistics (CONFIG_TELEGRAM_STATS_INTERVAL), event data is tg_stats_t
+ESP_EVENT_DECLARE_BASE(RE_TELEGRAM_EVENTS);
+#define RE_TELEGRAM_STATS 0
+// Received commands, event data is tg_command_t
+#define RE_TELEGRAM_COMMAND 1
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -59,7 +187,9 @@ bool tgTaskSuspend();
 bool tgTaskResume();
 
 /**
- * @brief Delete the task (for example, before restarting the device)
+ * @brief Delete the task (for example, before restarting the device). Waits until the workers have finished or 
+ * cancelled their requests, messages being sent stay queued for the next tgTaskCreate(). Must not be called from 
+ * a delivery callback
  * @return true - successful, false - failure
  * */
 bool tgTaskDelete();
@@ -69,11 +199,40 @@ bool tgTaskDelete();
  * @brief Add a message to the send queue. If the Internet is available, an attempt will be made to send a message almost immediately
  * @param msgOptions - message options (kind, priority and notification)
  * @param msgTitle - message header
- * @param msgText - message text or formatting template
+ * @param msgText - message text or formatting template (checked against the arguments by the compiler)
+ * @param ... - formatting options
+ * @return true - successful, false - failure
+ * */
+bool tgSendMsg(msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...) __attribute__((format(printf, 3, 4)));
+
+/**
+ * Add a message to the send queue with extended parameters
+ * @brief Add a message to the send queue, the result of the delivery (and the message_id) is reported by the callback. 
+ * Messages with a callback are always sent separately: they are not merged with other messages or collapsed as repeats. 
+ * A message whose time to live has passed is dropped without a request, the callback receives ESP_ERR_TIMEOUT
+ * @param params - message parameters
+ * @param msgTitle - message header
+ * @param msgText - message text or formatting template (checked against the arguments by the compiler)
+ * @param ... - formatting options
+ * @return true - successful, false - failure
+ * */
+bool tgSendMsgEx(const tg_send_params_t* params, const char* msgTitle, const char* msgText, ...) __attribute__((format(printf, 3, 4)));
+
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+/**
+ * Update a live message
+ * @brief Shows the text as a single message that is updated in place (status reports and the like). The first call 
+ * for the slot sends a new message, the next ones edit it no more often than CONFIG_TELEGRAM_LIVE_INTERVAL. 
+ * Only the newest pending text is sent, the previous ones are dropped. Available with CONFIG_TELEGRAM_LIVE_SLOTS
+ * @param slot - live message slot, 0..CONFIG_TELEGRAM_LIVE_SLOTS-1
+ * @param msgOptions - message options (kind, priority and notification)
+ * @param msgTitle - message header
+ * @param msgText - message text or formatting template (checked against the arguments by the compiler)
  * @param ... - formatting options
  * @return true - successful, false - failure
  * */
-bool tgSendMsg(msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...);
+bool tgSendLive(uint8_t slot, msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...) __attribute__((format(printf, 4, 5)));
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
 
 /**
  * Easier adding a message to the send queue
@@ -88,8 +247,345 @@ bool tgSendMsg(msg_options_t msgOptions, const char* msgTitle, const char* msgTe
  * */
 #define tgSend(msgKind, msgPriority, msgNotify, msgTitle, msgText, ...) tgSendMsg(encMsgOptions(msgKind, msgNotify, msgPriority), msgTitle, msgText, ##__VA_ARGS__)
 
+/**
+ * Escape text from outside for a %s argument
+ * @brief Replaces <, > and & with HTML entities, so that the text does not break the markup of the message. An 
+ * entity is never cut, the result is truncated at the last character that fits
+ * @param text - source text (nullptr gives an empty string)
+ * @param buffer - result buffer
+ * @param size - size of the buffer, including the terminating zero
+ * @return buffer
+ * */
+const char* tgHtmlEscape(const char* text, char* buffer, size_t size);
+
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+/**
+ * Add a message to the send queue from an interrupt handler
+ * @brief Add a message to the send queue from an interrupt handler. The text is copied as is, without formatting, 
+ * the function never blocks. Available only with CONFIG_TELEGRAM_MESSAGE_SIZE (messages are taken from the static arena)
+ * @param msgOptions - message options (kind, priority and notification)
+ * @param msgTitle - message header
+ * @param msgText - message text
+ * @return true - successful, false - failure (the queue is full)
+ * */
+bool tgSendMsgFromISR(msg_options_t msgOptions, const char* msgTitle, const char* msgText);
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+/**
+ * Low-level interface of the C++ API
+ * @brief tgMsgBegin() allocates a message of the specified size (including the terminating zero, with 
+ * CONFIG_TELEGRAM_MESSAGE_SIZE the size is always the configured one), the text is written to buffer->text. 
+ * tgMsgCommit() queues the message, after a failure the message is freed. Use tg::send() instead
+ * @param params - message parameters
+ * @param size - buffer size
+ * @param buffer - message buffer
+ * @return true - successful, false - failure
+ * */
+bool tgMsgBegin(const tg_send_params_t* params, size_t size, tg_msg_buffer_t* buffer);
+bool tgMsgCommit(const tg_send_params_t* params, tg_msg_buffer_t* buffer);
+
+/**
+ * Message coalescing counters
+ * @brief Returns the number of messages delivered and the number of sendMessage requests used for them. 
+ * The ratio messages/requests is the batch factor achieved by coalescing
+ * @param messages - number of delivered messages (can be NULL)
+ * @param requests - number of successful API requests (can be NULL)
+ * */
+void tgGetBatchStats(uint32_t* messages, uint32_t* requests);
+
+/**
+ * Send path statistics
+ * @brief Returns a snapshot of the counters, high-water marks and latency histograms collected since startup
+ * @param stats - buffer for the snapshot
+ * */
+void tgGetStats(tg_stats_t* stats);
+
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
+/**
+ * Register a command handler
+ * @brief Calls the handler for the command sent to the bot (the first bot of the pool) in one of the configured chats. 
+ * Commands are received by long polling getUpdates on the connection of the send task, outgoing messages interrupt 
+ * the poll. Every command is also posted to the event loop as RE_TELEGRAM_COMMAND. Available with CONFIG_TELEGRAM_COMMANDS
+ * @param command - command name, with or without the leading slash (the string must remain valid)
+ * @param handler - command handler
+ * @param ctx - handler context
+ * @return true - successful, false - failure (all CONFIG_TELEGRAM_COMMANDS slots are taken)
+ * */
+bool tgCommandRegister(const char* command, tg_command_cb_t handler, void* ctx);
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+
 #ifdef __cplusplus
 }
 #endif
 
+#if defined(__cplusplus) && (__cplusplus >= 201402L)
+
+#include <math.h>
+#include <limits>
+#include <type_traits>
+
+/**
+ * C++ API: messages without format strings. The title with its HTML envelope is assembled by the compiler, the text 
+ * is given as a list of pieces (strings, numbers, tg::fixed()) whose types are checked at compile time. The upper 
+ * bound of the length is known from the types, so the text is written into the message buffer in a single pass 
+ * (requires C++14):
+ * 
+ *   static constexpr auto title = tg::title("🌦 Weather");
+ *   tg::send(encMsgOptions(MK_PARAMS, false, MP_ORDINARY), title, "Temperature: ", tg::fixed(t, 1), " °C, humidity: ", h, " %");
+ * */
+namespace tg {
+
+template <size_t N>
+struct title_t {
+  char text[N];
+  static constexpr size_t length = N - 1;
+};
+
+template <size_t N>
+constexpr title_t<sizeof(API_TELEGRAM_TITLE_BEGIN) + N + sizeof(API_TELEGRAM_TITLE_END) - 2> title(const char (&text)[N])
+{
+  title_t<sizeof(API_TELEGRAM_TITLE_BEGIN) + N + sizeof(API_TELEGRAM_TITLE_END) - 2> ret = {};
+  size_t len = 0;
+  for (size_t i = 0; i < sizeof(API_TELEGRAM_TITLE_BEGIN) - 1; i++) ret.text[len++] = API_TELEGRAM_TITLE_BEGIN[i];
+  for (size_t i = 0; i < N - 1; i++) ret.text[len++] = text[i];
+  for (size_t i = 0; i < sizeof(API_TELEGRAM_TITLE_END) - 1; i++) ret.text[len++] = API_TELEGRAM_TITLE_END[i];
+  ret.text[len] = 0;
+  return ret;
+}
+
+// A number with a fixed number of decimals (no more than 6)
+struct fixed_t {
+  double value;
+  uint8_t decimals;
+};
+
+constexpr fixed_t fixed(double value, uint8_t decimals = 2)
+{
+  return fixed_t { value, (uint8_t)(decimals < 6 ? decimals : 6) };
+}
+
+// Text from outside (a device name, a reply of a server): <, > and & are escaped for the HTML parse mode
+struct html_t {
+  const char* text;
+};
+
+constexpr html_t html(const char* text)
+{
+  return html_t { text };
+}
+
+namespace detail {
+
+struct writer_t {
+  char* pos;
+  char* end;      // The place of the terminating zero
+};
+
+inline void put(writer_t& w, const char* text, size_t length)
+{
+  if (length > (size_t)(w.end - w.pos)) length = w.end - w.pos;
+  memcpy(w.pos, text, length);
+  w.pos += length;
+}
+
+inline void put_uint(writer_t& w, unsigned long long value, bool negative)
+{
+  char buffer[24];
+  char* pos = buffer + sizeof(buffer);
+  do {
+    *--pos = '0' + (char)(value % 10);
+    value /= 10;
+  } while (value);
+  if (negative) *--pos = '-';
+  put(w, pos, buffer + sizeof(buffer) - pos);
+}
+
+// Upper bounds of the length and writers of the supported pieces, any other type does not compile
+template <typename T, typename Enable = void>
+struct piece {
+  static_assert(sizeof(T) == 0, "tg::send(): unsupported argument type, use strings, integers, bool, char, float, tg::fixed() or tg::html()");
+};
+
+template <size_t N>
+struct piece<char[N]> {
+  static size_t bound(const char (&)[N]) { return N - 1; }
+  static void write(writer_t& w, const char (&text)[N]) { put(w, text, strnlen(text, N - 1)); }
+};
+
+template <>
+struct piece<const char*> {
+  static size_t bound(const char* text) { return text ? strlen(text) : 0; }
+  static void write(writer_t& w, const char* text) { if (text) put(w, text, strlen(text)); }
+};
+
+template <>
+struct piece<char*> : piece<const char*> {};
+
+template <>
+struct piece<char> {
+  static constexpr size_t bound(char) { return 1; }
+  static void write(writer_t& w, char c) { put(w, &c, 1); }
+};
+
+template <>
+struct piece<bool> {
+  static constexpr size_t bound(bool) { return 5; }
+  static void write(writer_t& w, bool value) { if (value) put(w, "true", 4); else put(w, "false", 5); }
+};
+
+template <typename T>
+struct piece<T, typename std::enable_if<std::is_integral<T>::value && !std::is_same<T, bool>::value && !std::is_same<T, char>::value>::type> {
+  static constexpr size_t bound(T) { return std::numeric_limits<T>::digits10 + 2; }
+  static void write(writer_t& w, T value)
+  {
+    bool negative = std::is_signed<T>::value && (value < T(0));
+    put_uint(w, negative ? 0ULL - (unsigned long long)(long long)value : (unsigned long long)value, negative);
+  }
+};
+
+template <>
+struct piece<fixed_t> {
+  static unsigned long long scale(const fixed_t& f)
+  {
+    unsigned long long scale = 1;
+    for (uint8_t i = 0; i < f.decimals; i++) scale *= 10;
+    return scale;
+  }
+  // Beyond the range of unsigned long long (and for infinity) the value is printed by snprintf()
+  static bool large(const fixed_t& f) { return !isnan(f.value) && !(fabs(f.value) * scale(f) < 1e18); }
+  static size_t bound(const fixed_t& f) { return large(f) ? snprintf(nullptr, 0, "%.*f", f.decimals, f.value) : 21 + 1 + f.decimals; }
+  static void write(writer_t& w, const fixed_t& f)
+  {
+    if (isnan(f.value)) return put(w, "nan", 3);
+    if (large(f)) {
+      // w.end is the place of the terminating zero, so snprintf() may write it there
+      size_t room = w.end - w.pos;
+      int length = snprintf(w.pos, room + 1, "%.*f", f.decimals, f.value);
+      if (length > 0) w.pos += (size_t)length < room ? (size_t)length : room;
+      return;
+    };
+    unsigned long long scale = piece::scale(f);
+    double value = fabs(f.value);
+    unsigned long long scaled = (unsigned long long)(value * scale + 0.5);
+    put_uint(w, scaled / scale, (f.value < 0) && (scaled > 0));
+    if (f.decimals > 0) {
+      char buffer[8];
+      unsigned long long frac = scaled % scale;
+      buffer[0] = '.';
+      for (uint8_t i = f.decimals; i > 0; i--) {
+        buffer[i] = '0' + (char)(frac % 10);
+        frac /= 10;
+      };
+      put(w, buffer, f.decimals + 1);
+    };
+  }
+};
+
+template <>
+struct piece<html_t> {
+  static size_t bound(const html_t& h) { return h.text ? 5 * strlen(h.text) : 0; }
+  static void write(writer_t& w, const html_t& h)
+  {
+    if (!h.text) return;
+    const char* text = h.text;
+    while (*text) {
+      size_t span = strcspn(text, "<>&");
+      put(w, text, span);
+      text += span;
+      switch (*text) {
+        case '<': put(w, "&lt;", 4); break;
+        case '>': put(w, "&gt;", 4); break;
+        case '&': put(w, "&amp;", 5); break;
+        default: return;
+      };
+      text++;
+    };
+  }
+};
+
+template <>
+struct piece<double> {
+  static size_t bound(double value) { return piece<fixed_t>::bound(fixed(value)); }
+  static void write(writer_t& w, double value) { piece<fixed_t>::write(w, fixed(value)); }
+};
+
+template <>
+struct piece<float> : piece<double> {};
+
+template <typename T>
+using piece_of = piece<typename std::remove_cv<typename std::remove_reference<T>::type>::type>;
+
+inline size_t bound() { return 0; }
+
+template <typename T, typename... Args>
+size_t bound(const T& value, const Args&... args)
+{
+  return piece_of<T>::bound(value) + bound(args...);
+}
+
+inline void write(writer_t&) {}
+
+template <typename T, typename... Args>
+void write(writer_t& w, const T& value, const Args&... args)
+{
+  piece_of<T>::write(w, value);
+  write(w, args...);
+}
+
+template <typename... Args>
+bool send(const tg_send_params_t& params, const char* title, size_t title_len, const Args&... args)
+{
+  #if !CONFIG_TELEGRAM_TITLE_ENABLED
+    title_len = 0;
+  #endif // CONFIG_TELEGRAM_TITLE_ENABLED
+  tg_msg_buffer_t buffer;
+  if (!tgMsgBegin(&params, title_len + bound(args...) + 1, &buffer)) return false;
+  writer_t w = { buffer.text, buffer.text + buffer.size - 1 };
+  put(w, title, title_len);
+  write(w, args...);
+  *w.pos = 0;
+  return tgMsgCommit(&params, &buffer);
+}
+
+} // namespace detail
+
+/**
+ * Add a message to the send queue
+ * @brief The same as tgSendMsg() / tgSendMsgEx(), the text is the concatenation of the pieces
+ * @param options or params - message options or extended parameters
+ * @param title - title built by tg::title() or nullptr
+ * @param args - pieces of the text: strings, integers, bool, char, float, double (2 decimals), tg::fixed() or 
+ * tg::html() (the text is escaped, strings are copied as is)
+ * @return true - successful, false - failure
+ * */
+template <size_t N, typename... Args>
+bool send(const tg_send_params_t& params, const title_t<N>& title, const Args&... args)
+{
+  return detail::send(params, title.text, title.length, args...);
+}
+
+template <typename... Args>
+bool send(const tg_send_params_t& params, std::nullptr_t, const Args&... args)
+{
+  return detail::send(params, nullptr, 0, args...);
+}
+
+template <size_t N, typename... Args>
+bool send(msg_options_t options, const title_t<N>& title, const Args&... args)
+{
+  tg_send_params_t params = { options, nullptr, nullptr, 0, 0, TG_LATENCY_DEFAULT };
+  return detail::send(params, title.text, title.length, args...);
+}
+
+template <typename... Args>
+bool send(msg_options_t options, std::nullptr_t, const Args&... args)
+{
+  tg_send_params_t params = { options, nullptr, nullptr, 0, 0, TG_LATENCY_DEFAULT };
+  return detail::send(params, nullptr, 0, args...);
+}
+
+} // namespace tg
+
+#endif // __cplusplus
+
 #endif // __RE_TGSEND_H__
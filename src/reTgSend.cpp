@@ -1,22 +1,86 @@
 #include "reTgSend.h"
 #include <time.h>
+#include <ctype.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "freertos/queue.h" 
-#include "esp_wifi.h" 
+#include "freertos/semphr.h"
 #include "esp_http_client.h"
+#include "esp_timer.h"
+#include "esp_idf_version.h"
+#include "esp_netif.h"
 #include "mbedtls/ssl.h"
+#include "mbedtls/sha256.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+#include "esp_random.h"
+#else
+#include "esp_system.h"
+#endif // ESP_IDF_VERSION
+#if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
+#include "esp_attr.h"
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
 
 #define API_TELEGRAM_HOST "api.telegram.org"
 #define API_TELEGRAM_PORT 443
-#define API_TELEGRAM_TIMEOUT_MS 60000
-#define API_TELEGRAM_BOT_PATH "/bot" CONFIG_TELEGRAM_TOKEN
-#define API_TELEGRAM_SEND_MESSAGE API_TELEGRAM_BOT_PATH "/sendMessage"
-#define API_TELEGRAM_TMPL_MESSAGE "{\"chat_id\":%s,\"parse_mode\":\"HTML\",\"disable_notification\":%s,\"text\":\"%s\r\n\r\n<code>%s</code>\"}"
-#define API_TELEGRAM_TMPL_TITLE "<b>%s</b>\r\n\r\n%s"
-#define API_TELEGRAM_JSON_SIZE 256
+#define API_TELEGRAM_BOT_PATH "/bot"
+#define API_TELEGRAM_SEND_MESSAGE "/sendMessage"
+#define API_TELEGRAM_EDIT_MESSAGE "/editMessageText"
+#define API_TELEGRAM_SEND_DOCUMENT "/sendDocument"
+#define API_TELEGRAM_GET_ME "/getMe"
+#define API_TELEGRAM_GET_UPDATES "/getUpdates"
+#define API_TELEGRAM_BOT_URLS(token) { \
+  API_TELEGRAM_BOT_PATH token API_TELEGRAM_SEND_MESSAGE, \
+  API_TELEGRAM_BOT_PATH token API_TELEGRAM_EDIT_MESSAGE, \
+  API_TELEGRAM_BOT_PATH token API_TELEGRAM_SEND_DOCUMENT, \
+  API_TELEGRAM_BOT_PATH token API_TELEGRAM_GET_ME, \
+  API_TELEGRAM_BOT_PATH token API_TELEGRAM_GET_UPDATES }
+#define API_TELEGRAM_HEADER_HOST "Host"
+#define API_TELEGRAM_JSON_CHAT_ID "{\"chat_id\":"
+#define API_TELEGRAM_JSON_NOTIFY ",\"parse_mode\":\"HTML\",\"disable_notification\":"
+#define API_TELEGRAM_JSON_TEXT ",\"text\":\""
+#define API_TELEGRAM_JSON_MESSAGE_ID "{\"message_id\":"
+#define API_TELEGRAM_JSON_TIME_BEGIN "\\r\\n\\r\\n<code>"
+#define API_TELEGRAM_JSON_TIME_END "</code>\"}"
+#define API_TELEGRAM_JSON_PREFIX(chat_id, disable_notification) \
+  API_TELEGRAM_JSON_CHAT_ID chat_id API_TELEGRAM_JSON_NOTIFY disable_notification API_TELEGRAM_JSON_TEXT
+#define API_TELEGRAM_CHUNK_SIZE 128
+#define API_TELEGRAM_TMPL_TITLE API_TELEGRAM_TITLE_BEGIN "%s" API_TELEGRAM_TITLE_END
+#define API_TELEGRAM_TMPL_BATCH "\r\n\r\n<code>%s</code>\r\n\r\n%s"
+#define API_TELEGRAM_TMPL_REPEATS "\r\n\r\n<i>\u00d7%d, first seen %s</i>"
+#define API_TELEGRAM_MAX_LENGTH 4096
 #define API_TELEGRAM_HEADER_CTYPE "Content-Type"
 #define API_TELEGRAM_HEADER_AJSON "application/json"
+#define API_TELEGRAM_BOUNDARY "reTgSendSpillBoundary"
+#define API_TELEGRAM_HEADER_MULTIPART "multipart/form-data; boundary=" API_TELEGRAM_BOUNDARY
+#define API_TELEGRAM_PART(name) "--" API_TELEGRAM_BOUNDARY "\r\nContent-Disposition: form-data; name=\"" name "\"\r\n\r\n"
+#define API_TELEGRAM_PART_DOCUMENT "--" API_TELEGRAM_BOUNDARY "\r\nContent-Disposition: form-data; name=\"document\"; filename=\"messages.txt\"\r\nContent-Type: text/plain; charset=utf-8\r\n\r\n"
+#define API_TELEGRAM_PART_END "\r\n"
+#define API_TELEGRAM_MULTIPART_END "\r\n--" API_TELEGRAM_BOUNDARY "--\r\n"
+#define API_TELEGRAM_TMPL_SPILL "%d messages delayed by a connection outage, %s - %s"
+#define API_TELEGRAM_TOO_MANY_REQUESTS 429
+#define API_TELEGRAM_BAD_REQUEST 400
+#define API_TELEGRAM_RESPONSE_CHUNK 64
+#define API_TELEGRAM_KEY_MESSAGE_ID "message_id"
+#define API_TELEGRAM_KEY_RETRY_AFTER "retry_after"
+#define API_TELEGRAM_KEY_MIGRATE_TO "migrate_to_chat_id"
+#define API_TELEGRAM_KEY_DESCRIPTION "description"
+#define API_TELEGRAM_DESC_NOT_MODIFIED "message is not modified"
+#define API_TELEGRAM_DESC_EDIT_NOT_FOUND "message to edit not found"
+#define API_TELEGRAM_DESC_CANT_BE_EDITED "message can't be edited"
+#define API_TELEGRAM_TMPL_UPDATES "{\"offset\":%s,\"timeout\":%d,\"allowed_updates\":[\"message\",\"channel_post\"]}"
+#define API_TELEGRAM_KEY_UPDATE_ID "update_id"
+#define API_TELEGRAM_KEY_MESSAGE "message"
+#define API_TELEGRAM_KEY_CHANNEL_POST "channel_post"
+#define API_TELEGRAM_KEY_CHAT "chat"
+#define API_TELEGRAM_KEY_FROM "from"
+#define API_TELEGRAM_KEY_ID "id"
+#define API_TELEGRAM_KEY_TEXT "text"
+#define API_TELEGRAM_CHAT_ID_SIZE 24
 #define API_TELEGRAM_FALSE "false"
 #define API_TELEGRAM_TRUE "true"
 
@@ -24,457 +88,4711 @@ typedef struct {
   char* message;
   msg_options_t options;
   time_t timestamp;
+  uint16_t parts;
+  int64_t queued;        // esp_timer time when the message was queued, us
+  int64_t deadline;      // esp_timer time by which the message should be delivered (latency class), us
+  int64_t expires;       // esp_timer time after which the message is dropped unsent, us (0 - never)
+  tg_send_cb_t callback;
+  void* ctx;
+  uint8_t live;          // Live message slot + 1, 0 - regular message
+  uint8_t attempts;      // Failed attempts so far
+  int64_t retry_at;      // esp_timer time of the next attempt, us
+  void* retry_next;      // Next message in the same retry wheel slot
+  #if CONFIG_TELEGRAM_DEDUP_ENABLE
+    uint32_t hash;       // Hash of kind and text, 0 - not calculated yet
+    uint16_t repeats;
+    time_t first_seen;
+  #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+  #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    size_t size;
+  #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+    uint16_t packed;     // Size of the compressed text, 0 - the text is stored as is
+    uint16_t length;     // Length of the original text
+  #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+    uint32_t id;
+  #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
 } tgMessage_t;
 
+// Receives the text of a message in pieces, returns false to stop
+typedef bool (*tgTextSink_t)(const char* chunk, size_t length, void* ctx);
+
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #define TELEGRAM_SLAB_SIZE (CONFIG_TELEGRAM_QUEUE_SIZE + CONFIG_TELEGRAM_OUTBOX_SIZE + 1)
+#else
+  #define TELEGRAM_SLAB_SIZE (CONFIG_TELEGRAM_QUEUE_SIZE + 1)
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+// Message arena: every message that can exist at the same time (queue + outbox + one in the hands of the task) has its own slot
 typedef struct {
-  #if CONFIG_TELEGRAM_OUTBOX_ENABLE
-    bool queued;
-  #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
-  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-    char message[CONFIG_TELEGRAM_MESSAGE_SIZE];
-  #else
-    char* message;
-  #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
+  tgMessage_t headers[TELEGRAM_SLAB_SIZE];
+  char texts[TELEGRAM_SLAB_SIZE][CONFIG_TELEGRAM_MESSAGE_SIZE];
+  uint16_t next[TELEGRAM_SLAB_SIZE];
+  uint32_t free_top;   // (ABA tag << 16) | index of the first free slot
+} tgSlab_t;
+#define TELEGRAM_SLAB_NONE 0xFFFF
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+// One lane for each msg_kind_t; kinds sent to the same chat share a lane
+#define TELEGRAM_LANES 4
+// Number of msg_priority_t levels
+#define TELEGRAM_PRIORITY_LEVELS 4
+
+// Bot tokens in the pool: CONFIG_TELEGRAM_TOKEN, then CONFIG_TELEGRAM_TOKEN_2 ... CONFIG_TELEGRAM_TOKEN_4
+#if defined(CONFIG_TELEGRAM_TOKEN_4)
+  #define TELEGRAM_TOKENS 4
+#elif defined(CONFIG_TELEGRAM_TOKEN_3)
+  #define TELEGRAM_TOKENS 3
+#elif defined(CONFIG_TELEGRAM_TOKEN_2)
+  #define TELEGRAM_TOKENS 2
+#else
+  #define TELEGRAM_TOKENS 1
+#endif // CONFIG_TELEGRAM_TOKEN_N
+#if (defined(CONFIG_TELEGRAM_TOKEN_4) && !defined(CONFIG_TELEGRAM_TOKEN_3)) || (defined(CONFIG_TELEGRAM_TOKEN_3) && !defined(CONFIG_TELEGRAM_TOKEN_2))
+  #error "Bot tokens of the pool must be numbered without gaps"
+#endif // CONFIG_TELEGRAM_TOKEN_N
+// Any token of the pool may be used
+#define TELEGRAM_TOKEN_ANY 0xFF
+
+// The ring is rounded up to a power of two so that positions can wrap around 32 bits
+static constexpr uint32_t tgRingCapacity(uint32_t size, uint32_t capacity = 1)
+{
+  return capacity >= size ? capacity : tgRingCapacity(size, capacity << 1);
+}
+#define TELEGRAM_RING_SIZE tgRingCapacity(CONFIG_TELEGRAM_QUEUE_SIZE)
+// Free slots that a message of the given priority cannot take: when the ring fills up, low priorities are dropped first
+#define TELEGRAM_RING_RESERVE(level) ((int32_t)(CONFIG_TELEGRAM_QUEUE_SIZE * (TELEGRAM_PRIORITY_LEVELS - 1 - (level)) / (2 * TELEGRAM_PRIORITY_LEVELS)))
+
+typedef struct {
+  tgMessage_t* slots[TELEGRAM_RING_SIZE];
+  uint32_t commits[TELEGRAM_RING_SIZE];   // Position + 1 after the slot has been published
+  uint32_t head;                          // Next position to reserve (producers)
+  uint32_t tail;                          // Next position to receive (consumer only)
+  int32_t credits;                        // Free slots
+  uint32_t isr_dropped;
+  bool ready;
+} tgRing_t;
+
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
+#define TELEGRAM_OUTBOX_NONE 0xFFFF
+// Each priority level has its own FIFO list in the outbox
+#define TELEGRAM_OUTBOX_LEVELS TELEGRAM_PRIORITY_LEVELS
+
+typedef struct {
+  tgMessage_t* message;
+  uint16_t next;
+} tgOutboxItem_t;
+
+typedef struct {
+  uint16_t head;
+  uint16_t tail;
+} tgOutboxList_t;
+
+typedef struct {
+  tgOutboxItem_t items[CONFIG_TELEGRAM_OUTBOX_SIZE];
+  tgOutboxList_t lists[TELEGRAM_LANES][TELEGRAM_OUTBOX_LEVELS];
+  uint16_t free_head;
+  uint16_t count;
+  bool ready;
+} tgOutbox_t;
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+
+#if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+#define TELEGRAM_LOG_AREA_MAGIC 0x424F4754  // "TGOB"
+#define TELEGRAM_LOG_RECORD_MAGIC 0x4754    // "TG"
+#define TELEGRAM_LOG_ENTRY 0x01
+#define TELEGRAM_LOG_TOMBSTONE 0x02
+#define TELEGRAM_LOG_ALIGN(x) (((x) + 3) & ~3)
+#define TELEGRAM_LOG_CHUNK 64
+#define TELEGRAM_LOG_SECTOR 4096
+
+typedef struct {
+  uint32_t magic;
+  uint32_t generation;
+  uint32_t crc;
+} tgLogArea_t;
+
+typedef struct {
+  uint16_t magic;
+  uint8_t type;
+  uint8_t reserved;
+  uint32_t id;
+  uint32_t options;
+  uint32_t timestamp;
+  uint16_t parts;
+  uint16_t length;
+  uint32_t crc;
+} tgLogRecord_t;
+
+typedef struct {
+  const esp_partition_t* partition;
+  uint32_t area_size;
+  uint8_t area;
+  uint32_t generation;
+  uint32_t offset;
+  uint32_t next_id;
+} tgLog_t;
+#endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+
+typedef struct {
+  esp_http_client_handle_t client;
+  TickType_t last_used;
+  const char* url;       // API method the client is currently set to
+  uint32_t epoch;        // Network connection the client was connected in
+  bool connected;        // false - the client is only kept for its TLS session, the next request connects again
+  bool fallback;         // The client was created for the last known address of the host
+} tgConnection_t;
+
+typedef struct {
+  uint32_t address;      // IPv4 address of the API host (network byte order), 0 - never resolved
+  TickType_t resolved;   // When the address was last resolved
+  bool failed;           // The last lookup failed, the address is the last known good one
+} tgDns_t;
+
+typedef struct {
+  TaskHandle_t task;
+  tgConnection_t conn;
+  uint8_t index;
+  uint8_t token;         // The bot that sends the current request
+  #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+    bool updates;        // Long polling for commands, an outgoing message may interrupt it
+  #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+} tgWorker_t;
+
+typedef struct {
+  esp_http_client_handle_t client; // nullptr - only the length of the body is calculated
+  size_t length;
+  size_t fill;
+  esp_err_t error;
+  char buffer[API_TELEGRAM_CHUNK_SIZE];
+} tgBodyWriter_t;
+
+typedef enum {
+  TG_RESP_IDLE = 0,
+  TG_RESP_STRING,
+  TG_RESP_ESCAPE,
+  TG_RESP_KEY,
+  TG_RESP_VALUE,
+  TG_RESP_NUMBER,
+  TG_RESP_TEXT,
+  TG_RESP_TEXT_ESCAPE
+} tgResponseState_t;
+
+typedef enum {
+  TG_FIELD_NONE = 0,
+  TG_FIELD_MESSAGE_ID,
+  TG_FIELD_RETRY_AFTER,
+  TG_FIELD_MIGRATE_TO,
+  TG_FIELD_DESCRIPTION
+} tgResponseField_t;
+
+// Incremental parser of the API response: only the last string (a possible key) and the current number are kept
+typedef struct {
+  tgResponseState_t state;
+  tgResponseField_t field;
+  char key[20];
+  uint8_t key_len;
+  bool negative;
+  int64_t number;
+  // Results
+  int status;                    // HTTP status, 0 - no response
+  int64_t message_id;
+  uint32_t retry_after;          // ms
+  int64_t migrate_to_chat_id;
+  char description[48];          // The beginning of the error description
+  uint8_t description_len;
+} tgResponse_t;
+
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
+typedef enum {
+  TG_UPDATE_NONE = 0,
+  TG_UPDATE_ID,          // update_id of an update
+  TG_UPDATE_MESSAGE,     // message or channel_post object of an update
+  TG_UPDATE_CHAT,        // chat object of the message
+  TG_UPDATE_FROM,        // from object of the message
+  TG_UPDATE_CHAT_ID,
+  TG_UPDATE_FROM_ID,
+  TG_UPDATE_TEXT
+} tgUpdateField_t;
+
+/**
+ * Incremental parser of the getUpdates response. Only the nesting depth, the last string and the fields of the 
+ * current update are kept: result[] (depth 2) -> update (3) -> message (4) -> chat / from (5)
+ * */
+typedef struct {
+  tgResponseState_t state;
+  tgUpdateField_t field;
+  tgUpdateField_t nested;        // The object at depth 5 (chat or from)
+  bool message;                  // The object at depth 4 is a message
+  bool text;                     // The text of the message is being read
+  uint8_t depth;
+  uint8_t skip;                  // Hex digits of a \u escape left to skip
+  char key[16];
+  uint8_t key_len;
+  bool negative;
+  int64_t number;
+  int64_t offset;                // The next update to receive
+  bool dispatch;                 // false - updates are only confirmed (the backlog after a cold start)
+  tg_command_t command;          // The current update
+  uint16_t text_len;
+} tgUpdates_t;
+
+typedef struct {
+  const char* command;
+  uint8_t length;
+  tg_command_cb_t handler;       // Published last, nullptr - the slot is being filled
+  void* ctx;
+} tgCommand_t;
+
+#define TELEGRAM_UPDATES_MAGIC 0x54475550
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+
+// Statistics are collected separately for each core, so that recording does not fight over cache lines and locks
+typedef struct {
+  uint32_t counters[TG_STATS_KINDS][TG_COUNTER_MAX];
+  uint32_t latency[TG_STAGE_MAX][TG_STATS_BUCKETS];
+} tgStatsCore_t;
+
+typedef struct {
+  int64_t tat;         // Theoretical arrival time of the next message, us
+  int64_t interval;    // Emission interval, us
+  int64_t tolerance;   // How far ahead of schedule a burst may run, us
+} tgBucket_t;
+
+typedef enum {
+  TG_RETRY_NETWORK = 0,  // The network is down: wait for it, the attempt is not counted
+  TG_RETRY_TRANSPORT,    // Connection, TLS or timeout error
+  TG_RETRY_SERVER,       // 5xx from the API
+  TG_RETRY_LIMIT         // 429 or 403: the whole chat is paused
+} tgRetryClass_t;
+
+#define TELEGRAM_WHEEL_SLOTS 32
+#define TELEGRAM_WHEEL_TICK 500000 // us
+
+typedef struct {
+  tgMessage_t* slots[TELEGRAM_WHEEL_SLOTS];
+  int64_t tick;          // The oldest tick that may still hold due messages
+  uint16_t count;
+} tgWheel_t;
+
+#ifndef CONFIG_TELEGRAM_STATS_INTERVAL
+  #define CONFIG_TELEGRAM_STATS_INTERVAL 0
+#endif // CONFIG_TELEGRAM_STATS_INTERVAL
+
+#ifndef CONFIG_TELEGRAM_WORKERS
+  #define CONFIG_TELEGRAM_WORKERS 1
+#endif // CONFIG_TELEGRAM_WORKERS
+
+#ifndef CONFIG_TELEGRAM_WORKERS_CORE
+  #define CONFIG_TELEGRAM_WORKERS_CORE tskNO_AFFINITY
+#endif // CONFIG_TELEGRAM_WORKERS_CORE
+
+#if (CONFIG_TELEGRAM_WORKERS > 1) && !CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #error "CONFIG_TELEGRAM_WORKERS > 1 requires CONFIG_TELEGRAM_OUTBOX_SIZE"
+#endif // CONFIG_TELEGRAM_WORKERS
+
+#ifndef CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT
+  #define CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT 300000
+#endif // CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT
+
+#ifndef CONFIG_TELEGRAM_RETRY_MAX_SERVER
+  #define CONFIG_TELEGRAM_RETRY_MAX_SERVER 600000
+#endif // CONFIG_TELEGRAM_RETRY_MAX_SERVER
+
+#ifndef CONFIG_TELEGRAM_LIVE_INTERVAL
+  #define CONFIG_TELEGRAM_LIVE_INTERVAL 60000
+#endif // CONFIG_TELEGRAM_LIVE_INTERVAL
+
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+typedef struct {
+  int64_t message_id;    // Message in the chat that is being edited, 0 - not sent yet
+  uint32_t sent_hash;    // Hash of the text shown in the chat
+  int64_t due;           // esp_timer time when the next edit is allowed, us
+  tgMessage_t* queued;   // Update in the outbox
+  tgMessage_t* held;     // Newest update waiting for the interval (or for the queued one to be sent)
+  uint8_t token;         // The bot that has sent the message, only it can edit it
+} tgLive_t;
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
+
+#ifndef CONFIG_TELEGRAM_SPILL_THRESHOLD
+  #define CONFIG_TELEGRAM_SPILL_THRESHOLD 20
+#endif // CONFIG_TELEGRAM_SPILL_THRESHOLD
+
+#if CONFIG_TELEGRAM_SPILL_ENABLE
+typedef struct {
+  uint16_t length;       // Text length, TELEGRAM_SPILL_WRAP - the rest of the buffer is not used
+  uint8_t lane;
+  uint8_t sent;          // Delivered, waiting for the older records of other chats
+  uint16_t parts;
   msg_options_t options;
   time_t timestamp;
-} tgMessageItem_t;
+} tgSpillRecord_t;
+
+#define TELEGRAM_SPILL_WRAP 0xFFFF
+#define TELEGRAM_SPILL_ALIGN alignof(tgSpillRecord_t)
+#define TELEGRAM_SPILL_SIZE (CONFIG_TELEGRAM_SPILL_SIZE & ~(TELEGRAM_SPILL_ALIGN - 1))
+#define TELEGRAM_SPILL_TEXT_MAX (TELEGRAM_SPILL_SIZE / 4 < API_TELEGRAM_MAX_LENGTH ? TELEGRAM_SPILL_SIZE / 4 : API_TELEGRAM_MAX_LENGTH)
+
+typedef struct {
+  uint8_t* data;
+  uint32_t head;         // The oldest record
+  uint32_t tail;         // Where the next record is written
+  uint32_t used;         // Bytes used, including the unused end of the buffer before a wrap
+  uint16_t count[TELEGRAM_LANES];  // Records not delivered yet
+  uint32_t upload_used;  // Bytes from the head that are being uploaded and cannot be overwritten, 0 - no upload
+  uint8_t attempts;
+} tgSpill_t;
+
+typedef struct {
+  uint8_t lane;
+  uint16_t count;
+  uint32_t parts;
+  msg_options_t options; // Options of the first record, they define the chat
+  uint8_t token;         // The bot that uploads the document
+  time_t first;
+  time_t last;
+} tgSpillUpload_t;
+#endif // CONFIG_TELEGRAM_SPILL_ENABLE
+
+static tgRing_t _tgRing;
+SemaphoreHandle_t _tgLock = nullptr;
+// Given by each worker that has stopped for tgTaskDelete()
+static SemaphoreHandle_t _tgStopped = nullptr;
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
+static tgOutbox_t _tgOutbox;
+#if CONFIG_TELEGRAM_DEDUP_ENABLE
+static tgMessage_t* _tgDedup[CONFIG_TELEGRAM_DEDUP_SIZE];
+#endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+static tgLive_t _tgLive[CONFIG_TELEGRAM_LIVE_SLOTS];
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
+#if CONFIG_TELEGRAM_SPILL_ENABLE
+static tgSpill_t _tgSpill;
+#endif // CONFIG_TELEGRAM_SPILL_ENABLE
+#if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+static tgLog_t _tgLog;
+#endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+static tgSlab_t* _tgSlab = nullptr;
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+static tgWorker_t _tgWorkers[CONFIG_TELEGRAM_WORKERS];
+static uint8_t _tgLanes[TELEGRAM_LANES];
+static bool _tgLaneBusy[TELEGRAM_LANES];
+static bool _tgLaneMigrated[TELEGRAM_LANES];
+static tgBucket_t _tgRateLanes[TELEGRAM_LANES][TELEGRAM_TOKENS];
+static tgBucket_t _tgRateGlobal[TELEGRAM_TOKENS];
+static uint8_t _tgTokenPrimary[TELEGRAM_LANES];
+static tgWheel_t _tgWheel;
+static tgDns_t _tgDns;
+static volatile uint32_t _tgNetworkEpoch = 0;
+static volatile bool _tgWarmup = false;
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
+static volatile bool _tgNetworkChanged = false;
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
+static tgCommand_t _tgCommands[CONFIG_TELEGRAM_COMMANDS];
+static uint8_t _tgCommandsUsed = 0;
+static tgUpdates_t _tgUpdates;
+static int64_t _tgUpdatesNext = 0;
+static uint8_t _tgUpdatesErrors = 0;
+// The offset survives a software restart, so a command that has restarted the device is not executed again
+RTC_NOINIT_ATTR static int64_t _tgUpdatesOffset;
+RTC_NOINIT_ATTR static uint32_t _tgUpdatesMagic;
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+static esp_err_t _tgResLast = ESP_OK;
+static uint32_t _tgBatchMessages = 0;
+static uint32_t _tgBatchRequests = 0;
+static tgStatsCore_t _tgStats[portNUM_PROCESSORS];
+static uint16_t _tgStatsQueueHigh = 0;
+static uint16_t _tgStatsOutboxHigh = 0;
+static uint32_t _tgStatsHeap = 0;
+#if CONFIG_TELEGRAM_STATS_INTERVAL > 0
+static TickType_t _tgStatsPublished = 0;
+static tg_stats_t _tgStatsSnapshot;
+#endif // CONFIG_TELEGRAM_STATS_INTERVAL
+
+ESP_EVENT_DEFINE_BASE(RE_TELEGRAM_EVENTS);
+
+static const char* logTAG = "TG";
+static const char* tgTaskName = "tg_send";
+
+#ifdef CONFIG_TELEGRAM_CHAT_ID_SERVICE
+  #define TELEGRAM_CHAT_ID_SERVICE CONFIG_TELEGRAM_CHAT_ID_SERVICE
+#else
+  #define TELEGRAM_CHAT_ID_SERVICE CONFIG_TELEGRAM_CHAT_ID_MAIN
+#endif // CONFIG_TELEGRAM_CHAT_ID_SERVICE
+
+#ifdef CONFIG_TELEGRAM_CHAT_ID_PARAMS
+  #define TELEGRAM_CHAT_ID_PARAMS CONFIG_TELEGRAM_CHAT_ID_PARAMS
+#else
+  #define TELEGRAM_CHAT_ID_PARAMS CONFIG_TELEGRAM_CHAT_ID_MAIN
+#endif // CONFIG_TELEGRAM_CHAT_ID_PARAMS
+
+#ifdef CONFIG_TELEGRAM_CHAT_ID_SECURITY
+  #define TELEGRAM_CHAT_ID_SECURITY CONFIG_TELEGRAM_CHAT_ID_SECURITY
+#else
+  #define TELEGRAM_CHAT_ID_SECURITY CONFIG_TELEGRAM_CHAT_ID_MAIN
+#endif // CONFIG_TELEGRAM_CHAT_ID_SECURITY
+
+#ifndef CONFIG_TELEGRAM_TLS_PEM_STORAGE
+  #define CONFIG_TELEGRAM_TLS_PEM_STORAGE TLS_CERT_BUFFER
+#endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+
+#ifndef CONFIG_TELEGRAM_CONNECT_TIMEOUT
+  #define CONFIG_TELEGRAM_CONNECT_TIMEOUT 10000
+#endif // CONFIG_TELEGRAM_CONNECT_TIMEOUT
+
+#ifndef CONFIG_TELEGRAM_RESPONSE_TIMEOUT
+  #define CONFIG_TELEGRAM_RESPONSE_TIMEOUT 30000
+#endif // CONFIG_TELEGRAM_RESPONSE_TIMEOUT
+
+#ifndef CONFIG_TELEGRAM_UPDATES_TIMEOUT
+  #define CONFIG_TELEGRAM_UPDATES_TIMEOUT 20
+#endif // CONFIG_TELEGRAM_UPDATES_TIMEOUT
+
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE && (CONFIG_TELEGRAM_UPDATES_TIMEOUT * 1000 >= CONFIG_TELEGRAM_RESPONSE_TIMEOUT)
+  #error "CONFIG_TELEGRAM_UPDATES_TIMEOUT must be shorter than CONFIG_TELEGRAM_RESPONSE_TIMEOUT"
+#endif // CONFIG_TELEGRAM_UPDATES_TIMEOUT
+
+#ifndef CONFIG_TELEGRAM_POLL_INTERVAL
+  #define CONFIG_TELEGRAM_POLL_INTERVAL 200
+#endif // CONFIG_TELEGRAM_POLL_INTERVAL
+
+#ifndef CONFIG_TELEGRAM_STALL_TIMEOUT
+  #define CONFIG_TELEGRAM_STALL_TIMEOUT 3000
+#endif // CONFIG_TELEGRAM_STALL_TIMEOUT
+
+// Since ESP-IDF 5.0, esp_http_client_fetch_headers() returns -ESP_ERR_HTTP_EAGAIN on a read timeout and can be called again
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  #define TELEGRAM_RESPONSE_POLLING 1
+#else
+  #define TELEGRAM_RESPONSE_POLLING 0
+#endif // ESP_IDF_VERSION
+
+#ifndef ESP_ERR_HTTP_CONNECTION_CLOSED
+  #define ESP_ERR_HTTP_CONNECTION_CLOSED (ESP_ERR_HTTP_BASE + 8)
+#endif // ESP_ERR_HTTP_CONNECTION_CLOSED
+
+#ifndef CONFIG_TELEGRAM_KEEP_ALIVE
+  #define CONFIG_TELEGRAM_KEEP_ALIVE 1
+#endif // CONFIG_TELEGRAM_KEEP_ALIVE
+
+#ifndef CONFIG_TELEGRAM_IDLE_TIMEOUT
+  #define CONFIG_TELEGRAM_IDLE_TIMEOUT 60000
+#endif // CONFIG_TELEGRAM_IDLE_TIMEOUT
+
+#ifndef CONFIG_TELEGRAM_WARMUP
+  #define CONFIG_TELEGRAM_WARMUP 1
+#endif // CONFIG_TELEGRAM_WARMUP
+
+#ifndef CONFIG_TELEGRAM_PARAMS_TTL
+  #define CONFIG_TELEGRAM_PARAMS_TTL 0
+#endif // CONFIG_TELEGRAM_PARAMS_TTL
+
+#ifndef CONFIG_TELEGRAM_COMPRESS_DICTIONARY
+  #define CONFIG_TELEGRAM_COMPRESS_DICTIONARY ""
+#endif // CONFIG_TELEGRAM_COMPRESS_DICTIONARY
+
+#ifndef CONFIG_TELEGRAM_DNS_TTL
+  #define CONFIG_TELEGRAM_DNS_TTL 300000
+#endif // CONFIG_TELEGRAM_DNS_TTL
+
+// Since ESP-IDF 5.0, esp_http_client can keep the TLS session ticket and resume the session when it connects again
+#if (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)) && defined(CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS) && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  #define TELEGRAM_TLS_RESUMPTION 1
+#else
+  #define TELEGRAM_TLS_RESUMPTION 0
+#endif // CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+
+// Since ESP-IDF 5.0, the server certificate can be checked against a name other than the host connected to
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+  #define TELEGRAM_DNS_FALLBACK 1
+#else
+  #define TELEGRAM_DNS_FALLBACK 0
+#endif // ESP_IDF_VERSION
+
+#ifndef CONFIG_TELEGRAM_OUTBOX_PARTITION
+  #define CONFIG_TELEGRAM_OUTBOX_PARTITION "tg_outbox"
+#endif // CONFIG_TELEGRAM_OUTBOX_PARTITION
+
+#if CONFIG_TELEGRAM_OUTBOX_PERSISTENT && !CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #error "CONFIG_TELEGRAM_OUTBOX_PERSISTENT requires CONFIG_TELEGRAM_OUTBOX_SIZE"
+#endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+
+#ifndef CONFIG_TELEGRAM_RATE_CHAT
+  #define CONFIG_TELEGRAM_RATE_CHAT 1000
+#endif // CONFIG_TELEGRAM_RATE_CHAT
+
+#ifndef CONFIG_TELEGRAM_RATE_GROUP
+  #define CONFIG_TELEGRAM_RATE_GROUP 3000
+#endif // CONFIG_TELEGRAM_RATE_GROUP
+
+#ifndef CONFIG_TELEGRAM_RATE_GLOBAL
+  #define CONFIG_TELEGRAM_RATE_GLOBAL 34
+#endif // CONFIG_TELEGRAM_RATE_GLOBAL
+
+#ifndef CONFIG_TELEGRAM_RATE_BURST
+  #define CONFIG_TELEGRAM_RATE_BURST 3
+#endif // CONFIG_TELEGRAM_RATE_BURST
+
+#ifndef CONFIG_TELEGRAM_DEDUP_WINDOW
+  #define CONFIG_TELEGRAM_DEDUP_WINDOW 600
+#endif // CONFIG_TELEGRAM_DEDUP_WINDOW
+
+#ifndef CONFIG_TELEGRAM_BATCH_LINGER
+  #define CONFIG_TELEGRAM_BATCH_LINGER 0
+#endif // CONFIG_TELEGRAM_BATCH_LINGER
+
+// Text added to the message when it is sent: the timestamp and the repeat counter of a collapsed message
+#define TELEGRAM_REPEATS_SIZE (48 + CONFIG_BUFFER_LEN_INT64_RADIX10)
+#if CONFIG_TELEGRAM_DEDUP_ENABLE
+  #define TELEGRAM_SEND_SUFFIX (sizeof("\r\n\r\n<code></code>") + CONFIG_BUFFER_LEN_INT64_RADIX10 + TELEGRAM_REPEATS_SIZE)
+#else
+  #define TELEGRAM_SEND_SUFFIX (sizeof("\r\n\r\n<code></code>") + CONFIG_BUFFER_LEN_INT64_RADIX10)
+#endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+
+// A batch must fit into the message buffer, and into the API limit together with the suffix
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  #define TELEGRAM_BATCH_LIMIT (CONFIG_TELEGRAM_MESSAGE_SIZE - 1 < API_TELEGRAM_MAX_LENGTH - TELEGRAM_SEND_SUFFIX \
+    ? CONFIG_TELEGRAM_MESSAGE_SIZE - 1 : API_TELEGRAM_MAX_LENGTH - TELEGRAM_SEND_SUFFIX)
+#else
+  #define TELEGRAM_BATCH_LIMIT (API_TELEGRAM_MAX_LENGTH - TELEGRAM_SEND_SUFFIX)
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+#if (CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUFFER)
+  #if defined(CONFIG_TELEGRAM_TLS_DER_START)
+    // Certificates in DER (certs/*.der) do not need to be decoded from base64
+    extern const char api_telegram_org_der_start[] asm(CONFIG_TELEGRAM_TLS_DER_START);
+    extern const char api_telegram_org_der_end[]   asm(CONFIG_TELEGRAM_TLS_DER_END);
+    #define TELEGRAM_TLS_CERT api_telegram_org_der_start
+    #define TELEGRAM_TLS_CERT_LEN (size_t)(api_telegram_org_der_end - api_telegram_org_der_start)
+  #else
+    extern const char api_telegram_org_pem_start[] asm(CONFIG_TELEGRAM_TLS_PEM_START);
+    extern const char api_telegram_org_pem_end[]   asm(CONFIG_TELEGRAM_TLS_PEM_END);  
+    #define TELEGRAM_TLS_CERT api_telegram_org_pem_start
+    #define TELEGRAM_TLS_CERT_LEN (strlen(api_telegram_org_pem_start) + 1)
+  #endif // CONFIG_TELEGRAM_TLS_DER_START
+  // esp-tls passes the TLS configuration to crt_bundle_attach only if the certificate bundle is enabled
+  #if defined(CONFIG_MBEDTLS_CERTIFICATE_BUNDLE) && CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+    #define TELEGRAM_TLS_TRUST_CACHE 1
+  #else
+    #define TELEGRAM_TLS_TRUST_CACHE 0
+  #endif // CONFIG_MBEDTLS_CERTIFICATE_BUNDLE
+#else
+  #define TELEGRAM_TLS_TRUST_CACHE 0
+#endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+
+#if defined(CONFIG_TELEGRAM_TLS_PIN_SHA256)
+  #define TELEGRAM_TLS_PIN 1
+  #if !TELEGRAM_TLS_TRUST_CACHE
+    #error "CONFIG_TELEGRAM_TLS_PIN_SHA256 requires TLS_CERT_BUFFER and CONFIG_MBEDTLS_CERTIFICATE_BUNDLE"
+  #endif // TELEGRAM_TLS_TRUST_CACHE
+#else
+  #define TELEGRAM_TLS_PIN 0
+#endif // CONFIG_TELEGRAM_TLS_PIN_SHA256
+
+#if CONFIG_TELEGRAM_STATIC_ALLOCATION
+StaticSemaphore_t _tgLockBuffer;
+StaticSemaphore_t _tgStoppedBuffer;
+StaticTask_t _tgTaskBuffer[CONFIG_TELEGRAM_WORKERS];
+StackType_t _tgTaskStack[CONFIG_TELEGRAM_WORKERS][CONFIG_TELEGRAM_STACK_SIZE];
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+tgSlab_t _tgSlabBuffer;
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+#endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Statistics ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Counters are recorded into the slot of the current core with relaxed atomic increments: no locks, no contention 
+ * between cores, and a task preempted on the same core cannot lose an increment. tgGetStats() sums the slots
+ * */
+static inline void tgStatsCount(msg_options_t msgOptions, tg_counter_t counter, uint32_t value = 1)
+{
+  uint8_t kind = decMsgOptionsKind(msgOptions);
+  if (kind >= TG_STATS_KINDS) kind = MK_MAIN;
+  __atomic_add_fetch(&_tgStats[xPortGetCoreID()].counters[kind][counter], value, __ATOMIC_RELAXED);
+}
+
+static inline void tgStatsLatency(tg_stage_t stage, int64_t time_us)
+{
+  uint32_t units = time_us > 0 ? (uint32_t)((time_us >> 7) < UINT32_MAX ? (time_us >> 7) : UINT32_MAX) : 0;
+  uint8_t bucket = units > 0 ? 32 - __builtin_clz(units) : 0;
+  if (bucket >= TG_STATS_BUCKETS) bucket = TG_STATS_BUCKETS - 1;
+  __atomic_add_fetch(&_tgStats[xPortGetCoreID()].latency[stage][bucket], 1, __ATOMIC_RELAXED);
+}
+
+static inline void tgStatsHigh(uint16_t* mark, uint16_t value)
+{
+  if (value > *mark) *mark = value;
+}
+
+void tgGetStats(tg_stats_t* stats)
+{
+  memset(stats, 0, sizeof(tg_stats_t));
+  for (uint8_t core = 0; core < portNUM_PROCESSORS; core++) {
+    for (uint8_t kind = 0; kind < TG_STATS_KINDS; kind++) {
+      for (uint8_t counter = 0; counter < TG_COUNTER_MAX; counter++) {
+        stats->counters[kind][counter] += __atomic_load_n(&_tgStats[core].counters[kind][counter], __ATOMIC_RELAXED);
+      };
+    };
+    for (uint8_t stage = 0; stage < TG_STAGE_MAX; stage++) {
+      for (uint8_t bucket = 0; bucket < TG_STATS_BUCKETS; bucket++) {
+        stats->latency[stage][bucket] += __atomic_load_n(&_tgStats[core].latency[stage][bucket], __ATOMIC_RELAXED);
+      };
+    };
+  };
+  stats->queue_high = _tgStatsQueueHigh;
+  stats->outbox_high = _tgStatsOutboxHigh;
+  stats->heap_bytes = __atomic_load_n(&_tgStatsHeap, __ATOMIC_RELAXED);
+}
+
+#if CONFIG_TELEGRAM_STATS_INTERVAL > 0
+
+// Returns how long the task may sleep before the next publication of statistics
+TickType_t tgStatsWait(TickType_t waitTicks)
+{
+  TickType_t passed = xTaskGetTickCount() - _tgStatsPublished;
+  TickType_t interval = pdMS_TO_TICKS(CONFIG_TELEGRAM_STATS_INTERVAL);
+  TickType_t remain = passed < interval ? interval - passed : 0;
+  return remain < waitTicks ? remain : waitTicks;
+}
+
+// Posts a snapshot to the event loop, from there it can be forwarded to MQTT by the application
+void tgStatsPublish()
+{
+  if ((xTaskGetTickCount() - _tgStatsPublished) >= pdMS_TO_TICKS(CONFIG_TELEGRAM_STATS_INTERVAL)) {
+    _tgStatsPublished = xTaskGetTickCount();
+    tgGetStats(&_tgStatsSnapshot);
+    eventLoopPost(RE_TELEGRAM_EVENTS, RE_TELEGRAM_STATS, &_tgStatsSnapshot, sizeof(_tgStatsSnapshot), 0);
+  };
+}
+
+#endif // CONFIG_TELEGRAM_STATS_INTERVAL
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Message memory ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * With CONFIG_TELEGRAM_MESSAGE_SIZE, messages live in a fixed arena allocated once: the text is formatted 
+ * directly into its slot and the slot pointer travels through the queue and the outbox without copying.
+ * Free slots form a lock-free stack (the tag in the upper half of free_top protects against ABA), so a slot 
+ * can also be taken from an interrupt handler. Without it, the header and the text share a single heap block
+ * */
+bool tgSlabInit()
+{
+  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    if (_tgSlab == nullptr) {
+      #if CONFIG_TELEGRAM_STATIC_ALLOCATION
+        _tgSlab = &_tgSlabBuffer;
+      #else
+        _tgSlab = (tgSlab_t*)psram_calloc(1, sizeof(tgSlab_t));
+        if (_tgSlab == nullptr) return false;
+        _tgStatsHeap = sizeof(tgSlab_t);
+      #endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
+      for (uint16_t i = 0; i < TELEGRAM_SLAB_SIZE; i++) {
+        _tgSlab->headers[i].message = _tgSlab->texts[i];
+        _tgSlab->next[i] = (i + 1 < TELEGRAM_SLAB_SIZE) ? i + 1 : TELEGRAM_SLAB_NONE;
+      };
+      _tgSlab->free_top = 0;
+    };
+  #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  return true;
+}
+
+tgMessage_t* tgMessageAlloc(size_t size)
+{
+  tgMessage_t* tgMsg = nullptr;
+  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    if (_tgSlab) {
+      uint32_t top = __atomic_load_n(&_tgSlab->free_top, __ATOMIC_ACQUIRE);
+      uint32_t next;
+      do {
+        if ((top & 0xFFFF) == TELEGRAM_SLAB_NONE) break;
+        next = ((top & 0xFFFF0000) + 0x10000) | _tgSlab->next[top & 0xFFFF];
+      } while (!__atomic_compare_exchange_n(&_tgSlab->free_top, &top, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+      if ((top & 0xFFFF) != TELEGRAM_SLAB_NONE) {
+        tgMsg = &_tgSlab->headers[top & 0xFFFF];
+      };
+    };
+  #else
+    tgMsg = (tgMessage_t*)psram_calloc(1, sizeof(tgMessage_t) + size);
+    if (tgMsg) {
+      tgMsg->message = (char*)(tgMsg + 1);
+      tgMsg->size = sizeof(tgMessage_t) + size;
+      __atomic_add_fetch(&_tgStatsHeap, tgMsg->size, __ATOMIC_RELAXED);
+    };
+  #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  if (tgMsg) {
+    tgMsg->message[0] = 0;
+    tgMsg->parts = 1;
+    tgMsg->callback = nullptr;
+    tgMsg->live = 0;
+    tgMsg->attempts = 0;
+    tgMsg->retry_next = nullptr;
+    tgMsg->deadline = 0;
+    tgMsg->expires = 0;
+    #if CONFIG_TELEGRAM_DEDUP_ENABLE
+      tgMsg->hash = 0;
+      tgMsg->repeats = 1;
+    #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+    #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+      tgMsg->packed = 0;
+      tgMsg->length = 0;
+    #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  };
+  return tgMsg;
+}
+
+void tgMessageFree(tgMessage_t* tgMsg)
+{
+  if (tgMsg) {
+    #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      uint16_t index = (uint16_t)(tgMsg - _tgSlab->headers);
+      uint32_t top = __atomic_load_n(&_tgSlab->free_top, __ATOMIC_RELAXED);
+      uint32_t next;
+      do {
+        _tgSlab->next[index] = (uint16_t)(top & 0xFFFF);
+        next = ((top & 0xFFFF0000) + 0x10000) | index;
+      } while (!__atomic_compare_exchange_n(&_tgSlab->free_top, &top, next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    #else
+      __atomic_sub_fetch(&_tgStatsHeap, tgMsg->size, __ATOMIC_RELAXED);
+      free(tgMsg);
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  };
+}
+
+/**
+ * Delivery targets of the latency classes, ms. Without a class, the target is chosen by priority: 
+ * low - bulk, ordinary - normal, high - 5 s, critical - urgent
+ * */
+#define TELEGRAM_LATENCY_URGENT 1000
+#define TELEGRAM_LATENCY_HIGH 5000
+#define TELEGRAM_LATENCY_NORMAL 30000
+#define TELEGRAM_LATENCY_BULK 600000
+static const uint32_t _tgLatencyClass[TG_LATENCY_MAX] = { 0, TELEGRAM_LATENCY_URGENT, TELEGRAM_LATENCY_NORMAL, TELEGRAM_LATENCY_BULK };
+static const uint32_t _tgLatencyLevel[TELEGRAM_PRIORITY_LEVELS] = { TELEGRAM_LATENCY_BULK, TELEGRAM_LATENCY_NORMAL, TELEGRAM_LATENCY_HIGH, TELEGRAM_LATENCY_URGENT };
+
+// Sets the deadline and the expiration time of a queued message (safe in an interrupt)
+void tgMessageSchedule(tgMessage_t* tgMsg, uint32_t ttl, tg_latency_t latency)
+{
+  uint8_t level = decMsgOptionsPriority(tgMsg->options);
+  uint32_t target = (latency > TG_LATENCY_DEFAULT) && (latency < TG_LATENCY_MAX) 
+    ? _tgLatencyClass[latency] 
+    : _tgLatencyLevel[level < TELEGRAM_PRIORITY_LEVELS ? level : TELEGRAM_PRIORITY_LEVELS - 1];
+  tgMsg->deadline = tgMsg->queued + (int64_t)target * 1000;
+  if ((ttl == 0) && (decMsgOptionsKind(tgMsg->options) == MK_PARAMS)) {
+    ttl = CONFIG_TELEGRAM_PARAMS_TTL;
+  };
+  tgMsg->expires = ttl > 0 ? tgMsg->queued + (int64_t)ttl * 1000 : 0;
+}
+
+static inline bool tgMessageExpired(tgMessage_t* tgMsg, int64_t now)
+{
+  return (tgMsg->expires != 0) && (tgMsg->expires <= now);
+}
+
+// FNV-1a over the kind and the text
+uint32_t tgMessageHash(msg_options_t msgOptions, const char* text)
+{
+  uint32_t hash = 2166136261UL;
+  hash = (hash ^ (uint8_t)decMsgOptionsKind(msgOptions)) * 16777619UL;
+  while (*text) {
+    hash = (hash ^ (uint8_t)*text++) * 16777619UL;
+  };
+  return hash ? hash : 1;
+}
+
+// Reports the final result to the sender (if it asked for it) and frees the message
+void tgMessageDone(tgMessage_t* tgMsg, esp_err_t result, int64_t message_id)
+{
+  if (tgMsg->callback) {
+    tgMsg->callback(result, message_id, tgMsg->ctx);
+  };
+  tgMessageFree(tgMsg);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Compression -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_COMPRESS_ENABLE
+
+/**
+ * Messages waiting in the outbox are compressed with LZSS: a flag byte precedes every 8 items, an item is either 
+ * a literal byte or a two-byte reference (9-bit distance, 7-bit length) into the last TELEGRAM_PACK_WINDOW bytes. 
+ * The window starts filled with a static dictionary of typical fragments, so even a short message finds its tags 
+ * and labels there. The text is decompressed in small chunks straight into the request body, so the decoder 
+ * needs only the window and a chunk on the stack
+ * */
+#define TELEGRAM_PACK_WINDOW 512
+#define TELEGRAM_PACK_MIN_MATCH 3
+#define TELEGRAM_PACK_MAX_MATCH (TELEGRAM_PACK_MIN_MATCH + 127)
+#define TELEGRAM_PACK_CHUNK 64
+// Shorter texts or a smaller gain are not worth a new allocation
+#define TELEGRAM_PACK_MIN_LENGTH 32
+#define TELEGRAM_PACK_MIN_GAIN 16
+
+static const char _tgPackDictionary[] = CONFIG_TELEGRAM_COMPRESS_DICTIONARY 
+  "\u00b0C, " " %, " "Error" "Warning" "temperature" "humidity" "pressure" "sensor" "alarm" 
+  " is " ": ON" ": OFF" "enabled" "disabled" "</i>\r\n" "<i>" "</code>\r\n" "<code>" 
+  "</b>\r\n\r\n" "<b>" "\r\n";
+#define TELEGRAM_PACK_DICTIONARY_SIZE (sizeof(_tgPackDictionary) - 1)
+static_assert(TELEGRAM_PACK_DICTIONARY_SIZE <= TELEGRAM_PACK_WINDOW, "CONFIG_TELEGRAM_COMPRESS_DICTIONARY is too long");
+
+// The text as if it followed the dictionary
+static inline char tgPackAt(const char* text, size_t pos)
+{
+  return pos < TELEGRAM_PACK_DICTIONARY_SIZE ? _tgPackDictionary[pos] : text[pos - TELEGRAM_PACK_DICTIONARY_SIZE];
+}
+
+// Compresses the text, returns the compressed size (out == nullptr - only calculates it)
+size_t tgPackEncode(const char* text, size_t length, uint8_t* out)
+{
+  size_t size = 0;
+  size_t flags = 0;
+  uint8_t bit = 8;
+  size_t pos = TELEGRAM_PACK_DICTIONARY_SIZE;
+  size_t end = TELEGRAM_PACK_DICTIONARY_SIZE + length;
+  while (pos < end) {
+    if (bit == 8) {
+      flags = size++;
+      if (out) out[flags] = 0;
+      bit = 0;
+    };
+    // The longest match in the window, the first one found wins
+    char first = tgPackAt(text, pos);
+    size_t limit = end - pos < TELEGRAM_PACK_MAX_MATCH ? end - pos : TELEGRAM_PACK_MAX_MATCH;
+    size_t best = 0;
+    size_t distance = 0;
+    if (limit >= TELEGRAM_PACK_MIN_MATCH) {
+      for (size_t from = pos > TELEGRAM_PACK_WINDOW ? pos - TELEGRAM_PACK_WINDOW : 0; from < pos; from++) {
+        if (tgPackAt(text, from) != first) continue;
+        size_t len = 1;
+        while ((len < limit) && (tgPackAt(text, from + len) == tgPackAt(text, pos + len))) {
+          len++;
+        };
+        if (len > best) {
+          best = len;
+          distance = pos - from;
+          if (len == limit) break;
+        };
+      };
+    };
+    if (best >= TELEGRAM_PACK_MIN_MATCH) {
+      if (out) {
+        out[flags] |= 1 << bit;
+        out[size] = (uint8_t)((distance - 1) & 0xFF);
+        out[size + 1] = (uint8_t)(((distance - 1) >> 8) | ((best - TELEGRAM_PACK_MIN_MATCH) << 1));
+      };
+      size += 2;
+      pos += best;
+    } else {
+      if (out) out[size] = (uint8_t)first;
+      size++;
+      pos++;
+    };
+    bit++;
+  };
+  return size;
+}
+
+// Decompresses the data and passes the text to the sink in chunks, returns false if the sink has stopped or the data is damaged
+bool tgPackDecode(const uint8_t* data, size_t size, tgTextSink_t sink, void* ctx)
+{
+  char window[TELEGRAM_PACK_WINDOW];
+  char chunk[TELEGRAM_PACK_CHUNK + 1];
+  size_t fill = 0;
+  uint32_t pos = TELEGRAM_PACK_DICTIONARY_SIZE;
+  memcpy(window, _tgPackDictionary, TELEGRAM_PACK_DICTIONARY_SIZE);
+  uint8_t flags = 0;
+  uint8_t bit = 8;
+  size_t i = 0;
+  while (i < size) {
+    if (bit == 8) {
+      flags = data[i++];
+      bit = 0;
+      continue;
+    };
+    uint32_t distance = 0;
+    uint16_t count = 1;
+    if (flags & (1 << bit)) {
+      if ((i + 2 > size) || ((distance = (data[i] | ((data[i + 1] & 1) << 8)) + 1) > pos)) return false;
+      count = (data[i + 1] >> 1) + TELEGRAM_PACK_MIN_MATCH;
+      i += 2;
+    };
+    while (count--) {
+      char c = distance ? window[(pos - distance) & (TELEGRAM_PACK_WINDOW - 1)] : (char)data[i];
+      window[pos++ & (TELEGRAM_PACK_WINDOW - 1)] = c;
+      chunk[fill++] = c;
+      if (fill == TELEGRAM_PACK_CHUNK) {
+        chunk[fill] = 0;
+        if (!sink(chunk, fill, ctx)) return false;
+        fill = 0;
+      };
+    };
+    if (distance == 0) i++;
+    bit++;
+  };
+  chunk[fill] = 0;
+  return (fill == 0) || sink(chunk, fill, ctx);
+}
+
+// Replaces a message waiting in the outbox with its compressed copy, if that saves enough memory
+tgMessage_t* tgMessagePack(tgMessage_t* tgMsg)
+{
+  if ((tgMsg->packed > 0) || (tgMsg->live != 0)) return tgMsg;
+  size_t length = strlen(tgMsg->message);
+  if ((length < TELEGRAM_PACK_MIN_LENGTH) || (length > UINT16_MAX)) return tgMsg;
+  size_t size = tgPackEncode(tgMsg->message, length, nullptr);
+  if (size + TELEGRAM_PACK_MIN_GAIN > length) return tgMsg;
+
+  tgMessage_t* packed = tgMessageAlloc(size);
+  if (packed == nullptr) return tgMsg;
+  char* data = packed->message;
+  size_t block = packed->size;
+  *packed = *tgMsg;
+  packed->message = data;
+  packed->size = block;
+  packed->packed = (uint16_t)size;
+  packed->length = (uint16_t)length;
+  tgPackEncode(tgMsg->message, length, (uint8_t*)data);
+  tgMessageFree(tgMsg);
+  return packed;
+}
+
+static bool tgPackCopy(const char* chunk, size_t length, void* ctx)
+{
+  char** dest = (char**)ctx;
+  memcpy(*dest, chunk, length);
+  *dest += length;
+  return true;
+}
+
+// Restores the plain text of a compressed message (for the spill buffer), returns nullptr if there is not enough memory
+tgMessage_t* tgMessageUnpack(tgMessage_t* tgMsg)
+{
+  if (tgMsg->packed == 0) return tgMsg;
+  tgMessage_t* plain = tgMessageAlloc(tgMsg->length + 1);
+  if (plain == nullptr) return nullptr;
+  char* text = plain->message;
+  size_t block = plain->size;
+  *plain = *tgMsg;
+  plain->message = text;
+  plain->size = block;
+  plain->packed = 0;
+  tgPackDecode((const uint8_t*)tgMsg->message, tgMsg->packed, tgPackCopy, &text);
+  *text = 0;
+  tgMessageFree(tgMsg);
+  return plain;
+}
+
+static bool tgPackCompare(const char* chunk, size_t length, void* ctx)
+{
+  const char** text = (const char**)ctx;
+  if (strncmp(*text, chunk, length) != 0) return false;
+  *text += length;
+  return true;
+}
+
+#endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+
+// Passes the text of the message to the sink, decompressing it if necessary
+bool tgMessageText(tgMessage_t* tgMsg, tgTextSink_t sink, void* ctx)
+{
+  #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+    if (tgMsg->packed > 0) {
+      return tgPackDecode((const uint8_t*)tgMsg->message, tgMsg->packed, sink, ctx);
+    };
+  #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  return sink(tgMsg->message, strlen(tgMsg->message), ctx);
+}
+
+// Compares the text of the message with a plain string
+bool tgMessageEqual(tgMessage_t* tgMsg, const char* text)
+{
+  #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+    if (tgMsg->packed > 0) {
+      return tgPackDecode((const uint8_t*)tgMsg->message, tgMsg->packed, tgPackCompare, &text) && (*text == 0);
+    };
+  #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  return strcmp(tgMsg->message, text) == 0;
+}
 
-#define TELEGRAM_QUEUE_ITEM_SIZE sizeof(tgMessage_t*)
+// The text for the debug log: a compressed text is not decompressed just to be logged
+static inline const char* tgMessageLogText(tgMessage_t* tgMsg)
+{
+  #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+    if (tgMsg->packed > 0) return "<compressed>";
+  #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  return tgMsg->message;
+}
+
+// The time to live of the message has passed before it could be sent: it is dropped without a request
+void tgMessageExpire(tgMessage_t* tgMsg)
+{
+  rlog_w(logTAG, "Message expired before it could be sent: %s", tgMessageLogText(tgMsg));
+  tgStatsCount(tgMsg->options, TG_COUNTER_EXPIRED, tgMsg->parts);
+  tgMessageDone(tgMsg, ESP_ERR_TIMEOUT, 0);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Message ring -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Producers (tgSendMsg from any task or interrupt) pass preformatted messages to the first worker through a 
+ * lock-free multi-producer / single-consumer ring. A producer takes a credit (free slot), reserves a position 
+ * with an atomic fetch-add, stores the message and publishes it by writing the position to the commit word of 
+ * the slot. Producers never block: if there are no credits left for the message priority, it is dropped. 
+ * The consumer only reads committed slots in order and returns the credit after taking the message
+ * */
+void tgRingInit()
+{
+  for (uint32_t i = 0; i < TELEGRAM_RING_SIZE; i++) {
+    _tgRing.slots[i] = nullptr;
+    _tgRing.commits[i] = 0;
+  };
+  _tgRing.head = 0;
+  _tgRing.tail = 0;
+  _tgRing.credits = CONFIG_TELEGRAM_QUEUE_SIZE;
+  _tgRing.isr_dropped = 0;
+}
+
+bool tgRingPush(tgMessage_t* tgMsg)
+{
+  uint8_t level = decMsgOptionsPriority(tgMsg->options);
+  if (level >= TELEGRAM_PRIORITY_LEVELS) level = TELEGRAM_PRIORITY_LEVELS - 1;
+  if (__atomic_sub_fetch(&_tgRing.credits, 1, __ATOMIC_ACQUIRE) < TELEGRAM_RING_RESERVE(level)) {
+    __atomic_add_fetch(&_tgRing.credits, 1, __ATOMIC_RELAXED);
+    return false;
+  };
+  // acq_rel: the position may belong to a slot released by a credit that another producer has taken
+  uint32_t position = __atomic_fetch_add(&_tgRing.head, 1, __ATOMIC_ACQ_REL);
+  uint32_t index = position & (TELEGRAM_RING_SIZE - 1);
+  _tgRing.slots[index] = tgMsg;
+  __atomic_store_n(&_tgRing.commits[index], position + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+// Returns the next committed message without taking it out of the ring
+tgMessage_t* tgRingPeek()
+{
+  uint32_t index = _tgRing.tail & (TELEGRAM_RING_SIZE - 1);
+  if (__atomic_load_n(&_tgRing.commits[index], __ATOMIC_ACQUIRE) != _tgRing.tail + 1) {
+    return nullptr;
+  };
+  tgMessage_t* tgMsg = _tgRing.slots[index];
+  // Messages from interrupts are stamped here
+  if (tgMsg->timestamp == 0) {
+    tgMsg->timestamp = time(nullptr);
+  };
+  return tgMsg;
+}
+
+// Takes the peeked message out of the ring and returns its credit to the producers
+void tgRingAdvance()
+{
+  uint32_t index = _tgRing.tail & (TELEGRAM_RING_SIZE - 1);
+  tgStatsHigh(&_tgStatsQueueHigh, (uint16_t)(__atomic_load_n(&_tgRing.head, __ATOMIC_RELAXED) - _tgRing.tail));
+  tgStatsLatency(TG_STAGE_QUEUE, esp_timer_get_time() - _tgRing.slots[index]->queued);
+  _tgRing.slots[index] = nullptr;
+  _tgRing.tail++;
+  __atomic_add_fetch(&_tgRing.credits, 1, __ATOMIC_RELEASE);
+}
+
+void tgSendResult(esp_err_t resSend);
+
+// Waits for a message or any notification of the consumer task, whichever comes first
+tgMessage_t* tgRingWait(TickType_t waitTicks)
+{
+  tgMessage_t* tgMsg = tgRingPeek();
+  if ((tgMsg == nullptr) && (waitTicks > 0)) {
+    ulTaskNotifyTake(pdTRUE, waitTicks);
+    tgMsg = tgRingPeek();
+  };
+  uint32_t dropped = __atomic_exchange_n(&_tgRing.isr_dropped, 0, __ATOMIC_RELAXED);
+  if (dropped > 0) {
+    rlog_e(logTAG, "Failed to add %d message(s) from interrupt handlers to queue", (int)dropped);
+    // Reported as a send result, so that the next delivered message clears the error state
+    tgSendResult(ESP_ERR_NO_MEM);
+  };
+  return tgMsg;
+}
+
+// Frees messages left in the ring when the task is deleted
+void tgRingClear()
+{
+  tgMessage_t* tgMsg;
+  while ((tgMsg = tgRingPeek()) != nullptr) {
+    tgRingAdvance();
+    tgMessageDone(tgMsg, ESP_ERR_INVALID_STATE, 0);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Chats & lanes ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+const char* tgChatId(msg_kind_t msgKind)
+{
+  switch (msgKind) {
+    case MK_SERVICE:
+      return TELEGRAM_CHAT_ID_SERVICE;
+    case MK_PARAMS:
+      return TELEGRAM_CHAT_ID_PARAMS;
+    case MK_SECURITY:
+      return TELEGRAM_CHAT_ID_SECURITY;
+    default:
+      return CONFIG_TELEGRAM_CHAT_ID_MAIN;
+  };
+}
+
+/**
+ * Messages are sent in lanes, one lane per destination chat. Messages within a lane are sent strictly one 
+ * after another, different lanes can be served by different workers at the same time
+ * */
+void tgLanesInit()
+{
+  for (uint8_t kind = 0; kind < TELEGRAM_LANES; kind++) {
+    _tgLanes[kind] = kind;
+    _tgLaneBusy[kind] = false;
+    for (uint8_t prev = 0; prev < kind; prev++) {
+      if (strcmp(tgChatId((msg_kind_t)prev), tgChatId((msg_kind_t)kind)) == 0) {
+        _tgLanes[kind] = _tgLanes[prev];
+        break;
+      };
+    };
+  };
+}
+
+static inline uint8_t tgLane(msg_options_t msgOptions)
+{
+  uint8_t kind = decMsgOptionsKind(msgOptions);
+  return _tgLanes[kind < TELEGRAM_LANES ? (uint8_t)kind : (uint8_t)MK_MAIN];
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Rate limiter -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Sending is paced by token buckets (in the GCRA form: one timestamp per bucket) so that the Telegram limits 
+ * are not exceeded in the first place: one bucket per lane (about 1 message per second to a private chat, 
+ * 20 messages per minute to a group) and one global bucket for the bot. When the API still answers 
+ * 429 Too Many Requests, the lane is blocked for the retry_after period reported by the server. 
+ * 
+ * With a pool of bot tokens, every bot has its own buckets. A chat is always served by the same bot (chosen 
+ * by the hash of the chat ID), while that bot is throttled or denied access, the next bot of the pool that 
+ * may send to the chat takes over
+ * */
+static void tgBucketInit(tgBucket_t* bucket, uint32_t interval_ms)
+{
+  bucket->interval = (int64_t)interval_ms * 1000;
+  bucket->tolerance = bucket->interval * (CONFIG_TELEGRAM_RATE_BURST > 1 ? CONFIG_TELEGRAM_RATE_BURST - 1 : 0);
+  bucket->tat = 0;
+}
+
+static inline int64_t tgBucketWait(tgBucket_t* bucket, int64_t now)
+{
+  int64_t allowed = bucket->tat - bucket->tolerance;
+  return allowed > now ? allowed - now : 0;
+}
+
+static inline void tgBucketConsume(tgBucket_t* bucket, int64_t now)
+{
+  bucket->tat = (bucket->tat > now ? bucket->tat : now) + bucket->interval;
+}
+
+void tgRateInit()
+{
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    const char* chat_id = tgChatId((msg_kind_t)lane);
+    uint32_t hash = 2166136261u;
+    for (const char* c = chat_id; *c; c++) {
+      hash = (hash ^ (uint8_t)*c) * 16777619u;
+    };
+    _tgTokenPrimary[lane] = hash % TELEGRAM_TOKENS;
+    for (uint8_t token = 0; token < TELEGRAM_TOKENS; token++) {
+      // Group and channel IDs are negative
+      tgBucketInit(&_tgRateLanes[lane][token], chat_id[0] == '-' ? CONFIG_TELEGRAM_RATE_GROUP : CONFIG_TELEGRAM_RATE_CHAT);
+    };
+  };
+  for (uint8_t token = 0; token < TELEGRAM_TOKENS; token++) {
+    tgBucketInit(&_tgRateGlobal[token], CONFIG_TELEGRAM_RATE_GLOBAL);
+  };
+}
+
+/**
+ * Chooses the bot for the next message to the lane: the primary bot of the chat if it may send right now, 
+ * otherwise the first one of the pool that may, otherwise the one that is unblocked first. 
+ * wait receives the time until the chosen bot may send, us
+ * */
+uint8_t tgRateToken(uint8_t lane, uint8_t token, int64_t* wait)
+{
+  int64_t now = esp_timer_get_time();
+  uint8_t first = token == TELEGRAM_TOKEN_ANY ? _tgTokenPrimary[lane] : token;
+  uint8_t count = token == TELEGRAM_TOKEN_ANY ? TELEGRAM_TOKENS : 1;
+  uint8_t best = first;
+  *wait = -1;
+  for (uint8_t i = 0; i < count; i++) {
+    uint8_t candidate = (first + i) % TELEGRAM_TOKENS;
+    int64_t wait_lane = tgBucketWait(&_tgRateLanes[lane][candidate], now);
+    int64_t wait_global = tgBucketWait(&_tgRateGlobal[candidate], now);
+    int64_t wait_token = wait_lane > wait_global ? wait_lane : wait_global;
+    if ((*wait < 0) || (wait_token < *wait)) {
+      *wait = wait_token;
+      best = candidate;
+      if (wait_token == 0) break;
+    };
+  };
+  return best;
+}
+
+// Returns the time until the next message can be sent to the lane (by the specified bot or by any bot of the pool), us
+int64_t tgRateWait(uint8_t lane, uint8_t token = TELEGRAM_TOKEN_ANY)
+{
+  int64_t wait;
+  tgRateToken(lane, token, &wait);
+  return wait;
+}
+
+// Charges the buckets of the bot that will send the next message to the lane and returns it
+uint8_t tgRateConsume(uint8_t lane, uint8_t token = TELEGRAM_TOKEN_ANY)
+{
+  int64_t wait;
+  token = tgRateToken(lane, token, &wait);
+  int64_t now = esp_timer_get_time();
+  tgBucketConsume(&_tgRateLanes[lane][token], now);
+  tgBucketConsume(&_tgRateGlobal[token], now);
+  return token;
+}
+
+// Blocks the lane for the bot for the specified period, after that messages go one per interval without a burst
+void tgRatePenalty(uint8_t lane, uint8_t token, uint32_t delay_ms)
+{
+  tgBucket_t* bucket = &_tgRateLanes[lane][token];
+  int64_t tat = esp_timer_get_time() + (int64_t)delay_ms * 1000 + bucket->tolerance;
+  if (tat > bucket->tat) {
+    bucket->tat = tat;
+  };
+}
+
+static inline TickType_t tgRateTicks(int64_t wait_us)
+{
+  return wait_us > 0 ? pdMS_TO_TICKS((uint32_t)((wait_us + 999) / 1000)) + 1 : 0;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Retry scheduler ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * A failed message gets its own time of the next attempt: exponential backoff from CONFIG_TELEGRAM_SEND_INTERVAL 
+ * with a cap depending on the error class, half of the delay is random so that messages that failed together 
+ * do not retry in lockstep. Waiting messages are kept in a hashed timer wheel (slot = tick modulo the number 
+ * of slots), a deadline beyond one revolution simply stays in its slot for another round. Meanwhile the 
+ * following messages are sent as usual
+ * */
+tgRetryClass_t tgRetryClass(esp_err_t resSend, tgResponse_t* resp)
+{
+  if (resp->status >= 500) return TG_RETRY_SERVER;
+  if (resSend == ESP_ERR_INVALID_RESPONSE) return TG_RETRY_LIMIT;
+  if (!statesNetworkIsConnected()) return TG_RETRY_NETWORK;
+  return TG_RETRY_TRANSPORT;
+}
+
+int64_t tgRetryDelay(tgRetryClass_t retryClass, uint8_t attempts)
+{
+  int64_t limit = (int64_t)(retryClass == TG_RETRY_SERVER ? CONFIG_TELEGRAM_RETRY_MAX_SERVER : CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT) * 1000;
+  int64_t delay = (int64_t)CONFIG_TELEGRAM_SEND_INTERVAL * 1000;
+  for (uint8_t i = 1; (i < attempts) && (delay < limit); i++) {
+    delay *= 2;
+  };
+  if (delay > limit) delay = limit;
+  // Equal jitter: half of the delay is fixed, the other half is random
+  return delay / 2 + (int64_t)(esp_random() % (uint32_t)(delay / 2 + 1));
+}
+
+void tgWheelAdd(tgMessage_t* tgMsg, int64_t delay_us)
+{
+  int64_t now = esp_timer_get_time();
+  if (_tgWheel.count == 0) {
+    _tgWheel.tick = now / TELEGRAM_WHEEL_TICK;
+  };
+  tgMsg->retry_at = now + delay_us;
+  // A slot is kept in the order of the retry time, messages held back by the rate limit of a chat keep their order
+  tgMessage_t** link = &_tgWheel.slots[(tgMsg->retry_at / TELEGRAM_WHEEL_TICK) % TELEGRAM_WHEEL_SLOTS];
+  while ((*link) && ((*link)->retry_at <= tgMsg->retry_at)) {
+    link = (tgMessage_t**)&(*link)->retry_next;
+  };
+  tgMsg->retry_next = *link;
+  *link = tgMsg;
+  _tgWheel.count++;
+}
+
+// Takes one message whose time has come out of the wheel
+tgMessage_t* tgWheelNext(int64_t now)
+{
+  if (_tgWheel.count == 0) return nullptr;
+  int64_t nowTick = now / TELEGRAM_WHEEL_TICK;
+  // One revolution covers all slots
+  if (nowTick - _tgWheel.tick >= TELEGRAM_WHEEL_SLOTS) {
+    _tgWheel.tick = nowTick - TELEGRAM_WHEEL_SLOTS + 1;
+  };
+  for (uint8_t i = 0; (i < TELEGRAM_WHEEL_SLOTS) && (_tgWheel.tick <= nowTick); i++) {
+    tgMessage_t** link = &_tgWheel.slots[_tgWheel.tick % TELEGRAM_WHEEL_SLOTS];
+    while (*link) {
+      tgMessage_t* tgMsg = *link;
+      if (tgMsg->retry_at <= now) {
+        *link = (tgMessage_t*)tgMsg->retry_next;
+        tgMsg->retry_next = nullptr;
+        _tgWheel.count--;
+        return tgMsg;
+      };
+      link = (tgMessage_t**)&tgMsg->retry_next;
+    };
+    // The current tick is scanned again next time, its messages may not be due yet
+    if (_tgWheel.tick == nowTick) break;
+    _tgWheel.tick++;
+  };
+  return nullptr;
+}
+
+// Returns the time until the wheel has to be checked again (-1 - it is empty), us
+int64_t tgWheelWait(int64_t now)
+{
+  if (_tgWheel.count == 0) return -1;
+  int64_t nowTick = now / TELEGRAM_WHEEL_TICK;
+  int64_t wait = -1;
+  for (tgMessage_t* tgMsg = _tgWheel.slots[nowTick % TELEGRAM_WHEEL_SLOTS]; tgMsg; tgMsg = (tgMessage_t*)tgMsg->retry_next) {
+    if ((tgMsg->retry_at / TELEGRAM_WHEEL_TICK == nowTick) && ((wait < 0) || (tgMsg->retry_at - now < wait))) {
+      wait = tgMsg->retry_at > now ? tgMsg->retry_at - now : 0;
+    };
+  };
+  if (wait >= 0) return wait;
+  for (uint8_t i = 1; i <= TELEGRAM_WHEEL_SLOTS; i++) {
+    if (_tgWheel.slots[(nowTick + i) % TELEGRAM_WHEEL_SLOTS]) {
+      return (nowTick + i) * TELEGRAM_WHEEL_TICK - now;
+    };
+  };
+  return TELEGRAM_WHEEL_SLOTS * TELEGRAM_WHEEL_TICK;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Deduplication -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_DEDUP_ENABLE
+
+/**
+ * Flapping sensors repeat the same text over and over. Each message is hashed when it is queued; a small 
+ * direct-mapped table points to pending outbox messages by hash. A repeat of a pending message within 
+ * CONFIG_TELEGRAM_DEDUP_WINDOW seconds is not queued again, the pending one counts it and is sent once with 
+ * a "xN, first seen" suffix. A collision simply replaces the table entry
+ * */
+static inline bool tgDedupSame(tgMessage_t* pending, tgMessage_t* repeat)
+{
+  return (pending->hash == repeat->hash) 
+      && (pending->options == repeat->options)
+      && (pending->parts == 1) && (repeat->parts == 1)
+      && (pending->callback == nullptr) && (repeat->callback == nullptr)
+      && (pending->live == 0) && (repeat->live == 0)
+      && ((repeat->timestamp - (pending->repeats > 1 ? pending->first_seen : pending->timestamp)) < CONFIG_TELEGRAM_DEDUP_WINDOW)
+      && tgMessageEqual(pending, repeat->message);
+}
+
+static void tgDedupMerge(tgMessage_t* pending, tgMessage_t* repeat)
+{
+  if (pending->repeats == 1) {
+    pending->first_seen = pending->timestamp;
+  };
+  if (pending->repeats < UINT16_MAX) {
+    pending->repeats++;
+  };
+  pending->timestamp = repeat->timestamp;
+  // The repeat is fresh, the pending message lives as long as it does
+  pending->expires = (pending->expires == 0) || (repeat->expires == 0) ? 0 : repeat->expires;
+  tgStatsCount(repeat->options, TG_COUNTER_COLLAPSED);
+  rlog_d(logTAG, "Repeated message collapsed (x%d): %s", pending->repeats, repeat->message);
+}
+
+void tgDedupRemember(tgMessage_t* tgMsg)
+{
+  if ((tgMsg->hash != 0) && (tgMsg->parts == 1)) {
+    _tgDedup[tgMsg->hash % CONFIG_TELEGRAM_DEDUP_SIZE] = tgMsg;
+  };
+}
+
+void tgDedupForget(tgMessage_t* tgMsg)
+{
+  if ((tgMsg->hash != 0) && (_tgDedup[tgMsg->hash % CONFIG_TELEGRAM_DEDUP_SIZE] == tgMsg)) {
+    _tgDedup[tgMsg->hash % CONFIG_TELEGRAM_DEDUP_SIZE] = nullptr;
+  };
+}
+
+#endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Outbox --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
+
+/**
+ * The outbox keeps a FIFO list for each lane and priority level plus a list of free items, linked by indexes 
+ * in a compact array of headers (message texts stay in the message arena). Insertion, eviction of the 
+ * oldest message of the lowest priority and selection of the next message to send do not depend on the 
+ * size of the outbox
+ * */
+void tgOutboxInit()
+{
+  for (uint16_t i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    _tgOutbox.items[i].message = nullptr;
+    _tgOutbox.items[i].next = (i + 1 < CONFIG_TELEGRAM_OUTBOX_SIZE) ? i + 1 : TELEGRAM_OUTBOX_NONE;
+  };
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+      _tgOutbox.lists[lane][level].head = TELEGRAM_OUTBOX_NONE;
+      _tgOutbox.lists[lane][level].tail = TELEGRAM_OUTBOX_NONE;
+    };
+  };
+  _tgOutbox.free_head = 0;
+  _tgOutbox.count = 0;
+  _tgOutbox.ready = true;
+}
+
+static inline uint8_t tgOutboxLevel(tgMessage_t* tgMsg)
+{
+  uint8_t level = decMsgOptionsPriority(tgMsg->options);
+  return level < TELEGRAM_OUTBOX_LEVELS ? level : TELEGRAM_OUTBOX_LEVELS - 1;
+}
+
+static inline tgMessage_t* tgOutboxHead(uint8_t lane, uint8_t level)
+{
+  uint16_t index = _tgOutbox.lists[lane][level].head;
+  return index != TELEGRAM_OUTBOX_NONE ? _tgOutbox.items[index].message : nullptr;
+}
+
+static inline bool tgOutboxPending(uint8_t lane)
+{
+  for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+    if (_tgOutbox.lists[lane][level].head != TELEGRAM_OUTBOX_NONE) return true;
+  };
+  return false;
+}
+
+bool tgOutboxPush(tgMessage_t* tgMsg)
+{
+  uint16_t index = _tgOutbox.free_head;
+  if (index == TELEGRAM_OUTBOX_NONE) return false;
+  _tgOutbox.free_head = _tgOutbox.items[index].next;
+
+  uint8_t lane = tgLane(tgMsg->options);
+  tgOutboxList_t* list = &_tgOutbox.lists[lane][tgOutboxLevel(tgMsg)];
+  _tgOutbox.items[index].message = tgMsg;
+  // A retried message returns to its place by the time it was queued, but not before a head that may be in flight
+  uint16_t prev = list->tail;
+  if ((tgMsg->attempts > 0) && (list->head != TELEGRAM_OUTBOX_NONE)) {
+    prev = _tgLaneBusy[lane] ? list->head : TELEGRAM_OUTBOX_NONE;
+    uint16_t next = prev == TELEGRAM_OUTBOX_NONE ? list->head : _tgOutbox.items[prev].next;
+    while ((next != TELEGRAM_OUTBOX_NONE) && (_tgOutbox.items[next].message->timestamp <= tgMsg->timestamp)) {
+      prev = next;
+      next = _tgOutbox.items[next].next;
+    };
+  };
+  if (prev == TELEGRAM_OUTBOX_NONE) {
+    _tgOutbox.items[index].next = list->head;
+    list->head = index;
+  } else {
+    _tgOutbox.items[index].next = _tgOutbox.items[prev].next;
+    _tgOutbox.items[prev].next = index;
+  };
+  if (_tgOutbox.items[index].next == TELEGRAM_OUTBOX_NONE) {
+    list->tail = index;
+  };
+  _tgOutbox.count++;
+  return true;
+}
+
+// Returns an item that has been unlinked from its list to the free list, the outbox no longer owns the message
+tgMessage_t* tgOutboxRelease(uint16_t index)
+{
+  tgMessage_t* tgMsg = _tgOutbox.items[index].message;
+  _tgOutbox.items[index].message = nullptr;
+  #if CONFIG_TELEGRAM_DEDUP_ENABLE
+    tgDedupForget(tgMsg);
+  #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    if ((tgMsg->live) && (_tgLive[tgMsg->live - 1].queued == tgMsg)) {
+      _tgLive[tgMsg->live - 1].queued = nullptr;
+    };
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  _tgOutbox.items[index].next = _tgOutbox.free_head;
+  _tgOutbox.free_head = index;
+  _tgOutbox.count--;
+  return tgMsg;
+}
+
+// Unlinks the item that follows prev (or the head if prev is TELEGRAM_OUTBOX_NONE) from the list, the outbox no longer owns the message
+tgMessage_t* tgOutboxUnlink(tgOutboxList_t* list, uint16_t prev, uint16_t index)
+{
+  if (prev == TELEGRAM_OUTBOX_NONE) {
+    list->head = _tgOutbox.items[index].next;
+  } else {
+    _tgOutbox.items[prev].next = _tgOutbox.items[index].next;
+  };
+  if (list->tail == index) list->tail = prev;
+  return tgOutboxRelease(index);
+}
+
+// Removes the oldest message of the specified list, the outbox no longer owns it
+tgMessage_t* tgOutboxPop(uint8_t lane, uint8_t level)
+{
+  tgOutboxList_t* list = &_tgOutbox.lists[lane][level];
+  if (list->head == TELEGRAM_OUTBOX_NONE) return nullptr;
+  return tgOutboxUnlink(list, TELEGRAM_OUTBOX_NONE, list->head);
+}
+
+// Removes the oldest message among the lowest priority messages below the specified message
+tgMessage_t* tgOutboxEvict(tgMessage_t* tgMsg)
+{
+  uint8_t limit = tgOutboxLevel(tgMsg);
+  for (uint8_t level = 0; level < limit; level++) {
+    uint8_t evict_lane = TELEGRAM_LANES;
+    uint16_t evict_prev = TELEGRAM_OUTBOX_NONE;
+    uint16_t evict_index = TELEGRAM_OUTBOX_NONE;
+    for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+      // The head of a busy lane may be in flight right now, it cannot be dropped, but the message behind it can
+      uint16_t prev = _tgLaneBusy[lane] ? _tgOutbox.lists[lane][level].head : TELEGRAM_OUTBOX_NONE;
+      uint16_t index = prev == TELEGRAM_OUTBOX_NONE ? _tgOutbox.lists[lane][level].head : _tgOutbox.items[prev].next;
+      if ((index != TELEGRAM_OUTBOX_NONE) 
+       && ((evict_index == TELEGRAM_OUTBOX_NONE) || (_tgOutbox.items[index].message->timestamp < _tgOutbox.items[evict_index].message->timestamp))) {
+        evict_lane = lane;
+        evict_prev = prev;
+        evict_index = index;
+      };
+    };
+    if (evict_index != TELEGRAM_OUTBOX_NONE) {
+      return tgOutboxUnlink(&_tgOutbox.lists[evict_lane][level], evict_prev, evict_index);
+    };
+  };
+  return nullptr;
+}
+
+// Puts a newer version in place of a pending message, a message that a worker is sending right now cannot be replaced
+bool tgOutboxReplace(tgMessage_t* pending, tgMessage_t* tgMsg)
+{
+  uint8_t lane = tgLane(pending->options);
+  uint8_t level = tgOutboxLevel(pending);
+  if ((lane != tgLane(tgMsg->options)) || (level != tgOutboxLevel(tgMsg))) return false;
+  if (_tgLaneBusy[lane] && (tgOutboxHead(lane, level) == pending)) return false;
+  for (uint16_t index = _tgOutbox.lists[lane][level].head; index != TELEGRAM_OUTBOX_NONE; index = _tgOutbox.items[index].next) {
+    if (_tgOutbox.items[index].message == pending) {
+      _tgOutbox.items[index].message = tgMsg;
+      return true;
+    };
+  };
+  return false;
+}
+
+// The bot that must send the message: a live message that is already in the chat can only be edited by the bot that has sent it
+static inline uint8_t tgMessageToken(tgMessage_t* tgMsg)
+{
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    if ((tgMsg->live) && (_tgLive[tgMsg->live - 1].message_id != 0)) {
+      return _tgLive[tgMsg->live - 1].token;
+    };
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  return TELEGRAM_TOKEN_ANY;
+}
+
+/**
+ * Finds the message with the earliest deadline in the lanes that are not busy with another worker and may be sent right now. 
+ * If there is no such message, wait receives the time until the first lane is unblocked by the rate limiter 
+ * (or -1 if there is nothing to send)
+ * */
+bool tgOutboxNext(uint8_t* next_lane, uint8_t* next_level, int64_t* wait)
+{
+  tgMessage_t* next = nullptr;
+  *wait = -1;
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    if (!_tgLaneBusy[lane]) {
+      for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+        tgMessage_t* head = tgOutboxHead(lane, level);
+        if (head) {
+          int64_t lane_wait = tgRateWait(lane, tgMessageToken(head));
+          if ((lane_wait > 0) && ((*wait < 0) || (lane_wait < *wait))) {
+            *wait = lane_wait;
+          };
+          if ((lane_wait == 0) && ((next == nullptr) || (head->deadline < next->deadline))) {
+            next = head;
+            *next_lane = lane;
+            *next_level = level;
+          };
+        };
+      };
+    };
+  };
+  if (next) {
+    *wait = 0;
+  };
+  return next != nullptr;
+}
+
+// Checks if a message of a higher priority than the specified one can be sent right now
+bool tgOutboxUrgent(uint8_t above_level)
+{
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    if (!_tgLaneBusy[lane]) {
+      for (uint8_t level = above_level + 1; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+        tgMessage_t* head = tgOutboxHead(lane, level);
+        if ((head) && (tgRateWait(lane, tgMessageToken(head)) == 0)) {
+          return true;
+        };
+      };
+    };
+  };
+  return false;
+}
+
+#if CONFIG_TELEGRAM_DEDUP_ENABLE
+
+/**
+ * Counts the message as a repeat of an identical pending one (the caller frees it). A message that a worker 
+ * is sending right now cannot be changed
+ * */
+bool tgDedupAbsorb(tgMessage_t* tgMsg)
+{
+  if (tgMsg->hash == 0) {
+    tgMsg->hash = tgMessageHash(tgMsg->options, tgMsg->message);
+  };
+  tgMessage_t* pending = _tgDedup[tgMsg->hash % CONFIG_TELEGRAM_DEDUP_SIZE];
+  if ((pending) && tgDedupSame(pending, tgMsg)) {
+    uint8_t lane = tgLane(pending->options);
+    if (!_tgLaneBusy[lane] || (tgOutboxHead(lane, tgOutboxLevel(pending)) != pending)) {
+      tgDedupMerge(pending, tgMsg);
+      return true;
+    };
+  };
+  return false;
+}
+
+#endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Persistent outbox --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+
+/**
+ * The outbox is mirrored into an append-only log in a data partition. The partition is split into two areas: 
+ * records are appended to the active area, an entry when a message enters the outbox and a tombstone when it 
+ * leaves it. Each record is protected by CRC, a torn record (or anything written after the last header) marks 
+ * the end of the log and is followed by compaction, so nothing is ever appended over it. Compaction writes the 
+ * messages still in the outbox into the other area and commits it by writing the area header last, so after 
+ * an unclean shutdown the log is always recovered either from the old or from the new area. A live update held 
+ * in its slot is not in the outbox and is not logged until it is moved there
+ * */
+static uint32_t tgLogAreaCrc(tgLogArea_t* hdr)
+{
+  return esp_rom_crc32_le(0, (const uint8_t*)hdr, offsetof(tgLogArea_t, crc));
+}
+
+static uint32_t tgLogRecordCrc(tgLogRecord_t* rec, const char* text)
+{
+  uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)rec, offsetof(tgLogRecord_t, crc));
+  if ((text) && (rec->length > 0)) crc = esp_rom_crc32_le(crc, (const uint8_t*)text, rec->length);
+  return crc;
+}
+
+static inline uint32_t tgLogAreaOffset(uint8_t area)
+{
+  return area * _tgLog.area_size;
+}
+
+static bool tgLogReadArea(uint8_t area, tgLogArea_t* hdr)
+{
+  return (esp_partition_read(_tgLog.partition, tgLogAreaOffset(area), hdr, sizeof(tgLogArea_t)) == ESP_OK)
+      && (hdr->magic == TELEGRAM_LOG_AREA_MAGIC) && (hdr->crc == tgLogAreaCrc(hdr));
+}
+
+// Whether the area is still erased from the offset to its end
+static bool tgLogBlank(uint32_t offset)
+{
+  uint8_t data[TELEGRAM_LOG_CHUNK];
+  size_t base = tgLogAreaOffset(_tgLog.area);
+  while (offset < _tgLog.area_size) {
+    size_t part = (_tgLog.area_size - offset) < TELEGRAM_LOG_CHUNK ? (_tgLog.area_size - offset) : TELEGRAM_LOG_CHUNK;
+    if (esp_partition_read(_tgLog.partition, base + offset, data, part) != ESP_OK) return false;
+    for (size_t i = 0; i < part; i++) {
+      if (data[i] != 0xFF) return false;
+    };
+    offset += part;
+  };
+  return true;
+}
+
+typedef struct {
+  size_t offset;
+  uint32_t crc;
+  esp_err_t err;
+} tgLogText_t;
+
+static bool tgLogWriteText(const char* chunk, size_t length, void* ctx)
+{
+  tgLogText_t* text = (tgLogText_t*)ctx;
+  text->crc = esp_rom_crc32_le(text->crc, (const uint8_t*)chunk, length);
+  text->err = esp_partition_write(_tgLog.partition, text->offset, chunk, length);
+  text->offset += length;
+  return text->err == ESP_OK;
+}
+
+static esp_err_t tgLogWriteRecord(uint8_t type, tgMessage_t* tgMsg)
+{
+  tgLogRecord_t rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.magic = TELEGRAM_LOG_RECORD_MAGIC;
+  rec.type = type;
+  rec.id = tgMsg->id;
+  if (type == TELEGRAM_LOG_ENTRY) {
+    rec.options = tgMsg->options;
+    rec.timestamp = (uint32_t)tgMsg->timestamp;
+    rec.parts = tgMsg->parts;
+    #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+      rec.length = tgMsg->packed > 0 ? tgMsg->length : strlen(tgMsg->message);
+    #else
+      rec.length = strlen(tgMsg->message);
+    #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+  };
+
+  size_t size = sizeof(rec) + TELEGRAM_LOG_ALIGN(rec.length);
+  if (_tgLog.offset + size > _tgLog.area_size) return ESP_ERR_NO_MEM;
+  size_t base = tgLogAreaOffset(_tgLog.area) + _tgLog.offset;
+  // The log always keeps the plain text, a compressed one is written as it is decompressed
+  tgLogText_t text;
+  text.offset = base + sizeof(rec);
+  text.crc = tgLogRecordCrc(&rec, nullptr);
+  text.err = ESP_OK;
+  if (rec.length > 0) tgMessageText(tgMsg, tgLogWriteText, &text);
+  rec.crc = text.crc;
+  esp_err_t err = text.err;
+  // The header is written after the text, so an interrupted write is always detected by CRC
+  if (err == ESP_OK) err = esp_partition_write(_tgLog.partition, base, &rec, sizeof(rec));
+  _tgLog.offset += size;
+  return err;
+}
+
+// Starts a new generation of the log in the other area and copies the messages from the outbox into it
+bool tgLogCompact()
+{
+  uint8_t area = _tgLog.area ^ 1;
+  if (esp_partition_erase_range(_tgLog.partition, tgLogAreaOffset(area), _tgLog.area_size) != ESP_OK) {
+    rlog_e(logTAG, "Failed to erase outbox log area %d", area);
+    return false;
+  };
+
+  // On failure the log goes on in the old area from where it was
+  uint8_t prev_area = _tgLog.area;
+  uint32_t prev_offset = _tgLog.offset;
+  _tgLog.area = area;
+  _tgLog.offset = sizeof(tgLogArea_t);
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+      uint16_t index = _tgOutbox.lists[lane][level].head;
+      while (index != TELEGRAM_OUTBOX_NONE) {
+        if (tgLogWriteRecord(TELEGRAM_LOG_ENTRY, _tgOutbox.items[index].message) != ESP_OK) {
+          rlog_e(logTAG, "Failed to compact outbox log");
+          _tgLog.area = prev_area;
+          _tgLog.offset = prev_offset;
+          return false;
+        };
+        index = _tgOutbox.items[index].next;
+      };
+    };
+  };
+  // Messages waiting for a retry are still pending
+  for (uint8_t slot = 0; slot < TELEGRAM_WHEEL_SLOTS; slot++) {
+    for (tgMessage_t* tgMsg = _tgWheel.slots[slot]; tgMsg; tgMsg = (tgMessage_t*)tgMsg->retry_next) {
+      if (tgLogWriteRecord(TELEGRAM_LOG_ENTRY, tgMsg) != ESP_OK) {
+        rlog_e(logTAG, "Failed to compact outbox log");
+        _tgLog.area = prev_area;
+        _tgLog.offset = prev_offset;
+        return false;
+      };
+    };
+  };
+
+  // Commit the new area
+  tgLogArea_t hdr;
+  hdr.magic = TELEGRAM_LOG_AREA_MAGIC;
+  hdr.generation = _tgLog.generation + 1;
+  hdr.crc = tgLogAreaCrc(&hdr);
+  if (esp_partition_write(_tgLog.partition, tgLogAreaOffset(area), &hdr, sizeof(hdr)) != ESP_OK) {
+    rlog_e(logTAG, "Failed to commit outbox log area %d", area);
+    _tgLog.area = prev_area;
+    _tgLog.offset = prev_offset;
+    return false;
+  };
+  _tgLog.generation = hdr.generation;
+  esp_partition_erase_range(_tgLog.partition, tgLogAreaOffset(prev_area), _tgLog.area_size);
+  rlog_d(logTAG, "Outbox log compacted: generation %d, %d bytes", _tgLog.generation, _tgLog.offset);
+  return true;
+}
+
+// If the area is full or the write failed, the log is rewritten from the outbox (the message is already there)
+static void tgLogWrite(uint8_t type, tgMessage_t* tgMsg)
+{
+  if ((tgLogWriteRecord(type, tgMsg) != ESP_OK) && !tgLogCompact()) {
+    rlog_e(logTAG, "Outbox log is not available, messages will not be saved");
+    _tgLog.partition = nullptr;
+  };
+}
+
+void tgLogAppend(tgMessage_t* tgMsg)
+{
+  if (_tgLog.partition) {
+    tgMsg->id = _tgLog.next_id++;
+    tgLogWrite(TELEGRAM_LOG_ENTRY, tgMsg);
+  };
+}
+
+void tgLogRemove(tgMessage_t* tgMsg)
+{
+  if (_tgLog.partition) {
+    tgLogWrite(TELEGRAM_LOG_TOMBSTONE, tgMsg);
+  };
+}
+
+// Background compaction: when the outbox is empty, the log is simply restarted in the other area
+void tgLogIdle()
+{
+  if ((_tgLog.partition) && (_tgOutbox.count == 0) && (_tgLog.offset > _tgLog.area_size / 2)) {
+    tgLogCompact();
+  };
+}
+
+// Reads the log and puts the messages without tombstones back into the outbox
+void tgLogRecover()
+{
+  memset(&_tgLog, 0, sizeof(_tgLog));
+  const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, CONFIG_TELEGRAM_OUTBOX_PARTITION);
+  if (partition == nullptr) {
+    rlog_e(logTAG, "Partition \"%s\" for outbox log not found", CONFIG_TELEGRAM_OUTBOX_PARTITION);
+    return;
+  };
+  _tgLog.partition = partition;
+  _tgLog.area_size = (partition->size / 2) & ~(TELEGRAM_LOG_SECTOR - 1);
+
+  // Select the area of the latest generation
+  tgLogArea_t hdr0, hdr1;
+  bool valid0 = tgLogReadArea(0, &hdr0);
+  bool valid1 = tgLogReadArea(1, &hdr1);
+  if (!valid0 && !valid1) {
+    rlog_i(logTAG, "Outbox log is empty, initialization");
+    _tgLog.area = 1;
+    if (!tgLogCompact()) _tgLog.partition = nullptr;
+    return;
+  };
+  _tgLog.area = (valid1 && (!valid0 || (int32_t)(hdr1.generation - hdr0.generation) > 0)) ? 1 : 0;
+  _tgLog.generation = _tgLog.area ? hdr1.generation : hdr0.generation;
+
+  // First pass: find the entries that have not been removed. There cannot be more of them than places in the outbox
+  uint32_t* live_ids = (uint32_t*)calloc(CONFIG_TELEGRAM_OUTBOX_SIZE, sizeof(uint32_t));
+  uint32_t* live_offsets = (uint32_t*)calloc(CONFIG_TELEGRAM_OUTBOX_SIZE, sizeof(uint32_t));
+  uint16_t live_count = 0;
+  bool torn = false;
+  tgLogRecord_t rec;
+  char text[TELEGRAM_LOG_CHUNK];
+  size_t base = tgLogAreaOffset(_tgLog.area);
+  _tgLog.offset = sizeof(tgLogArea_t);
+  while ((live_ids) && (live_offsets) && (_tgLog.offset + sizeof(rec) <= _tgLog.area_size)) {
+    if (esp_partition_read(partition, base + _tgLog.offset, &rec, sizeof(rec)) != ESP_OK) break;
+    if (rec.magic == 0xFFFF) {
+      // The text is written before the header: a write cut between them leaves the text behind an erased header,
+      // and an append over it would fail its CRC
+      torn = !tgLogBlank(_tgLog.offset);
+      break;
+    };
+    if ((rec.magic != TELEGRAM_LOG_RECORD_MAGIC) || (_tgLog.offset + sizeof(rec) + rec.length > _tgLog.area_size)) {
+      torn = true;
+      break;
+    };
+    // Check the CRC of the record, reading the text in small portions
+    uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)&rec, offsetof(tgLogRecord_t, crc));
+    for (size_t pos = 0; pos < rec.length; pos += TELEGRAM_LOG_CHUNK) {
+      size_t part = (rec.length - pos) < TELEGRAM_LOG_CHUNK ? (rec.length - pos) : TELEGRAM_LOG_CHUNK;
+      esp_partition_read(partition, base + _tgLog.offset + sizeof(rec) + pos, text, part);
+      crc = esp_rom_crc32_le(crc, (const uint8_t*)text, part);
+    };
+    if (crc != rec.crc) {
+      torn = true;
+      break;
+    };
+
+    if ((int32_t)(rec.id - _tgLog.next_id) >= 0) _tgLog.next_id = rec.id + 1;
+    if (rec.type == TELEGRAM_LOG_ENTRY) {
+      if (live_count >= CONFIG_TELEGRAM_OUTBOX_SIZE) {
+        // Should not happen, but keep the most recent entries
+        memmove(&live_ids[0], &live_ids[1], (live_count - 1) * sizeof(uint32_t));
+        memmove(&live_offsets[0], &live_offsets[1], (live_count - 1) * sizeof(uint32_t));
+        live_count--;
+      };
+      live_ids[live_count] = rec.id;
+      live_offsets[live_count] = _tgLog.offset;
+      live_count++;
+    } else if (rec.type == TELEGRAM_LOG_TOMBSTONE) {
+      for (uint16_t i = 0; i < live_count; i++) {
+        if (live_ids[i] == rec.id) {
+          memmove(&live_ids[i], &live_ids[i + 1], (live_count - i - 1) * sizeof(uint32_t));
+          memmove(&live_offsets[i], &live_offsets[i + 1], (live_count - i - 1) * sizeof(uint32_t));
+          live_count--;
+          break;
+        };
+      };
+    };
+    _tgLog.offset += sizeof(rec) + TELEGRAM_LOG_ALIGN(rec.length);
+  };
+
+  // Second pass: load the messages into the outbox
+  for (uint16_t i = 0; i < live_count; i++) {
+    esp_partition_read(partition, base + live_offsets[i], &rec, sizeof(rec));
+    #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      if (rec.length >= CONFIG_TELEGRAM_MESSAGE_SIZE) rec.length = CONFIG_TELEGRAM_MESSAGE_SIZE - 1;
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    tgMessage_t* tgMsg = tgMessageAlloc(rec.length + 1);
+    if (tgMsg) {
+      esp_partition_read(partition, base + live_offsets[i] + sizeof(rec), tgMsg->message, rec.length);
+      tgMsg->message[rec.length] = 0;
+      tgMsg->id = rec.id;
+      tgMsg->options = (msg_options_t)rec.options;
+      tgMsg->timestamp = (time_t)rec.timestamp;
+      tgMsg->parts = rec.parts;
+      tgMsg->queued = esp_timer_get_time();
+      tgMessageSchedule(tgMsg, 0, TG_LATENCY_DEFAULT);
+      if (!tgOutboxPush(tgMsg)) tgMessageFree(tgMsg);
+    };
+  };
+  if (live_ids) free(live_ids);
+  if (live_offsets) free(live_offsets);
+  rlog_i(logTAG, "Outbox log recovered: %d messages, generation %d", _tgOutbox.count, _tgLog.generation);
+
+  // After an interrupted write the tail of the area can no longer be appended to
+  if (torn) {
+    rlog_w(logTAG, "Outbox log has a damaged record at offset %d", _tgLog.offset);
+    if (!tgLogCompact()) _tgLog.partition = nullptr;
+  };
+}
+
+#endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Live messages ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+
+/**
+ * A live message is a status report that stays one message in the chat and is updated in place: the first update 
+ * of a slot is sent with sendMessage, the next ones with editMessageText for the returned message_id. A slot has 
+ * at most one update in the outbox. A newer update replaces it there while it is waiting, otherwise the newer 
+ * update is held in the slot until the previous one has been sent and CONFIG_TELEGRAM_LIVE_INTERVAL has passed. 
+ * Superseded updates are dropped without a request, as is an update with the same text that the chat already shows
+ * */
+void tgLiveUpdate(tgMessage_t* tgMsg)
+{
+  tgLive_t* slot = &_tgLive[tgMsg->live - 1];
+  tgMessage_t* superseded;
+  if ((slot->queued) && tgOutboxReplace(slot->queued, tgMsg)) {
+    superseded = slot->queued;
+    slot->queued = tgMsg;
+    #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+      tgLogRemove(superseded);
+      tgLogAppend(tgMsg);
+    #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+  } else {
+    superseded = slot->held;
+    slot->held = tgMsg;
+  };
+  if (superseded) {
+    rlog_d(logTAG, "Live message %d superseded: %s", tgMsg->live - 1, superseded->message);
+    tgStatsCount(superseded->options, TG_COUNTER_SUPERSEDED);
+    tgMessageDone(superseded, ESP_ERR_INVALID_STATE, 0);
+  };
+}
+
+// The update has been shown in the chat, the next edit is allowed after the interval
+void tgLiveSent(tgMessage_t* tgMsg, int64_t message_id, uint8_t token)
+{
+  tgLive_t* slot = &_tgLive[tgMsg->live - 1];
+  if (message_id != 0) {
+    slot->message_id = message_id;
+    slot->token = token;
+  };
+  slot->sent_hash = tgMessageHash(tgMsg->options, tgMsg->message);
+  slot->due = esp_timer_get_time() + (int64_t)CONFIG_TELEGRAM_LIVE_INTERVAL * 1000;
+}
+
+// Returns the message to edit, 0 - the update must be sent as a new message
+static inline int64_t tgLiveTarget(tgMessage_t* tgMsg)
+{
+  return tgMsg->live ? _tgLive[tgMsg->live - 1].message_id : 0;
+}
+
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Overflow spill ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#if CONFIG_TELEGRAM_SPILL_ENABLE
+
+/**
+ * Messages that do not fit into the full outbox are not dropped, but appended to a circular buffer in PSRAM as 
+ * compact records in the order they arrived (HTML tags are stripped, the text is kept as is). When the network 
+ * is back, the records of a chat are uploaded as one text file with sendDocument: after the outbox of the chat 
+ * has drained, or earlier if CONFIG_TELEGRAM_SPILL_THRESHOLD records have accumulated. If the buffer is full, the 
+ * oldest records are overwritten, except during an upload
+ * */
+bool tgSpillInit()
+{
+  if (_tgSpill.data == nullptr) {
+    _tgSpill.data = (uint8_t*)psram_calloc(1, TELEGRAM_SPILL_SIZE);
+    if (_tgSpill.data == nullptr) return false;
+    __atomic_add_fetch(&_tgStatsHeap, TELEGRAM_SPILL_SIZE, __ATOMIC_RELAXED);
+  };
+  return true;
+}
+
+static inline uint32_t tgSpillRecordSize(uint16_t length)
+{
+  return (sizeof(tgSpillRecord_t) + length + TELEGRAM_SPILL_ALIGN - 1) & ~(TELEGRAM_SPILL_ALIGN - 1);
+}
+
+static inline tgSpillRecord_t* tgSpillRecord(uint32_t offset)
+{
+  return (tgSpillRecord_t*)(_tgSpill.data + offset);
+}
+
+// Returns the offset of the next record, bytes receives the space taken by the record at the specified offset
+static uint32_t tgSpillNextOffset(uint32_t offset, uint32_t* bytes)
+{
+  tgSpillRecord_t* rec = tgSpillRecord(offset);
+  *bytes = rec->length == TELEGRAM_SPILL_WRAP ? TELEGRAM_SPILL_SIZE - offset : tgSpillRecordSize(rec->length);
+  offset += *bytes;
+  return offset < TELEGRAM_SPILL_SIZE ? offset : 0;
+}
+
+static void tgSpillRemoveOldest()
+{
+  uint32_t bytes;
+  tgSpillRecord_t* rec = tgSpillRecord(_tgSpill.head);
+  if ((rec->length != TELEGRAM_SPILL_WRAP) && !rec->sent) {
+    _tgSpill.count[rec->lane]--;
+    tgStatsCount(rec->options, TG_COUNTER_DROPPED, rec->parts);
+  };
+  _tgSpill.head = tgSpillNextOffset(_tgSpill.head, &bytes);
+  _tgSpill.used -= bytes;
+  if (_tgSpill.used == 0) {
+    _tgSpill.head = _tgSpill.tail = 0;
+  };
+}
+
+// Copies the text without HTML tags, returns its length (only calculates it if dest is nullptr)
+static uint16_t tgSpillCopyText(char* dest, const char* text, uint16_t limit)
+{
+  uint16_t len = 0;
+  bool tag = false;
+  for (; *text && (len < limit); text++) {
+    if (*text == '<') {
+      tag = true;
+    } else if (*text == '>') {
+      tag = false;
+    } else if (!tag) {
+      if (dest) dest[len] = *text;
+      len++;
+    };
+  };
+  return len;
+}
+
+bool tgSpillAppend(tgMessage_t* tgMsg)
+{
+  if (_tgSpill.data == nullptr) return false;
+  uint16_t length = tgSpillCopyText(nullptr, tgMsg->message, TELEGRAM_SPILL_TEXT_MAX);
+  uint32_t need = tgSpillRecordSize(length);
+  while (true) {
+    if ((_tgSpill.tail > _tgSpill.head) || (_tgSpill.used == 0)) {
+      // Free space at the end of the buffer and before the head
+      if (TELEGRAM_SPILL_SIZE - _tgSpill.tail >= need) break;
+      if (_tgSpill.head >= need) {
+        tgSpillRecord(_tgSpill.tail)->length = TELEGRAM_SPILL_WRAP;
+        _tgSpill.used += TELEGRAM_SPILL_SIZE - _tgSpill.tail;
+        _tgSpill.tail = 0;
+        break;
+      };
+    } else if (_tgSpill.head - _tgSpill.tail >= need) {
+      break;
+    };
+    // Make room by overwriting the oldest records, unless they are being uploaded
+    if ((_tgSpill.upload_used > 0) || (_tgSpill.used == 0)) return false;
+    tgSpillRemoveOldest();
+  };
+
+  tgSpillRecord_t* rec = tgSpillRecord(_tgSpill.tail);
+  rec->length = length;
+  rec->lane = tgLane(tgMsg->options);
+  rec->sent = 0;
+  rec->parts = tgMsg->parts;
+  rec->options = tgMsg->options;
+  rec->timestamp = tgMsg->timestamp;
+  tgSpillCopyText((char*)(rec + 1), tgMsg->message, length);
+  _tgSpill.tail += need;
+  if (_tgSpill.tail >= TELEGRAM_SPILL_SIZE) {
+    _tgSpill.tail = 0;
+  };
+  _tgSpill.used += need;
+  _tgSpill.count[rec->lane]++;
+  return true;
+}
+
+// Finds a chat whose spilled records may be uploaded right now, otherwise wait receives the time until the rate limiter allows it
+bool tgSpillNext(uint8_t* next_lane, int64_t* wait)
+{
+  *wait = -1;
+  if (_tgSpill.upload_used > 0) return false;
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    if (!_tgLaneBusy[lane] && (_tgSpill.count[lane] > 0) 
+    && ((_tgSpill.count[lane] >= CONFIG_TELEGRAM_SPILL_THRESHOLD) || !tgOutboxPending(lane))) {
+      int64_t lane_wait = tgRateWait(lane);
+      if (lane_wait == 0) {
+        *next_lane = lane;
+        *wait = 0;
+        return true;
+      };
+      if ((*wait < 0) || (lane_wait < *wait)) {
+        *wait = lane_wait;
+      };
+    };
+  };
+  return false;
+}
+
+// Freezes the current records for upload: they will not be overwritten until tgSpillDone()
+void tgSpillBegin(uint8_t lane, tgSpillUpload_t* upload)
+{
+  uint32_t bytes;
+  memset(upload, 0, sizeof(tgSpillUpload_t));
+  upload->lane = lane;
+  _tgSpill.upload_used = _tgSpill.used;
+  uint32_t offset = _tgSpill.head;
+  for (uint32_t done = 0; done < _tgSpill.upload_used; done += bytes) {
+    tgSpillRecord_t* rec = tgSpillRecord(offset);
+    if ((rec->length != TELEGRAM_SPILL_WRAP) && (rec->lane == lane) && !rec->sent) {
+      if (upload->count == 0) {
+        upload->options = rec->options;
+        upload->first = rec->timestamp;
+      };
+      upload->last = rec->timestamp;
+      upload->count++;
+      upload->parts += rec->parts;
+    };
+    offset = tgSpillNextOffset(offset, &bytes);
+  };
+}
+
+#endif // CONFIG_TELEGRAM_SPILL_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Address cache ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The API host is resolved when the network comes up and again when the cached address is older than 
+ * CONFIG_TELEGRAM_DNS_TTL. lwIP keeps the answer in its own table for the TTL of the record, so the lookup 
+ * made by esp-tls on connect does not wait for the DNS server. If the server does not respond, the last 
+ * address resolved successfully is kept as a fallback
+ * */
+bool tgDnsResolve(bool force)
+{
+  if (!force && (_tgDns.address != 0) && !_tgDns.failed 
+   && ((xTaskGetTickCount() - _tgDns.resolved) < pdMS_TO_TICKS(CONFIG_TELEGRAM_DNS_TTL))) {
+    return true;
+  };
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* res = nullptr;
+  int64_t started = esp_timer_get_time();
+  if ((getaddrinfo(API_TELEGRAM_HOST, nullptr, &hints, &res) == 0) && (res)) {
+    uint32_t address = ((struct sockaddr_in*)res->ai_addr)->sin_addr.s_addr;
+    freeaddrinfo(res);
+    __atomic_store_n(&_tgDns.address, address, __ATOMIC_RELAXED);
+    _tgDns.resolved = xTaskGetTickCount();
+    _tgDns.failed = false;
+    rlog_d(logTAG, "%s resolved in %d ms", API_TELEGRAM_HOST, (int)((esp_timer_get_time() - started) / 1000));
+    return true;
+  };
+  _tgDns.failed = true;
+  rlog_w(logTAG, "Failed to resolve %s", API_TELEGRAM_HOST);
+  return false;
+}
+
+#if TELEGRAM_TLS_TRUST_CACHE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Trust anchors ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Given cert_pem, esp-tls parses the certificate again for every connection. Instead, the certificates are 
+ * parsed once when the task is created and the resulting chain is attached to each new TLS configuration 
+ * through the crt_bundle_attach hook. If parsing fails, connections fall back to cert_pem. 
+ * With CONFIG_TELEGRAM_TLS_PIN_SHA256 the SHA-256 of the public key (SubjectPublicKeyInfo) of the server certificate 
+ * must also match the pin. mbedTLS still verifies the chain (it requires a CA chain for a verified handshake), 
+ * the pin rejects a certificate that the CA has issued for another key. There is no fallback to cert_pem then
+ * */
+static mbedtls_x509_crt _tgTrust;
+static bool _tgTrustReady = false;
+
+#if TELEGRAM_TLS_PIN
+
+static uint8_t _tgTrustPin[32];
+
+static int tgTrustHex(char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  return -1;
+}
+
+// The pin is written in hex as printed by openssl dgst, colons between bytes are allowed
+static bool tgTrustPinInit()
+{
+  const char* hex = CONFIG_TELEGRAM_TLS_PIN_SHA256;
+  for (uint8_t i = 0; i < sizeof(_tgTrustPin); i++) {
+    if ((i > 0) && (*hex == ':')) hex++;
+    int hi = tgTrustHex(hex[0]);
+    int lo = hi < 0 ? -1 : tgTrustHex(hex[1]);
+    if (lo < 0) return false;
+    _tgTrustPin[i] = (uint8_t)((hi << 4) | lo);
+    hex += 2;
+  };
+  return *hex == 0;
+}
+
+static int tgTrustVerify(void* ctx, mbedtls_x509_crt* crt, int depth, uint32_t* flags)
+{
+  if (depth == 0) {
+    uint8_t hash[32];
+    #if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+      int ret = mbedtls_sha256(crt->pk_raw.p, crt->pk_raw.len, hash, 0);
+    #else
+      int ret = mbedtls_sha256_ret(crt->pk_raw.p, crt->pk_raw.len, hash, 0);
+    #endif // ESP_IDF_VERSION
+    if ((ret != 0) || (memcmp(hash, _tgTrustPin, sizeof(hash)) != 0)) {
+      rlog_e(logTAG, "The public key of the Telegram API certificate does not match CONFIG_TELEGRAM_TLS_PIN_SHA256");
+      *flags |= MBEDTLS_X509_BADCERT_OTHER;
+    };
+  };
+  return 0;
+}
+
+#endif // TELEGRAM_TLS_PIN
+
+bool tgTrustInit()
+{
+  if (!_tgTrustReady) {
+    #if TELEGRAM_TLS_PIN
+      if (!tgTrustPinInit()) {
+        rlog_e(logTAG, "Invalid CONFIG_TELEGRAM_TLS_PIN_SHA256, connections to Telegram API are disabled");
+        return false;
+      };
+    #endif // TELEGRAM_TLS_PIN
+    mbedtls_x509_crt_init(&_tgTrust);
+    const unsigned char* cert = (const unsigned char*)TELEGRAM_TLS_CERT;
+    size_t length = TELEGRAM_TLS_CERT_LEN;
+    int ret = 0;
+    #if defined(CONFIG_TELEGRAM_TLS_DER_START)
+      // Several DER certificates can follow each other: SEQUENCE with a two-byte length
+      while ((ret == 0) && (length >= 4) && (cert[0] == 0x30) && (cert[1] == 0x82)) {
+        size_t size = 4 + ((size_t)cert[2] << 8) + cert[3];
+        if (size > length) break;
+        ret = mbedtls_x509_crt_parse_der(&_tgTrust, cert, size);
+        cert += size;
+        length -= size;
+      };
+    #else
+      ret = mbedtls_x509_crt_parse(&_tgTrust, cert, length);
+    #endif // CONFIG_TELEGRAM_TLS_DER_START
+    if ((ret < 0) || (_tgTrust.raw.len == 0)) {
+      rlog_e(logTAG, "Failed to parse the Telegram API certificate: -0x%x", -ret);
+      mbedtls_x509_crt_free(&_tgTrust);
+      return false;
+    };
+    _tgTrustReady = true;
+    rlog_d(logTAG, "Telegram API certificates parsed");
+  };
+  return true;
+}
+
+// Called by esp-tls for each new connection instead of attaching the certificate bundle
+static esp_err_t tgTrustAttach(void* conf)
+{
+  if (!_tgTrustReady) return ESP_FAIL;
+  mbedtls_ssl_conf_ca_chain((mbedtls_ssl_config*)conf, &_tgTrust, nullptr);
+  #if TELEGRAM_TLS_PIN
+    mbedtls_ssl_conf_verify((mbedtls_ssl_config*)conf, tgTrustVerify, nullptr);
+  #endif // TELEGRAM_TLS_PIN
+  return ESP_OK;
+}
+
+#endif // TELEGRAM_TLS_TRUST_CACHE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------- Connection manager --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The HTTP client is created once and kept between messages. esp_http_client reuses an established 
+ * connection (HTTP/1.1 keep-alive) on the next esp_http_client_perform() if the host has not changed, 
+ * so a TCP connect and a full TLS handshake are only paid after a reconnect. API methods are switched 
+ * by path only, so the client stays with the address it was created for. With CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS 
+ * the client is not deleted when its connection is closed (idle, network lost, failed request): it keeps the 
+ * session ticket, and the next connection resumes the session with an abbreviated handshake
+ * */
+typedef enum {
+  TG_URL_SEND = 0,
+  TG_URL_EDIT,
+  TG_URL_DOCUMENT,
+  TG_URL_GET_ME,
+  TG_URL_UPDATES,
+  TG_URL_MAX
+} tgUrl_t;
+
+// The token is a part of the path, so the bots of the pool share the connection
+static const char* const _tgUrls[TELEGRAM_TOKENS][TG_URL_MAX] = {
+  API_TELEGRAM_BOT_URLS(CONFIG_TELEGRAM_TOKEN),
+  #ifdef CONFIG_TELEGRAM_TOKEN_2
+    API_TELEGRAM_BOT_URLS(CONFIG_TELEGRAM_TOKEN_2),
+  #endif // CONFIG_TELEGRAM_TOKEN_2
+  #ifdef CONFIG_TELEGRAM_TOKEN_3
+    API_TELEGRAM_BOT_URLS(CONFIG_TELEGRAM_TOKEN_3),
+  #endif // CONFIG_TELEGRAM_TOKEN_3
+  #ifdef CONFIG_TELEGRAM_TOKEN_4
+    API_TELEGRAM_BOT_URLS(CONFIG_TELEGRAM_TOKEN_4),
+  #endif // CONFIG_TELEGRAM_TOKEN_4
+};
+
+// Deletes the client together with its TLS session
+void tgConnFree(tgConnection_t* conn)
+{
+  if (conn->client) {
+    esp_http_client_cleanup(conn->client);
+    conn->client = nullptr;
+    conn->connected = false;
+    rlog_d(logTAG, "HTTP client for Telegram API deleted");
+  };
+}
+
+void tgConnClose(tgConnection_t* conn)
+{
+  #if TELEGRAM_TLS_RESUMPTION
+    if ((conn->client) && (conn->connected)) {
+      esp_http_client_close(conn->client);
+      conn->connected = false;
+      rlog_d(logTAG, "Connection to Telegram API closed, TLS session saved");
+    };
+  #else
+    tgConnFree(conn);
+  #endif // TELEGRAM_TLS_RESUMPTION
+}
+
+esp_http_client_handle_t tgConnOpen(tgConnection_t* conn)
+{
+  // The socket of a client connected before the network was lost is dead, even if it looks open
+  if ((conn->client) && (conn->connected) && (conn->epoch != _tgNetworkEpoch)) {
+    rlog_d(logTAG, "Network reconnected, the previous connection is discarded");
+    tgConnClose(conn);
+  };
+  #if TELEGRAM_DNS_FALLBACK
+    char address[16];
+    bool fallback = conn->fallback;
+  #endif // TELEGRAM_DNS_FALLBACK
+  if ((conn->client == nullptr) || !conn->connected) {
+    #if TELEGRAM_DNS_FALLBACK
+      // The DNS server does not respond: connect to the last known address, the certificate is still checked against the host name
+      fallback = !tgDnsResolve(false) && (_tgDns.address != 0);
+      // A kept client stays with the address it was created for
+      if ((conn->client) && (fallback != conn->fallback)) {
+        tgConnFree(conn);
+      };
+    #else
+      tgDnsResolve(false);
+    #endif // TELEGRAM_DNS_FALLBACK
+  };
+  if (conn->client == nullptr) {
+    esp_http_client_config_t cfgHttp;
+    memset(&cfgHttp, 0, sizeof(cfgHttp));
+    cfgHttp.method = HTTP_METHOD_POST;
+    cfgHttp.host = API_TELEGRAM_HOST;
+    #if TELEGRAM_DNS_FALLBACK
+      if (fallback) {
+        struct in_addr addr;
+        addr.s_addr = __atomic_load_n(&_tgDns.address, __ATOMIC_RELAXED);
+        inet_ntoa_r(addr, address, sizeof(address));
+        cfgHttp.host = address;
+        cfgHttp.common_name = API_TELEGRAM_HOST;
+        rlog_w(logTAG, "Using the last known address of %s: %s", API_TELEGRAM_HOST, address);
+      };
+      conn->fallback = fallback;
+    #endif // TELEGRAM_DNS_FALLBACK
+    cfgHttp.port = API_TELEGRAM_PORT;
+    cfgHttp.path = _tgUrls[0][TG_URL_SEND];
+    cfgHttp.timeout_ms = CONFIG_TELEGRAM_CONNECT_TIMEOUT;
+    cfgHttp.transport_type = HTTP_TRANSPORT_OVER_SSL;
+    #if CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUFFER
+      #if TELEGRAM_TLS_TRUST_CACHE
+        // A pinned connection is never made without the pin check
+        if (_tgTrustReady || TELEGRAM_TLS_PIN) {
+          cfgHttp.crt_bundle_attach = tgTrustAttach;
+        } else {
+          cfgHttp.cert_pem = TELEGRAM_TLS_CERT;
+          cfgHttp.cert_len = TELEGRAM_TLS_CERT_LEN;
+        };
+      #else
+        cfgHttp.cert_pem = TELEGRAM_TLS_CERT;
+        cfgHttp.cert_len = TELEGRAM_TLS_CERT_LEN;
+      #endif // TELEGRAM_TLS_TRUST_CACHE
+      cfgHttp.use_global_ca_store = false;
+    #elif CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_GLOBAL
+      cfgHttp.use_global_ca_store = true;
+    #elif CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUNGLE
+      cfgHttp.crt_bundle_attach = esp_crt_bundle_attach;
+      cfgHttp.use_global_ca_store = false;
+    #endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+    cfgHttp.skip_cert_common_name_check = false;
+    cfgHttp.is_async = false;
+    #if CONFIG_TELEGRAM_KEEP_ALIVE
+      // TCP keep-alive probes detect a dead idle socket before we try to write a request into it
+      cfgHttp.keep_alive_enable = true;
+    #endif // CONFIG_TELEGRAM_KEEP_ALIVE
+    #if TELEGRAM_TLS_RESUMPTION
+      cfgHttp.save_client_session = true;
+    #endif // TELEGRAM_TLS_RESUMPTION
+
+    conn->client = esp_http_client_init(&cfgHttp);
+    conn->url = _tgUrls[0][TG_URL_SEND];
+    if (conn->client) {
+      esp_http_client_set_header(conn->client, API_TELEGRAM_HEADER_CTYPE, API_TELEGRAM_HEADER_AJSON);
+      #if TELEGRAM_DNS_FALLBACK
+        if (fallback) {
+          esp_http_client_set_header(conn->client, API_TELEGRAM_HEADER_HOST, API_TELEGRAM_HOST);
+        };
+      #endif // TELEGRAM_DNS_FALLBACK
+      rlog_d(logTAG, "HTTP client for Telegram API created");
+    };
+  };
+  conn->connected = conn->client != nullptr;
+  conn->epoch = _tgNetworkEpoch;
+  conn->last_used = xTaskGetTickCount();
+  return conn->client;
+}
+
+// Switches the client to another API method, the connection is kept because the host does not change
+void tgConnSetUrl(tgConnection_t* conn, const char* url)
+{
+  if (conn->url != url) {
+    esp_http_client_set_url(conn->client, url);
+    conn->url = url;
+  };
+}
+
+// Whether the next request goes over a connection kept from an earlier one
+static inline bool tgConnKept(tgConnection_t* conn)
+{
+  return (conn->client) && (conn->connected) && (conn->epoch == _tgNetworkEpoch);
+}
+
+/**
+ * Whether the request has failed the way it does on a connection that the server has closed while it was idle: 
+ * opening or writing the request fails, or the response fails at once without a single byte 
+ * (ESP_ERR_HTTP_CONNECTION_CLOSED). Once the whole body has been written any other failure may come after the 
+ * server has accepted the message, so it goes the usual way of retries rather than posting the message twice
+ * */
+static inline bool tgConnStale(esp_err_t ret, bool written)
+{
+  return (ret != ESP_OK) && (!written || (ret == ESP_ERR_HTTP_CONNECTION_CLOSED));
+}
+
+void tgConnRelease(tgConnection_t* conn, bool reusable)
+{
+  #if CONFIG_TELEGRAM_KEEP_ALIVE
+    if (reusable) {
+      conn->last_used = xTaskGetTickCount();
+      return;
+    };
+  #endif // CONFIG_TELEGRAM_KEEP_ALIVE
+  tgConnClose(conn);
+}
+
+// Returns how long the task may sleep before the idle connection must be closed
+TickType_t tgConnIdleWait(tgConnection_t* conn, TickType_t waitTicks)
+{
+  if ((conn->client) && (conn->connected)) {
+    TickType_t idle = xTaskGetTickCount() - conn->last_used;
+    TickType_t limit = pdMS_TO_TICKS(CONFIG_TELEGRAM_IDLE_TIMEOUT);
+    TickType_t remain = idle < limit ? limit - idle : 0;
+    if (remain < waitTicks) return remain;
+  };
+  return waitTicks;
+}
+
+void tgConnCheckIdle(tgConnection_t* conn)
+{
+  if ((conn->client) && (conn->connected) && ((xTaskGetTickCount() - conn->last_used) >= pdMS_TO_TICKS(CONFIG_TELEGRAM_IDLE_TIMEOUT))) {
+    rlog_d(logTAG, "Telegram API connection is idle");
+    tgConnClose(conn);
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Body writer -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The request body is generated twice by the same code: first without a client to calculate Content-Length,
+ * then it is streamed into the open connection through a small chunk buffer. So the memory used does not 
+ * depend on the length of the message
+ * */
+void tgBodyInit(tgBodyWriter_t* writer, esp_http_client_handle_t client)
+{
+  writer->client = client;
+  writer->length = 0;
+  writer->fill = 0;
+  writer->error = ESP_OK;
+}
+
+void tgBodyFlush(tgBodyWriter_t* writer)
+{
+  if ((writer->client) && (writer->fill > 0) && (writer->error == ESP_OK)) {
+    if (esp_http_client_write(writer->client, writer->buffer, writer->fill) != (int)writer->fill) {
+      writer->error = ESP_ERR_HTTP_WRITE_DATA;
+    };
+  };
+  writer->fill = 0;
+}
+
+void tgBodyPut(tgBodyWriter_t* writer, const char* data, size_t len)
+{
+  writer->length += len;
+  if (writer->client) {
+    while (len > 0) {
+      size_t part = API_TELEGRAM_CHUNK_SIZE - writer->fill;
+      if (part > len) part = len;
+      memcpy(writer->buffer + writer->fill, data, part);
+      writer->fill += part;
+      data += part;
+      len -= part;
+      if (writer->fill == API_TELEGRAM_CHUNK_SIZE) tgBodyFlush(writer);
+    };
+  };
+}
+
+void tgBodyPutStr(tgBodyWriter_t* writer, const char* str)
+{
+  tgBodyPut(writer, str, strlen(str));
+}
+
+#define TG_SWAR_ONES 0x01010101UL
+#define TG_SWAR_HIGH 0x80808080UL
+#define TG_SWAR_HASZERO(w) (((w) - TG_SWAR_ONES) & ~(w) & TG_SWAR_HIGH)
+#define TG_SWAR_HASLESS(w, n) (((w) - TG_SWAR_ONES * (n)) & ~(w) & TG_SWAR_HIGH)
+
+static inline bool tgJsonIsSpecial(char c)
+{
+  return ((uint8_t)c < 0x20) || (c == '"') || (c == '\\');
+}
+
+// Length of the beginning of the text that can be written into a JSON string as is.
+// Aligned words are checked four bytes at a time while a whole word remains, the tail byte by byte
+size_t tgJsonSafeSpan(const char* text, size_t length)
+{
+  const char* ptr = text;
+  const char* end = text + length;
+  while ((ptr < end) && (((uintptr_t)ptr & 3) != 0)) {
+    if (tgJsonIsSpecial(*ptr)) return ptr - text;
+    ptr++;
+  };
+  while (end - ptr >= (ptrdiff_t)sizeof(uint32_t)) {
+    uint32_t word;
+    memcpy(&word, ptr, sizeof(word));
+    if (TG_SWAR_HASLESS(word, 0x20) 
+     || TG_SWAR_HASZERO(word ^ (TG_SWAR_ONES * '"')) 
+     || TG_SWAR_HASZERO(word ^ (TG_SWAR_ONES * '\\'))) break;
+    ptr += sizeof(word);
+  };
+  while ((ptr < end) && !tgJsonIsSpecial(*ptr)) ptr++;
+  return ptr - text;
+}
+
+void tgJsonPutEscaped(tgBodyWriter_t* writer, const char* text, size_t length)
+{
+  char escape[8];
+  const char* end = text + length;
+  while (text < end) {
+    size_t span = tgJsonSafeSpan(text, end - text);
+    if (span > 0) {
+      tgBodyPut(writer, text, span);
+      text += span;
+    };
+    if (text < end) {
+      switch (*text) {
+        case '"':  tgBodyPut(writer, "\\\"", 2); break;
+        case '\\': tgBodyPut(writer, "\\\\", 2); break;
+        case '\n': tgBodyPut(writer, "\\n", 2); break;
+        case '\r': tgBodyPut(writer, "\\r", 2); break;
+        case '\t': tgBodyPut(writer, "\\t", 2); break;
+        default:
+          tgBodyPut(writer, escape, snprintf(escape, sizeof(escape), "\\u%04x", (uint8_t)*text));
+          break;
+      };
+      text++;
+    };
+  };
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Send message -----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void tgFormatTimestamp(time_t timestamp, char* buffer, size_t size)
+{
+  struct tm timeinfo;
+  localtime_r(&timestamp, &timeinfo);
+  strftime(buffer, size, CONFIG_FORMAT_DTS, &timeinfo);
+}
+
+// Formats a 64-bit integer without relying on 64-bit printf support, returns the beginning of the string in the buffer
+const char* tgFormatInt64(int64_t value, char* buffer, size_t size)
+{
+  char* pos = buffer + size - 1;
+  uint64_t rest = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  *pos = 0;
+  do {
+    *--pos = '0' + (rest % 10);
+    rest /= 10;
+  } while (rest > 0);
+  if (value < 0) *--pos = '-';
+  return pos;
+}
+
+const char* tgHtmlEscape(const char* text, char* buffer, size_t size)
+{
+  if (size == 0) return buffer;
+  char* pos = buffer;
+  char* end = buffer + size - 1;
+  while (text && *text) {
+    const char* entity;
+    size_t length;
+    switch (*text) {
+      case '<': entity = "&lt;"; length = 4; break;
+      case '>': entity = "&gt;"; length = 4; break;
+      case '&': entity = "&amp;"; length = 5; break;
+      default: entity = text; length = 1; break;
+    };
+    if (length > (size_t)(end - pos)) break;
+    memcpy(pos, entity, length);
+    pos += length;
+    text++;
+  };
+  *pos = 0;
+  return buffer;
+}
+
+/**
+ * The constant beginning of the JSON body (chat_id, parse_mode, disable_notification) is assembled by the 
+ * preprocessor for each chat and notification flag, so only the text and the timestamp are written at runtime
+ * */
+typedef struct {
+  const char* json;
+  uint16_t length;
+} tgJsonPrefix_t;
+
+#define TELEGRAM_JSON_PREFIX(chat_id, disable_notification) \
+  { API_TELEGRAM_JSON_PREFIX(chat_id, disable_notification), sizeof(API_TELEGRAM_JSON_PREFIX(chat_id, disable_notification)) - 1 }
+#define TELEGRAM_JSON_PREFIXES(chat_id) \
+  { TELEGRAM_JSON_PREFIX(chat_id, API_TELEGRAM_TRUE), TELEGRAM_JSON_PREFIX(chat_id, API_TELEGRAM_FALSE) }
+
+// In msg_kind_t order, the second index is the notification flag
+static const tgJsonPrefix_t _tgJsonPrefixes[TELEGRAM_LANES][2] = {
+  TELEGRAM_JSON_PREFIXES(CONFIG_TELEGRAM_CHAT_ID_MAIN),
+  TELEGRAM_JSON_PREFIXES(TELEGRAM_CHAT_ID_SERVICE),
+  TELEGRAM_JSON_PREFIXES(TELEGRAM_CHAT_ID_PARAMS),
+  TELEGRAM_JSON_PREFIXES(TELEGRAM_CHAT_ID_SECURITY)
+};
+
+// When a group is upgraded to a supergroup, the lane is redirected to the new chat until restart
+#define TELEGRAM_JSON_PREFIX_SIZE (sizeof(API_TELEGRAM_JSON_PREFIX("", API_TELEGRAM_FALSE)) + API_TELEGRAM_CHAT_ID_SIZE)
+static char _tgLaneJson[TELEGRAM_LANES][2][TELEGRAM_JSON_PREFIX_SIZE];
+static char _tgLaneChatIds[TELEGRAM_LANES][API_TELEGRAM_CHAT_ID_SIZE];
+static tgJsonPrefix_t _tgLanePrefixes[TELEGRAM_LANES][2];
+
+static inline const tgJsonPrefix_t* tgJsonPrefix(tgMessage_t* tgMsg)
+{
+  uint8_t notify = decMsgOptionsNotify(tgMsg->options) ? 1 : 0;
+  uint8_t lane = tgLane(tgMsg->options);
+  if (_tgLaneMigrated[lane]) {
+    return &_tgLanePrefixes[lane][notify];
+  };
+  uint8_t kind = decMsgOptionsKind(tgMsg->options);
+  return &_tgJsonPrefixes[kind < TELEGRAM_LANES ? kind : (uint8_t)MK_MAIN][notify];
+}
+
+// The chat the lane sends to, for requests that are not built from the JSON prefix
+static inline const char* tgLaneChatId(uint8_t lane)
+{
+  return _tgLaneMigrated[lane] ? _tgLaneChatIds[lane] : tgChatId((msg_kind_t)lane);
+}
+
+void tgLaneMigrate(uint8_t lane, int64_t chat_id)
+{
+  char buffer[API_TELEGRAM_CHAT_ID_SIZE];
+  const char* pos = tgFormatInt64(chat_id, buffer, sizeof(buffer));
+  strncpy(_tgLaneChatIds[lane], pos, API_TELEGRAM_CHAT_ID_SIZE - 1);
+
+  for (uint8_t notify = 0; notify < 2; notify++) {
+    int len = snprintf(_tgLaneJson[lane][notify], TELEGRAM_JSON_PREFIX_SIZE, "%s%s%s%s%s", 
+      API_TELEGRAM_JSON_CHAT_ID, pos, API_TELEGRAM_JSON_NOTIFY, notify ? API_TELEGRAM_FALSE : API_TELEGRAM_TRUE, API_TELEGRAM_JSON_TEXT);
+    _tgLanePrefixes[lane][notify].json = _tgLaneJson[lane][notify];
+    _tgLanePrefixes[lane][notify].length = (uint16_t)len;
+  };
+  _tgLaneMigrated[lane] = true;
+  rlog_w(logTAG, "The chat has been upgraded to a supergroup, messages are redirected to chat %s. Please update CONFIG_TELEGRAM_CHAT_ID_*", pos);
+}
+
+static bool tgJsonPutChunk(const char* chunk, size_t length, void* ctx)
+{
+  tgBodyWriter_t* writer = (tgBodyWriter_t*)ctx;
+  tgJsonPutEscaped(writer, chunk, length);
+  return writer->error == ESP_OK;
+}
+
+void tgJsonMessage(tgBodyWriter_t* writer, const tgJsonPrefix_t* prefix, tgMessage_t* tgMsg, const char* message_id, const char* repeats, const char* timestamp)
+{
+  if (message_id) {
+    // editMessageText: the message_id goes first, followed by the prefix without its opening brace
+    tgBodyPut(writer, API_TELEGRAM_JSON_MESSAGE_ID, sizeof(API_TELEGRAM_JSON_MESSAGE_ID) - 1);
+    tgBodyPutStr(writer, message_id);
+    tgBodyPut(writer, ",", 1);
+    tgBodyPut(writer, prefix->json + 1, prefix->length - 1);
+  } else {
+    tgBodyPut(writer, prefix->json, prefix->length);
+  };
+  tgMessageText(tgMsg, tgJsonPutChunk, writer);
+  if (repeats) {
+    tgJsonPutEscaped(writer, repeats, strlen(repeats));
+  };
+  tgBodyPut(writer, API_TELEGRAM_JSON_TIME_BEGIN, sizeof(API_TELEGRAM_JSON_TIME_BEGIN) - 1);
+  tgJsonPutEscaped(writer, timestamp, strlen(timestamp));
+  tgBodyPut(writer, API_TELEGRAM_JSON_TIME_END, sizeof(API_TELEGRAM_JSON_TIME_END) - 1);
+}
+
+/**
+ * The response body is parsed as it arrives, through a small buffer and without building a document: the parser 
+ * remembers the last string, and if it turns out to be one of the keys of interest followed by a number, the number 
+ * is stored. This is enough for result.message_id, parameters.retry_after and parameters.migrate_to_chat_id. 
+ * The only string value kept is the beginning of the description, it tells apart the reasons of a 400 Bad Request
+ * */
+void tgResponseInit(tgResponse_t* resp)
+{
+  memset(resp, 0, sizeof(tgResponse_t));
+}
+
+static tgResponseField_t tgResponseField(const char* key)
+{
+  if (strcmp(key, API_TELEGRAM_KEY_MESSAGE_ID) == 0) return TG_FIELD_MESSAGE_ID;
+  if (strcmp(key, API_TELEGRAM_KEY_RETRY_AFTER) == 0) return TG_FIELD_RETRY_AFTER;
+  if (strcmp(key, API_TELEGRAM_KEY_MIGRATE_TO) == 0) return TG_FIELD_MIGRATE_TO;
+  if (strcmp(key, API_TELEGRAM_KEY_DESCRIPTION) == 0) return TG_FIELD_DESCRIPTION;
+  return TG_FIELD_NONE;
+}
+
+static void tgResponseStore(tgResponse_t* resp)
+{
+  int64_t value = resp->negative ? -resp->number : resp->number;
+  switch (resp->field) {
+    case TG_FIELD_MESSAGE_ID:
+      // The first one belongs to the sent message, nested messages (reply_to_message) come later
+      if (resp->message_id == 0) resp->message_id = value;
+      break;
+    case TG_FIELD_RETRY_AFTER:
+      resp->retry_after = value > 0 ? (uint32_t)value * 1000 : 0;
+      break;
+    case TG_FIELD_MIGRATE_TO:
+      resp->migrate_to_chat_id = value;
+      break;
+    default:
+      break;
+  };
+}
+
+void tgResponseParse(tgResponse_t* resp, const char* data, int len)
+{
+  int i = 0;
+  while (i < len) {
+    char c = data[i];
+    switch (resp->state) {
+      case TG_RESP_STRING:
+        if (c == '\\') {
+          resp->state = TG_RESP_ESCAPE;
+        } else if (c == '"') {
+          resp->key[resp->key_len] = 0;
+          resp->state = TG_RESP_KEY;
+        } else if (resp->key_len < sizeof(resp->key) - 1) {
+          resp->key[resp->key_len++] = c;
+        };
+        break;
+      case TG_RESP_ESCAPE:
+        resp->state = TG_RESP_STRING;
+        break;
+      case TG_RESP_KEY:
+        // The string was a key if it is followed by a colon
+        if (c == ':') {
+          resp->field = tgResponseField(resp->key);
+          resp->state = resp->field != TG_FIELD_NONE ? TG_RESP_VALUE : TG_RESP_IDLE;
+        } else if (!isspace((unsigned char)c)) {
+          resp->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      case TG_RESP_VALUE:
+        if ((c == '"') && (resp->field == TG_FIELD_DESCRIPTION)) {
+          resp->description_len = 0;
+          resp->state = TG_RESP_TEXT;
+        } else if ((c == '-') || isdigit((unsigned char)c)) {
+          resp->negative = c == '-';
+          resp->number = resp->negative ? 0 : c - '0';
+          resp->state = TG_RESP_NUMBER;
+        } else if (!isspace((unsigned char)c)) {
+          resp->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      case TG_RESP_NUMBER:
+        if (isdigit((unsigned char)c)) {
+          resp->number = resp->number * 10 + (c - '0');
+        } else {
+          tgResponseStore(resp);
+          resp->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      case TG_RESP_TEXT:
+        if (c == '\\') {
+          resp->state = TG_RESP_TEXT_ESCAPE;
+          break;
+        } else if (c == '"') {
+          resp->description[resp->description_len] = 0;
+          resp->state = TG_RESP_IDLE;
+          break;
+        };
+        // fall through
+      case TG_RESP_TEXT_ESCAPE:
+        if (resp->description_len < sizeof(resp->description) - 1) {
+          resp->description[resp->description_len++] = c;
+        };
+        resp->state = TG_RESP_TEXT;
+        break;
+      default:
+        if (c == '"') {
+          resp->key_len = 0;
+          resp->state = TG_RESP_STRING;
+        };
+        break;
+    };
+    i++;
+  };
+}
+
+// Reads the whole response body (so that the connection can be reused) and parses it
+void tgResponseRead(esp_http_client_handle_t client, tgResponse_t* resp)
+{
+  char buffer[API_TELEGRAM_RESPONSE_CHUNK];
+  int read;
+  while ((read = esp_http_client_read(client, buffer, sizeof(buffer))) > 0) {
+    tgResponseParse(resp, buffer, read);
+  };
+  if (resp->state == TG_RESP_NUMBER) {
+    tgResponseStore(resp);
+  };
+  esp_http_client_flush_response(client, nullptr);
+}
+
+// Called between slices of waiting for a response, returns false if the request should be abandoned
+static bool tgSendPoll(tgWorker_t* worker, tgMessage_t* tgMsg, int64_t elapsed);
+
+// A response that fails at once, before its status line, has not been sent by the server: the connection was already closed
+static esp_err_t tgFetchError(esp_http_client_handle_t client, int64_t started)
+{
+  bool closed = (esp_timer_get_time() - started < (int64_t)CONFIG_TELEGRAM_POLL_INTERVAL * 1000) 
+             && (esp_http_client_get_status_code(client) <= 0);
+  return closed ? ESP_ERR_HTTP_CONNECTION_CLOSED : ESP_ERR_HTTP_FETCH_HEADER;
+}
+
+/**
+ * The request is opened and written with CONFIG_TELEGRAM_CONNECT_TIMEOUT (TCP connect, TLS handshake, body), 
+ * then the response is awaited in short slices up to CONFIG_TELEGRAM_RESPONSE_TIMEOUT. Between the slices the 
+ * task keeps accepting messages and may give up on the request: when the network is lost, the task is being 
+ * deleted, or a stalled request holds up a more important message
+ * */
+esp_err_t tgWaitResponse(tgWorker_t* worker, esp_http_client_handle_t client, tgMessage_t* tgMsg)
+{
+  esp_err_t ret = ESP_OK;
+  #if TELEGRAM_RESPONSE_POLLING
+    int64_t started = esp_timer_get_time();
+    esp_http_client_set_timeout_ms(client, CONFIG_TELEGRAM_POLL_INTERVAL);
+    while (true) {
+      int64_t res = esp_http_client_fetch_headers(client);
+      if (res >= 0) break;
+      if (res != -ESP_ERR_HTTP_EAGAIN) {
+        ret = tgFetchError(client, started);
+        break;
+      };
+      int64_t elapsed = esp_timer_get_time() - started;
+      if (elapsed >= (int64_t)CONFIG_TELEGRAM_RESPONSE_TIMEOUT * 1000) {
+        rlog_w(logTAG, "No response from Telegram API in %d ms", CONFIG_TELEGRAM_RESPONSE_TIMEOUT);
+        ret = ESP_ERR_TIMEOUT;
+        break;
+      };
+      if (!tgSendPoll(worker, tgMsg, elapsed)) {
+        #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+          // An idle long poll is interrupted on purpose
+          if (worker->updates) {
+            ret = ESP_ERR_TIMEOUT;
+            break;
+          };
+        #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+        rlog_w(logTAG, "Request to Telegram API cancelled");
+        ret = ESP_ERR_TIMEOUT;
+        break;
+      };
+    };
+  #else
+    esp_http_client_set_timeout_ms(client, CONFIG_TELEGRAM_RESPONSE_TIMEOUT);
+    int64_t started = esp_timer_get_time();
+    if (esp_http_client_fetch_headers(client) < 0) {
+      // A read timeout is not reported apart from other errors
+      ret = esp_timer_get_time() - started >= (int64_t)CONFIG_TELEGRAM_RESPONSE_TIMEOUT * 1000 ? ESP_ERR_TIMEOUT : tgFetchError(client, started);
+    };
+  #endif // TELEGRAM_RESPONSE_POLLING
+  esp_http_client_set_timeout_ms(client, CONFIG_TELEGRAM_CONNECT_TIMEOUT);
+  return ret;
+}
+
+// Maps an unsuccessful API status to the result of sending (see tgSendApi())
+esp_err_t tgApiStatus(int retCode, tgResponse_t* resp)
+{
+  if ((retCode == API_TELEGRAM_TOO_MANY_REQUESTS) || (resp->retry_after > 0)) {
+    rlog_w(logTAG, "Failed to send message, too many messages, retry after %d ms", (int)resp->retry_after);
+    return ESP_ERR_INVALID_RESPONSE;
+  } else if (retCode == HttpStatus_Forbidden) {
+    rlog_w(logTAG, "Failed to send message, access denied, please wait");
+    return ESP_ERR_INVALID_RESPONSE;
+  } else if (retCode >= 500) {
+    rlog_w(logTAG, "Failed to send message, server error: #%d", retCode);
+    return ESP_FAIL;
+  };
+  rlog_e(logTAG, "Failed to send message, API error code: #%d (%s)!", retCode, resp->description);
+  return ESP_ERR_INVALID_ARG;
+}
+
+/**
+ * Sends the message to the Telegram API and parses the response. Result: ESP_OK - sent (resp->message_id), 
+ * ESP_ERR_INVALID_RESPONSE - try again later (resp->retry_after, if the API has specified it), 
+ * ESP_ERR_NOT_FOUND - the chat has moved, the message can be sent again right away, 
+ * ESP_ERR_INVALID_ARG - rejected by the API, other - network errors
+ * */
+esp_err_t tgSendApi(tgWorker_t* worker, tgMessage_t* tgMsg, tgResponse_t* resp)
+{
+  tgConnection_t* conn = &worker->conn;
+  tgResponseInit(resp);
+  rlog_i(logTAG, "Send message: %s", tgMessageLogText(tgMsg));
+
+  char buffer_timestamp[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  tgBodyWriter_t body;
+
+  // Determine chat ID
+  if (tgChatId(decMsgOptionsKind(tgMsg->options))[0] == 0) {
+    rlog_d(logTAG, "Chat ID not set, message ignored");
+    return ESP_OK;
+  };
+
+  // Calculate the length of JSON to send
+  const tgJsonPrefix_t* prefix = tgJsonPrefix(tgMsg);
+  const char* repeats = nullptr;
+  #if CONFIG_TELEGRAM_DEDUP_ENABLE
+    char buffer_repeats[TELEGRAM_REPEATS_SIZE];
+    if (tgMsg->repeats > 1) {
+      tgFormatTimestamp(tgMsg->first_seen, buffer_timestamp, sizeof(buffer_timestamp));
+      snprintf(buffer_repeats, sizeof(buffer_repeats), API_TELEGRAM_TMPL_REPEATS, tgMsg->repeats, buffer_timestamp);
+      repeats = buffer_repeats;
+    };
+  #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+  // Live messages that have already been sent are edited in place
+  const char* url = _tgUrls[worker->token][TG_URL_SEND];
+  const char* message_id = nullptr;
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    char buffer_message_id[API_TELEGRAM_CHAT_ID_SIZE];
+    if (tgLiveTarget(tgMsg) != 0) {
+      message_id = tgFormatInt64(tgLiveTarget(tgMsg), buffer_message_id, sizeof(buffer_message_id));
+      url = _tgUrls[worker->token][TG_URL_EDIT];
+    };
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  tgFormatTimestamp(tgMsg->timestamp, buffer_timestamp, sizeof(buffer_timestamp));
+  tgBodyInit(&body, nullptr);
+  tgJsonMessage(&body, prefix, tgMsg, message_id, repeats, buffer_timestamp);
+
+  // Make request to Telegram API
+  esp_err_t ret = ESP_FAIL;
+  esp_http_client_handle_t client;
+  int64_t timeRequest = 0;
+  bool kept, written;
+  do {
+    kept = tgConnKept(conn);
+    written = false;
+    client = tgConnOpen(conn);
+    if (client == nullptr) break;
+    tgConnSetUrl(conn, url);
+    int64_t timeOpen = esp_timer_get_time();
+    ret = esp_http_client_open(client, body.length);
+    timeRequest = esp_timer_get_time();
+    tgStatsLatency(TG_STAGE_CONNECT, timeRequest - timeOpen);
+    if (ret == ESP_OK) {
+      tgBodyInit(&body, client);
+      tgJsonMessage(&body, prefix, tgMsg, message_id, repeats, buffer_timestamp);
+      tgBodyFlush(&body);
+      ret = body.error;
+    };
+    if (ret == ESP_OK) {
+      written = true;
+      ret = tgWaitResponse(worker, client, tgMsg);
+    };
+    // The server closes an idle kept connection on its own: the request is repeated at once on a new one, 
+    // this is neither a failed attempt nor an error
+    kept = kept && tgConnStale(ret, written);
+    if (kept) {
+      rlog_d(logTAG, "Kept connection to Telegram API has been closed by the server, reconnecting");
+      tgConnRelease(conn, false);
+    };
+  } while (kept);
+  if (client) {
+    if (ret == ESP_OK) {
+      tgStatsLatency(TG_STAGE_REQUEST, esp_timer_get_time() - timeRequest);
+      int retCode = esp_http_client_get_status_code(client);
+      tgResponseRead(client, resp);
+      resp->status = retCode;
+      if (retCode == HttpStatus_Ok) {
+        ret = ESP_OK;
+        rlog_v(logTAG, "Message sent: %s", tgMessageLogText(tgMsg));
+      } else if (resp->migrate_to_chat_id != 0) {
+        ret = ESP_ERR_NOT_FOUND;
+        tgLaneMigrate(tgLane(tgMsg->options), resp->migrate_to_chat_id);
+      #if CONFIG_TELEGRAM_LIVE_ENABLE
+      } else if ((message_id) && (retCode == API_TELEGRAM_BAD_REQUEST) && strstr(resp->description, API_TELEGRAM_DESC_NOT_MODIFIED)) {
+        // The chat already shows this text
+        ret = ESP_OK;
+        rlog_d(logTAG, "Live message %d is not modified", tgMsg->live - 1);
+      } else if ((message_id) && (retCode == API_TELEGRAM_BAD_REQUEST) 
+              && (strstr(resp->description, API_TELEGRAM_DESC_EDIT_NOT_FOUND) || strstr(resp->description, API_TELEGRAM_DESC_CANT_BE_EDITED))) {
+        // The message has been deleted from the chat (or is too old to edit): send the update as a new one
+        ret = ESP_ERR_NOT_FOUND;
+        _tgLive[tgMsg->live - 1].message_id = 0;
+        rlog_w(logTAG, "Failed to edit live message %d (%s), it will be sent again", tgMsg->live - 1, resp->description);
+      #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+      } else {
+        ret = tgApiStatus(retCode, resp);
+      };
+      #if !defined(CONFIG_TELEGRAM_SYSLED_ACTIVITY) || CONFIG_TELEGRAM_SYSLED_ACTIVITY
+        // Flashing system LED
+        ledSysActivity();
+      #endif // CONFIG_TELEGRAM_SYSLED_ACTIVITY
+      tgConnRelease(conn, true);
+    } else {
+      rlog_e(logTAG, "Failed to complete request to Telegram API, error code: 0x%x!", ret);
+      tgConnRelease(conn, false);
+    };
+  } else {
+    ret = ESP_ERR_INVALID_STATE;
+    rlog_e(logTAG, "Failed to complete request to Telegram API!");
+  };
+
+  return ret;
+}
+
+#if CONFIG_TELEGRAM_SPILL_ENABLE
+
+// Writes the text file: one paragraph per record, each starting with its time
+void tgSpillDocument(tgBodyWriter_t* writer, tgSpillUpload_t* upload)
+{
+  char buffer_timestamp[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  uint32_t bytes;
+  uint32_t offset = _tgSpill.head;
+  for (uint32_t done = 0; done < _tgSpill.upload_used; done += bytes) {
+    tgSpillRecord_t* rec = tgSpillRecord(offset);
+    if ((rec->length != TELEGRAM_SPILL_WRAP) && (rec->lane == upload->lane) && !rec->sent) {
+      tgFormatTimestamp(rec->timestamp, buffer_timestamp, sizeof(buffer_timestamp));
+      tgBodyPutStr(writer, buffer_timestamp);
+      tgBodyPut(writer, "\r\n", 2);
+      tgBodyPut(writer, (const char*)(rec + 1), rec->length);
+      tgBodyPut(writer, "\r\n\r\n", 4);
+    };
+    offset = tgSpillNextOffset(offset, &bytes);
+  };
+}
+
+void tgSpillMultipart(tgBodyWriter_t* writer, tgSpillUpload_t* upload, const char* caption)
+{
+  tgBodyPut(writer, API_TELEGRAM_PART("chat_id"), sizeof(API_TELEGRAM_PART("chat_id")) - 1);
+  tgBodyPutStr(writer, tgLaneChatId(upload->lane));
+  tgBodyPut(writer, API_TELEGRAM_PART_END, sizeof(API_TELEGRAM_PART_END) - 1);
+  tgBodyPut(writer, API_TELEGRAM_PART("caption"), sizeof(API_TELEGRAM_PART("caption")) - 1);
+  tgBodyPutStr(writer, caption);
+  tgBodyPut(writer, API_TELEGRAM_PART_END, sizeof(API_TELEGRAM_PART_END) - 1);
+  tgBodyPut(writer, API_TELEGRAM_PART_DOCUMENT, sizeof(API_TELEGRAM_PART_DOCUMENT) - 1);
+  tgSpillDocument(writer, upload);
+  tgBodyPut(writer, API_TELEGRAM_MULTIPART_END, sizeof(API_TELEGRAM_MULTIPART_END) - 1);
+}
+
+/**
+ * Uploads the spilled records of a chat as a text file with a summary in the caption. The multipart body is 
+ * streamed from the spill buffer in the same two passes as a message, it is never assembled in memory
+ * */
+esp_err_t tgSendSpill(tgWorker_t* worker, tgSpillUpload_t* upload, tgResponse_t* resp)
+{
+  tgConnection_t* conn = &worker->conn;
+  tgResponseInit(resp);
+  rlog_i(logTAG, "Send %d delayed messages as a document", upload->count);
+
+  char buffer_first[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  char buffer_last[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  char caption[64 + 2 * CONFIG_BUFFER_LEN_INT64_RADIX10];
+  tgFormatTimestamp(upload->first, buffer_first, sizeof(buffer_first));
+  tgFormatTimestamp(upload->last, buffer_last, sizeof(buffer_last));
+  snprintf(caption, sizeof(caption), API_TELEGRAM_TMPL_SPILL, upload->count, buffer_first, buffer_last);
+
+  tgBodyWriter_t body;
+  tgBodyInit(&body, nullptr);
+  tgSpillMultipart(&body, upload, caption);
+
+  esp_err_t ret = ESP_FAIL;
+  esp_http_client_handle_t client = tgConnOpen(conn);
+  if (client) {
+    tgConnSetUrl(conn, _tgUrls[upload->token][TG_URL_DOCUMENT]);
+    esp_http_client_set_header(client, API_TELEGRAM_HEADER_CTYPE, API_TELEGRAM_HEADER_MULTIPART);
+    int64_t timeOpen = esp_timer_get_time();
+    ret = esp_http_client_open(client, body.length);
+    int64_t timeRequest = esp_timer_get_time();
+    tgStatsLatency(TG_STAGE_CONNECT, timeRequest - timeOpen);
+    if (ret == ESP_OK) {
+      tgBodyInit(&body, client);
+      tgSpillMultipart(&body, upload, caption);
+      tgBodyFlush(&body);
+      ret = body.error;
+    };
+    if (ret == ESP_OK) {
+      ret = tgWaitResponse(worker, client, nullptr);
+    };
+    esp_http_client_set_header(client, API_TELEGRAM_HEADER_CTYPE, API_TELEGRAM_HEADER_AJSON);
+    if (ret == ESP_OK) {
+      tgStatsLatency(TG_STAGE_REQUEST, esp_timer_get_time() - timeRequest);
+      int retCode = esp_http_client_get_status_code(client);
+      tgResponseRead(client, resp);
+      resp->status = retCode;
+      if (retCode == HttpStatus_Ok) {
+        ret = ESP_OK;
+        rlog_d(logTAG, "%d delayed messages sent", upload->count);
+      } else if (resp->migrate_to_chat_id != 0) {
+        ret = ESP_ERR_NOT_FOUND;
+        tgLaneMigrate(upload->lane, resp->migrate_to_chat_id);
+      } else {
+        ret = tgApiStatus(retCode, resp);
+      };
+      tgConnRelease(conn, true);
+    } else {
+      rlog_e(logTAG, "Failed to complete request to Telegram API, error code: 0x%x!", ret);
+      tgConnRelease(conn, false);
+    };
+  } else {
+    ret = ESP_ERR_INVALID_STATE;
+    rlog_e(logTAG, "Failed to complete request to Telegram API!");
+  };
+
+  return ret;
+}
+
+#endif // CONFIG_TELEGRAM_SPILL_ENABLE
+
+#if CONFIG_TELEGRAM_WARMUP
+
+/**
+ * After the network comes up, the API host is resolved and a connection is established with a getMe request, 
+ * so the first message does not wait for DNS, TCP and TLS. The connection is then kept for 
+ * CONFIG_TELEGRAM_IDLE_TIMEOUT like after any other request
+ * */
+void tgSendWarmup(tgWorker_t* worker)
+{
+  tgConnection_t* conn = &worker->conn;
+  int64_t started = esp_timer_get_time();
+  tgDnsResolve(true);
+  esp_http_client_handle_t client = tgConnOpen(conn);
+  if (client == nullptr) {
+    return;
+  };
+  tgConnSetUrl(conn, _tgUrls[0][TG_URL_GET_ME]);
+  esp_http_client_set_method(client, HTTP_METHOD_GET);
+  esp_err_t ret = esp_http_client_open(client, 0);
+  if (ret == ESP_OK) {
+    ret = tgWaitResponse(worker, client, nullptr);
+  };
+  esp_http_client_set_method(client, HTTP_METHOD_POST);
+  if (ret == ESP_OK) {
+    // The response is read to the end, otherwise the connection cannot be reused
+    tgResponse_t resp;
+    tgResponseInit(&resp);
+    int retCode = esp_http_client_get_status_code(client);
+    tgResponseRead(client, &resp);
+    if (retCode == HttpStatus_Ok) {
+      rlog_i(logTAG, "Connection to Telegram API established in %d ms", (int)((esp_timer_get_time() - started) / 1000));
+    } else {
+      rlog_w(logTAG, "Connection to Telegram API established, but getMe failed: #%d", retCode);
+    };
+    tgConnRelease(conn, true);
+  } else {
+    rlog_w(logTAG, "Failed to connect to Telegram API in advance, error code: 0x%x", ret);
+    tgConnRelease(conn, false);
+  };
+}
+
+#endif // CONFIG_TELEGRAM_WARMUP
+
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Command receiver ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Commands are received by long polling getUpdates on the connection of a worker that has nothing to send, so the 
+ * receiver costs no extra TLS session. With a single worker, an outgoing message interrupts the poll (the connection 
+ * is then opened again), with several workers the last one polls while the others send. The response is parsed as it 
+ * arrives: only the text of the current update is buffered. Commands from the configured chats are posted to the 
+ * event loop and dispatched there to the registered handlers. The offset of the next update is saved before the 
+ * command is posted and kept in RTC memory, so an update is never dispatched twice. After a cold start the backlog 
+ * is confirmed without being executed
+ * */
+void tgUpdatesInit(tgUpdates_t* upd, int64_t offset, bool dispatch)
+{
+  memset(upd, 0, sizeof(tgUpdates_t));
+  upd->offset = offset;
+  upd->dispatch = dispatch;
+}
+
+static tgUpdateField_t tgUpdatesField(tgUpdates_t* upd)
+{
+  switch (upd->depth) {
+    case 3:
+      if (strcmp(upd->key, API_TELEGRAM_KEY_UPDATE_ID) == 0) return TG_UPDATE_ID;
+      if ((strcmp(upd->key, API_TELEGRAM_KEY_MESSAGE) == 0) || (strcmp(upd->key, API_TELEGRAM_KEY_CHANNEL_POST) == 0)) return TG_UPDATE_MESSAGE;
+      break;
+    case 4:
+      if (!upd->message) break;
+      if (strcmp(upd->key, API_TELEGRAM_KEY_TEXT) == 0) return TG_UPDATE_TEXT;
+      if (strcmp(upd->key, API_TELEGRAM_KEY_CHAT) == 0) return TG_UPDATE_CHAT;
+      if (strcmp(upd->key, API_TELEGRAM_KEY_FROM) == 0) return TG_UPDATE_FROM;
+      break;
+    case 5:
+      if ((upd->nested != TG_UPDATE_NONE) && (strcmp(upd->key, API_TELEGRAM_KEY_ID) == 0)) {
+        return upd->nested == TG_UPDATE_CHAT ? TG_UPDATE_CHAT_ID : TG_UPDATE_FROM_ID;
+      };
+      break;
+    default:
+      break;
+  };
+  return TG_UPDATE_NONE;
+}
+
+static void tgUpdatesStore(tgUpdates_t* upd)
+{
+  int64_t value = upd->negative ? -upd->number : upd->number;
+  switch (upd->field) {
+    case TG_UPDATE_ID:
+      upd->command.update_id = value;
+      break;
+    case TG_UPDATE_CHAT_ID:
+      upd->command.chat_id = value;
+      break;
+    case TG_UPDATE_FROM_ID:
+      upd->command.from_id = value;
+      break;
+    default:
+      break;
+  };
+}
+
+// Commands are accepted only from the chats the device reports to
+static bool tgUpdatesAllowed(int64_t chat_id)
+{
+  char buffer[API_TELEGRAM_CHAT_ID_SIZE];
+  const char* id = tgFormatInt64(chat_id, buffer, sizeof(buffer));
+  for (uint8_t kind = 0; kind < TELEGRAM_LANES; kind++) {
+    if (strcmp(tgChatId((msg_kind_t)kind), id) == 0) return true;
+  };
+  return false;
+}
+
+// The update object is complete
+static void tgUpdatesDone(tgUpdates_t* upd)
+{
+  tg_command_t* command = &upd->command;
+  command->text[upd->text_len] = 0;
+  if (command->update_id >= upd->offset) {
+    upd->offset = command->update_id + 1;
+    if (upd->dispatch && (command->text[0] == '/')) {
+      if (tgUpdatesAllowed(command->chat_id)) {
+        _tgUpdatesOffset = upd->offset;
+        rlog_i(logTAG, "Command received: %s", command->text);
+        if (!eventLoopPost(RE_TELEGRAM_EVENTS, RE_TELEGRAM_COMMAND, command, sizeof(tg_command_t), pdMS_TO_TICKS(CONFIG_TELEGRAM_POLL_INTERVAL))) {
+          rlog_e(logTAG, "Failed to post command %s to the event loop", command->text);
+        };
+      } else {
+        rlog_w(logTAG, "Command from an unknown chat ignored: %s", command->text);
+      };
+    };
+  };
+  memset(command, 0, sizeof(tg_command_t));
+  upd->text_len = 0;
+}
+
+static void tgUpdatesOpen(tgUpdates_t* upd, char c)
+{
+  if (c == '{') {
+    if ((upd->depth == 3) && (upd->field == TG_UPDATE_MESSAGE)) {
+      upd->message = true;
+    } else if ((upd->depth == 4) && ((upd->field == TG_UPDATE_CHAT) || (upd->field == TG_UPDATE_FROM))) {
+      upd->nested = upd->field;
+    };
+  };
+  upd->field = TG_UPDATE_NONE;
+  if (upd->depth < UINT8_MAX) upd->depth++;
+}
+
+static void tgUpdatesClose(tgUpdates_t* upd, char c)
+{
+  if (upd->depth == 0) return;
+  if (upd->depth == 5) {
+    upd->nested = TG_UPDATE_NONE;
+  } else if (upd->depth == 4) {
+    upd->message = false;
+  } else if ((upd->depth == 3) && (c == '}')) {
+    tgUpdatesDone(upd);
+  };
+  upd->depth--;
+}
+
+static void tgUpdatesText(tgUpdates_t* upd, char c)
+{
+  if (upd->text_len < sizeof(upd->command.text) - 1) {
+    upd->command.text[upd->text_len++] = c;
+  };
+}
+
+void tgUpdatesParse(tgUpdates_t* upd, const char* data, int len)
+{
+  int i = 0;
+  while (i < len) {
+    char c = data[i];
+    switch (upd->state) {
+      case TG_RESP_STRING:
+        if (upd->skip > 0) {
+          upd->skip--;
+        } else if (c == '\\') {
+          upd->state = TG_RESP_ESCAPE;
+        } else if (c == '"') {
+          if (upd->text) {
+            upd->text = false;
+            upd->state = TG_RESP_IDLE;
+          } else {
+            upd->key[upd->key_len] = 0;
+            upd->state = TG_RESP_KEY;
+          };
+        } else if (upd->text) {
+          tgUpdatesText(upd, c);
+        } else if (upd->key_len < sizeof(upd->key) - 1) {
+          upd->key[upd->key_len++] = c;
+        };
+        break;
+      case TG_RESP_ESCAPE:
+        upd->state = TG_RESP_STRING;
+        if (upd->text) {
+          switch (c) {
+            case 'n': tgUpdatesText(upd, '\n'); break;
+            case 'r': tgUpdatesText(upd, '\r'); break;
+            case 't': tgUpdatesText(upd, '\t'); break;
+            // Commands are ASCII, other characters of the arguments are replaced
+            case 'u': tgUpdatesText(upd, '?'); upd->skip = 4; break;
+            default: tgUpdatesText(upd, c); break;
+          };
+        };
+        break;
+      case TG_RESP_KEY:
+        // The string was a key if it is followed by a colon
+        if (c == ':') {
+          upd->field = tgUpdatesField(upd);
+          upd->state = upd->field != TG_UPDATE_NONE ? TG_RESP_VALUE : TG_RESP_IDLE;
+        } else if (!isspace((unsigned char)c)) {
+          upd->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      case TG_RESP_VALUE:
+        if ((c == '"') && (upd->field == TG_UPDATE_TEXT)) {
+          upd->text = true;
+          upd->text_len = 0;
+          upd->state = TG_RESP_STRING;
+        } else if (((c == '-') || isdigit((unsigned char)c)) && (upd->field == TG_UPDATE_ID || upd->field == TG_UPDATE_CHAT_ID || upd->field == TG_UPDATE_FROM_ID)) {
+          upd->negative = c == '-';
+          upd->number = upd->negative ? 0 : c - '0';
+          upd->state = TG_RESP_NUMBER;
+        } else if (!isspace((unsigned char)c)) {
+          // An object opened here inherits the field, anything else is skipped
+          upd->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      case TG_RESP_NUMBER:
+        if (isdigit((unsigned char)c)) {
+          upd->number = upd->number * 10 + (c - '0');
+        } else {
+          tgUpdatesStore(upd);
+          upd->field = TG_UPDATE_NONE;
+          upd->state = TG_RESP_IDLE;
+          continue;
+        };
+        break;
+      default:
+        if (c == '"') {
+          upd->key_len = 0;
+          upd->state = TG_RESP_STRING;
+        } else if ((c == '{') || (c == '[')) {
+          tgUpdatesOpen(upd, c);
+        } else if ((c == '}') || (c == ']')) {
+          tgUpdatesClose(upd, c);
+        } else if (!isspace((unsigned char)c)) {
+          upd->field = TG_UPDATE_NONE;
+        };
+        break;
+    };
+    i++;
+  };
+}
+
+/**
+ * Long-polls getUpdates for CONFIG_TELEGRAM_UPDATES_TIMEOUT seconds on the worker's connection. After an error 
+ * the next poll is delayed with the same backoff as a failed message
+ * */
+void tgUpdatesPoll(tgWorker_t* worker)
+{
+  tgConnection_t* conn = &worker->conn;
+  bool cold = _tgUpdatesMagic != TELEGRAM_UPDATES_MAGIC;
+  char buffer_offset[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  char json[sizeof(API_TELEGRAM_TMPL_UPDATES) + CONFIG_BUFFER_LEN_INT64_RADIX10 + 8];
+  // After a cold start only the last update is requested, to confirm the backlog
+  int len = snprintf(json, sizeof(json), API_TELEGRAM_TMPL_UPDATES, 
+    tgFormatInt64(cold ? -1 : _tgUpdatesOffset, buffer_offset, sizeof(buffer_offset)), cold ? 0 : CONFIG_TELEGRAM_UPDATES_TIMEOUT);
+
+  esp_err_t ret = ESP_FAIL;
+  esp_http_client_handle_t client = tgConnOpen(conn);
+  if (client) {
+    tgConnSetUrl(conn, _tgUrls[0][TG_URL_UPDATES]);
+    ret = esp_http_client_open(client, len);
+    if ((ret == ESP_OK) && (esp_http_client_write(client, json, len) != len)) {
+      ret = ESP_ERR_HTTP_WRITE_DATA;
+    };
+    if (ret == ESP_OK) {
+      worker->updates = true;
+      ret = tgWaitResponse(worker, client, nullptr);
+      worker->updates = false;
+    };
+    if (ret == ESP_OK) {
+      int retCode = esp_http_client_get_status_code(client);
+      char buffer[API_TELEGRAM_RESPONSE_CHUNK];
+      int read;
+      tgUpdatesInit(&_tgUpdates, cold ? 0 : _tgUpdatesOffset, !cold);
+      while ((read = esp_http_client_read(client, buffer, sizeof(buffer))) > 0) {
+        tgUpdatesParse(&_tgUpdates, buffer, read);
+      };
+      esp_http_client_flush_response(client, nullptr);
+      if (retCode == HttpStatus_Ok) {
+        _tgUpdatesOffset = _tgUpdates.offset;
+        _tgUpdatesMagic = TELEGRAM_UPDATES_MAGIC;
+        _tgUpdatesErrors = 0;
+      } else {
+        // 409 Conflict: a webhook is set or another client is polling the same bot
+        rlog_w(logTAG, "Failed to receive commands, API error code: #%d", retCode);
+        ret = ESP_ERR_INVALID_RESPONSE;
+      };
+      tgConnRelease(conn, true);
+    } else {
+      tgConnRelease(conn, false);
+    };
+  };
+  // An interrupted poll is simply repeated later
+  if ((ret != ESP_OK) && (ret != ESP_ERR_TIMEOUT)) {
+    if (_tgUpdatesErrors < UINT8_MAX) {
+      _tgUpdatesErrors++;
+    };
+    _tgUpdatesNext = esp_timer_get_time() + tgRetryDelay(TG_RETRY_SERVER, _tgUpdatesErrors);
+  };
+}
+
+// Dispatches a command posted to the event loop to the registered handler
+static void tgCommandEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  const tg_command_t* command = (const tg_command_t*)event_data;
+  if ((command == nullptr) || (command->text[0] != '/')) return;
+  // "/name@bot args"
+  const char* name = command->text + 1;
+  size_t length = strcspn(name, " @\n");
+  const char* args = name + strcspn(name, " \n");
+  while ((*args == ' ') || (*args == '\n')) args++;
+  uint8_t used = __atomic_load_n(&_tgCommandsUsed, __ATOMIC_ACQUIRE);
+  for (uint8_t i = 0; (i < used) && (i < CONFIG_TELEGRAM_COMMANDS); i++) {
+    tg_command_cb_t handler = __atomic_load_n(&_tgCommands[i].handler, __ATOMIC_ACQUIRE);
+    if ((handler) && (_tgCommands[i].length == length) && (strncmp(_tgCommands[i].command, name, length) == 0)) {
+      handler(command, args, _tgCommands[i].ctx);
+      return;
+    };
+  };
+  rlog_w(logTAG, "No handler for command %.*s", (int)length, name);
+}
+
+bool tgCommandRegister(const char* command, tg_command_cb_t handler, void* ctx)
+{
+  if ((command == nullptr) || (handler == nullptr)) return false;
+  if (*command == '/') command++;
+  uint8_t index = __atomic_fetch_add(&_tgCommandsUsed, 1, __ATOMIC_RELAXED);
+  if (index >= CONFIG_TELEGRAM_COMMANDS) {
+    __atomic_store_n(&_tgCommandsUsed, CONFIG_TELEGRAM_COMMANDS, __ATOMIC_RELAXED);
+    rlog_e(logTAG, "Failed to register command %s: no free slots", command);
+    return false;
+  };
+  _tgCommands[index].command = command;
+  _tgCommands[index].length = strlen(command);
+  _tgCommands[index].ctx = ctx;
+  __atomic_store_n(&_tgCommands[index].handler, handler, __ATOMIC_RELEASE);
+  return true;
+}
+
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+
+// Queues a formatted message: the ring takes ownership of it, or it is freed
+static bool tgSendCommit(const tg_send_params_t* params, tgMessage_t* tgMsg, int64_t formatStart)
+{
+  msg_options_t msgOptions = params->options;
+  tgMsg->options = msgOptions;
+  tgMsg->timestamp = time(nullptr);
+  tgMsg->callback = params->callback;
+  tgMsg->ctx = params->ctx;
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    tgMsg->live = params->live <= CONFIG_TELEGRAM_LIVE_SLOTS ? params->live : 0;
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  #if CONFIG_TELEGRAM_DEDUP_ENABLE
+    tgMsg->hash = tgMessageHash(msgOptions, tgMsg->message);
+  #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+  tgMsg->queued = esp_timer_get_time();
+  tgMessageSchedule(tgMsg, params->ttl, params->latency);
+  tgStatsLatency(TG_STAGE_FORMAT, tgMsg->queued - formatStart);
+
+  // Put a message to the ring and wake up the task
+  if (tgRingPush(tgMsg)) {
+    tgStatsCount(msgOptions, TG_COUNTER_ENQUEUED);
+    xTaskNotifyGive(_tgWorkers[0].task);
+    return true;
+  };
+  rloga_e("Failed to adding message to queue [ %s ]!", tgTaskName);
+  eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_ERR_NO_MEM);
+  tgMessageFree(tgMsg);
+  tgStatsCount(msgOptions, TG_COUNTER_DROPPED);
+  return false;
+}
+
+static tgMessage_t* tgSendAlloc(const tg_send_params_t* params, size_t size)
+{
+  tgMessage_t* tgMsg = tgMessageAlloc(size);
+  if (tgMsg == nullptr) {
+    rlog_e(logTAG, "Failed to allocate memory for message");
+    eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_ERR_NO_MEM);
+    tgStatsCount(params->options, TG_COUNTER_DROPPED);
+  };
+  return tgMsg;
+}
+
+static bool tgSendMsgV(const tg_send_params_t* params, const char* msgTitle, const char* msgText, va_list args)
+{
+  if (_tgRing.ready) {
+    int64_t formatStart = esp_timer_get_time();
+
+    // Calculate the size of the message and allocate memory for it in one piece
+    #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      size_t size = CONFIG_TELEGRAM_MESSAGE_SIZE;
+    #else
+      va_list args_len;
+      va_copy(args_len, args);
+      size_t size = vsnprintf(nullptr, 0, msgText, args_len) + 1;
+      va_end(args_len);
+      #if CONFIG_TELEGRAM_TITLE_ENABLED
+        if (msgTitle) size += snprintf(nullptr, 0, API_TELEGRAM_TMPL_TITLE, msgTitle);
+      #endif // CONFIG_TELEGRAM_TITLE_ENABLED
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    tgMessage_t* tgMsg = tgSendAlloc(params, size);
+    if (tgMsg) {
+      // Format the title and the text directly into the message buffer
+      size_t len = 0;
+      #if CONFIG_TELEGRAM_TITLE_ENABLED
+        if (msgTitle) {
+          len = snprintf(tgMsg->message, size, API_TELEGRAM_TMPL_TITLE, msgTitle);
+          if (len >= size) len = size - 1;
+        };
+      #endif // CONFIG_TELEGRAM_TITLE_ENABLED
+      vsnprintf(tgMsg->message + len, size - len, msgText, args);
+      return tgSendCommit(params, tgMsg, formatStart);
+    };
+  };
+  return false;
+}
+
+/**
+ * The C++ API (tg::send()) computes an upper bound of the message length from the types of its arguments, 
+ * writes the text into the buffer itself in a single pass and then queues it like tgSendMsg() does
+ * */
+bool tgMsgBegin(const tg_send_params_t* params, size_t size, tg_msg_buffer_t* buffer)
+{
+  buffer->message = nullptr;
+  if (_tgRing.ready) {
+    #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      size = CONFIG_TELEGRAM_MESSAGE_SIZE;
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    buffer->started = esp_timer_get_time();
+    tgMessage_t* tgMsg = tgSendAlloc(params, size);
+    if (tgMsg) {
+      buffer->message = tgMsg;
+      buffer->text = tgMsg->message;
+      buffer->size = size;
+      return true;
+    };
+  };
+  return false;
+}
+
+bool tgMsgCommit(const tg_send_params_t* params, tg_msg_buffer_t* buffer)
+{
+  tgMessage_t* tgMsg = (tgMessage_t*)buffer->message;
+  buffer->message = nullptr;
+  return tgMsg ? tgSendCommit(params, tgMsg, buffer->started) : false;
+}
+
+bool tgSendMsg(msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...)
+{
+  tg_send_params_t params = { msgOptions, nullptr, nullptr, 0 };
+  va_list args;
+  va_start(args, msgText);
+  bool ret = tgSendMsgV(&params, msgTitle, msgText, args);
+  va_end(args);
+  return ret;
+}
+
+bool tgSendMsgEx(const tg_send_params_t* params, const char* msgTitle, const char* msgText, ...)
+{
+  va_list args;
+  va_start(args, msgText);
+  bool ret = tgSendMsgV(params, msgTitle, msgText, args);
+  va_end(args);
+  return ret;
+}
+
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+bool tgSendLive(uint8_t slot, msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...)
+{
+  if (slot >= CONFIG_TELEGRAM_LIVE_SLOTS) {
+    rlog_e(logTAG, "Invalid live message slot: %d", slot);
+    return false;
+  };
+  tg_send_params_t params = { msgOptions, nullptr, nullptr, (uint8_t)(slot + 1) };
+  va_list args;
+  va_start(args, msgText);
+  bool ret = tgSendMsgV(&params, msgTitle, msgText, args);
+  va_end(args);
+  return ret;
+}
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
+
+#if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+static size_t tgAppendText(char* buffer, size_t len, size_t size, const char* text)
+{
+  while ((*text) && (len < size - 1)) {
+    buffer[len++] = *text++;
+  };
+  buffer[len] = 0;
+  return len;
+}
+
+bool tgSendMsgFromISR(msg_options_t msgOptions, const char* msgTitle, const char* msgText)
+{
+  if (_tgRing.ready) {
+    tgMessage_t* tgMsg = tgMessageAlloc(CONFIG_TELEGRAM_MESSAGE_SIZE);
+    if (tgMsg) {
+      tgMsg->options = msgOptions;
+      // time() is not safe in an interrupt, the task will stamp the message
+      tgMsg->timestamp = 0;
+      size_t len = 0;
+      #if CONFIG_TELEGRAM_TITLE_ENABLED
+        if (msgTitle) {
+          len = tgAppendText(tgMsg->message, len, CONFIG_TELEGRAM_MESSAGE_SIZE, API_TELEGRAM_TITLE_BEGIN);
+          len = tgAppendText(tgMsg->message, len, CONFIG_TELEGRAM_MESSAGE_SIZE, msgTitle);
+          len = tgAppendText(tgMsg->message, len, CONFIG_TELEGRAM_MESSAGE_SIZE, API_TELEGRAM_TITLE_END);
+        };
+      #endif // CONFIG_TELEGRAM_TITLE_ENABLED
+      tgAppendText(tgMsg->message, len, CONFIG_TELEGRAM_MESSAGE_SIZE, msgText);
+      tgMsg->queued = esp_timer_get_time();
+      tgMessageSchedule(tgMsg, 0, TG_LATENCY_DEFAULT);
+
+      if (tgRingPush(tgMsg)) {
+        tgStatsCount(msgOptions, TG_COUNTER_ENQUEUED);
+        BaseType_t taskWoken = pdFALSE;
+        vTaskNotifyGiveFromISR(_tgWorkers[0].task, &taskWoken);
+        if (taskWoken == pdTRUE) {
+          portYIELD_FROM_ISR();
+        };
+        return true;
+      };
+      tgMessageFree(tgMsg);
+    };
+    // Errors are reported later by the task
+    __atomic_add_fetch(&_tgRing.isr_dropped, 1, __ATOMIC_RELAXED);
+    tgStatsCount(msgOptions, TG_COUNTER_DROPPED);
+  };
+  return false;
+}
+
+#endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ----------------------------------------------------- Coalescing ------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool tgBatchCompatible(tgMessage_t* batch, tgMessage_t* next)
+{
+  return (decMsgOptionsNotify(batch->options) == decMsgOptionsNotify(next->options))
+      && (tgLane(batch->options) == tgLane(next->options))
+      && (batch->callback == nullptr) && (next->callback == nullptr)
+      && (batch->live == 0) && (next->live == 0);
+}
+
+/**
+ * Merges messages waiting in the ring into the received one while they go to the same chat with the same 
+ * notification flag. Each part keeps its title, the timestamp of the previous part is inserted between them,
+ * the timestamp of the last part is added when sending
+ * */
+tgMessage_t* tgBatchCollect(tgMessage_t* batch)
+{
+  char buffer_timestamp[CONFIG_BUFFER_LEN_INT64_RADIX10];
+  tgMessage_t* nextMsg = nullptr;
+  TickType_t lingerStart = xTaskGetTickCount();
+  TickType_t lingerTime = pdMS_TO_TICKS(CONFIG_TELEGRAM_BATCH_LINGER);
+  while (true) {
+    TickType_t lingerPassed = xTaskGetTickCount() - lingerStart;
+    TickType_t lingerWait = lingerPassed < lingerTime ? lingerTime - lingerPassed : 0;
+    nextMsg = tgRingWait(lingerWait);
+    if (nextMsg == nullptr) {
+      // Woken up by another worker, keep waiting until the end of the linger time
+      if (lingerWait > 0) continue;
+      break;
+    };
+    #if CONFIG_TELEGRAM_DEDUP_ENABLE
+      // A repeat of the batch itself or of a pending message is counted instead of being appended
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      bool absorbed = tgDedupAbsorb(nextMsg);
+      xSemaphoreGive(_tgLock);
+      if (!absorbed && tgDedupSame(batch, nextMsg)) {
+        tgDedupMerge(batch, nextMsg);
+        absorbed = true;
+      };
+      if (absorbed) {
+        tgRingAdvance();
+        tgMessageFree(nextMsg);
+        continue;
+      };
+      // The repeat counter is shown at the end of the message, nothing can be appended after it
+      if (batch->repeats > 1) break;
+    #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+    if (!tgBatchCompatible(batch, nextMsg)) break;
+    tgFormatTimestamp(batch->timestamp, buffer_timestamp, sizeof(buffer_timestamp));
+    size_t len = strlen(batch->message);
+    size_t size = len + snprintf(nullptr, 0, API_TELEGRAM_TMPL_BATCH, buffer_timestamp, nextMsg->message) + 1;
+    if ((size - 1) > TELEGRAM_BATCH_LIMIT) break;
+    // Append the next part in place (arena slot) or move the batch to a larger block
+    #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      tgMessage_t* merged = tgMessageAlloc(size);
+      if (merged == nullptr) break;
+      memcpy(merged->message, batch->message, len + 1);
+      merged->options = batch->options;
+      merged->parts = batch->parts;
+      merged->queued = batch->queued;
+      merged->deadline = batch->deadline;
+      merged->expires = batch->expires;
+      tgMessageFree(batch);
+      batch = merged;
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    snprintf(batch->message + len, size - len, API_TELEGRAM_TMPL_BATCH, buffer_timestamp, nextMsg->message);
+
+    // The message has been merged, take it out of the ring
+    tgRingAdvance();
+    batch->timestamp = nextMsg->timestamp;
+    batch->parts += nextMsg->parts;
+    // The batch is due as soon as any part is due, and lives as long as any part does
+    if (nextMsg->deadline < batch->deadline) {
+      batch->deadline = nextMsg->deadline;
+    };
+    batch->expires = (batch->expires == 0) || (nextMsg->expires == 0) ? 0 : (nextMsg->expires > batch->expires ? nextMsg->expires : batch->expires);
+    if (decMsgOptionsPriority(nextMsg->options) > decMsgOptionsPriority(batch->options)) {
+      batch->options = encMsgOptions(decMsgOptionsKind(batch->options), decMsgOptionsNotify(batch->options), decMsgOptionsPriority(nextMsg->options));
+    };
+    tgMessageFree(nextMsg);
+    nextMsg = nullptr;
+    rlog_d(logTAG, "Message merged into batch (parts: %d)", batch->parts);
+  };
+  return batch;
+}
+
+void tgGetBatchStats(uint32_t* messages, uint32_t* requests)
+{
+  // Requests are counted after messages, so the ratio is never below 1 even while workers are counting
+  uint32_t batches = __atomic_load_n(&_tgBatchRequests, __ATOMIC_ACQUIRE);
+  if (messages) *messages = __atomic_load_n(&_tgBatchMessages, __ATOMIC_RELAXED);
+  if (requests) *requests = batches;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------- Task routines ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+void tgSendResult(esp_err_t resSend)
+{
+  // If the send status has changed, send an event to the event loop
+  if (resSend != _tgResLast) {
+    _tgResLast = resSend;
+    eventLoopPostError(RE_SYS_TELEGRAM_ERROR, resSend);
+  };
+}
+
+// Pauses the chat for the bot: for the period requested by the API, or for the configured interval. Other bots of the pool take over
+void tgSendPenalty(uint8_t lane, uint8_t token, uint32_t retryAfter)
+{
+  tgRatePenalty(lane, token, retryAfter > 0 ? retryAfter : CONFIG_TELEGRAM_FORBIDDEN_INTERVAL);
+}
+
+// Counts a delivered message (or batch)
+void tgSendDone(tgMessage_t* tgMsg)
+{
+  // In direct mode several workers count at the same time without a lock
+  __atomic_add_fetch(&_tgBatchMessages, tgMsg->parts, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&_tgBatchRequests, 1, __ATOMIC_RELEASE);
+  tgStatsCount(tgMsg->options, TG_COUNTER_SENT, tgMsg->parts);
+  int64_t now = esp_timer_get_time();
+  if (now > tgMsg->deadline) {
+    tgStatsCount(tgMsg->options, TG_COUNTER_LATE, tgMsg->parts);
+  };
+  tgStatsLatency(TG_STAGE_TOTAL, now - tgMsg->queued);
+}
 
-TaskHandle_t _tgTask;
-QueueHandle_t _tgQueue = nullptr;
-#if CONFIG_TELEGRAM_OUTBOX_ENABLE
-static tgMessageItem_t _tgOutbox[CONFIG_TELEGRAM_OUTBOX_SIZE];
-#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+/**
+ * A new IP address: connections opened before it are discarded, the workers sleeping while the network 
+ * was down are woken up, and the first of them warms up a new connection
+ * */
+static void tgNetworkEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  _tgNetworkEpoch++;
+  _tgWarmup = true;
+  #if CONFIG_TELEGRAM_OUTBOX_ENABLE
+    _tgNetworkChanged = true;
+  #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+    if (_tgWorkers[i].task) {
+      xTaskNotifyGive(_tgWorkers[i].task);
+    };
+  };
+}
 
-static const char* logTAG = "TG";
-static const char* tgTaskName = "tg_send";
+#if CONFIG_TELEGRAM_WARMUP
 
-#ifndef CONFIG_TELEGRAM_TLS_PEM_STORAGE
-  #define CONFIG_TELEGRAM_TLS_PEM_STORAGE TLS_CERT_BUFFER
-#endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+// Warms up the connection once the network state module reports the network, unless a message is about to open it anyway
+void tgTaskWarmup(tgWorker_t* worker, bool pending)
+{
+  if ((worker->index == 0) && _tgWarmup && statesNetworkIsConnected()) {
+    _tgWarmup = false;
+    if (!pending && (tgRingPeek() == nullptr)) {
+      tgSendWarmup(worker);
+    };
+  };
+}
 
-#if (CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUFFER)
-  extern const char api_telegram_org_pem_start[] asm(CONFIG_TELEGRAM_TLS_PEM_START);
-  extern const char api_telegram_org_pem_end[]   asm(CONFIG_TELEGRAM_TLS_PEM_END);  
-#endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+#endif // CONFIG_TELEGRAM_WARMUP
 
-#if CONFIG_TELEGRAM_STATIC_ALLOCATION
-StaticQueue_t _tgQueueBuffer;
-StaticTask_t _tgTaskBuffer;
-StackType_t _tgTaskStack[CONFIG_TELEGRAM_STACK_SIZE];
-uint8_t _tgQueueStorage[CONFIG_TELEGRAM_QUEUE_SIZE * TELEGRAM_QUEUE_ITEM_SIZE];
-#endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
+#if CONFIG_TELEGRAM_COMMANDS_ENABLE
 
-char* tgNotifyApi(tgMessageItem_t* tgMsg)
+// The last worker long-polls for commands instead of sleeping, returns how long it may sleep afterwards
+TickType_t tgTaskUpdates(tgWorker_t* worker, TickType_t waitTicks)
 {
-  if (decMsgOptionsNotify(tgMsg->options))
-    return (char*)API_TELEGRAM_FALSE;
-  else 
-    return (char*)API_TELEGRAM_TRUE;
+  if ((worker->index != CONFIG_TELEGRAM_WORKERS - 1) || (waitTicks == 0) || !statesNetworkIsConnected()) {
+    return waitTicks;
+  };
+  int64_t wait = _tgUpdatesNext - esp_timer_get_time();
+  if (wait > 0) {
+    TickType_t waitUpdates = tgRateTicks(wait);
+    return waitUpdates < waitTicks ? waitUpdates : waitTicks;
+  };
+  tgUpdatesPoll(worker);
+  return 0;
 }
 
-esp_err_t tgSendApi(tgMessageItem_t* tgMsg)
+#endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+
+/**
+ * The worker stops on its own once tgTaskDelete() has closed the ring: it holds no lock and its message is back in 
+ * the outbox or the wheel. It reports that it has stopped and waits to be deleted, so that its stack is not reused 
+ * by tgTaskCreate() while it is still running
+ * */
+static void tgTaskExit(tgWorker_t* worker)
 {
-  rlog_i(logTAG, "Send message: %s", tgMsg->message);
+  tgConnFree(&worker->conn);
+  xSemaphoreGive(_tgStopped);
+  vTaskSuspend(nullptr);
+}
 
-  struct tm timeinfo;
-  static char buffer_timestamp[CONFIG_BUFFER_LEN_INT64_RADIX10];
-  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-    static char buffer_json[CONFIG_TELEGRAM_MESSAGE_SIZE+API_TELEGRAM_JSON_SIZE];
-  #else 
-    char * buffer_json = nullptr;
-  #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
+#if CONFIG_TELEGRAM_OUTBOX_ENABLE
 
-  // Determine chat ID
-  const char* chat_id;
-  switch (decMsgOptionsKind(tgMsg->options)) {
-    case MK_SERVICE:
-      #ifdef CONFIG_TELEGRAM_CHAT_ID_SERVICE
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_SERVICE;
-      #else
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_MAIN;
-      #endif // CONFIG_TELEGRAM_CHAT_ID_SERVICE
-      break;
+// Wakes up the other workers: new messages have appeared or a lane has been released
+void tgWorkersNotify(tgWorker_t* worker)
+{
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+    if ((&_tgWorkers[i] != worker) && (_tgWorkers[i].task)) {
+      xTaskNotifyGive(_tgWorkers[i].task);
+    };
+  };
+}
 
-    case MK_PARAMS:
-      #ifdef CONFIG_TELEGRAM_CHAT_ID_PARAMS
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_PARAMS;
+// A message that does not fit into the outbox goes to the spill buffer, if there is one, otherwise it is dropped
+void tgOutboxDiscard(tgMessage_t* tgMsg, tg_counter_t counter)
+{
+  #if CONFIG_TELEGRAM_SPILL_ENABLE
+    if ((tgMsg->callback == nullptr) && (tgMsg->live == 0)) {
+      #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+        // The spill buffer keeps plain text
+        tgMessage_t* plain = tgMessageUnpack(tgMsg);
       #else
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_MAIN;
-      #endif // CONFIG_TELEGRAM_CHAT_ID_PARAMS
-      break;
+        tgMessage_t* plain = tgMsg;
+      #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+      if (plain) {
+        tgMsg = plain;
+        if (tgSpillAppend(tgMsg)) {
+          tgStatsCount(tgMsg->options, TG_COUNTER_SPILLED, tgMsg->parts);
+          tgMessageFree(tgMsg);
+          return;
+        };
+      };
+    };
+  #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+  tgStatsCount(tgMsg->options, counter, tgMsg->parts);
+  tgMessageDone(tgMsg, ESP_ERR_NO_MEM, 0);
+}
 
-    case MK_SECURITY:
-      #ifdef CONFIG_TELEGRAM_CHAT_ID_SECURITY
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_SECURITY;
-      #else
-        chat_id = CONFIG_TELEGRAM_CHAT_ID_MAIN;
-      #endif // CONFIG_TELEGRAM_CHAT_ID_SECURITY
-      break;
+bool tgOutboxInsert(tgMessage_t* inMsg)
+{
+  rlog_d(logTAG, "New message received (outbox size: %d): %s", _tgOutbox.count, tgMessageLogText(inMsg));
 
-    default:
-      chat_id = CONFIG_TELEGRAM_CHAT_ID_MAIN;
-      break;
+  // A message that has waited too long for its retry or live slot is not worth a place in the outbox
+  if (tgMessageExpired(inMsg, esp_timer_get_time())) {
+    #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+      if (inMsg->attempts > 0) {
+        tgLogRemove(inMsg);
+      };
+    #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+    tgMessageExpire(inMsg);
+    return false;
   };
-  if (strcmp(chat_id, "") == 0) {
-    rlog_d(logTAG, "Chat ID not set, message ignored");
-    return ESP_OK;
+
+  #if CONFIG_TELEGRAM_COMPRESS_ENABLE
+    inMsg = tgMessagePack(inMsg);
+  #endif // CONFIG_TELEGRAM_COMPRESS_ENABLE
+
+  // Drop the oldest message with the lowest priority to make room for a more important one
+  if (_tgOutbox.count >= CONFIG_TELEGRAM_OUTBOX_SIZE) {
+    tgMessage_t* dropMsg = tgOutboxEvict(inMsg);
+    if (dropMsg) {
+      rlog_w(logTAG, "Message dropped from send outbox (size: %d): %s", _tgOutbox.count, tgMessageLogText(dropMsg));
+      #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+        tgLogRemove(dropMsg);
+      #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+      tgOutboxDiscard(dropMsg, TG_COUNTER_EVICTED);
+    };
+  };
+  
+  // Insert new message to outbox, the outbox takes ownership of the message
+  if (tgOutboxPush(inMsg)) {
+    rlog_d(logTAG, "Message inserted to send outbox (size: %d): %s", _tgOutbox.count, tgMessageLogText(inMsg));
+    tgStatsHigh(&_tgStatsOutboxHigh, _tgOutbox.count);
+    #if CONFIG_TELEGRAM_DEDUP_ENABLE
+      tgDedupRemember(inMsg);
+    #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+    #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+      // A retried message is still in the log
+      if (inMsg->attempts == 0) {
+        tgLogAppend(inMsg);
+      };
+    #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+    return true;
   };
+  rlog_e(logTAG, "Failed to insert message to send outbox (outbox size: %d): queue is full", _tgOutbox.count);
+  #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+    if (inMsg->attempts > 0) {
+      tgLogRemove(inMsg);
+    };
+  #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+  tgOutboxDiscard(inMsg, TG_COUNTER_DROPPED);
+  return false;
+}
 
-  // Preparing JSON to send
-  localtime_r(&tgMsg->timestamp, &timeinfo);
-  strftime(buffer_timestamp, sizeof(buffer_timestamp), CONFIG_FORMAT_DTS, &timeinfo);
-  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-    uint16_t size = format_string(buffer_json, CONFIG_TELEGRAM_MESSAGE_SIZE+API_TELEGRAM_JSON_SIZE, API_TELEGRAM_TMPL_MESSAGE, 
-      chat_id, tgNotifyApi(tgMsg), tgMsg->message, buffer_timestamp);
-    if (size == 0) {
-      rlog_e(logTAG, "Failed to create json request to Telegram API");
-      return ESP_ERR_NO_MEM;
-    };
-  #else 
-    buffer_json = malloc_stringf(API_TELEGRAM_TMPL_MESSAGE, 
-      chat_id, tgNotifyApi(tgMsg), tgMsg->message, buffer_timestamp);
-    if (buffer_json == nullptr) {
-      rlog_e(logTAG, "Failed to create json request to Telegram API");
-      return ESP_ERR_NO_MEM;
-    };
-  #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-
-  // Configuring request parameters
-  esp_err_t ret = ESP_FAIL;
-  esp_http_client_config_t cfgHttp;
-  memset(&cfgHttp, 0, sizeof(cfgHttp));
-  cfgHttp.method = HTTP_METHOD_POST;
-  cfgHttp.host = API_TELEGRAM_HOST;
-  cfgHttp.port = API_TELEGRAM_PORT;
-  cfgHttp.path = API_TELEGRAM_SEND_MESSAGE;
-  cfgHttp.timeout_ms = API_TELEGRAM_TIMEOUT_MS;
-  cfgHttp.transport_type = HTTP_TRANSPORT_OVER_SSL;
-  #if CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUFFER
-    cfgHttp.cert_pem = api_telegram_org_pem_start;
-    cfgHttp.use_global_ca_store = false;
-  #elif CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_GLOBAL
-    cfgHttp.use_global_ca_store = true;
-  #elif CONFIG_TELEGRAM_TLS_PEM_STORAGE == TLS_CERT_BUNGLE
-    cfgHttp.crt_bundle_attach = esp_crt_bundle_attach;
-    cfgHttp.use_global_ca_store = false;
-  #endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
-  cfgHttp.skip_cert_common_name_check = false;
-  cfgHttp.is_async = false;
+#if CONFIG_TELEGRAM_SPILL_ENABLE
 
-  // Make request to Telegram API
-  esp_http_client_handle_t client = esp_http_client_init(&cfgHttp);
-  if (client) {
-    esp_http_client_set_header(client, API_TELEGRAM_HEADER_CTYPE, API_TELEGRAM_HEADER_AJSON);
-    esp_http_client_set_post_field(client, buffer_json, strlen(buffer_json));
-    ret = esp_http_client_perform(client);
-    if (ret == ESP_OK) {
-      int retCode = esp_http_client_get_status_code(client);
-      if (retCode == HttpStatus_Ok) {
-        ret = ESP_OK;
-        rlog_v(logTAG, "Message sent: %s", tgMsg->message);
-      } else if (retCode == HttpStatus_Forbidden) {
-        ret = ESP_ERR_INVALID_RESPONSE;
-        rlog_w(logTAG, "Failed to send message, too many messages, please wait");
-      } else {
-        ret = ESP_ERR_INVALID_ARG;
-        rlog_e(logTAG, "Failed to send message, API error code: #%d!", retCode);
+// The upload is finished: delivered (or rejected) records are released, otherwise the chat is paused until the next attempt
+void tgSpillDone(tgSpillUpload_t* upload, esp_err_t resSend, tgResponse_t* resp)
+{
+  uint32_t bytes;
+  if ((resSend == ESP_OK) || (resSend == ESP_ERR_INVALID_ARG)) {
+    uint32_t offset = _tgSpill.head;
+    for (uint32_t done = 0; done < _tgSpill.upload_used; done += bytes) {
+      tgSpillRecord_t* rec = tgSpillRecord(offset);
+      if ((rec->length != TELEGRAM_SPILL_WRAP) && (rec->lane == upload->lane) && !rec->sent) {
+        rec->sent = 1;
+        _tgSpill.count[rec->lane]--;
       };
-      #if !defined(CONFIG_TELEGRAM_SYSLED_ACTIVITY) || CONFIG_TELEGRAM_SYSLED_ACTIVITY
-        // Flashing system LED
-        ledSysActivity();
-      #endif // CONFIG_TELEGRAM_SYSLED_ACTIVITY
-    } else {
-      rlog_e(logTAG, "Failed to complete request to Telegram API, error code: 0x%x!", ret);
+      offset = tgSpillNextOffset(offset, &bytes);
+    };
+    _tgSpill.upload_used = 0;
+    while ((_tgSpill.used > 0) && ((tgSpillRecord(_tgSpill.head)->length == TELEGRAM_SPILL_WRAP) || tgSpillRecord(_tgSpill.head)->sent)) {
+      tgSpillRemoveOldest();
     };
-    esp_http_client_cleanup(client);
+    tgStatsCount(upload->options, resSend == ESP_OK ? TG_COUNTER_SENT : TG_COUNTER_DROPPED, upload->parts);
+    _tgSpill.attempts = 0;
+  } else if (resSend == ESP_ERR_NOT_FOUND) {
+    // The chat has moved, the records are uploaded to the new one right away
+    _tgSpill.upload_used = 0;
   } else {
-    ret = ESP_ERR_INVALID_STATE;
-    rlog_e(logTAG, "Failed to complete request to Telegram API!");
+    _tgSpill.upload_used = 0;
+    tgRetryClass_t retryClass = tgRetryClass(resSend, resp);
+    if (retryClass == TG_RETRY_LIMIT) {
+      tgSendPenalty(upload->lane, upload->token, resp->retry_after);
+    } else if (retryClass != TG_RETRY_NETWORK) {
+      if (_tgSpill.attempts < UINT8_MAX) {
+        _tgSpill.attempts++;
+      };
+      tgRatePenalty(upload->lane, upload->token, (uint32_t)(tgRetryDelay(retryClass, _tgSpill.attempts) / 1000));
+    };
   };
+}
 
-  // Free buffer
-  #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-    if (buffer_json != nullptr) free(buffer_json);
-  #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
+#endif // CONFIG_TELEGRAM_SPILL_ENABLE
 
-  return ret;
+// Takes a failed message out of the outbox until its retry time, so that the following messages are not blocked
+void tgOutboxDefer(uint8_t lane, uint8_t level, uint8_t token, tgMessage_t* tgMsg, esp_err_t resSend, tgResponse_t* resp)
+{
+  tgRetryClass_t retryClass = tgRetryClass(resSend, resp);
+  if (retryClass == TG_RETRY_LIMIT) {
+    tgSendPenalty(lane, token, resp->retry_after);
+  } else if (retryClass != TG_RETRY_NETWORK) {
+    // The message stays in the log
+    tgOutboxPop(lane, level);
+    #if CONFIG_TELEGRAM_LIVE_ENABLE
+      if (tgMsg->live) {
+        _tgLive[tgMsg->live - 1].queued = tgMsg;
+      };
+    #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+    if (tgMsg->attempts < UINT8_MAX) {
+      tgMsg->attempts++;
+    };
+    int64_t delay = tgRetryDelay(retryClass, tgMsg->attempts);
+    rlog_w(logTAG, "Message will be sent again in %d ms (attempt %d)", (int)(delay / 1000), tgMsg->attempts + 1);
+    tgWheelAdd(tgMsg, delay);
+  };
 }
 
-bool tgSendMsg(msg_options_t msgOptions, const char* msgTitle, const char* msgText, ...)
+// Returns messages whose retry time has come to the outbox
+void tgOutboxRetry()
 {
-  if (_tgQueue) {
-    tgMessage_t* tgMsg = (tgMessage_t*)psram_calloc(1, sizeof(tgMessage_t));
-    if (tgMsg) {
-      tgMsg->options = msgOptions;
-      tgMsg->timestamp = time(nullptr);
-      tgMsg->message = nullptr;
-
-      // Allocate memory for the message text and format it
-      va_list args;
-      va_start(args, msgText);
-      uint16_t len = vsnprintf(nullptr, 0, msgText, args);
-      tgMsg->message = (char*)psram_calloc(1, len+1);
-      if (tgMsg->message) {
-        vsnprintf(tgMsg->message, len+1, msgText, args);
-      } else {
-        rlog_e(logTAG, "Failed to allocate memory for message text");
-        va_end(args);
-        goto error;
+  tgMessage_t* tgMsg;
+  int64_t now = esp_timer_get_time();
+  while ((tgMsg = tgWheelNext(now)) != nullptr) {
+    #if CONFIG_TELEGRAM_LIVE_ENABLE
+      if (tgMsg->live) {
+        tgLive_t* slot = &_tgLive[tgMsg->live - 1];
+        slot->queued = nullptr;
+        if (slot->held) {
+          // A newer update is waiting, this one is no longer needed
+          #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+            tgLogRemove(tgMsg);
+          #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+          tgStatsCount(tgMsg->options, TG_COUNTER_SUPERSEDED);
+          tgMessageDone(tgMsg, ESP_ERR_INVALID_STATE, 0);
+          continue;
+        };
+        if (tgOutboxInsert(tgMsg)) {
+          slot->queued = tgMsg;
+        };
+        continue;
       };
-      va_end(args);
+    #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+    tgOutboxInsert(tgMsg);
+  };
+}
 
-      // Add title if available
-      #if CONFIG_TELEGRAM_TITLE_ENABLED
-      if (msgTitle) {
-        char * temp_message = tgMsg->message;
-        tgMsg->message = malloc_stringf(API_TELEGRAM_TMPL_TITLE, msgTitle, temp_message);
-        if (tgMsg->message == nullptr) {
-          rlog_e(logTAG, "Failed to allocate memory for message text");
-          goto error;
+#if CONFIG_TELEGRAM_LIVE_ENABLE
+
+// Moves held live updates whose time has come to the outbox, returns the time until the next one (-1 - none), us
+int64_t tgLivePromote()
+{
+  int64_t now = esp_timer_get_time();
+  int64_t wait = -1;
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_LIVE_SLOTS; i++) {
+    tgLive_t* slot = &_tgLive[i];
+    tgMessage_t* tgMsg = slot->held;
+    if ((tgMsg) && (slot->queued == nullptr)) {
+      if ((slot->message_id != 0) && (slot->due > now)) {
+        if ((wait < 0) || (slot->due - now < wait)) {
+          wait = slot->due - now;
+        };
+      } else {
+        slot->held = nullptr;
+        if ((slot->message_id != 0) && (slot->sent_hash == tgMessageHash(tgMsg->options, tgMsg->message))) {
+          // The chat already shows this text
+          tgStatsCount(tgMsg->options, TG_COUNTER_SUPERSEDED);
+          tgMessageDone(tgMsg, ESP_OK, slot->message_id);
+        } else if (tgOutboxInsert(tgMsg)) {
+          slot->queued = tgMsg;
         };
-        free(temp_message);
       };
-      #endif // CONFIG_TELEGRAM_TITLE_ENABLED
+    };
+  };
+  return wait;
+}
 
-      // Put a message to the task queue
-      if (xQueueSend(_tgQueue, &tgMsg, pdMS_TO_TICKS(CONFIG_TELEGRAM_QUEUE_WAIT)) == pdPASS) {
-        return true;
-      } else {
-        rloga_e("Failed to adding message to queue [ %s ]!", tgTaskName);
-        eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_ERR_NO_MEM);
-        goto error;
+#endif // CONFIG_TELEGRAM_LIVE_ENABLE
+
+// Moves messages from the ring to the outbox (only the first worker calls it), returns true if there were any
+bool tgIntakeDrain(tgWorker_t* worker, TickType_t waitTicks)
+{
+  bool received = false;
+  for (uint16_t i = 0; i < CONFIG_TELEGRAM_QUEUE_SIZE; i++) {
+    tgMessage_t* inMsg = tgRingWait(received ? 0 : waitTicks);
+    if (inMsg == nullptr) break;
+    tgRingAdvance();
+    received = true;
+    #if CONFIG_TELEGRAM_LIVE_ENABLE
+      if (inMsg->live) {
+        xSemaphoreTake(_tgLock, portMAX_DELAY);
+        tgLiveUpdate(inMsg);
+        xSemaphoreGive(_tgLock);
+        continue;
+      };
+    #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+    #if CONFIG_TELEGRAM_DEDUP_ENABLE
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      bool absorbed = tgDedupAbsorb(inMsg);
+      xSemaphoreGive(_tgLock);
+      if (absorbed) {
+        tgMessageFree(inMsg);
+        continue;
+      };
+    #endif // CONFIG_TELEGRAM_DEDUP_ENABLE
+    inMsg = tgBatchCollect(inMsg);
+    xSemaphoreTake(_tgLock, portMAX_DELAY);
+    tgOutboxInsert(inMsg);
+    xSemaphoreGive(_tgLock);
+  };
+  if (received) {
+    tgWorkersNotify(worker);
+  };
+  return received;
+}
+
+// Drops the messages whose time to live has passed, returns the time until the next one expires (-1 - none), us
+int64_t tgOutboxExpire(int64_t now)
+{
+  int64_t wait = -1;
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+      tgOutboxList_t* list = &_tgOutbox.lists[lane][level];
+      // The head of a busy lane may be in flight right now, it cannot be dropped
+      uint16_t prev = _tgLaneBusy[lane] ? list->head : TELEGRAM_OUTBOX_NONE;
+      uint16_t index = prev == TELEGRAM_OUTBOX_NONE ? list->head : _tgOutbox.items[prev].next;
+      while (index != TELEGRAM_OUTBOX_NONE) {
+        uint16_t next = _tgOutbox.items[index].next;
+        tgMessage_t* tgMsg = _tgOutbox.items[index].message;
+        if (tgMessageExpired(tgMsg, now)) {
+          tgOutboxUnlink(list, prev, index);
+          #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+            tgLogRemove(tgMsg);
+          #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+          tgMessageExpire(tgMsg);
+        } else {
+          if ((tgMsg->expires != 0) && ((wait < 0) || (tgMsg->expires - now < wait))) {
+            wait = tgMsg->expires - now;
+          };
+          prev = index;
+        };
+        index = next;
       };
-    } else {
-      rlog_e(logTAG, "Failed to allocate memory for message");
     };
-  error:
-    // Deallocate resources from heap
-    if (tgMsg) {
-      if (tgMsg->message) free(tgMsg->message);
-      free(tgMsg);
+  };
+  return wait;
+}
+
+/**
+ * Calculate the timeout for an incoming message: until the rate limiter allows the next message to be sent, 
+ * a retry is due, a held live update may be sent or a queued message expires. Nothing is polled while the network is down
+ * */
+TickType_t tgOutboxWait()
+{
+  uint8_t lane, level;
+  int64_t wait;
+  tgOutboxRetry();
+  int64_t waitExpire = tgOutboxExpire(esp_timer_get_time());
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    int64_t waitLive = tgLivePromote();
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  bool ready = tgOutboxNext(&lane, &level, &wait);
+  if (!statesNetworkIsConnected()) {
+    // Sleep until an IP address is obtained, then until the network state module catches up with the event
+    return _tgNetworkChanged ? pdMS_TO_TICKS(CONFIG_TELEGRAM_INTERNET_INTERVAL) : portMAX_DELAY;
+  };
+  _tgNetworkChanged = false;
+  if (ready) {
+    return 0;
+  };
+  #if CONFIG_TELEGRAM_SPILL_ENABLE
+    int64_t waitSpill;
+    if (tgSpillNext(&lane, &waitSpill)) {
+      return 0;
+    };
+    if ((waitSpill >= 0) && ((wait < 0) || (waitSpill < wait))) {
+      wait = waitSpill;
     };
+  #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+  int64_t waitRetry = tgWheelWait(esp_timer_get_time());
+  if ((waitRetry >= 0) && ((wait < 0) || (waitRetry < wait))) {
+    wait = waitRetry;
   };
-  return false;
+  #if CONFIG_TELEGRAM_LIVE_ENABLE
+    if ((waitLive >= 0) && ((wait < 0) || (waitLive < wait))) {
+      wait = waitLive;
+    };
+  #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+  if ((waitExpire >= 0) && ((wait < 0) || (waitExpire < wait))) {
+    wait = waitExpire;
+  };
+  return wait < 0 ? portMAX_DELAY : tgRateTicks(wait);
 }
 
-// -----------------------------------------------------------------------------------------------------------------------
-// ---------------------------------------------------- Task routines ----------------------------------------------------
-// -----------------------------------------------------------------------------------------------------------------------
+static bool tgSendPoll(tgWorker_t* worker, tgMessage_t* tgMsg, int64_t elapsed)
+{
+  if (!_tgRing.ready || !statesNetworkIsConnected()) {
+    return false;
+  };
+  // Keep accepting messages while the request is in flight
+  if (worker->index == 0) {
+    tgIntakeDrain(worker, 0);
+  };
+  // With a single worker, an idle long poll gives way to any message that may be sent
+  #if CONFIG_TELEGRAM_COMMANDS_ENABLE && (CONFIG_TELEGRAM_WORKERS == 1)
+    if (worker->updates) {
+      uint8_t lane, level;
+      int64_t wait;
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      bool ready = tgOutboxNext(&lane, &level, &wait);
+      #if CONFIG_TELEGRAM_SPILL_ENABLE
+        ready = ready || tgSpillNext(&lane, &wait);
+      #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+      xSemaphoreGive(_tgLock);
+      return !ready;
+    };
+  #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+  // With a single worker, a stalled request gives way to a more important message waiting in another chat
+  #if CONFIG_TELEGRAM_WORKERS == 1
+    if (elapsed >= (int64_t)CONFIG_TELEGRAM_STALL_TIMEOUT * 1000) {
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      // A document of delayed messages (no message) gives way to anything
+      bool urgent = tgOutboxUrgent(tgMsg ? tgOutboxLevel(tgMsg) : 0);
+      xSemaphoreGive(_tgLock);
+      if (urgent) {
+        rlog_w(logTAG, "Request to Telegram API is stalled, a more important message is waiting");
+        return false;
+      };
+    };
+  #endif // CONFIG_TELEGRAM_WORKERS
+  return true;
+}
 
 void tgTaskExec(void *pvParameters)
 {
-  tgMessage_t *inMsg;
-  esp_err_t resLast = ESP_OK;
+  tgWorker_t* worker = (tgWorker_t*)pvParameters;
+  uint8_t lane, level;
+  int64_t wait;
+  tgResponse_t resp;
+  #if CONFIG_TELEGRAM_SPILL_ENABLE
+    tgSpillUpload_t upload;
+  #endif // CONFIG_TELEGRAM_SPILL_ENABLE
 
-  // Init outgoing message queue
-  #if CONFIG_TELEGRAM_OUTBOX_ENABLE
-    static uint8_t _tgOutboxSize = 0;
-    TickType_t waitIncoming = portMAX_DELAY;
+  while (_tgRing.ready) {
+    #if CONFIG_TELEGRAM_WARMUP
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      bool pending = _tgOutbox.count > 0;
+      xSemaphoreGive(_tgLock);
+      tgTaskWarmup(worker, pending);
+    #endif // CONFIG_TELEGRAM_WARMUP
+    xSemaphoreTake(_tgLock, portMAX_DELAY);
+    TickType_t waitIncoming = tgConnIdleWait(&worker->conn, tgOutboxWait());
+    xSemaphoreGive(_tgLock);
+    #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+      waitIncoming = tgTaskUpdates(worker, waitIncoming);
+    #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+    #if CONFIG_TELEGRAM_STATS_INTERVAL > 0
+      if (worker->index == 0) {
+        waitIncoming = tgStatsWait(waitIncoming);
+      };
+    #endif // CONFIG_TELEGRAM_STATS_INTERVAL
 
-    rlog_d(logTAG, "Initialize telegram outbox...");
-    memset(_tgOutbox, 0, sizeof(tgMessageItem_t) * CONFIG_TELEGRAM_OUTBOX_SIZE);
-  #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+    // The first worker is the only consumer of the ring, the rest are waiting for a notification
+    bool received = false;
+    if (worker->index == 0) {
+      received = tgIntakeDrain(worker, waitIncoming);
+      #if CONFIG_TELEGRAM_STATS_INTERVAL > 0
+        tgStatsPublish();
+      #endif // CONFIG_TELEGRAM_STATS_INTERVAL
+    } else {
+      received = ulTaskNotifyTake(pdTRUE, waitIncoming) > 0;
+    };
+    if (!received) {
+      tgConnCheckIdle(&worker->conn);
+      #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+        xSemaphoreTake(_tgLock, portMAX_DELAY);
+        tgLogIdle();
+        xSemaphoreGive(_tgLock);
+      #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+    };
 
-  while (true) {
-    // Outbox mode
-    #if CONFIG_TELEGRAM_OUTBOX_ENABLE
-      // Calculate the timeout for an incoming message
-      if (_tgOutboxSize > 0) {
-        if (statesNetworkIsConnected()) {
-          // If the API denied service last time, you'll have to wait longer
-          if (resLast == ESP_ERR_INVALID_RESPONSE) {
-            waitIncoming = pdMS_TO_TICKS(CONFIG_TELEGRAM_FORBIDDEN_INTERVAL);
-          } else {
-            waitIncoming = pdMS_TO_TICKS(CONFIG_TELEGRAM_SEND_INTERVAL);
-          };
-        } else {
-          waitIncoming = pdMS_TO_TICKS(CONFIG_TELEGRAM_INTERNET_INTERVAL);
-        };
-      } else {
-        waitIncoming = portMAX_DELAY;
-      };
-
-      // Waiting for an incoming message
-      if (xQueueReceive(_tgQueue, &inMsg, waitIncoming) == pdPASS) {
-        rlog_d(logTAG, "New message received (outbox size: %d): %s", _tgOutboxSize, inMsg->message);
-
-        // Search for a lower priority message that could be deleted
-        if (_tgOutboxSize >= CONFIG_TELEGRAM_OUTBOX_SIZE) {
-          msg_priority_t inPriority = decMsgOptionsPriority(inMsg->options);
-          for (uint8_t i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
-            if (decMsgOptionsPriority(_tgOutbox[i].options) < inPriority) {
-              rlog_w(logTAG, "Message dropped from send outbox (size: %d, index: %d): %s", _tgOutboxSize, i, _tgOutbox[i].message);
-              #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-                if (_tgOutbox[i].message) free(_tgOutbox[i].message);
-                _tgOutbox[i].message = nullptr;
-              #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-              _tgOutbox[i].queued = false;
-              _tgOutboxSize--;
-              break;
-            };
-          };
-        };
-        
-        // Insert new message to outbox
-        if (_tgOutboxSize < CONFIG_TELEGRAM_OUTBOX_SIZE) {
-          for (uint8_t i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
-            if (!_tgOutbox[i].queued) {
-              #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-                memset(_tgOutbox[i].message, 0, CONFIG_TELEGRAM_MESSAGE_SIZE);
-                strncpy(_tgOutbox[i].message, inMsg->message, CONFIG_TELEGRAM_MESSAGE_SIZE-1);
-              #else
-                _tgOutbox[i].message = inMsg->message;
-                inMsg->message = nullptr;
-              #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-              _tgOutbox[i].queued = true;
-              _tgOutbox[i].options = inMsg->options;
-              _tgOutbox[i].timestamp = inMsg->timestamp;
-              _tgOutboxSize++;
-              rlog_d(logTAG, "Message inserted to send outbox (size: %d, index: %d): %s", _tgOutboxSize, i, _tgOutbox[i].message);
-              break;
-            };
-          };
-        } else {
-          rlog_e(logTAG, "Failed to insert message to send outbox (outbox size: %d): queue is full", _tgOutboxSize);
-        };
-        
-        // Delete the resources used for the message
-        if (inMsg->message) free(inMsg->message);
-        free(inMsg);
-        inMsg = nullptr;
-      };
-
-      // Search for the first message in the outbox
-      if (statesNetworkIsConnected()) {
-        _tgOutboxSize = 0;
-        uint8_t first_msg = 0xFF;
-        time_t first_time = 0;
-        for (uint8_t i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
-          if (_tgOutbox[i].queued) {
-            if ((first_time == 0) || (_tgOutbox[i].timestamp < first_time)) {
-              first_msg = i;
-              first_time = _tgOutbox[i].timestamp;
-            };
-            _tgOutboxSize++;
-          };
+    // Take the oldest message from a lane that no other worker is busy with
+    if (_tgRing.ready && statesNetworkIsConnected()) {
+      tgMessage_t* sendMsg = nullptr;
+      #if CONFIG_TELEGRAM_SPILL_ENABLE
+        bool sendSpill = false;
+      #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+      xSemaphoreTake(_tgLock, portMAX_DELAY);
+      if (tgOutboxNext(&lane, &level, &wait)) {
+        sendMsg = tgOutboxHead(lane, level);
+        _tgLaneBusy[lane] = true;
+        worker->token = tgRateConsume(lane, tgMessageToken(sendMsg));
+      #if CONFIG_TELEGRAM_SPILL_ENABLE
+      } else if (tgSpillNext(&lane, &wait)) {
+        tgSpillBegin(lane, &upload);
+        sendSpill = true;
+        _tgLaneBusy[lane] = true;
+        upload.token = tgRateConsume(lane);
+      #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+      };
+      xSemaphoreGive(_tgLock);
+
+      #if CONFIG_TELEGRAM_SPILL_ENABLE
+        if (sendSpill) {
+          // The frozen records are read outside the lock, new records are only appended after them
+          esp_err_t resSend = tgSendSpill(worker, &upload, &resp);
+          xSemaphoreTake(_tgLock, portMAX_DELAY);
+          _tgLaneBusy[lane] = false;
+          tgSendResult(resSend);
+          tgSpillDone(&upload, resSend, &resp);
+          xSemaphoreGive(_tgLock);
+          tgWorkersNotify(worker);
         };
-        
-        // If the queue is not empty, send the first found message
-        if ((_tgOutboxSize > 0) && (first_msg < CONFIG_TELEGRAM_OUTBOX_SIZE)) {
-          esp_err_t resSend = tgSendApi(&_tgOutbox[first_msg]);
-          // If the send status has changed, send an event to the event loop
-          if (resSend != resLast) {
-            resLast = resSend;
-            eventLoopPostError(RE_SYS_TELEGRAM_ERROR, resLast);
-          };
-          // If the message is sent (ESP_OK) or too long (ESP_ERR_NO_MEM) or an API error (ESP_ERR_INVALID_ARG - bad message?), then remove it from the queue
-          if ((resSend == ESP_OK) || (resSend == ESP_ERR_NO_MEM) || (resSend == ESP_ERR_INVALID_ARG)) {
-            #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-              if (_tgOutbox[first_msg].message) free(_tgOutbox[first_msg].message);
-              _tgOutbox[first_msg].message = nullptr;
-            #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-            _tgOutbox[first_msg].queued = false;
-            _tgOutboxSize--;
-            rlog_d(logTAG, "Message #%d removed from queue, outbox size: %d", first_msg, _tgOutboxSize);
+      #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+
+      if (sendMsg) {
+        esp_err_t resSend = tgSendApi(worker, sendMsg, &resp);
+
+        // The message is still at the head of its list: the lane was busy, so no one else could touch it
+        xSemaphoreTake(_tgLock, portMAX_DELAY);
+        _tgLaneBusy[lane] = false;
+        tgSendResult(resSend);
+        // If the message is sent (ESP_OK) or too long (ESP_ERR_NO_MEM) or an API error (ESP_ERR_INVALID_ARG - bad message?), then remove it from the queue
+        if ((resSend == ESP_OK) || (resSend == ESP_ERR_NO_MEM) || (resSend == ESP_ERR_INVALID_ARG)) {
+          tgOutboxPop(lane, level);
+          #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+            tgLogRemove(sendMsg);
+          #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+          if (resSend == ESP_OK) {
+            tgSendDone(sendMsg);
+            #if CONFIG_TELEGRAM_LIVE_ENABLE
+              if (sendMsg->live) {
+                tgLiveSent(sendMsg, resp.message_id, worker->token);
+              };
+            #endif // CONFIG_TELEGRAM_LIVE_ENABLE
+          } else {
+            tgStatsCount(sendMsg->options, TG_COUNTER_DROPPED, sendMsg->parts);
           };
+          tgMessageDone(sendMsg, resSend, resp.message_id);
+          rlog_d(logTAG, "Message removed from queue, outbox size: %d", _tgOutbox.count);
+        } else if (resSend != ESP_ERR_NOT_FOUND) {
+          tgStatsCount(sendMsg->options, TG_COUNTER_RETRIED);
+          tgOutboxDefer(lane, level, worker->token, sendMsg, resSend, &resp);
         };
+        xSemaphoreGive(_tgLock);
+        tgWorkersNotify(worker);
       };
-    #else
-      // Direct send
-      if (xQueueReceive(_tgQueue, &inMsg, portMAX_DELAY) == pdPASS) {
+    };
+  };
+
+  // A cancelled message has been deferred in the outbox like any failed one
+  tgTaskExit(worker);
+}
+
+#else
+
+static bool tgSendPoll(tgWorker_t* worker, tgMessage_t* tgMsg, int64_t elapsed)
+{
+  #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+    // An idle long poll gives way to a new message or a retry that is due
+    if ((worker->updates) && ((tgRingPeek() != nullptr) || (tgWheelWait(esp_timer_get_time()) == 0))) {
+      return false;
+    };
+  #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+  return _tgRing.ready && statesNetworkIsConnected();
+}
+
+void tgTaskExec(void *pvParameters)
+{
+  tgWorker_t* worker = (tgWorker_t*)pvParameters;
+  tgMessage_t *inMsg;
+  tgResponse_t resp;
+
+  while (_tgRing.ready) {
+    // A message whose retry time has come goes first, otherwise wait for a new one until the next retry is due. 
+    // Without the internet the waiting messages stay in the wheel, they are checked again at intervals or as 
+    // soon as the network event wakes the task up
+    bool online = statesInetIsAvailable();
+    inMsg = online ? tgWheelNext(esp_timer_get_time()) : nullptr;
+    #if CONFIG_TELEGRAM_WARMUP
+      tgTaskWarmup(worker, inMsg != nullptr);
+    #endif // CONFIG_TELEGRAM_WARMUP
+    if (inMsg == nullptr) {
+      int64_t waitRetry = tgWheelWait(esp_timer_get_time());
+      if ((waitRetry >= 0) && !online) {
+        waitRetry = (int64_t)CONFIG_TELEGRAM_INTERNET_INTERVAL * 1000;
+      };
+      TickType_t waitIncoming = tgConnIdleWait(&worker->conn, waitRetry < 0 ? portMAX_DELAY : tgRateTicks(waitRetry));
+      #if CONFIG_TELEGRAM_WARMUP
+        // Until the network state module catches up with the event
+        if (_tgWarmup && (waitIncoming > pdMS_TO_TICKS(CONFIG_TELEGRAM_INTERNET_INTERVAL))) {
+          waitIncoming = pdMS_TO_TICKS(CONFIG_TELEGRAM_INTERNET_INTERVAL);
+        };
+      #endif // CONFIG_TELEGRAM_WARMUP
+      #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+        waitIncoming = tgTaskUpdates(worker, waitIncoming);
+      #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+      #if CONFIG_TELEGRAM_STATS_INTERVAL > 0
+        inMsg = tgRingWait(tgStatsWait(waitIncoming));
+        tgStatsPublish();
+      #else
+        inMsg = tgRingWait(waitIncoming);
+      #endif // CONFIG_TELEGRAM_STATS_INTERVAL
+      if (inMsg) {
+        tgRingAdvance();
+        inMsg = tgBatchCollect(inMsg);
         rlog_v(logTAG, "New message received: %s", inMsg->message);
+      };
+    };
 
-        tgMessageItem_t tgMsg;
-        memset(&tgMsg, 0, sizeof(tgMessageItem_t));
-        #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-          memset(tgMsg.message, 0, CONFIG_TELEGRAM_MESSAGE_SIZE);
-          strncpy(tgMsg.message, inMsg->message, CONFIG_TELEGRAM_MESSAGE_SIZE-1);
-          if (inMsg->message) free(inMsg->message);
-        #else
-          tgMsg.message = inMsg->message;
-        #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-        tgMsg.options = inMsg->options;
-        tgMsg.timestamp = inMsg->timestamp;
-        free(inMsg);
-        inMsg = nullptr;
-        
-        // Trying to send a message to the Telegram API
-        uint16_t trySend = 0;
-        // Waiting for internet access
-        while (statesInetWait(portMAX_DELAY)) {
-          trySend++;
-          esp_err_t resSend = tgSendApi(&tgMsg);
-          // If the send status has changed, send an event to the event loop
-          if (resSend != resLast) {
-            resLast = resSend;
-            eventLoopPostError(RE_SYS_TELEGRAM_ERROR, resLast);
-          };
-          // If the message is sent (ESP_OK) or too long (ESP_ERR_NO_MEM) or an API error (ESP_ERR_INVALID_ARG - bad message?), then remove it from the heap
-          if (resSend == ESP_OK) {
-            #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-              if (tgMsg.message) free(tgMsg.message);
-              tgMsg.message = nullptr;
-            #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-            break;
-          } else {
-            if (trySend <= CONFIG_TELEGRAM_MAX_ATTEMPTS) {
-              if (resLast == ESP_ERR_INVALID_RESPONSE) {
-                vTaskDelay(pdMS_TO_TICKS(CONFIG_TELEGRAM_FORBIDDEN_INTERVAL));
-              } else {
-                vTaskDelay(pdMS_TO_TICKS(CONFIG_TELEGRAM_SEND_INTERVAL));
-              };
-            } else {
-              rlog_e(logTAG, "Failed to send message %s", tgMsg.message);
-              #if !CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
-                if (tgMsg.message) free(tgMsg.message);
-                tgMsg.message = nullptr;
-              #endif // CONFIG_TELEGRAM_MESSAGE_SIZE
-              break;
-            };
-          };
+    // The task is being deleted: the message is kept in the wheel for the next tgTaskCreate()
+    if (!_tgRing.ready) {
+      if (inMsg) {
+        tgWheelAdd(inMsg, 0);
+      };
+      break;
+    };
+
+    if ((inMsg) && tgMessageExpired(inMsg, esp_timer_get_time())) {
+      tgMessageExpire(inMsg);
+      inMsg = nullptr;
+    };
+
+    if (inMsg) {
+      // The message waits in the wheel for the internet or for the rate limiter of its chat (also after a 429), 
+      // so that messages to other chats and due retries are not held up behind it
+      uint8_t lane = tgLane(inMsg->options);
+      int64_t waitRate = tgRateWait(lane);
+      if (!statesInetIsAvailable() || (waitRate > 0)) {
+        tgWheelAdd(inMsg, waitRate);
+        continue;
+      };
+      // Trying to send a message to the Telegram API
+      worker->token = tgRateConsume(lane);
+      esp_err_t resSend = tgSendApi(worker, inMsg, &resp);
+      tgSendResult(resSend);
+      // If the message is sent, then remove it from the heap, otherwise schedule the next attempt
+      tgRetryClass_t retryClass = tgRetryClass(resSend, &resp);
+      if (resSend == ESP_OK) {
+        tgSendDone(inMsg);
+        tgMessageDone(inMsg, resSend, resp.message_id);
+      } else if ((resSend == ESP_ERR_NOT_FOUND) || (retryClass == TG_RETRY_NETWORK)) {
+        // Redirected to the new chat or the network is down: the attempt is not counted
+        tgWheelAdd(inMsg, 0);
+      } else if (++inMsg->attempts <= CONFIG_TELEGRAM_MAX_ATTEMPTS) {
+        tgStatsCount(inMsg->options, TG_COUNTER_RETRIED);
+        if (retryClass == TG_RETRY_LIMIT) {
+          tgSendPenalty(lane, worker->token, resp.retry_after);
+          tgWheelAdd(inMsg, 0);
+        } else {
+          tgWheelAdd(inMsg, tgRetryDelay(retryClass, inMsg->attempts));
         };
+      } else {
+        rlog_e(logTAG, "Failed to send message %s", inMsg->message);
+        tgStatsCount(inMsg->options, TG_COUNTER_DROPPED, inMsg->parts);
+        tgMessageDone(inMsg, resSend, resp.message_id);
       };
-    #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+      inMsg = nullptr;
+    } else {
+      tgConnCheckIdle(&worker->conn);
+    };
   };
 
-  // Delete task
-  tgTaskDelete();
+  tgTaskExit(worker);
 }
 
+#endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+
 bool tgTaskCreate() 
 {
-  if (!_tgTask) {
-    if (!_tgQueue) {
+  if (!_tgWorkers[0].task) {
+    if (!tgSlabInit()) {
+      rloga_e("Failed to allocate memory for Telegram messages!");
+      eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_ERR_NO_MEM);
+      return false;
+    };
+    tgLanesInit();
+    tgRateInit();
+    #if TELEGRAM_TLS_TRUST_CACHE
+      tgTrustInit();
+    #endif // TELEGRAM_TLS_TRUST_CACHE
+
+    // Init outgoing message queue
+    #if CONFIG_TELEGRAM_OUTBOX_ENABLE
+      if (!_tgOutbox.ready) {
+        rlog_d(logTAG, "Initialize telegram outbox...");
+        tgOutboxInit();
+        #if CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+          tgLogRecover();
+        #endif // CONFIG_TELEGRAM_OUTBOX_PERSISTENT
+      };
+      #if CONFIG_TELEGRAM_SPILL_ENABLE
+        if (!tgSpillInit()) {
+          rloga_w("Failed to allocate the spill buffer, messages that do not fit into the outbox will be dropped");
+        };
+      #endif // CONFIG_TELEGRAM_SPILL_ENABLE
+
+      if (!_tgLock) {
+        #if CONFIG_TELEGRAM_STATIC_ALLOCATION
+        _tgLock = xSemaphoreCreateMutexStatic(&_tgLockBuffer);
+        #else
+        _tgLock = xSemaphoreCreateMutex();
+        #endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
+        if (!_tgLock) {
+          rloga_e("Failed to create mutex for sending notifications to Telegram!");
+          eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_FAIL);
+          return false;
+        };
+      };
+    #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+
+    if (!_tgStopped) {
       #if CONFIG_TELEGRAM_STATIC_ALLOCATION
-      _tgQueue = xQueueCreateStatic(CONFIG_TELEGRAM_QUEUE_SIZE, TELEGRAM_QUEUE_ITEM_SIZE, &(_tgQueueStorage[0]), &_tgQueueBuffer);
+      _tgStopped = xSemaphoreCreateCountingStatic(CONFIG_TELEGRAM_WORKERS, 0, &_tgStoppedBuffer);
       #else
-      _tgQueue = xQueueCreate(CONFIG_TELEGRAM_QUEUE_SIZE, TELEGRAM_QUEUE_ITEM_SIZE);
+      _tgStopped = xSemaphoreCreateCounting(CONFIG_TELEGRAM_WORKERS, 0);
       #endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
-      if (!_tgQueue) {
-        rloga_e("Failed to create a queue for sending notifications to Telegram!");
+      if (!_tgStopped) {
+        rloga_e("Failed to create semaphore for sending notifications to Telegram!");
         eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_FAIL);
         return false;
       };
     };
+
+    if (!_tgRing.ready) {
+      tgRingInit();
+      eventHandlerRegister(IP_EVENT, IP_EVENT_STA_GOT_IP, &tgNetworkEventHandler, nullptr);
+      eventHandlerRegister(IP_EVENT, IP_EVENT_ETH_GOT_IP, &tgNetworkEventHandler, nullptr);
+      #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+        eventHandlerRegister(RE_TELEGRAM_EVENTS, RE_TELEGRAM_COMMAND, &tgCommandEventHandler, nullptr);
+      #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+    };
+    // The workers run while the ring is open
+    _tgRing.ready = true;
     
-    #if CONFIG_TELEGRAM_STATIC_ALLOCATION
-    _tgTask = xTaskCreateStaticPinnedToCore(tgTaskExec, tgTaskName, CONFIG_TELEGRAM_STACK_SIZE, nullptr, CONFIG_TASK_PRIORITY_TELEGRAM, _tgTaskStack, &_tgTaskBuffer, CONFIG_TASK_CORE_TELEGRAM); 
-    #else
-    xTaskCreatePinnedToCore(tgTaskExec, tgTaskName, CONFIG_TELEGRAM_STACK_SIZE, nullptr, CONFIG_TASK_PRIORITY_TELEGRAM, &_tgTask, CONFIG_TASK_CORE_TELEGRAM); 
-    #endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
-    if (!_tgTask) {
-      vQueueDelete(_tgQueue);
-      rloga_e("Failed to create task for sending notifications to Telegram!");
-      eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_FAIL);
-      return false;
-    }
-    else {
-      rloga_i("Task [ %s ] has been successfully started", tgTaskName);
-      eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_OK);
-      return true;
+    // The first worker runs on the configured core, additional workers can run on any core
+    for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+      char workerName[16];
+      snprintf(workerName, sizeof(workerName), i == 0 ? "%s" : "%s%d", tgTaskName, i);
+      BaseType_t workerCore = i == 0 ? CONFIG_TASK_CORE_TELEGRAM : CONFIG_TELEGRAM_WORKERS_CORE;
+      _tgWorkers[i].index = i;
+      _tgWorkers[i].token = 0;
+      #if CONFIG_TELEGRAM_COMMANDS_ENABLE
+        _tgWorkers[i].updates = false;
+      #endif // CONFIG_TELEGRAM_COMMANDS_ENABLE
+      #if CONFIG_TELEGRAM_STATIC_ALLOCATION
+      _tgWorkers[i].task = xTaskCreateStaticPinnedToCore(tgTaskExec, workerName, CONFIG_TELEGRAM_STACK_SIZE, &_tgWorkers[i], CONFIG_TASK_PRIORITY_TELEGRAM, _tgTaskStack[i], &_tgTaskBuffer[i], workerCore); 
+      #else
+      xTaskCreatePinnedToCore(tgTaskExec, workerName, CONFIG_TELEGRAM_STACK_SIZE, &_tgWorkers[i], CONFIG_TASK_PRIORITY_TELEGRAM, &_tgWorkers[i].task, workerCore); 
+      #endif // CONFIG_TELEGRAM_STATIC_ALLOCATION
+      if (!_tgWorkers[i].task) {
+        tgTaskDelete();
+        rloga_e("Failed to create task for sending notifications to Telegram!");
+        eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_FAIL);
+        return false;
+      };
     };
+    rloga_i("Task [ %s ] has been successfully started", tgTaskName);
+    eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_OK);
+    return true;
   }
   else {
     return tgTaskResume();
@@ -483,9 +4801,15 @@ bool tgTaskCreate()
 
 bool tgTaskSuspend()
 {
-  if ((_tgTask) && (eTaskGetState(_tgTask) != eSuspended)) {
-    vTaskSuspend(_tgTask);
-    if (eTaskGetState(_tgTask) == eSuspended) {
+  if ((_tgWorkers[0].task) && (eTaskGetState(_tgWorkers[0].task) != eSuspended)) {
+    bool suspended = true;
+    for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+      if (_tgWorkers[i].task) {
+        vTaskSuspend(_tgWorkers[i].task);
+        suspended = suspended && (eTaskGetState(_tgWorkers[i].task) == eSuspended);
+      };
+    };
+    if (suspended) {
       rloga_d("Task [ %s ] has been suspended", tgTaskName);
       eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_ERR_NOT_SUPPORTED);
       return true;
@@ -499,9 +4823,15 @@ bool tgTaskSuspend()
 
 bool tgTaskResume()
 {
-  if ((_tgTask) && (eTaskGetState(_tgTask) == eSuspended)) {
-    vTaskResume(_tgTask);
-    if (eTaskGetState(_tgTask) != eSuspended) {
+  if ((_tgWorkers[0].task) && (eTaskGetState(_tgWorkers[0].task) == eSuspended)) {
+    bool resumed = true;
+    for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+      if (_tgWorkers[i].task) {
+        vTaskResume(_tgWorkers[i].task);
+        resumed = resumed && (eTaskGetState(_tgWorkers[i].task) != eSuspended);
+      };
+    };
+    if (resumed) {
       rloga_i("Task [ %s ] has been successfully resumed", tgTaskName);
       eventLoopPostError(RE_SYS_TELEGRAM_ERROR, ESP_OK);
       return true;
@@ -515,18 +4845,41 @@ bool tgTaskResume()
 
 bool tgTaskDelete()
 {
-  if (_tgQueue) {
-    vQueueDelete(_tgQueue);
-    rloga_v("The queue for sending notifications in Telegram has been deleted");
-    _tgQueue = nullptr;
+  // A worker cannot wait for itself to stop (delivery callbacks are called by the workers)
+  TaskHandle_t self = xTaskGetCurrentTaskHandle();
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+    if (_tgWorkers[i].task == self) {
+      rloga_e("Task [ %s ] cannot delete itself!", tgTaskName);
+      return false;
+    };
   };
 
-  if (_tgTask) {
-    vTaskDelete(_tgTask);
-    _tgTask = nullptr;
-    rloga_d("Task [ %s ] was deleted", tgTaskName);
+  // Closing the ring stops the workers: each one finishes or cancels its request, puts the message back, 
+  // releases the lock and reports that it has stopped
+  bool clear = _tgRing.ready;
+  _tgRing.ready = false;
+  uint8_t running = 0;
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+    if (_tgWorkers[i].task) {
+      vTaskResume(_tgWorkers[i].task);
+      xTaskNotifyGive(_tgWorkers[i].task);
+      running++;
+    };
   };
-  
+  for (; running > 0; running--) {
+    xSemaphoreTake(_tgStopped, portMAX_DELAY);
+  };
+  for (uint8_t i = 0; i < CONFIG_TELEGRAM_WORKERS; i++) {
+    if (_tgWorkers[i].task) {
+      vTaskDelete(_tgWorkers[i].task);
+      _tgWorkers[i].task = nullptr;
+    };
+  };
+  // The ring has a single consumer: it is cleared only when the first worker can no longer take messages from it
+  if (clear) {
+    tgRingClear();
+    rloga_v("The queue for sending notifications in Telegram has been cleared");
+  };
+  rloga_d("Task [ %s ] was deleted", tgTaskName);
   return true;
 }
-
@@ -0,0 +1,261 @@
+/* 
+   EN: Benchmark of the send path: producer threads call tgSendMsgEx() while the fake Bot API server 
+   answers with the latency and the failures of the chosen scenario
+   RU: Нагрузочный тест отправки: потоки-производители вызывают tgSendMsgEx(), имитатор Bot API отвечает 
+   с задержками и ошибками выбранного сценария
+*/
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "reTgSend.h"
+#include "host.h"
+#include "esp_timer.h"
+
+typedef struct {
+  const char* name;
+  const char* control;       // Query to the fake server at the start
+  uint32_t outage_delay;     // Outage of outage_ms starts this many ms after the start, 0 - none
+  const char* description;
+} benchScenario_t;
+
+static const benchScenario_t _benchScenarios[] = {
+  { "clean",    "",                                             0,   "immediate responses" },
+  { "latency",  "latency_ms=50&jitter_ms=50",                   0,   "50..100 ms per response" },
+  { "throttle", "fail=429&fail_rate=0.05&retry_after=1",        0,   "5% of requests get 429 with retry_after 1 s" },
+  { "flaky",    "fail=reset&fail_rate=0.05",                    0,   "5% of requests are reset" },
+  { "outage",   "latency_ms=5",                                 200, "the server resets everything for a while" },
+};
+
+typedef struct {
+  int64_t queued;
+  int64_t done;
+  esp_err_t result;
+  std::atomic<bool> completed;
+} benchSample_t;
+
+static std::vector<benchSample_t> _benchSamples;
+static std::atomic<uint32_t> _benchDelivered(0);
+static std::atomic<uint32_t> _benchFailed(0);
+
+static void benchResult(esp_err_t result, int64_t message_id, void* ctx)
+{
+  benchSample_t* sample = (benchSample_t*)ctx;
+  sample->done = esp_timer_get_time();
+  sample->result = result;
+  sample->completed = true;
+  if (result == ESP_OK) {
+    _benchDelivered++;
+  } else {
+    _benchFailed++;
+  };
+}
+
+static void benchProducer(int thread, int messages, const std::string* payload, int interval_us, std::vector<int64_t>* enqueue)
+{
+  for (int i = 0; i < messages; i++) {
+    int index = thread * messages + i;
+    benchSample_t* sample = &_benchSamples[index];
+    tg_send_params_t params = {};
+    params.options = encMsgOptions((msg_kind_t)(index % 4), false, MP_ORDINARY);
+    params.callback = benchResult;
+    params.ctx = sample;
+    sample->queued = esp_timer_get_time();
+    bool queued = tgSendMsgEx(&params, "Bench", "%s #%d", payload->c_str(), index);
+    enqueue->push_back(esp_timer_get_time() - sample->queued);
+    if (!queued) {
+      sample->result = ESP_ERR_NO_MEM;
+      sample->completed = true;
+    };
+    if (interval_us > 0) {
+      usleep(interval_us);
+    };
+  };
+}
+
+static int64_t benchPercentile(std::vector<int64_t>& values, double p)
+{
+  if (values.empty()) return 0;
+  size_t index = (size_t)(p * (values.size() - 1) + 0.5);
+  return values[index];
+}
+
+static void benchUsage(const char* name)
+{
+  printf("Usage: fake_api.py --run %s [options]\n", name);
+  printf("  --threads N       producer threads (4)\n");
+  printf("  --messages N      messages per thread (250)\n");
+  printf("  --size N          text length, bytes (200)\n");
+  printf("  --interval-us N   pause between messages of a thread (1000)\n");
+  printf("  --timeout-ms N    how long to wait for the results (60000)\n");
+  printf("  --outage-ms N     length of the outage in the outage scenario (1000)\n");
+  printf("  --scenario NAME   server behavior:\n");
+  for (const benchScenario_t& scenario : _benchScenarios) {
+    printf("      %-10s %s\n", scenario.name, scenario.description);
+  };
+}
+
+int main(int argc, char** argv)
+{
+  int threads = 4;
+  int messages = 250;
+  int size = 200;
+  int interval_us = 1000;
+  int timeout_ms = 60000;
+  int outage_ms = 1000;
+  const benchScenario_t* scenario = &_benchScenarios[0];
+
+  static const struct option options[] = {
+    { "threads",     required_argument, nullptr, 't' },
+    { "messages",    required_argument, nullptr, 'm' },
+    { "size",        required_argument, nullptr, 's' },
+    { "interval-us", required_argument, nullptr, 'i' },
+    { "timeout-ms",  required_argument, nullptr, 'w' },
+    { "outage-ms",   required_argument, nullptr, 'o' },
+    { "scenario",    required_argument, nullptr, 'c' },
+    { "help",        no_argument,       nullptr, 'h' },
+    { nullptr,       0,                 nullptr, 0 }
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", options, nullptr)) != -1) {
+    switch (opt) {
+      case 't': threads = atoi(optarg); break;
+      case 'm': messages = atoi(optarg); break;
+      case 's': size = atoi(optarg); break;
+      case 'i': interval_us = atoi(optarg); break;
+      case 'w': timeout_ms = atoi(optarg); break;
+      case 'o': outage_ms = atoi(optarg); break;
+      case 'c':
+        scenario = nullptr;
+        for (const benchScenario_t& item : _benchScenarios) {
+          if (strcmp(item.name, optarg) == 0) scenario = &item;
+        };
+        if (scenario == nullptr) {
+          benchUsage(argv[0]);
+          return 2;
+        };
+        break;
+      default:
+        benchUsage(argv[0]);
+        return opt == 'h' ? 0 : 2;
+    };
+  };
+
+  // The log of the library would drown the report, TG_HOST_LOG=W brings it back
+  setenv("TG_HOST_LOG", "N", 0);
+  if (!hostFakeControl("reset=1")) {
+    fprintf(stderr, "The fake server is not available, run the benchmark with fake_api.py --run\n");
+    return 2;
+  };
+  if (scenario->control[0]) {
+    hostFakeControl(scenario->control);
+  };
+
+  // Everything the benchmark needs is allocated before the measurement
+  int total = threads * messages;
+  _benchSamples = std::vector<benchSample_t>(total);
+  std::vector<std::vector<int64_t>> enqueue(threads);
+  for (auto& values : enqueue) values.reserve(messages);
+  std::string payload(size, 'x');
+
+  hostHeapReset();
+  if (!tgTaskCreate()) {
+    fprintf(stderr, "Failed to start the send task\n");
+    return 1;
+  };
+  host_heap_t heapStarted;
+  hostHeapGet(&heapStarted);
+  hostHttpReset();
+  hostHeapReset();
+
+  int64_t started = esp_timer_get_time();
+  std::vector<std::thread> producers;
+  for (int i = 0; i < threads; i++) {
+    producers.emplace_back(benchProducer, i, messages, &payload, interval_us, &enqueue[i]);
+  };
+  if (scenario->outage_delay > 0) {
+    usleep(scenario->outage_delay * 1000);
+    hostFakeControl(("outage_ms=" + std::to_string(outage_ms)).c_str());
+  };
+  for (std::thread& producer : producers) {
+    producer.join();
+  };
+
+  int64_t deadline = started + (int64_t)timeout_ms * 1000;
+  auto pending = [&]() {
+    int count = 0;
+    for (const benchSample_t& sample : _benchSamples) {
+      if (!sample.completed) count++;
+    };
+    return count;
+  };
+  while ((pending() > 0) && (esp_timer_get_time() < deadline)) {
+    usleep(5000);
+  };
+
+  // Results
+  host_heap_t heap;
+  hostHeapGet(&heap);
+  host_http_t http;
+  hostHttpGet(&http);
+  uint32_t batchMessages, batchRequests;
+  tgGetBatchStats(&batchMessages, &batchRequests);
+
+  std::vector<int64_t> enqueueAll;
+  for (auto& values : enqueue) enqueueAll.insert(enqueueAll.end(), values.begin(), values.end());
+  std::vector<int64_t> delivery;
+  int64_t finished = started;
+  int rejected = 0;
+  for (const benchSample_t& sample : _benchSamples) {
+    if (!sample.completed) continue;
+    if (sample.result == ESP_OK) {
+      delivery.push_back(sample.done - sample.queued);
+      finished = std::max(finished, sample.done);
+    } else if (sample.result == ESP_ERR_NO_MEM && sample.done == 0) {
+      rejected++;
+    };
+  };
+  std::sort(enqueueAll.begin(), enqueueAll.end());
+  std::sort(delivery.begin(), delivery.end());
+  int unfinished = pending();
+  int dropped = (int)_benchFailed.load();
+  double seconds = (finished - started) / 1e6;
+
+  #if CONFIG_TELEGRAM_OUTBOX_ENABLE
+    const char* mode = "outbox";
+  #else
+    const char* mode = "direct";
+  #endif // CONFIG_TELEGRAM_OUTBOX_ENABLE
+  #ifdef CONFIG_TELEGRAM_WORKERS
+    int workers = CONFIG_TELEGRAM_WORKERS;
+  #else
+    int workers = 1;
+  #endif // CONFIG_TELEGRAM_WORKERS
+
+  printf("mode              %s, %d worker(s), queue %d\n", mode, workers, CONFIG_TELEGRAM_QUEUE_SIZE);
+  printf("scenario          %s: %s\n", scenario->name, scenario->description);
+  printf("offered           %d messages from %d threads, %d bytes each\n", total, threads, size);
+  printf("delivered         %u, rejected %d, dropped %d, unfinished %d\n", _benchDelivered.load(), rejected, dropped, unfinished);
+  printf("throughput        %.1f msg/s\n", seconds > 0 ? _benchDelivered.load() / seconds : 0.0);
+  printf("enqueue, us       p50 %lld, p90 %lld, p99 %lld, max %lld\n", 
+    (long long)benchPercentile(enqueueAll, 0.5), (long long)benchPercentile(enqueueAll, 0.9), 
+    (long long)benchPercentile(enqueueAll, 0.99), (long long)benchPercentile(enqueueAll, 1.0));
+  printf("delivery, ms      p50 %.1f, p90 %.1f, p99 %.1f, max %.1f\n", 
+    benchPercentile(delivery, 0.5) / 1000.0, benchPercentile(delivery, 0.9) / 1000.0, 
+    benchPercentile(delivery, 0.99) / 1000.0, benchPercentile(delivery, 1.0) / 1000.0);
+  printf("heap, bytes       %lld after start, peak %lld, %llu allocations during the run\n", 
+    (long long)heapStarted.bytes, (long long)heap.peak, (unsigned long long)heap.allocs);
+  printf("http              %u requests, %u handshakes (%u resumed), %u failures\n", 
+    http.requests, http.handshakes, http.resumed, http.failures);
+  printf("batches           %u messages in %u requests\n", batchMessages, batchRequests);
+
+  // Every message must be accounted for: delivered, rejected at once or reported as dropped
+  return (unfinished == 0) && (_benchDelivered.load() > 0) ? 0 : 1;
+}
@@ -0,0 +1,385 @@
+#!/usr/bin/env python3
+"""
+Fake Telegram Bot API server for the host tests and benchmarks.
+
+Serves sendMessage, editMessageText, sendDocument, getMe and getUpdates over plain HTTP/1.1 with keep-alive
+and injects faults on request. Faults and statistics are controlled over the same port:
+
+  GET /_control?key=value&...   change the behavior, keys:
+      latency_ms, jitter_ms     delay before every API response
+      connect_ms                delay before the first response on a new connection (stands in for the TLS handshake)
+      chat_latency=<chat>:<ms>  extra delay of the requests to this chat, comma-separated for several chats
+      fail                      429 | 403 | 500 | migrate | edit_not_found | reset | hang - the failure to inject
+      fail_count                inject it into the next N API requests
+      fail_rate                 or into every request with this probability (0..1)
+      fail_bot                  only for this bot (the number before ':' in the token)
+      retry_after               seconds reported with 429 (default 1)
+      bot_rate                  messages per second each bot may send, over it 429 (counted as "limited")
+      migrate_to                new chat ID reported with migrate (default -1009999)
+      outage_ms                 reset every connection for this period, starting now
+      close_all=1               close all open connections (as the server does with idle ones)
+      update=<text>             queue a message from chat update_chat (default 10001) for getUpdates
+      reset=1                   restore the defaults and zero the statistics
+  GET /_stats                   counters in JSON, "open" is the number of API connections open right now
+  GET /_messages                bodies of the requests received so far in JSON
+
+Usage:
+  fake_api.py --run <command> [args...]   start on a free port, run the command with TG_FAKE_API=127.0.0.1:<port>
+                                          and return its exit code
+  fake_api.py --port 8081                 serve until interrupted
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import socket
+import struct
+import subprocess
+import sys
+import threading
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+from urllib.parse import parse_qs, urlparse
+
+API_PATH = re.compile(r"^/bot(?P<bot>\d+):[^/]*/(?P<method>\w+)$")
+
+
+class FakeState:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.connections = set()
+        # IDs keep growing across resets, as in Telegram: the client remembers the ones it has seen
+        self.next_update = 1
+        self.next_message = 1
+        self.reset()
+
+    def reset(self):
+        self.latency_ms = 0
+        self.jitter_ms = 0
+        self.connect_ms = 0
+        self.chat_latency = {}
+        self.fail = None
+        self.fail_count = 0
+        self.fail_rate = 0.0
+        self.fail_bot = None
+        self.retry_after = 1
+        self.bot_rate = 0
+        self.bot_sent = {}
+        self.migrate_to = -1009999
+        self.outage_until = 0.0
+        self.updates = []
+        self.messages = []
+        self.stats = {
+            "connections": 0,
+            "requests": 0,
+            "delivered": 0,
+            "injected": 0,
+            "resets": 0,
+            "inflight": 0,
+            "inflight_peak": 0,
+            "limited": 0,
+        }
+
+    def count(self, key, value=1):
+        self.stats[key] = self.stats.get(key, 0) + value
+
+    def inject(self, bot):
+        """Returns the failure to inject into this request or None"""
+        if time.monotonic() < self.outage_until:
+            return "reset"
+        if self.fail is None or (self.fail_bot is not None and self.fail_bot != bot):
+            return None
+        if self.fail_count > 0:
+            self.fail_count -= 1
+            return self.fail
+        if self.fail_rate > 0 and random.random() < self.fail_rate:
+            return self.fail
+        return None
+
+    def limit(self, bot):
+        """Whether the bot has used up its bot_rate within the last second, the request is counted if it has not"""
+        if self.bot_rate <= 0:
+            return False
+        now = time.monotonic()
+        sent = [t for t in self.bot_sent.get(bot, []) if now - t < 1.0]
+        limited = len(sent) >= self.bot_rate
+        if not limited:
+            sent.append(now)
+        self.bot_sent[bot] = sent
+        return limited
+
+
+STATE = FakeState()
+
+
+class FakeHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "FakeBotAPI/1.0"
+
+    def setup(self):
+        super().setup()
+        # Headers and body go out in separate writes, Nagle's algorithm would hold the body until the delayed ACK
+        self.connection.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        # Only the connections that carry API requests are tracked, the control requests come on their own
+        self.handshake = True
+
+    def finish(self):
+        with STATE.lock:
+            STATE.connections.discard(self.connection)
+        try:
+            super().finish()
+        except OSError:
+            pass
+
+    def log_message(self, format, *args):
+        pass
+
+    def reply(self, status, body, close=False):
+        data = json.dumps(body, separators=(",", ":")).encode()
+        self.send_response(status)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(data)))
+        if close:
+            self.send_header("Connection", "close")
+            self.close_connection = True
+        try:
+            self.end_headers()
+            self.wfile.write(data)
+        except (BrokenPipeError, ConnectionResetError):
+            # The client has given up on the request, as it does with an interrupted long poll
+            self.close_connection = True
+
+    def abort(self):
+        """Closes the connection with RST, without a response"""
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        self.close_connection = True
+        self.connection.close()
+
+    def do_GET(self):
+        self.handle_request()
+
+    def do_POST(self):
+        self.handle_request()
+
+    def handle_request(self):
+        length = int(self.headers.get("Content-Length", 0))
+        body = self.rfile.read(length) if length > 0 else b""
+        url = urlparse(self.path)
+        if url.path == "/_control":
+            self.control(parse_qs(url.query))
+        elif url.path == "/_stats":
+            with STATE.lock:
+                stats = dict(STATE.stats)
+                stats["open"] = len(STATE.connections)
+            self.reply(200, stats, close=True)
+        elif url.path == "/_messages":
+            with STATE.lock:
+                messages = list(STATE.messages)
+            self.reply(200, messages, close=True)
+        else:
+            match = API_PATH.match(url.path)
+            if match is None:
+                self.reply(404, {"ok": False, "error_code": 404, "description": "Not Found"})
+                return
+            with STATE.lock:
+                STATE.count("inflight")
+                STATE.stats["inflight_peak"] = max(STATE.stats["inflight_peak"], STATE.stats["inflight"])
+            try:
+                self.api(match.group("bot"), match.group("method"), body)
+            finally:
+                with STATE.lock:
+                    STATE.count("inflight", -1)
+
+    def control(self, query):
+        with STATE.lock:
+            if "reset" in query:
+                STATE.reset()
+            for key in ("latency_ms", "jitter_ms", "connect_ms", "fail_count", "retry_after", "migrate_to", "bot_rate"):
+                if key in query:
+                    setattr(STATE, key, int(query[key][0]))
+            if "chat_latency" in query:
+                STATE.chat_latency = {}
+                for item in query["chat_latency"][0].split(","):
+                    if item:
+                        chat, ms = item.split(":")
+                        STATE.chat_latency[int(chat)] = int(ms)
+            if "fail_rate" in query:
+                STATE.fail_rate = float(query["fail_rate"][0])
+            if "fail" in query:
+                STATE.fail = query["fail"][0] or None
+            if "fail_bot" in query:
+                STATE.fail_bot = query["fail_bot"][0] or None
+            if "outage_ms" in query:
+                STATE.outage_until = time.monotonic() + int(query["outage_ms"][0]) / 1000
+            if "update" in query:
+                chat = int(query.get("update_chat", ["10001"])[0])
+                STATE.updates.append({
+                    "update_id": STATE.next_update,
+                    "message": {"message_id": STATE.next_message, "date": int(time.time()),
+                                "chat": {"id": chat, "type": "private"}, "from": {"id": chat, "is_bot": False},
+                                "text": query["update"][0]}})
+                STATE.next_update += 1
+                STATE.next_message += 1
+            connections = list(STATE.connections) if "close_all" in query else []
+        for connection in connections:
+            try:
+                connection.shutdown(socket.SHUT_RDWR)
+            except OSError:
+                pass
+        self.reply(200, {"ok": True}, close=True)
+
+    def api(self, bot, method, body):
+        with STATE.lock:
+            if self.handshake:
+                STATE.connections.add(self.connection)
+                STATE.count("connections")
+            STATE.count("requests")
+            STATE.count("bot_" + bot)
+            STATE.count("method_" + method)
+            failure = STATE.inject(bot)
+            latency = STATE.latency_ms + (random.randint(0, STATE.jitter_ms) if STATE.jitter_ms > 0 else 0)
+            if self.handshake:
+                latency += STATE.connect_ms
+                self.handshake = False
+            if STATE.chat_latency:
+                match = re.search(rb'"chat_id":(-?\d+)', body)
+                if match:
+                    latency += STATE.chat_latency.get(int(match.group(1)), 0)
+            retry_after = STATE.retry_after
+            migrate_to = STATE.migrate_to
+            if failure is not None:
+                STATE.count("injected")
+                STATE.count("injected_" + failure)
+            elif (method not in ("getMe", "getUpdates")) and STATE.limit(bot):
+                failure = "429"
+                STATE.count("limited")
+        if latency > 0:
+            time.sleep(latency / 1000)
+
+        if failure == "reset":
+            with STATE.lock:
+                STATE.count("resets")
+            self.abort()
+            return
+        if failure == "hang":
+            # Never answers: the client has to give up on its own
+            time.sleep(60)
+            self.abort()
+            return
+        if failure == "429":
+            self.reply(429, {"ok": False, "error_code": 429, "description": "Too Many Requests: retry after %d" % retry_after,
+                             "parameters": {"retry_after": retry_after}})
+            return
+        if failure == "403":
+            self.reply(403, {"ok": False, "error_code": 403, "description": "Forbidden: bot was blocked by the user"})
+            return
+        if failure == "500":
+            self.reply(500, {"ok": False, "error_code": 500, "description": "Internal Server Error"})
+            return
+        if failure == "migrate":
+            self.reply(400, {"ok": False, "error_code": 400, "description": "Bad Request: group chat was upgraded to a supergroup chat",
+                             "parameters": {"migrate_to_chat_id": migrate_to}})
+            return
+        if failure == "edit_not_found":
+            self.reply(400, {"ok": False, "error_code": 400, "description": "Bad Request: message to edit not found"})
+            return
+
+        if method == "getMe":
+            self.reply(200, {"ok": True, "result": {"id": int(bot), "is_bot": True, "first_name": "Host", "username": "host_bot"}})
+        elif method == "getUpdates":
+            self.updates(body)
+        elif method in ("sendMessage", "editMessageText", "sendDocument"):
+            self.deliver(bot, method, body)
+        else:
+            self.reply(404, {"ok": False, "error_code": 404, "description": "Not Found: method not found"})
+
+    def deliver(self, bot, method, body):
+        document = None
+        if method == "sendDocument":
+            match = re.search(rb'name="chat_id"\r\n\r\n(-?\d+)', body)
+            chat_id = int(match.group(1)) if match else 0
+            # The text of the uploaded file stands in for the text of the message
+            match = re.search(rb'name="document"; filename="[^"]*"\r\nContent-Type: [^\r]*\r\n\r\n(.*?)\r\n--', body, re.DOTALL)
+            document = match.group(1).decode(errors="replace") if match else ""
+            text = None
+        else:
+            try:
+                request = json.loads(body)
+            except ValueError:
+                self.reply(400, {"ok": False, "error_code": 400, "description": "Bad Request: can't parse JSON"})
+                return
+            chat_id = int(request.get("chat_id", 0))
+            text = request.get("text")
+        with STATE.lock:
+            STATE.count("delivered")
+            if method == "editMessageText":
+                # The edited message keeps its ID
+                message_id = int(request.get("message_id", 0))
+            else:
+                message_id = STATE.next_message
+                STATE.next_message += 1
+            STATE.messages.append({"bot": int(bot), "method": method, "chat_id": chat_id, "message_id": message_id,
+                                   "text": text if text is not None else document, "size": len(body)})
+        result = {"message_id": message_id, "from": {"id": int(bot), "is_bot": True, "first_name": "Host"},
+                  "chat": {"id": chat_id, "type": "group" if chat_id < 0 else "private"}, "date": int(time.time())}
+        if text is not None:
+            result["text"] = text
+        if document is not None:
+            result["document"] = {"file_name": "messages.txt", "mime_type": "text/plain"}
+        self.reply(200, {"ok": True, "result": result})
+
+    def updates(self, body):
+        try:
+            request = json.loads(body) if body else {}
+        except ValueError:
+            request = {}
+        offset = int(request.get("offset", 0))
+        # Long polling is shortened to a second, enough to see that outgoing messages interrupt it
+        deadline = time.monotonic() + min(int(request.get("timeout", 0)), 1)
+        while True:
+            with STATE.lock:
+                if offset < 0:
+                    updates = STATE.updates[offset:]
+                else:
+                    updates = [update for update in STATE.updates if update["update_id"] >= offset]
+            if updates or time.monotonic() >= deadline:
+                break
+            time.sleep(0.02)
+        self.reply(200, {"ok": True, "result": updates})
+
+
+class FakeServer(ThreadingHTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+    request_queue_size = 64
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Fake Telegram Bot API server")
+    parser.add_argument("--host", default="127.0.0.1")
+    parser.add_argument("--port", type=int, default=0)
+    parser.add_argument("--run", nargs=argparse.REMAINDER, help="command to run against the server")
+    args = parser.parse_args()
+
+    server = FakeServer((args.host, args.port), FakeHandler)
+    address = "%s:%d" % server.server_address[:2]
+    if not args.run:
+        print("Fake Bot API server at %s" % address, flush=True)
+        try:
+            server.serve_forever()
+        except KeyboardInterrupt:
+            pass
+        return 0
+
+    thread = threading.Thread(target=server.serve_forever, daemon=True)
+    thread.start()
+    env = dict(os.environ, TG_FAKE_API=address)
+    result = subprocess.call(args.run, env=env)
+    server.shutdown()
+    return result
+
+
+if __name__ == "__main__":
+    sys.exit(main())
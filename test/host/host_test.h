@@ -0,0 +1,101 @@
+/* 
+   EN: Minimal test runner of the host tests
+   RU: Минимальный запуск тестов для сборки на ПК
+*/
+
+#ifndef __HOST_TEST_H__
+#define __HOST_TEST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <atomic>
+#include "host.h"
+#include "esp_timer.h"
+#include "reTgSend.h"
+
+static int _hostTestFailures = 0;
+
+#define TEST_ASSERT(condition) do { \
+  if (!(condition)) { \
+    fprintf(stderr, "%s:%d: assertion failed: %s\n", __FILE__, __LINE__, #condition); \
+    _hostTestFailures++; \
+    return; \
+  }; \
+} while (0)
+
+#define TEST_ASSERT_EQ(expected, actual) do { \
+  long long _expected = (long long)(expected); \
+  long long _actual = (long long)(actual); \
+  if (_expected != _actual) { \
+    fprintf(stderr, "%s:%d: %s == %s failed: expected %lld, got %lld\n", __FILE__, __LINE__, #expected, #actual, _expected, _actual); \
+    _hostTestFailures++; \
+    return; \
+  }; \
+} while (0)
+
+#define TEST_RUN(test) do { \
+  int _before = _hostTestFailures; \
+  int64_t _started = esp_timer_get_time(); \
+  test(); \
+  fprintf(stderr, "%s %s (%lld ms)\n", _hostTestFailures == _before ? "PASS" : "FAIL", #test, \
+    (long long)((esp_timer_get_time() - _started) / 1000)); \
+} while (0)
+
+#define TEST_RESULT() (_hostTestFailures == 0 ? 0 : 1)
+
+// Polls the condition every millisecond until it is true or the timeout expires
+template <typename Condition>
+static inline bool hostWaitFor(Condition condition, uint32_t timeout_ms)
+{
+  int64_t deadline = esp_timer_get_time() + (int64_t)timeout_ms * 1000;
+  while (!condition()) {
+    if (esp_timer_get_time() >= deadline) return false;
+    usleep(1000);
+  };
+  return true;
+}
+
+// Counter of the fake server, 0 if it has not been counted yet, -1 if the server could not be reached
+static inline long long hostFakeCounter(const char* key)
+{
+  char stats[2048];
+  if (!hostFakeStats(stats, sizeof(stats))) return -1;
+  long long value = hostJsonInt(stats, key);
+  return value < 0 ? 0 : value;
+}
+
+// Results of the messages sent with hostOnResult() as their delivery callback
+static std::atomic<int> _hostDelivered(0);
+static std::atomic<int> _hostFailed(0);
+
+static inline void hostOnResult(esp_err_t result, int64_t message_id, void* ctx)
+{
+  if ((result == ESP_OK) && (message_id > 0)) {
+    _hostDelivered++;
+  } else {
+    _hostFailed++;
+  };
+}
+
+// Restores the defaults of the fake server, zeroes its counters and the results
+static inline void hostResetCounters()
+{
+  hostFakeControl("reset=1");
+  _hostDelivered = 0;
+  _hostFailed = 0;
+}
+
+// A send path counter of the library summed over the kinds of messages
+static inline uint32_t hostStatsCounter(tg_counter_t counter)
+{
+  tg_stats_t stats;
+  tgGetStats(&stats);
+  uint32_t count = 0;
+  for (int kind = 0; kind < TG_STATS_KINDS; kind++) {
+    count += stats.counters[kind][counter];
+  };
+  return count;
+}
+
+#endif // __HOST_TEST_H__
@@ -0,0 +1,342 @@
+/* 
+   EN: esp_http_client over plain TCP to the fake Bot API server
+   RU: esp_http_client поверх TCP к имитатору Bot API
+*/
+
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include "esp_http_client.h"
+#include "host_internal.h"
+
+struct esp_http_client {
+  std::mutex lock;                 // Guards fd against hostHttpBreakAll()
+  int fd = -1;
+  std::string host;
+  std::string path;
+  esp_http_client_method_t method = HTTP_METHOD_GET;
+  int timeout_ms = 5000;
+  bool save_session = false;
+  bool session = false;            // Has been connected: a saved session would be resumed
+  std::vector<std::pair<std::string, std::string>> headers;
+  // Response
+  std::string input;               // Received but not yet consumed
+  int status = 0;
+  int64_t content_length = 0;
+  int64_t body_read = 0;
+  bool close_after = false;
+};
+
+static std::atomic<uint32_t> _hostHandshakes(0);
+static std::atomic<uint32_t> _hostResumed(0);
+static std::atomic<uint32_t> _hostRequests(0);
+static std::atomic<uint32_t> _hostFailures(0);
+
+static std::mutex _hostClientsLock;
+static std::set<esp_http_client*> _hostClients;
+
+void hostHttpGet(host_http_t* http)
+{
+  http->handshakes = _hostHandshakes.load();
+  http->resumed = _hostResumed.load();
+  http->requests = _hostRequests.load();
+  http->failures = _hostFailures.load();
+}
+
+void hostHttpReset(void)
+{
+  _hostHandshakes = 0;
+  _hostResumed = 0;
+  _hostRequests = 0;
+  _hostFailures = 0;
+}
+
+// The socket is shut down rather than closed, so that a thread blocked on it wakes up and the descriptor is not reused under it
+void hostHttpBreakAll(void)
+{
+  std::lock_guard<std::mutex> guard(_hostClientsLock);
+  for (esp_http_client* client : _hostClients) {
+    std::lock_guard<std::mutex> clientGuard(client->lock);
+    if (client->fd >= 0) {
+      shutdown(client->fd, SHUT_RDWR);
+    };
+  };
+}
+
+static void hostHttpDisconnect(esp_http_client_handle_t client)
+{
+  std::lock_guard<std::mutex> guard(client->lock);
+  if (client->fd >= 0) {
+    close(client->fd);
+    client->fd = -1;
+  };
+  client->input.clear();
+}
+
+static void hostHttpFail(esp_http_client_handle_t client)
+{
+  _hostFailures++;
+  hostHttpDisconnect(client);
+}
+
+static bool hostHttpSend(esp_http_client_handle_t client, const char* data, size_t len)
+{
+  while (len > 0) {
+    ssize_t sent = send(client->fd, data, len, MSG_NOSIGNAL);
+    if (sent <= 0) {
+      if ((sent < 0) && (errno == EINTR)) continue;
+      return false;
+    };
+    data += sent;
+    len -= sent;
+  };
+  return true;
+}
+
+// Waits up to the client timeout for more data, returns 1 - received, 0 - timeout, -1 - the connection is broken
+static int hostHttpReceive(esp_http_client_handle_t client)
+{
+  struct pollfd pfd;
+  pfd.fd = client->fd;
+  pfd.events = POLLIN;
+  int ret = poll(&pfd, 1, client->timeout_ms);
+  if (ret == 0) return 0;
+  if (ret < 0) return errno == EINTR ? 0 : -1;
+  char buffer[1024];
+  ssize_t received = recv(client->fd, buffer, sizeof(buffer), 0);
+  if (received <= 0) return -1;
+  client->input.append(buffer, received);
+  return 1;
+}
+
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t* config)
+{
+  esp_http_client* client = new esp_http_client();
+  client->host = config->host ? config->host : "localhost";
+  client->path = config->path ? config->path : "/";
+  client->method = config->method;
+  client->timeout_ms = config->timeout_ms > 0 ? config->timeout_ms : 5000;
+  client->save_session = config->save_client_session;
+  std::lock_guard<std::mutex> guard(_hostClientsLock);
+  _hostClients.insert(client);
+  return client;
+}
+
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client)
+{
+  if (client == nullptr) return ESP_FAIL;
+  {
+    std::lock_guard<std::mutex> guard(_hostClientsLock);
+    _hostClients.erase(client);
+  };
+  hostHttpDisconnect(client);
+  delete client;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_close(esp_http_client_handle_t client)
+{
+  hostHttpDisconnect(client);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char* url)
+{
+  // A full URL keeps only its path, the client stays with its host
+  const char* scheme = strstr(url, "://");
+  if (scheme) {
+    const char* path = strchr(scheme + 3, '/');
+    client->path = path ? path : "/";
+  } else {
+    client->path = url;
+  };
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char* key, const char* value)
+{
+  for (auto& header : client->headers) {
+    if (strcasecmp(header.first.c_str(), key) == 0) {
+      header.second = value;
+      return ESP_OK;
+    };
+  };
+  client->headers.emplace_back(key, value);
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method)
+{
+  client->method = method;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_set_timeout_ms(esp_http_client_handle_t client, int timeout_ms)
+{
+  client->timeout_ms = timeout_ms;
+  return ESP_OK;
+}
+
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len)
+{
+  client->status = 0;
+  client->content_length = 0;
+  client->body_read = 0;
+  client->close_after = false;
+
+  if (client->fd < 0) {
+    struct sockaddr_in addr;
+    int fd = -1;
+    // esp-tls resolves a host name on connect, so it fails while DNS is off; a numeric address needs no lookup
+    struct in_addr numeric;
+    bool named = inet_pton(AF_INET, client->host.c_str(), &numeric) != 1;
+    if (hostNetworkConnected() && (!named || hostDnsAvailable()) && hostFakeAddress(&addr)) {
+      fd = hostConnect(&addr, client->timeout_ms);
+    };
+    if (fd < 0) {
+      _hostFailures++;
+      return ESP_ERR_HTTP_CONNECT;
+    };
+    _hostHandshakes++;
+    if (client->save_session && client->session) {
+      _hostResumed++;
+    };
+    client->session = true;
+    std::lock_guard<std::mutex> guard(client->lock);
+    client->fd = fd;
+    client->input.clear();
+  };
+
+  // As in ESP-IDF, a request to a kept connection that the server has closed fails only when the response is awaited
+  static const char* const methods[HTTP_METHOD_MAX] = { "GET", "POST", "PUT", "PATCH", "DELETE", "HEAD" };
+  std::string request = std::string(methods[client->method]) + " " + client->path + " HTTP/1.1\r\n";
+  bool host = false;
+  for (const auto& header : client->headers) {
+    request += header.first + ": " + header.second + "\r\n";
+    host = host || (strcasecmp(header.first.c_str(), "Host") == 0);
+  };
+  if (!host) {
+    request += "Host: " + client->host + "\r\n";
+  };
+  request += "User-Agent: ESP32 HTTP Client/1.0\r\n";
+  if ((client->method != HTTP_METHOD_GET) || (write_len > 0)) {
+    request += "Content-Length: " + std::to_string(write_len) + "\r\n";
+  };
+  request += "\r\n";
+  _hostRequests++;
+  if (!hostHttpSend(client, request.data(), request.size())) {
+    hostHttpFail(client);
+    return ESP_ERR_HTTP_WRITE_DATA;
+  };
+  return ESP_OK;
+}
+
+int esp_http_client_write(esp_http_client_handle_t client, const char* buffer, int len)
+{
+  if ((client->fd < 0) || !hostHttpSend(client, buffer, len)) {
+    return -1;
+  };
+  return len;
+}
+
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client)
+{
+  if (client->fd < 0) return ESP_FAIL;
+  size_t end;
+  while ((end = client->input.find("\r\n\r\n")) == std::string::npos) {
+    int ret = hostHttpReceive(client);
+    if (ret == 0) return -ESP_ERR_HTTP_EAGAIN;
+    if (ret < 0) {
+      hostHttpFail(client);
+      return ESP_FAIL;
+    };
+  };
+
+  std::string head = client->input.substr(0, end);
+  client->input.erase(0, end + 4);
+  int major = 0, minor = 0;
+  if (sscanf(head.c_str(), "HTTP/%d.%d %d", &major, &minor, &client->status) != 3) {
+    hostHttpFail(client);
+    return ESP_FAIL;
+  };
+  client->close_after = (major == 1) && (minor == 0);
+  size_t pos = head.find("\r\n");
+  while (pos != std::string::npos) {
+    size_t next = head.find("\r\n", pos + 2);
+    std::string line = head.substr(pos + 2, next == std::string::npos ? std::string::npos : next - pos - 2);
+    size_t colon = line.find(':');
+    if (colon != std::string::npos) {
+      std::string key = line.substr(0, colon);
+      const char* value = line.c_str() + colon + 1;
+      while (*value == ' ') value++;
+      if (strcasecmp(key.c_str(), "Content-Length") == 0) {
+        client->content_length = atoll(value);
+      } else if (strcasecmp(key.c_str(), "Connection") == 0) {
+        client->close_after = strcasecmp(value, "close") == 0;
+      };
+    };
+    pos = next;
+  };
+  return client->content_length;
+}
+
+int esp_http_client_read(esp_http_client_handle_t client, char* buffer, int len)
+{
+  int64_t remain = client->content_length - client->body_read;
+  if ((remain <= 0) || (len <= 0)) return 0;
+  if ((client->input.empty()) && (client->fd >= 0)) {
+    int ret = hostHttpReceive(client);
+    if (ret <= 0) {
+      hostHttpFail(client);
+      return -1;
+    };
+  };
+  if (client->input.empty()) return -1;
+  int part = (int)std::min<int64_t>(std::min<int64_t>(remain, len), (int64_t)client->input.size());
+  memcpy(buffer, client->input.data(), part);
+  client->input.erase(0, part);
+  client->body_read += part;
+  if ((client->body_read >= client->content_length) && (client->close_after)) {
+    hostHttpDisconnect(client);
+  };
+  return part;
+}
+
+esp_err_t esp_http_client_flush_response(esp_http_client_handle_t client, int* len)
+{
+  char buffer[256];
+  int total = 0;
+  int read;
+  while ((read = esp_http_client_read(client, buffer, sizeof(buffer))) > 0) {
+    total += read;
+  };
+  if (len) *len = total;
+  return read < 0 ? ESP_FAIL : ESP_OK;
+}
+
+int esp_http_client_get_status_code(esp_http_client_handle_t client)
+{
+  return client->status;
+}
+
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client)
+{
+  return client->content_length;
+}
+
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client)
+{
+  return client->body_read >= client->content_length;
+}
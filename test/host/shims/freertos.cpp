@@ -0,0 +1,286 @@
+/* 
+   EN: FreeRTOS tasks, notifications, mutexes and counting semaphores on top of POSIX threads
+   RU: Задачи, уведомления, мьютексы и счетные семафоры FreeRTOS поверх потоков POSIX
+*/
+
+#include <pthread.h>
+#include <string.h>
+#include <chrono>
+#include <functional>
+#include <condition_variable>
+#include <mutex>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "host_internal.h"
+
+struct hostTask {
+  pthread_t thread;
+  TaskFunction_t code = nullptr;
+  void* params = nullptr;
+  char name[16] = {0};
+  BaseType_t core = 0;
+  std::mutex lock;
+  std::condition_variable cv;
+  uint32_t notify = 0;
+  bool suspended = false;
+  bool deleted = false;
+};
+
+struct hostMutex {
+  std::timed_mutex mutex;
+  // A counting semaphore may be given by any task, so it is a counter and not a mutex
+  bool counting = false;
+  std::mutex lock;
+  std::condition_variable cv;
+  UBaseType_t count = 0;
+  UBaseType_t max = 0;
+};
+
+static thread_local hostTask* _hostCurrent = nullptr;
+
+// Threads that were not created by xTaskCreate (main, benchmark producers) get a task object on first use
+static hostTask* hostTaskSelf()
+{
+  if (_hostCurrent == nullptr) {
+    _hostCurrent = new hostTask();
+    _hostCurrent->thread = pthread_self();
+    strncpy(_hostCurrent->name, "host", sizeof(_hostCurrent->name) - 1);
+    _hostCurrent->core = (BaseType_t)(std::hash<pthread_t>()(pthread_self()) & 1);
+  };
+  return _hostCurrent;
+}
+
+// Called with the lock of the task held: blocks while the task is suspended, ends the thread if the task is deleted
+static void hostTaskCheckpoint(hostTask* task, std::unique_lock<std::mutex>& lock)
+{
+  while (task->suspended && !task->deleted) {
+    task->cv.wait(lock);
+  };
+  if (task->deleted) {
+    lock.unlock();
+    pthread_exit(nullptr);
+  };
+}
+
+// Waits until the predicate is true or the timeout expires, stopping at the checkpoint on every wake-up
+template <typename Predicate>
+static bool hostTaskWait(hostTask* task, std::unique_lock<std::mutex>& lock, TickType_t ticks, Predicate done)
+{
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(pdTICKS_TO_MS(ticks));
+  while (true) {
+    hostTaskCheckpoint(task, lock);
+    if (done()) return true;
+    if (ticks == portMAX_DELAY) {
+      task->cv.wait(lock);
+    } else if (task->cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+      hostTaskCheckpoint(task, lock);
+      return done();
+    };
+  };
+}
+
+static void* hostTaskRun(void* arg)
+{
+  hostTask* task = (hostTask*)arg;
+  _hostCurrent = task;
+  task->code(task->params);
+  // FreeRTOS tasks must not return, the thread ends as if the task deleted itself
+  vTaskDelete(nullptr);
+  return nullptr;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth, 
+  void* pvParameters, UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask, BaseType_t xCoreID)
+{
+  hostTask* task = new hostTask();
+  task->code = pvTaskCode;
+  task->params = pvParameters;
+  task->core = (xCoreID == tskNO_AFFINITY) ? 0 : xCoreID;
+  if (pcName) strncpy(task->name, pcName, sizeof(task->name) - 1);
+  // The handle is stored before the task starts, as if the task had a lower priority than the caller
+  if (pvCreatedTask) *pvCreatedTask = task;
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  int ret = pthread_create(&task->thread, &attr, hostTaskRun, task);
+  pthread_attr_destroy(&attr);
+  if (ret != 0) {
+    if (pvCreatedTask) *pvCreatedTask = nullptr;
+    delete task;
+    return pdFAIL;
+  };
+  return pdPASS;
+}
+
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t ulStackDepth, 
+  void* pvParameters, UBaseType_t uxPriority, StackType_t* pxStackBuffer, StaticTask_t* pxTaskBuffer, BaseType_t xCoreID)
+{
+  TaskHandle_t handle = nullptr;
+  xTaskCreatePinnedToCore(pvTaskCode, pcName, ulStackDepth, pvParameters, uxPriority, &handle, xCoreID);
+  return handle;
+}
+
+void vTaskDelete(TaskHandle_t xTask)
+{
+  hostTask* self = hostTaskSelf();
+  hostTask* task = xTask ? xTask : self;
+  {
+    std::lock_guard<std::mutex> guard(task->lock);
+    task->deleted = true;
+  };
+  task->cv.notify_all();
+  if (task == self) {
+    pthread_exit(nullptr);
+  };
+}
+
+void vTaskSuspend(TaskHandle_t xTask)
+{
+  hostTask* self = hostTaskSelf();
+  hostTask* task = xTask ? xTask : self;
+  std::unique_lock<std::mutex> lock(task->lock);
+  task->suspended = true;
+  task->cv.notify_all();
+  if (task == self) {
+    hostTaskCheckpoint(task, lock);
+  };
+}
+
+void vTaskResume(TaskHandle_t xTask)
+{
+  if (xTask == nullptr) return;
+  {
+    std::lock_guard<std::mutex> guard(xTask->lock);
+    xTask->suspended = false;
+  };
+  xTask->cv.notify_all();
+}
+
+eTaskState eTaskGetState(TaskHandle_t xTask)
+{
+  if (xTask == nullptr) return eInvalid;
+  std::lock_guard<std::mutex> guard(xTask->lock);
+  if (xTask->deleted) return eDeleted;
+  if (xTask->suspended) return eSuspended;
+  return xTask == _hostCurrent ? eRunning : eBlocked;
+}
+
+void vTaskDelay(TickType_t xTicksToDelay)
+{
+  hostTask* self = hostTaskSelf();
+  std::unique_lock<std::mutex> lock(self->lock);
+  hostTaskWait(self, lock, xTicksToDelay, [] { return false; });
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+  return (TickType_t)(hostClockUs() / (1000000 / configTICK_RATE_HZ));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+  return hostTaskSelf();
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+  return hostTaskSelf()->core;
+}
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait)
+{
+  hostTask* self = hostTaskSelf();
+  std::unique_lock<std::mutex> lock(self->lock);
+  hostTaskWait(self, lock, xTicksToWait, [self] { return self->notify > 0; });
+  uint32_t value = self->notify;
+  if (value > 0) {
+    self->notify = xClearCountOnExit ? 0 : value - 1;
+  };
+  return value;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify)
+{
+  if (xTaskToNotify == nullptr) return pdFAIL;
+  {
+    std::lock_guard<std::mutex> guard(xTaskToNotify->lock);
+    xTaskToNotify->notify++;
+  };
+  xTaskToNotify->cv.notify_all();
+  return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t* pxHigherPriorityTaskWoken)
+{
+  xTaskNotifyGive(xTaskToNotify);
+  if (pxHigherPriorityTaskWoken) *pxHigherPriorityTaskWoken = pdTRUE;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+  return new hostMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* pxMutexBuffer)
+{
+  return new hostMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount)
+{
+  hostMutex* semaphore = new hostMutex();
+  semaphore->counting = true;
+  semaphore->count = uxInitialCount;
+  semaphore->max = uxMaxCount;
+  return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount, StaticSemaphore_t* pxSemaphoreBuffer)
+{
+  return xSemaphoreCreateCounting(uxMaxCount, uxInitialCount);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime)
+{
+  if (xSemaphore->counting) {
+    std::unique_lock<std::mutex> lock(xSemaphore->lock);
+    auto available = [xSemaphore] { return xSemaphore->count > 0; };
+    if (xBlockTime == portMAX_DELAY) {
+      xSemaphore->cv.wait(lock, available);
+    } else if (!xSemaphore->cv.wait_for(lock, std::chrono::milliseconds(pdTICKS_TO_MS(xBlockTime)), available)) {
+      return pdFALSE;
+    };
+    xSemaphore->count--;
+    return pdTRUE;
+  };
+  if (xBlockTime == portMAX_DELAY) {
+    xSemaphore->mutex.lock();
+    return pdTRUE;
+  };
+  if (xBlockTime == 0) {
+    return xSemaphore->mutex.try_lock() ? pdTRUE : pdFALSE;
+  };
+  return xSemaphore->mutex.try_lock_for(std::chrono::milliseconds(pdTICKS_TO_MS(xBlockTime))) ? pdTRUE : pdFALSE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore)
+{
+  if (xSemaphore->counting) {
+    {
+      std::lock_guard<std::mutex> guard(xSemaphore->lock);
+      if (xSemaphore->count >= xSemaphore->max) return pdFALSE;
+      xSemaphore->count++;
+    };
+    xSemaphore->cv.notify_one();
+    return pdTRUE;
+  };
+  xSemaphore->mutex.unlock();
+  return pdTRUE;
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore)
+{
+  delete xSemaphore;
+}
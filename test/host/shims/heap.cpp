@@ -0,0 +1,83 @@
+/* 
+   EN: Heap accounting: the objects of the host build are linked with --wrap=malloc,calloc,realloc,free
+   RU: Учет кучи: объекты сборки на ПК компонуются с --wrap=malloc,calloc,realloc,free
+*/
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <atomic>
+#include "host_internal.h"
+
+extern "C" {
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void __real_free(void* ptr);
+}
+
+static std::atomic<uint64_t> _hostAllocs(0);
+static std::atomic<uint64_t> _hostFrees(0);
+static std::atomic<int64_t> _hostBytes(0);
+static std::atomic<int64_t> _hostPeak(0);
+
+static void hostHeapAdd(void* ptr)
+{
+  int64_t bytes = _hostBytes.fetch_add(malloc_usable_size(ptr)) + malloc_usable_size(ptr);
+  int64_t peak = _hostPeak.load();
+  while ((bytes > peak) && !_hostPeak.compare_exchange_weak(peak, bytes)) {};
+  _hostAllocs++;
+}
+
+static void hostHeapRemove(void* ptr)
+{
+  _hostBytes -= malloc_usable_size(ptr);
+  _hostFrees++;
+}
+
+extern "C" void* __wrap_malloc(size_t size)
+{
+  void* ptr = __real_malloc(size);
+  if (ptr) hostHeapAdd(ptr);
+  return ptr;
+}
+
+extern "C" void* __wrap_calloc(size_t count, size_t size)
+{
+  void* ptr = __real_calloc(count, size);
+  if (ptr) hostHeapAdd(ptr);
+  return ptr;
+}
+
+extern "C" void* __wrap_realloc(void* ptr, size_t size)
+{
+  if (ptr) hostHeapRemove(ptr);
+  void* result = __real_realloc(ptr, size);
+  if (result) {
+    hostHeapAdd(result);
+  } else if (ptr) {
+    // The old block is still allocated
+    hostHeapAdd(ptr);
+  };
+  return result;
+}
+
+extern "C" void __wrap_free(void* ptr)
+{
+  if (ptr) hostHeapRemove(ptr);
+  __real_free(ptr);
+}
+
+void hostHeapGet(host_heap_t* heap)
+{
+  heap->allocs = _hostAllocs.load();
+  heap->frees = _hostFrees.load();
+  heap->bytes = _hostBytes.load();
+  heap->peak = _hostPeak.load();
+}
+
+void hostHeapReset(void)
+{
+  _hostAllocs = 0;
+  _hostFrees = 0;
+  _hostPeak = _hostBytes.load();
+}
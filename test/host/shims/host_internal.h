@@ -0,0 +1,33 @@
+/* 
+   EN: Internal interface between the host build shims
+   RU: Внутренний интерфейс прослоек для сборки на ПК
+*/
+
+#ifndef __HOST_INTERNAL_H__
+#define __HOST_INTERNAL_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include "host.h"
+
+// Microseconds since the start of the process, the common clock of esp_timer and the FreeRTOS tick
+int64_t hostClockUs(void);
+
+bool hostNetworkConnected(void);
+bool hostDnsAvailable(void);
+
+// Address of the fake server from the TG_FAKE_API environment variable ("127.0.0.1:8081")
+bool hostFakeAddress(struct sockaddr_in* addr);
+
+// Connects a TCP socket to the fake server within the timeout, returns -1 on failure
+int hostConnect(const struct sockaddr_in* addr, int timeout_ms);
+
+// Closes the sockets of all HTTP clients (the network has gone down)
+void hostHttpBreakAll(void);
+
+// Memory of the shims themselves is not counted by hostHeapGet()
+extern "C" void* __real_malloc(size_t size);
+extern "C" void __real_free(void* ptr);
+
+#endif // __HOST_INTERNAL_H__
@@ -0,0 +1,11 @@
+#ifndef __DEF_CONSTS_H__
+#define __DEF_CONSTS_H__
+
+#define CONFIG_FORMAT_DTS "%d.%m.%Y %H:%M:%S"
+#define CONFIG_BUFFER_LEN_INT64_RADIX10 21
+
+#define TLS_CERT_BUFFER 1
+#define TLS_CERT_GLOBAL 2
+#define TLS_CERT_BUNGLE 3
+
+#endif // __DEF_CONSTS_H__
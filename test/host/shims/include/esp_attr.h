@@ -0,0 +1,8 @@
+#ifndef __ESP_ATTR_H__
+#define __ESP_ATTR_H__
+
+// There is no RTC memory on the host, the variables are simply not initialized at startup
+#define RTC_NOINIT_ATTR
+#define IRAM_ATTR
+
+#endif // __ESP_ATTR_H__
@@ -0,0 +1,17 @@
+#ifndef __ESP_CRT_BUNDLE_H__
+#define __ESP_CRT_BUNDLE_H__
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The host client connects without TLS, the bundle is never consulted
+esp_err_t esp_crt_bundle_attach(void* conf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ESP_CRT_BUNDLE_H__
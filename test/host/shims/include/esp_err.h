@@ -0,0 +1,36 @@
+/* 
+   EN: ESP-IDF error codes for the host build
+   RU: Коды ошибок ESP-IDF для сборки на ПК
+*/
+
+#ifndef __ESP_ERR_H__
+#define __ESP_ERR_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK                    0
+#define ESP_FAIL                  -1
+
+#define ESP_ERR_NO_MEM            0x101
+#define ESP_ERR_INVALID_ARG       0x102
+#define ESP_ERR_INVALID_STATE     0x103
+#define ESP_ERR_INVALID_SIZE      0x104
+#define ESP_ERR_NOT_FOUND         0x105
+#define ESP_ERR_NOT_SUPPORTED     0x106
+#define ESP_ERR_TIMEOUT           0x107
+#define ESP_ERR_INVALID_RESPONSE  0x108
+
+#define ESP_ERR_HTTP_BASE         0x7000
+#define ESP_ERR_HTTP_MAX_REDIRECT (ESP_ERR_HTTP_BASE + 1)
+#define ESP_ERR_HTTP_CONNECT      (ESP_ERR_HTTP_BASE + 2)
+#define ESP_ERR_HTTP_WRITE_DATA   (ESP_ERR_HTTP_BASE + 3)
+#define ESP_ERR_HTTP_FETCH_HEADER (ESP_ERR_HTTP_BASE + 4)
+#define ESP_ERR_HTTP_EAGAIN       (ESP_ERR_HTTP_BASE + 7)
+#define ESP_ERR_HTTP_CONNECTION_CLOSED (ESP_ERR_HTTP_BASE + 8)
+
+#endif // __ESP_ERR_H__
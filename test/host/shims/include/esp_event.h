@@ -0,0 +1,14 @@
+#ifndef __ESP_EVENT_H__
+#define __ESP_EVENT_H__
+
+#include "esp_err.h"
+
+typedef const char* esp_event_base_t;
+typedef void (*esp_event_handler_t)(void* event_handler_arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+#define ESP_EVENT_DECLARE_BASE(id) extern esp_event_base_t const id
+#define ESP_EVENT_DEFINE_BASE(id) esp_event_base_t const id = #id
+#define ESP_EVENT_ANY_BASE NULL
+#define ESP_EVENT_ANY_ID -1
+
+#endif // __ESP_EVENT_H__
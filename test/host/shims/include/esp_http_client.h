@@ -0,0 +1,98 @@
+/* 
+   EN: esp_http_client for the host build: plain HTTP/1.1 with keep-alive to the fake Bot API server
+   RU: esp_http_client для сборки на ПК: HTTP/1.1 без TLS к имитатору Bot API
+*/
+
+#ifndef __HOST_ESP_HTTP_CLIENT_H__
+#define __HOST_ESP_HTTP_CLIENT_H__
+
+#include "esp_err.h"
+#include "esp_crt_bundle.h"
+
+typedef struct esp_http_client* esp_http_client_handle_t;
+
+typedef enum {
+  HTTP_METHOD_GET = 0,
+  HTTP_METHOD_POST,
+  HTTP_METHOD_PUT,
+  HTTP_METHOD_PATCH,
+  HTTP_METHOD_DELETE,
+  HTTP_METHOD_HEAD,
+  HTTP_METHOD_MAX
+} esp_http_client_method_t;
+
+typedef enum {
+  HTTP_TRANSPORT_UNKNOWN = 0,
+  HTTP_TRANSPORT_OVER_TCP,
+  HTTP_TRANSPORT_OVER_SSL
+} esp_http_client_transport_t;
+
+typedef enum {
+  HttpStatus_Ok              = 200,
+  HttpStatus_BadRequest      = 400,
+  HttpStatus_Unauthorized    = 401,
+  HttpStatus_Forbidden       = 403,
+  HttpStatus_NotFound        = 404,
+  HttpStatus_TooManyRequests = 429,
+  HttpStatus_InternalError   = 500
+} HttpStatus_Code;
+
+typedef struct {
+  const char* url;
+  const char* host;
+  int port;
+  const char* path;
+  const char* query;
+  const char* cert_pem;
+  size_t cert_len;
+  esp_http_client_method_t method;
+  int timeout_ms;
+  esp_http_client_transport_t transport_type;
+  bool use_global_ca_store;
+  bool skip_cert_common_name_check;
+  const char* common_name;
+  esp_err_t (*crt_bundle_attach)(void* conf);
+  bool is_async;
+  bool keep_alive_enable;
+  int keep_alive_idle;
+  int keep_alive_interval;
+  int keep_alive_count;
+  bool save_client_session;
+  int buffer_size;
+  int buffer_size_tx;
+} esp_http_client_config_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The client connects to the address in the TG_FAKE_API environment variable ("127.0.0.1:8081") whatever 
+ * the configured host is, without TLS. A host name has to be resolved first, so it cannot connect while DNS is 
+ * switched off by hostDnsSet(), a numeric address can. Everything else follows ESP-IDF 5.1: the connection is kept between 
+ * requests until the server closes it or esp_http_client_close() is called, esp_http_client_open() sends the 
+ * request headers, and esp_http_client_fetch_headers() returns -ESP_ERR_HTTP_EAGAIN when no response has 
+ * arrived within the timeout. Each new connection is counted as a TLS handshake, as a resumed one if the 
+ * client was created with save_client_session and has been connected before (see hostHttpGet())
+ * */
+esp_http_client_handle_t esp_http_client_init(const esp_http_client_config_t* config);
+esp_err_t esp_http_client_cleanup(esp_http_client_handle_t client);
+esp_err_t esp_http_client_close(esp_http_client_handle_t client);
+esp_err_t esp_http_client_set_url(esp_http_client_handle_t client, const char* url);
+esp_err_t esp_http_client_set_header(esp_http_client_handle_t client, const char* key, const char* value);
+esp_err_t esp_http_client_set_method(esp_http_client_handle_t client, esp_http_client_method_t method);
+esp_err_t esp_http_client_set_timeout_ms(esp_http_client_handle_t client, int timeout_ms);
+esp_err_t esp_http_client_open(esp_http_client_handle_t client, int write_len);
+int esp_http_client_write(esp_http_client_handle_t client, const char* buffer, int len);
+int64_t esp_http_client_fetch_headers(esp_http_client_handle_t client);
+int esp_http_client_read(esp_http_client_handle_t client, char* buffer, int len);
+esp_err_t esp_http_client_flush_response(esp_http_client_handle_t client, int* len);
+int esp_http_client_get_status_code(esp_http_client_handle_t client);
+int64_t esp_http_client_get_content_length(esp_http_client_handle_t client);
+bool esp_http_client_is_complete_data_received(esp_http_client_handle_t client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_ESP_HTTP_CLIENT_H__
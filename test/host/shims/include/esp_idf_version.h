@@ -0,0 +1,9 @@
+#ifndef __ESP_IDF_VERSION_H__
+#define __ESP_IDF_VERSION_H__
+
+#define ESP_IDF_VERSION_VAL(major, minor, patch) ((major << 16) | (minor << 8) | (patch))
+
+// The shims follow the behavior of ESP-IDF 5.1 (esp_http_client_fetch_headers() returns -ESP_ERR_HTTP_EAGAIN on a timeout)
+#define ESP_IDF_VERSION ESP_IDF_VERSION_VAL(5, 1, 0)
+
+#endif // __ESP_IDF_VERSION_H__
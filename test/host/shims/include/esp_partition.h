@@ -0,0 +1,44 @@
+#ifndef __ESP_PARTITION_H__
+#define __ESP_PARTITION_H__
+
+#include "esp_err.h"
+
+typedef enum {
+  ESP_PARTITION_TYPE_APP  = 0x00,
+  ESP_PARTITION_TYPE_DATA = 0x01,
+  ESP_PARTITION_TYPE_ANY  = 0xff
+} esp_partition_type_t;
+
+typedef enum {
+  ESP_PARTITION_SUBTYPE_ANY = 0xff
+} esp_partition_subtype_t;
+
+typedef struct {
+  esp_partition_type_t type;
+  esp_partition_subtype_t subtype;
+  uint32_t address;
+  uint32_t size;
+  uint32_t erase_size;
+  char label[17];
+  bool encrypted;
+  bool readonly;
+} esp_partition_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * The host partition is kept in RAM and behaves like NOR flash: erasing sets the sectors to 0xFF, 
+ * writing can only clear bits. Its label and size are set by hostFlashInit() (see host.h)
+ * */
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label);
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size);
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size);
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ESP_PARTITION_H__
@@ -0,0 +1,16 @@
+#ifndef __ESP_RANDOM_H__
+#define __ESP_RANDOM_H__
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+uint32_t esp_random(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ESP_RANDOM_H__
@@ -0,0 +1,17 @@
+#ifndef __ESP_ROM_CRC_H__
+#define __ESP_ROM_CRC_H__
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// CRC-32 (IEEE 802.3) in the form of the ROM function: the initial value and the result are not inverted by the caller
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ESP_ROM_CRC_H__
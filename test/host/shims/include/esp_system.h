@@ -0,0 +1,6 @@
+#ifndef __ESP_SYSTEM_H__
+#define __ESP_SYSTEM_H__
+
+#include "esp_random.h"
+
+#endif // __ESP_SYSTEM_H__
@@ -0,0 +1,17 @@
+#ifndef __ESP_TIMER_H__
+#define __ESP_TIMER_H__
+
+#include "esp_err.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Microseconds since the start of the process (monotonic clock)
+int64_t esp_timer_get_time(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __ESP_TIMER_H__
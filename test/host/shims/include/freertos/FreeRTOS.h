@@ -0,0 +1,40 @@
+/* 
+   EN: FreeRTOS API on top of POSIX threads for the host build
+   RU: API FreeRTOS поверх потоков POSIX для сборки на ПК
+*/
+
+#ifndef __HOST_FREERTOS_H__
+#define __HOST_FREERTOS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint8_t StackType_t;
+
+#define pdFALSE                  ((BaseType_t)0)
+#define pdTRUE                   ((BaseType_t)1)
+#define pdFAIL                   pdFALSE
+#define pdPASS                   pdTRUE
+
+// One tick is one millisecond, as with CONFIG_FREERTOS_HZ=1000
+#define configTICK_RATE_HZ       1000
+#define portTICK_PERIOD_MS       ((TickType_t)1000 / configTICK_RATE_HZ)
+#define portMAX_DELAY            ((TickType_t)0xffffffffUL)
+#define pdMS_TO_TICKS(xTimeInMs) ((TickType_t)(((TickType_t)(xTimeInMs) * (TickType_t)configTICK_RATE_HZ) / (TickType_t)1000U))
+#define pdTICKS_TO_MS(xTicks)    ((TickType_t)(((uint64_t)(xTicks) * 1000U) / configTICK_RATE_HZ))
+
+#define portNUM_PROCESSORS       2
+#define tskNO_AFFINITY           ((BaseType_t)0x7FFFFFFF)
+
+// There are no interrupts on the host: the ISR variants are called from ordinary threads
+#define portYIELD_FROM_ISR(...)  ((void)0)
+
+typedef struct { uint8_t dummy[64]; } StaticTask_t;
+typedef struct { uint8_t dummy[64]; } StaticSemaphore_t;
+
+#endif // __HOST_FREERTOS_H__
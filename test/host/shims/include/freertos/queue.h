@@ -0,0 +1,6 @@
+#ifndef __HOST_FREERTOS_QUEUE_H__
+#define __HOST_FREERTOS_QUEUE_H__
+
+#include "freertos/FreeRTOS.h"
+
+#endif // __HOST_FREERTOS_QUEUE_H__
@@ -0,0 +1,25 @@
+#ifndef __HOST_FREERTOS_SEMPHR_H__
+#define __HOST_FREERTOS_SEMPHR_H__
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct hostMutex* SemaphoreHandle_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Mutexes and counting semaphores, the static buffer is not used
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t* pxMutexBuffer);
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount);
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t uxMaxCount, UBaseType_t uxInitialCount, StaticSemaphore_t* pxSemaphoreBuffer);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t xSemaphore, TickType_t xBlockTime);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t xSemaphore);
+void vSemaphoreDelete(SemaphoreHandle_t xSemaphore);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_FREERTOS_SEMPHR_H__
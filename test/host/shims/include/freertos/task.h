@@ -0,0 +1,49 @@
+#ifndef __HOST_FREERTOS_TASK_H__
+#define __HOST_FREERTOS_TASK_H__
+
+#include "freertos/FreeRTOS.h"
+
+typedef struct hostTask* TaskHandle_t;
+typedef void (*TaskFunction_t)(void* pvParameters);
+
+typedef enum {
+  eRunning = 0,
+  eReady,
+  eBlocked,
+  eSuspended,
+  eDeleted,
+  eInvalid
+} eTaskState;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Every task is a POSIX thread. The stack size, priority and core are only recorded; the stack buffer 
+ * of a static task is not used. A task deleted or suspended by another task stops at its next call 
+ * to a blocking function (delay, notification, mutex), which is where FreeRTOS tasks normally 
+ * spend their time anyway
+ * */
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t usStackDepth, 
+  void* pvParameters, UBaseType_t uxPriority, TaskHandle_t* pvCreatedTask, BaseType_t xCoreID);
+TaskHandle_t xTaskCreateStaticPinnedToCore(TaskFunction_t pvTaskCode, const char* pcName, uint32_t ulStackDepth, 
+  void* pvParameters, UBaseType_t uxPriority, StackType_t* pxStackBuffer, StaticTask_t* pxTaskBuffer, BaseType_t xCoreID);
+void vTaskDelete(TaskHandle_t xTask);
+void vTaskSuspend(TaskHandle_t xTask);
+void vTaskResume(TaskHandle_t xTask);
+eTaskState eTaskGetState(TaskHandle_t xTask);
+void vTaskDelay(TickType_t xTicksToDelay);
+TickType_t xTaskGetTickCount(void);
+TaskHandle_t xTaskGetCurrentTaskHandle(void);
+BaseType_t xPortGetCoreID(void);
+
+uint32_t ulTaskNotifyTake(BaseType_t xClearCountOnExit, TickType_t xTicksToWait);
+BaseType_t xTaskNotifyGive(TaskHandle_t xTaskToNotify);
+void vTaskNotifyGiveFromISR(TaskHandle_t xTaskToNotify, BaseType_t* pxHigherPriorityTaskWoken);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_FREERTOS_TASK_H__
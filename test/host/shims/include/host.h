@@ -0,0 +1,79 @@
+/* 
+   EN: Control and measurement interface of the host build shims
+   RU: Управление и измерения в прослойках для сборки на ПК
+*/
+
+#ifndef __HOST_H__
+#define __HOST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "esp_err.h"
+
+typedef struct {
+  uint64_t allocs;           // malloc(), calloc() and realloc() calls that returned memory
+  uint64_t frees;            // free() calls with a non-null pointer
+  int64_t bytes;             // Currently allocated
+  int64_t peak;              // High-water mark since the last hostHeapReset()
+} host_heap_t;
+
+typedef struct {
+  uint32_t handshakes;       // New connections (each one costs a full TLS handshake on the device)
+  uint32_t resumed;          // Of them, made by a client that kept its TLS session
+  uint32_t requests;         // Requests sent
+  uint32_t failures;         // Connections that could not be made or broke during a request
+} host_http_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Heap usage by the code linked with --wrap=malloc,calloc,realloc,free (the library, its shims and the tests; 
+ * the C and C++ runtimes are not counted). hostHeapReset() zeroes the call counters and sets the peak to the 
+ * current usage
+ * */
+void hostHeapGet(host_heap_t* heap);
+void hostHeapReset(void);
+
+// Counters of the HTTP client, hostHttpReset() zeroes them
+void hostHttpGet(host_http_t* http);
+void hostHttpReset(void);
+
+/**
+ * Switches the network: going down breaks the open connections and fails new ones, coming up posts 
+ * IP_EVENT_STA_GOT_IP to the registered handlers, like the WiFi module does after a reconnect
+ * */
+void hostNetworkSet(bool connected);
+// Switches the DNS server, while it is off every name fails to resolve
+void hostDnsSet(bool available);
+
+// Last status posted with eventLoopPostError() and the number of events posted with eventLoopPost()
+esp_err_t hostEventsLastError(void);
+uint32_t hostEventsPosted(void);
+
+// (Re)creates the RAM partition found by esp_partition_find_first(), filled with 0xFF
+void hostFlashInit(const char* label, uint32_t size);
+/**
+ * Cuts the power of the flash after this many more bytes have been written: the write in progress stops there, 
+ * the later writes and erases fail and change nothing. A negative value restores the power
+ * */
+void hostFlashCut(int64_t bytes);
+
+/**
+ * Requests to the control interface of the fake server (test/host/fake_api.py), for example 
+ * hostFakeControl("latency_ms=20&fail=429&fail_count=3"). hostFakeStats() receives the JSON of its counters, 
+ * hostFakeGet() the response to any GET request (/_messages). Return false if the server could not be reached
+ * */
+bool hostFakeControl(const char* query);
+bool hostFakeStats(char* buffer, size_t size);
+bool hostFakeGet(const char* path, char* buffer, size_t size);
+// Integer value of the key in the JSON of hostFakeStats(), -1 if there is no such key
+long long hostJsonInt(const char* json, const char* key);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_H__
@@ -0,0 +1,25 @@
+#ifndef __HOST_LWIP_NETDB_H__
+#define __HOST_LWIP_NETDB_H__
+
+#include <netdb.h>
+#include <netinet/in.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Like lwIP with LWIP_COMPAT_SOCKETS, getaddrinfo() is a macro. Every name resolves to the address of the 
+ * fake server, or fails while DNS is switched off by hostDnsSet() (see host.h)
+ * */
+int lwip_getaddrinfo(const char* nodename, const char* servname, const struct addrinfo* hints, struct addrinfo** res);
+void lwip_freeaddrinfo(struct addrinfo* ai);
+
+#define getaddrinfo(nodname, servname, hints, res) lwip_getaddrinfo(nodname, servname, hints, res)
+#define freeaddrinfo(addrinfo) lwip_freeaddrinfo(addrinfo)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_LWIP_NETDB_H__
@@ -0,0 +1,20 @@
+#ifndef __HOST_LWIP_SOCKETS_H__
+#define __HOST_LWIP_SOCKETS_H__
+
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include "lwip/netdb.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+char* lwip_inet_ntoa_r(struct in_addr addr, char* buf, int buflen);
+
+#define inet_ntoa_r(addr, buf, buflen) lwip_inet_ntoa_r(addr, buf, buflen)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_LWIP_SOCKETS_H__
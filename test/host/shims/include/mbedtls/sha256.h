@@ -0,0 +1,17 @@
+#ifndef __HOST_MBEDTLS_SHA256_H__
+#define __HOST_MBEDTLS_SHA256_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int mbedtls_sha256(const unsigned char* input, size_t ilen, unsigned char* output, int is224);
+int mbedtls_sha256_ret(const unsigned char* input, size_t ilen, unsigned char* output, int is224);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_MBEDTLS_SHA256_H__
@@ -0,0 +1,19 @@
+#ifndef __HOST_MBEDTLS_SSL_H__
+#define __HOST_MBEDTLS_SSL_H__
+
+#include "mbedtls/x509_crt.h"
+
+typedef struct mbedtls_ssl_config mbedtls_ssl_config;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mbedtls_ssl_conf_ca_chain(mbedtls_ssl_config* conf, mbedtls_x509_crt* ca_chain, mbedtls_x509_crl* ca_crl);
+void mbedtls_ssl_conf_verify(mbedtls_ssl_config* conf, int (*f_vrfy)(void*, mbedtls_x509_crt*, int, uint32_t*), void* p_vrfy);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_MBEDTLS_SSL_H__
@@ -0,0 +1,38 @@
+#ifndef __HOST_MBEDTLS_X509_CRT_H__
+#define __HOST_MBEDTLS_X509_CRT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Declarations only: the host build has no TLS, the trust cache and the key pin are not compiled in
+
+#define MBEDTLS_X509_BADCERT_OTHER 0x0100
+
+typedef struct {
+  int tag;
+  size_t len;
+  unsigned char* p;
+} mbedtls_x509_buf;
+
+typedef struct mbedtls_x509_crt {
+  mbedtls_x509_buf raw;
+  mbedtls_x509_buf pk_raw;
+  struct mbedtls_x509_crt* next;
+} mbedtls_x509_crt;
+
+typedef struct mbedtls_x509_crl mbedtls_x509_crl;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void mbedtls_x509_crt_init(mbedtls_x509_crt* crt);
+void mbedtls_x509_crt_free(mbedtls_x509_crt* crt);
+int mbedtls_x509_crt_parse(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen);
+int mbedtls_x509_crt_parse_der(mbedtls_x509_crt* chain, const unsigned char* buf, size_t buflen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __HOST_MBEDTLS_X509_CRT_H__
@@ -0,0 +1,76 @@
+/* 
+   EN: Project configuration of the host build. The test targets override these values with compile definitions
+   RU: Конфигурация проекта для сборки на ПК. Тестовые цели переопределяют значения через определения компилятора
+*/
+
+#ifndef __PROJECT_CONFIG_H__
+#define __PROJECT_CONFIG_H__
+
+#include "def_consts.h"
+
+// The fake server accepts any token, the token of the first bot also addresses its statistics
+#ifndef CONFIG_TELEGRAM_TOKEN
+  #define CONFIG_TELEGRAM_TOKEN "1000001:HOST"
+#endif // CONFIG_TELEGRAM_TOKEN
+
+#ifndef CONFIG_TELEGRAM_CHAT_ID_MAIN
+  #define CONFIG_TELEGRAM_CHAT_ID_MAIN "10001"
+#endif // CONFIG_TELEGRAM_CHAT_ID_MAIN
+#ifndef CONFIG_TELEGRAM_CHAT_ID_SERVICE
+  #define CONFIG_TELEGRAM_CHAT_ID_SERVICE "10002"
+#endif // CONFIG_TELEGRAM_CHAT_ID_SERVICE
+#ifndef CONFIG_TELEGRAM_CHAT_ID_PARAMS
+  #define CONFIG_TELEGRAM_CHAT_ID_PARAMS "10003"
+#endif // CONFIG_TELEGRAM_CHAT_ID_PARAMS
+#ifndef CONFIG_TELEGRAM_CHAT_ID_SECURITY
+  #define CONFIG_TELEGRAM_CHAT_ID_SECURITY "-10004"
+#endif // CONFIG_TELEGRAM_CHAT_ID_SECURITY
+
+// The host client has no TLS, the certificate bundle is the option that needs no embedded files
+#ifndef CONFIG_TELEGRAM_TLS_PEM_STORAGE
+  #define CONFIG_TELEGRAM_TLS_PEM_STORAGE TLS_CERT_BUNGLE
+#endif // CONFIG_TELEGRAM_TLS_PEM_STORAGE
+
+#ifndef CONFIG_TELEGRAM_TITLE_ENABLED
+  #define CONFIG_TELEGRAM_TITLE_ENABLED 1
+#endif // CONFIG_TELEGRAM_TITLE_ENABLED
+#ifndef CONFIG_TELEGRAM_STACK_SIZE
+  #define CONFIG_TELEGRAM_STACK_SIZE 4096
+#endif // CONFIG_TELEGRAM_STACK_SIZE
+#ifndef CONFIG_TELEGRAM_QUEUE_SIZE
+  #define CONFIG_TELEGRAM_QUEUE_SIZE 16
+#endif // CONFIG_TELEGRAM_QUEUE_SIZE
+#ifndef CONFIG_TASK_PRIORITY_TELEGRAM
+  #define CONFIG_TASK_PRIORITY_TELEGRAM 3
+#endif // CONFIG_TASK_PRIORITY_TELEGRAM
+#ifndef CONFIG_TASK_CORE_TELEGRAM
+  #define CONFIG_TASK_CORE_TELEGRAM 1
+#endif // CONFIG_TASK_CORE_TELEGRAM
+#ifndef CONFIG_TELEGRAM_MAX_ATTEMPTS
+  #define CONFIG_TELEGRAM_MAX_ATTEMPTS 3
+#endif // CONFIG_TELEGRAM_MAX_ATTEMPTS
+#ifndef CONFIG_TELEGRAM_SEND_INTERVAL
+  #define CONFIG_TELEGRAM_SEND_INTERVAL 100
+#endif // CONFIG_TELEGRAM_SEND_INTERVAL
+#ifndef CONFIG_TELEGRAM_FORBIDDEN_INTERVAL
+  #define CONFIG_TELEGRAM_FORBIDDEN_INTERVAL 1000
+#endif // CONFIG_TELEGRAM_FORBIDDEN_INTERVAL
+#ifndef CONFIG_TELEGRAM_INTERNET_INTERVAL
+  #define CONFIG_TELEGRAM_INTERNET_INTERVAL 1000
+#endif // CONFIG_TELEGRAM_INTERNET_INTERVAL
+
+// Short deadlines keep the fault scenarios fast
+#ifndef CONFIG_TELEGRAM_CONNECT_TIMEOUT
+  #define CONFIG_TELEGRAM_CONNECT_TIMEOUT 2000
+#endif // CONFIG_TELEGRAM_CONNECT_TIMEOUT
+#ifndef CONFIG_TELEGRAM_RESPONSE_TIMEOUT
+  #define CONFIG_TELEGRAM_RESPONSE_TIMEOUT 5000
+#endif // CONFIG_TELEGRAM_RESPONSE_TIMEOUT
+#ifndef CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT
+  #define CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT 2000
+#endif // CONFIG_TELEGRAM_RETRY_MAX_TRANSPORT
+#ifndef CONFIG_TELEGRAM_RETRY_MAX_SERVER
+  #define CONFIG_TELEGRAM_RETRY_MAX_SERVER 2000
+#endif // CONFIG_TELEGRAM_RETRY_MAX_SERVER
+
+#endif // __PROJECT_CONFIG_H__
@@ -0,0 +1,35 @@
+/* 
+   EN: Logging of the rLog library for the host build: messages go to stderr
+   RU: Журнал библиотеки rLog для сборки на ПК: сообщения выводятся в stderr
+*/
+
+#ifndef __RLOG_H__
+#define __RLOG_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Prints the message if its level passes the TG_HOST_LOG environment variable: 
+ * E, W (default), I, D or V, N disables the log
+ * */
+void hostLog(char level, const char* tag, const char* format, ...) __attribute__((format(printf, 3, 4)));
+
+#ifdef __cplusplus
+}
+#endif
+
+#define rlog_e(tag, format, ...) hostLog('E', tag, format, ##__VA_ARGS__)
+#define rlog_w(tag, format, ...) hostLog('W', tag, format, ##__VA_ARGS__)
+#define rlog_i(tag, format, ...) hostLog('I', tag, format, ##__VA_ARGS__)
+#define rlog_d(tag, format, ...) hostLog('D', tag, format, ##__VA_ARGS__)
+#define rlog_v(tag, format, ...) hostLog('V', tag, format, ##__VA_ARGS__)
+
+#define rloga_e(format, ...) rlog_e(logTAG, format, ##__VA_ARGS__)
+#define rloga_w(format, ...) rlog_w(logTAG, format, ##__VA_ARGS__)
+#define rloga_i(format, ...) rlog_i(logTAG, format, ##__VA_ARGS__)
+#define rloga_d(format, ...) rlog_d(logTAG, format, ##__VA_ARGS__)
+#define rloga_v(format, ...) rlog_v(logTAG, format, ##__VA_ARGS__)
+
+#endif // __RLOG_H__
@@ -0,0 +1,6 @@
+#ifndef __RSTRINGS_H__
+#define __RSTRINGS_H__
+
+#include <stdint.h>
+
+#endif // __RSTRINGS_H__
@@ -0,0 +1,35 @@
+/* 
+   EN: Message options of the rTypes library for the host build
+   RU: Параметры сообщений библиотеки rTypes для сборки на ПК
+*/
+
+#ifndef __RTYPES_H__
+#define __RTYPES_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+  MK_MAIN = 0,
+  MK_SERVICE,
+  MK_PARAMS,
+  MK_SECURITY
+} msg_kind_t;
+
+typedef enum {
+  MP_LOW = 0,
+  MP_ORDINARY,
+  MP_HIGH,
+  MP_CRITICAL
+} msg_priority_t;
+
+typedef uint16_t msg_options_t;
+
+#define encMsgOptions(kind, notify, priority) ((msg_options_t)((((kind) & 0x0F) << 8) | (((notify) ? 1 : 0) << 4) | ((priority) & 0x0F)))
+#define decMsgOptionsKind(options) ((msg_kind_t)(((options) >> 8) & 0x0F))
+#define decMsgOptionsNotify(options) ((bool)(((options) >> 4) & 0x01))
+#define decMsgOptionsPriority(options) ((msg_priority_t)((options) & 0x0F))
+
+#endif // __RTYPES_H__
@@ -0,0 +1,18 @@
+#ifndef __REESP32_H__
+#define __REESP32_H__
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// There is no PSRAM on the host, the memory comes from the heap and is counted like any other allocation
+void* psram_calloc(size_t count, size_t size);
+void ledSysActivity(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __REESP32_H__
@@ -0,0 +1,33 @@
+/* 
+   EN: Event loop of the reEvents library for the host build
+   RU: Цикл событий библиотеки reEvents для сборки на ПК
+*/
+
+#ifndef __REEVENTS_H__
+#define __REEVENTS_H__
+
+#include "esp_event.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum {
+  RE_SYS_STARTED = 0,
+  RE_SYS_TELEGRAM_ERROR
+} re_system_event_id_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Handlers are called synchronously by the thread that posts the event, the event data is passed as is. 
+ * The last status posted by eventLoopPostError() is available through hostEventsGet() (see host.h)
+ * */
+bool eventHandlerRegister(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void* event_handler_arg);
+bool eventLoopPost(esp_event_base_t event_base, int32_t event_id, void* event_data, size_t event_data_size, TickType_t ticks_to_wait);
+bool eventLoopPostError(int32_t event_id, esp_err_t event_data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __REEVENTS_H__
@@ -0,0 +1,19 @@
+#ifndef __RESTATES_H__
+#define __RESTATES_H__
+
+#include "freertos/FreeRTOS.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// The network and internet are available from the start, they are switched by hostNetworkSet() (see host.h)
+bool statesNetworkIsConnected(void);
+bool statesInetIsAvailable(void);
+bool statesInetWait(TickType_t timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __RESTATES_H__
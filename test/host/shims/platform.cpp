@@ -0,0 +1,418 @@
+/* 
+   EN: ESP-IDF services and the libraries of the project for the host build: time, random numbers, CRC, 
+   flash partition, log, events, network states, DNS and the control interface of the fake server
+   RU: Службы ESP-IDF и библиотеки проекта для сборки на ПК
+*/
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include "esp_timer.h"
+#include "esp_random.h"
+#include "esp_rom_crc.h"
+#include "esp_partition.h"
+#include "esp_netif.h"
+#include "esp_crt_bundle.h"
+#include "lwip/netdb.h"
+#include "lwip/sockets.h"
+#include "rLog.h"
+#include "reEsp32.h"
+#include "reEvents.h"
+#include "reStates.h"
+#include "host_internal.h"
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Time, random numbers -------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static const std::chrono::steady_clock::time_point _hostStarted = std::chrono::steady_clock::now();
+
+int64_t hostClockUs(void)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - _hostStarted).count();
+}
+
+int64_t esp_timer_get_time(void)
+{
+  return hostClockUs();
+}
+
+uint32_t esp_random(void)
+{
+  static std::mutex lock;
+  static std::mt19937 generator(std::random_device{}());
+  std::lock_guard<std::mutex> guard(lock);
+  return generator();
+}
+
+uint32_t esp_rom_crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len)
+{
+  crc = ~crc;
+  while (len--) {
+    crc ^= *buf++;
+    for (int i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320u & (0u - (crc & 1)));
+    };
+  };
+  return ~crc;
+}
+
+void* psram_calloc(size_t count, size_t size)
+{
+  return calloc(count, size);
+}
+
+void ledSysActivity(void)
+{
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------- Flash partition ---------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+#define HOST_FLASH_SECTOR 4096
+
+static esp_partition_t _hostPartition;
+static uint8_t* _hostFlash = nullptr;
+static int64_t _hostFlashPower = -1;
+
+void hostFlashInit(const char* label, uint32_t size)
+{
+  if (_hostFlash) __real_free(_hostFlash);
+  size = (size + HOST_FLASH_SECTOR - 1) & ~(HOST_FLASH_SECTOR - 1);
+  _hostFlash = (uint8_t*)__real_malloc(size);
+  memset(_hostFlash, 0xFF, size);
+  memset(&_hostPartition, 0, sizeof(_hostPartition));
+  _hostPartition.type = ESP_PARTITION_TYPE_DATA;
+  _hostPartition.subtype = ESP_PARTITION_SUBTYPE_ANY;
+  _hostPartition.size = size;
+  _hostPartition.erase_size = HOST_FLASH_SECTOR;
+  strncpy(_hostPartition.label, label, sizeof(_hostPartition.label) - 1);
+  _hostFlashPower = -1;
+}
+
+void hostFlashCut(int64_t bytes)
+{
+  _hostFlashPower = bytes;
+}
+
+const esp_partition_t* esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char* label)
+{
+  if ((_hostFlash == nullptr) || (type != _hostPartition.type)) return nullptr;
+  if ((label) && (strcmp(label, _hostPartition.label) != 0)) return nullptr;
+  return &_hostPartition;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t* partition, size_t src_offset, void* dst, size_t size)
+{
+  if ((partition != &_hostPartition) || (src_offset + size > partition->size)) return ESP_ERR_INVALID_SIZE;
+  memcpy(dst, _hostFlash + src_offset, size);
+  return ESP_OK;
+}
+
+// NOR flash: programming can only clear bits
+esp_err_t esp_partition_write(const esp_partition_t* partition, size_t dst_offset, const void* src, size_t size)
+{
+  if ((partition != &_hostPartition) || (dst_offset + size > partition->size)) return ESP_ERR_INVALID_SIZE;
+  const uint8_t* data = (const uint8_t*)src;
+  for (size_t i = 0; i < size; i++) {
+    if (_hostFlashPower == 0) return ESP_FAIL;
+    if (_hostFlashPower > 0) _hostFlashPower--;
+    _hostFlash[dst_offset + i] &= data[i];
+  };
+  return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* partition, size_t offset, size_t size)
+{
+  if ((partition != &_hostPartition) || (offset + size > partition->size)) return ESP_ERR_INVALID_SIZE;
+  if ((offset % HOST_FLASH_SECTOR) || (size % HOST_FLASH_SECTOR)) return ESP_ERR_INVALID_ARG;
+  if (_hostFlashPower == 0) return ESP_FAIL;
+  memset(_hostFlash + offset, 0xFF, size);
+  return ESP_OK;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------- Log --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static int hostLogRank(char level)
+{
+  switch (level) {
+    case 'N': return 0;
+    case 'E': return 1;
+    case 'W': return 2;
+    case 'I': return 3;
+    case 'D': return 4;
+    case 'V': return 5;
+    default:  return 2;
+  };
+}
+
+void hostLog(char level, const char* tag, const char* format, ...)
+{
+  static const int limit = hostLogRank(getenv("TG_HOST_LOG") ? getenv("TG_HOST_LOG")[0] : 'W');
+  if (hostLogRank(level) > limit) return;
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  fprintf(stderr, "%c (%lld) %s: %s\n", level, (long long)(hostClockUs() / 1000), tag, buffer);
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------------- Events --------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+ESP_EVENT_DEFINE_BASE(IP_EVENT);
+
+#define HOST_EVENT_HANDLERS 16
+
+typedef struct {
+  esp_event_base_t base;
+  int32_t id;
+  esp_event_handler_t handler;
+  void* arg;
+} hostHandler_t;
+
+static std::mutex _hostEventsLock;
+static hostHandler_t _hostHandlers[HOST_EVENT_HANDLERS];
+static uint8_t _hostHandlersCount = 0;
+static std::atomic<esp_err_t> _hostLastError(ESP_OK);
+static std::atomic<uint32_t> _hostPosted(0);
+
+bool eventHandlerRegister(esp_event_base_t event_base, int32_t event_id, esp_event_handler_t event_handler, void* event_handler_arg)
+{
+  std::lock_guard<std::mutex> guard(_hostEventsLock);
+  if (_hostHandlersCount >= HOST_EVENT_HANDLERS) return false;
+  _hostHandlers[_hostHandlersCount++] = { event_base, event_id, event_handler, event_handler_arg };
+  return true;
+}
+
+bool eventLoopPost(esp_event_base_t event_base, int32_t event_id, void* event_data, size_t event_data_size, TickType_t ticks_to_wait)
+{
+  _hostPosted++;
+  hostHandler_t handlers[HOST_EVENT_HANDLERS];
+  uint8_t count;
+  {
+    std::lock_guard<std::mutex> guard(_hostEventsLock);
+    count = _hostHandlersCount;
+    memcpy(handlers, _hostHandlers, sizeof(handlers));
+  };
+  for (uint8_t i = 0; i < count; i++) {
+    if (((handlers[i].base == event_base) || (handlers[i].base == ESP_EVENT_ANY_BASE)) 
+     && ((handlers[i].id == event_id) || (handlers[i].id == ESP_EVENT_ANY_ID))) {
+      handlers[i].handler(handlers[i].arg, event_base, event_id, event_data);
+    };
+  };
+  return true;
+}
+
+bool eventLoopPostError(int32_t event_id, esp_err_t event_data)
+{
+  _hostLastError = event_data;
+  return true;
+}
+
+esp_err_t hostEventsLastError(void)
+{
+  return _hostLastError.load();
+}
+
+uint32_t hostEventsPosted(void)
+{
+  return _hostPosted.load();
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// -------------------------------------------------- Network and DNS ----------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+static std::mutex _hostNetworkLock;
+static std::condition_variable _hostNetworkChanged;
+static bool _hostNetwork = true;
+static std::atomic<bool> _hostDns(true);
+
+bool hostNetworkConnected(void)
+{
+  std::lock_guard<std::mutex> guard(_hostNetworkLock);
+  return _hostNetwork;
+}
+
+void hostNetworkSet(bool connected)
+{
+  {
+    std::lock_guard<std::mutex> guard(_hostNetworkLock);
+    _hostNetwork = connected;
+  };
+  _hostNetworkChanged.notify_all();
+  if (connected) {
+    eventLoopPost(IP_EVENT, IP_EVENT_STA_GOT_IP, nullptr, 0, portMAX_DELAY);
+  } else {
+    hostHttpBreakAll();
+  };
+}
+
+bool statesNetworkIsConnected(void)
+{
+  return hostNetworkConnected();
+}
+
+bool statesInetIsAvailable(void)
+{
+  return hostNetworkConnected();
+}
+
+bool statesInetWait(TickType_t timeout)
+{
+  std::unique_lock<std::mutex> lock(_hostNetworkLock);
+  if (timeout == portMAX_DELAY) {
+    _hostNetworkChanged.wait(lock, [] { return _hostNetwork; });
+    return true;
+  };
+  return _hostNetworkChanged.wait_for(lock, std::chrono::milliseconds(pdTICKS_TO_MS(timeout)), [] { return _hostNetwork; });
+}
+
+bool hostDnsAvailable(void)
+{
+  return _hostDns.load() && hostNetworkConnected();
+}
+
+void hostDnsSet(bool available)
+{
+  _hostDns = available;
+}
+
+bool hostFakeAddress(struct sockaddr_in* addr)
+{
+  const char* env = getenv("TG_FAKE_API");
+  if ((env == nullptr) || (strchr(env, ':') == nullptr)) return false;
+  std::string host(env, strchr(env, ':') - env);
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_port = htons((uint16_t)atoi(strchr(env, ':') + 1));
+  return inet_pton(AF_INET, host.c_str(), &addr->sin_addr) == 1;
+}
+
+int hostConnect(const struct sockaddr_in* addr, int timeout_ms)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  int flags = fcntl(fd, F_GETFL, 0);
+  fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+  int ret = connect(fd, (const struct sockaddr*)addr, sizeof(*addr));
+  if ((ret < 0) && (errno == EINPROGRESS)) {
+    struct pollfd pfd = { fd, POLLOUT, 0 };
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if ((poll(&pfd, 1, timeout_ms) == 1) && (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0) && (error == 0)) {
+      ret = 0;
+    };
+  };
+  if (ret < 0) {
+    close(fd);
+    return -1;
+  };
+  fcntl(fd, F_SETFL, flags);
+  int nodelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  return fd;
+}
+
+// The result lives in thread local storage, so the resolver allocates nothing
+int lwip_getaddrinfo(const char* nodename, const char* servname, const struct addrinfo* hints, struct addrinfo** res)
+{
+  static thread_local struct addrinfo info;
+  static thread_local struct sockaddr_in addr;
+  if (!hostDnsAvailable() || !hostFakeAddress(&addr)) {
+    *res = nullptr;
+    return EAI_FAIL;
+  };
+  memset(&info, 0, sizeof(info));
+  info.ai_family = AF_INET;
+  info.ai_socktype = SOCK_STREAM;
+  info.ai_addrlen = sizeof(addr);
+  info.ai_addr = (struct sockaddr*)&addr;
+  *res = &info;
+  return 0;
+}
+
+void lwip_freeaddrinfo(struct addrinfo* ai)
+{
+}
+
+char* lwip_inet_ntoa_r(struct in_addr addr, char* buf, int buflen)
+{
+  return inet_ntop(AF_INET, &addr, buf, buflen) ? buf : nullptr;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// --------------------------------------------------------- TLS ---------------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+esp_err_t esp_crt_bundle_attach(void* conf)
+{
+  return ESP_OK;
+}
+
+// -----------------------------------------------------------------------------------------------------------------------
+// ------------------------------------------------ Fake server control --------------------------------------------------
+// -----------------------------------------------------------------------------------------------------------------------
+
+bool hostFakeGet(const char* path, char* buffer, size_t size)
+{
+  struct sockaddr_in addr;
+  if (!hostFakeAddress(&addr)) return false;
+  int fd = hostConnect(&addr, 2000);
+  if (fd < 0) return false;
+  std::string request = std::string("GET ") + path + " HTTP/1.1\r\nHost: fake\r\nConnection: close\r\n\r\n";
+  bool ok = send(fd, request.data(), request.size(), MSG_NOSIGNAL) == (ssize_t)request.size();
+  std::string response;
+  char chunk[1024];
+  ssize_t received;
+  while (ok && ((received = recv(fd, chunk, sizeof(chunk), 0)) > 0)) {
+    response.append(chunk, received);
+  };
+  close(fd);
+  size_t body = response.find("\r\n\r\n");
+  ok = ok && (response.compare(0, 12, "HTTP/1.1 200") == 0 || response.compare(0, 12, "HTTP/1.0 200") == 0) && (body != std::string::npos);
+  if (ok && buffer && size) {
+    snprintf(buffer, size, "%s", response.c_str() + body + 4);
+  };
+  return ok;
+}
+
+bool hostFakeControl(const char* query)
+{
+  return hostFakeGet((std::string("/_control?") + query).c_str(), nullptr, 0);
+}
+
+bool hostFakeStats(char* buffer, size_t size)
+{
+  return hostFakeGet("/_stats", buffer, size);
+}
+
+long long hostJsonInt(const char* json, const char* key)
+{
+  std::string pattern = std::string("\"") + key + "\":";
+  const char* found = strstr(json, pattern.c_str());
+  if (found == nullptr) return -1;
+  found += pattern.size();
+  while (*found == ' ') found++;
+  return atoll(found);
+}
@@ -0,0 +1,183 @@
+/*
+   EN: Commands received with getUpdates (CONFIG_TELEGRAM_COMMANDS): the response is parsed in chunks of any size,
+   every update is dispatched once and only from the configured chats, the backlog of a cold start is confirmed
+   without being executed, and an outgoing message does not wait for an idle long poll. Includes the library source
+   RU: Команды, полученные через getUpdates (CONFIG_TELEGRAM_COMMANDS): ответ разбирается частями любого размера,
+   каждое обновление обрабатывается один раз и только из настроенных чатов, накопленное до холодного старта
+   подтверждается без выполнения, а исходящее сообщение не ждет простаивающий длинный опрос. Включает исходник
+   библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <mutex>
+#include <string>
+#include <vector>
+#include "host_test.h"
+
+static const char* const _response =
+  "{\"ok\":true,\"result\":["
+  "{\"update_id\":501,\"message\":{\"message_id\":7,\"from\":{\"id\":10001,\"is_bot\":false},"
+    "\"chat\":{\"id\":10001,\"type\":\"private\"},\"date\":1,\"text\":\"/relay on\"}},"
+  "{\"update_id\":502,\"message\":{\"message_id\":8,\"from\":{\"id\":55555,\"is_bot\":false},"
+    "\"chat\":{\"id\":55555,\"type\":\"private\"},\"date\":1,\"text\":\"/relay off\"}},"
+  "{\"update_id\":503,\"message\":{\"message_id\":9,\"from\":{\"id\":10001,\"is_bot\":false},"
+    "\"chat\":{\"id\":10001,\"type\":\"private\"},\"date\":1,\"text\":\"hello\"}},"
+  "{\"update_id\":504,\"channel_post\":{\"message_id\":10,\"chat\":{\"id\":-10004,\"type\":\"channel\"},"
+    "\"date\":1,\"text\":\"/status \\\"now\\\"\\n\\u00e9\"}}"
+  "]}";
+
+static std::mutex _lock;
+static std::vector<tg_command_t> _posted;
+static std::vector<std::string> _relay;
+
+// Every command posted to the event loop
+static void onCommandEvent(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _posted.push_back(*(const tg_command_t*)event_data);
+}
+
+static void onRelay(const tg_command_t* command, const char* args, void* ctx)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _relay.push_back(args);
+}
+
+static size_t posted()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  return _posted.size();
+}
+
+static void resetPosted()
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  _posted.clear();
+  _relay.clear();
+}
+
+// Times the command with this text has been posted
+static int postedText(const char* text)
+{
+  std::lock_guard<std::mutex> guard(_lock);
+  int count = 0;
+  for (const tg_command_t& command : _posted) {
+    if (strcmp(command.text, text) == 0) count++;
+  };
+  return count;
+}
+
+static void parseInChunks(tgUpdates_t* upd, size_t chunk)
+{
+  size_t len = strlen(_response);
+  for (size_t pos = 0; pos < len; pos += chunk) {
+    tgUpdatesParse(upd, _response + pos, (int)(pos + chunk < len ? chunk : len - pos));
+  };
+}
+
+// The same response split anywhere gives the same commands, and a repeated response gives none
+static void test_parse_in_chunks()
+{
+  const size_t chunks[] = { 1, 2, 3, 5, 7, 13, 64, strlen(_response) };
+  for (size_t chunk : chunks) {
+    resetPosted();
+    _tgUpdatesOffset = 0;
+    tgUpdatesInit(&_tgUpdates, 0, true);
+    parseInChunks(&_tgUpdates, chunk);
+    TEST_ASSERT_EQ(505, _tgUpdates.offset);
+    TEST_ASSERT_EQ(2, posted());
+    {
+      std::lock_guard<std::mutex> guard(_lock);
+      TEST_ASSERT_EQ(501, _posted[0].update_id);
+      TEST_ASSERT_EQ(10001, _posted[0].chat_id);
+      TEST_ASSERT_EQ(10001, _posted[0].from_id);
+      TEST_ASSERT(strcmp(_posted[0].text, "/relay on") == 0);
+      TEST_ASSERT_EQ(504, _posted[1].update_id);
+      TEST_ASSERT_EQ(-10004, _posted[1].chat_id);
+      TEST_ASSERT_EQ(0, _posted[1].from_id);
+      TEST_ASSERT(strcmp(_posted[1].text, "/status \"now\"\n?") == 0);
+    };
+    // The offset is saved before each command is posted
+    TEST_ASSERT_EQ(505, _tgUpdatesOffset);
+
+    // The server repeats the updates if the offset has not reached it
+    tgUpdatesInit(&_tgUpdates, _tgUpdatesOffset, true);
+    parseInChunks(&_tgUpdates, chunk);
+    TEST_ASSERT_EQ(2, posted());
+    TEST_ASSERT_EQ(505, _tgUpdates.offset);
+  };
+  // The backlog of a cold start is only confirmed
+  resetPosted();
+  tgUpdatesInit(&_tgUpdates, 0, false);
+  parseInChunks(&_tgUpdates, 7);
+  TEST_ASSERT_EQ(0, posted());
+  TEST_ASSERT_EQ(505, _tgUpdates.offset);
+  _tgUpdatesOffset = 0;
+}
+
+// The update queued before the start has been confirmed by the first poll, but not executed
+static void test_backlog_confirmed()
+{
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("method_getUpdates") >= 2; }, 10000));
+  TEST_ASSERT_EQ(0, postedText("/relay backlog"));
+  TEST_ASSERT(_tgUpdatesOffset > 0);
+}
+
+// Each command is executed once, however many polls follow it
+static void test_commands_dispatched_once()
+{
+  resetPosted();
+  hostFakeControl("update=/relay%20first");
+  TEST_ASSERT(hostWaitFor([] { return postedText("/relay first") > 0; }, 5000));
+  int64_t offset = _tgUpdatesOffset;
+  hostFakeControl("update=/relay%20second");
+  hostFakeControl("update=/relay%20third&update_chat=55555");
+  TEST_ASSERT(hostWaitFor([] { return postedText("/relay second") > 0; }, 5000));
+  long long polls = hostFakeCounter("method_getUpdates");
+  // Long polls of the fake server end after a second
+  TEST_ASSERT(hostWaitFor([polls] { return hostFakeCounter("method_getUpdates") >= polls + 2; }, 5000));
+  TEST_ASSERT_EQ(1, postedText("/relay first"));
+  TEST_ASSERT_EQ(1, postedText("/relay second"));
+  TEST_ASSERT_EQ(0, postedText("/relay third"));
+  TEST_ASSERT_EQ(offset + 2, _tgUpdatesOffset);
+  std::lock_guard<std::mutex> guard(_lock);
+  TEST_ASSERT_EQ(2, _relay.size());
+  TEST_ASSERT(_relay[0] == "first");
+  TEST_ASSERT(_relay[1] == "second");
+}
+
+// With a single worker, a message interrupts the long poll instead of waiting for it to end
+static void test_message_preempts_poll()
+{
+  hostResetCounters();
+  TEST_ASSERT(hostWaitFor([] { return __atomic_load_n(&_tgWorkers[0].updates, __ATOMIC_RELAXED); }, 5000));
+  usleep(50000);
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+  params.callback = hostOnResult;
+  int64_t started = esp_timer_get_time();
+  TEST_ASSERT(tgSendMsgEx(&params, "Commands", "Sent during a long poll"));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 5000));
+  int64_t elapsed = esp_timer_get_time() - started;
+  fprintf(stderr, "  delivered %.1f ms after it was sent during a long poll\n", elapsed / 1000.0);
+  TEST_ASSERT_EQ(1, _hostDelivered.load());
+  TEST_ASSERT(elapsed < 500000);
+  // Polling goes on afterwards
+  long long polls = hostFakeCounter("method_getUpdates");
+  TEST_ASSERT(hostWaitFor([polls] { return hostFakeCounter("method_getUpdates") > polls; }, 5000));
+}
+
+int main()
+{
+  eventHandlerRegister(RE_TELEGRAM_EVENTS, RE_TELEGRAM_COMMAND, &onCommandEvent, nullptr);
+  TEST_RUN(test_parse_in_chunks);
+
+  if (!tgCommandRegister("/relay", onRelay, nullptr)) return 1;
+  hostFakeControl("reset=1");
+  hostFakeControl("update=/relay%20backlog");
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_backlog_confirmed);
+  TEST_RUN(test_commands_dispatched_once);
+  TEST_RUN(test_message_preempts_poll);
+  return TEST_RESULT();
+}
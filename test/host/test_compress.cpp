@@ -0,0 +1,307 @@
+/*
+   EN: Compression of the messages waiting in the outbox (CONFIG_TELEGRAM_OUTBOX_COMPRESS): random and typical texts
+   come back unchanged, damaged data is refused, messages kept while the network is down arrive at the fake server
+   as they were sent, and the ratio and the CPU time per message are measured. Includes the library source
+   RU: Сжатие сообщений, ожидающих в очереди отправки (CONFIG_TELEGRAM_OUTBOX_COMPRESS): случайные и типичные тексты
+   восстанавливаются без изменений, поврежденные данные отвергаются, сообщения, накопленные без сети, приходят на
+   имитатор такими, какими были отправлены, замеряются степень сжатия и время на сообщение. Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <random>
+#include <string>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_RANDOM_TEXTS 2000
+#define TEST_QUEUED 200
+#define TEST_BENCH 20000
+
+static std::mt19937 _random(20211120);
+
+static bool collectText(const char* chunk, size_t length, void* ctx)
+{
+  ((std::string*)ctx)->append(chunk, length);
+  return true;
+}
+
+static bool decodeText(const std::vector<uint8_t>& data, std::string& text)
+{
+  text.clear();
+  return tgPackDecode(data.data(), data.size(), collectText, &text);
+}
+
+static std::vector<uint8_t> encodeText(const std::string& text)
+{
+  std::vector<uint8_t> data(tgPackEncode(text.c_str(), text.size(), nullptr));
+  // One byte more than calculated, to catch a write past the calculated size
+  data.push_back(0xA5);
+  data.resize(tgPackEncode(text.c_str(), text.size(), data.data()) + 1);
+  if (data.back() != 0xA5) data.clear();
+  data.pop_back();
+  return data;
+}
+
+// Any bytes but zero, with runs and repeats so that references of every length and distance occur
+static std::string randomText(size_t length)
+{
+  std::string text;
+  while (text.size() < length) {
+    if ((text.size() > 4) && (_random() % 4 == 0)) {
+      size_t from = _random() % text.size();
+      size_t count = 1 + _random() % 200;
+      for (size_t i = 0; (i < count) && (text.size() < length); i++) {
+        text += text[from + i];
+      };
+    } else {
+      text += (char)(1 + _random() % 255);
+    };
+  };
+  return text;
+}
+
+// A message of the kind the devices send: the title, sensor readings with HTML markup, a state
+static std::string templateText()
+{
+  static const char* const devices[] = { "Greenhouse", "Boiler room", "Garage", "Теплица", "Котельная" };
+  static const char* const sensors[] = { "temperature", "humidity", "pressure" };
+  static const char* const units[] = { "°C", " %", " hPa" };
+  char buffer[512];
+  int len = snprintf(buffer, sizeof(buffer), "<b>🌡 %s</b>\r\n\r\n", devices[_random() % 5]);
+  for (int i = 0; i < 3; i++) {
+    len += snprintf(buffer + len, sizeof(buffer) - len, "Sensor <i>%s</i> %s: <code>%.1f%s</code>\r\n",
+      sensors[i], sensors[i], (_random() % 1000) / 10.0, units[i]);
+  };
+  snprintf(buffer + len, sizeof(buffer) - len, "Heating%s, alarm is %s", _random() % 2 ? ": ON" : ": OFF",
+    _random() % 2 ? "enabled" : "disabled");
+  return buffer;
+}
+
+static void test_round_trip()
+{
+  std::string decoded;
+  for (int i = 0; i < TEST_RANDOM_TEXTS; i++) {
+    // Lengths well beyond the window, so that it wraps
+    std::string text = i % 2 ? templateText() : randomText(_random() % 3000);
+    std::vector<uint8_t> data = encodeText(text);
+    TEST_ASSERT(text.empty() || !data.empty());
+    TEST_ASSERT(decodeText(data, decoded));
+    TEST_ASSERT(decoded == text);
+  };
+}
+
+// Messages are replaced with their compressed copies only when it pays off, and come back unchanged
+static void test_pack_unpack()
+{
+  for (int i = 0; i < 200; i++) {
+    std::string text = i % 4 ? templateText() : randomText(_random() % 100);
+    tgMessage_t* tgMsg = tgMessageAlloc(text.size() + 1);
+    TEST_ASSERT(tgMsg != nullptr);
+    memcpy(tgMsg->message, text.c_str(), text.size() + 1);
+    tgMsg->timestamp = 1000 + i;
+    tgMsg = tgMessagePack(tgMsg);
+    if (tgMsg->packed > 0) {
+      TEST_ASSERT((size_t)tgMsg->packed + TELEGRAM_PACK_MIN_GAIN <= text.size());
+      TEST_ASSERT_EQ(text.size(), tgMsg->length);
+    };
+    TEST_ASSERT(tgMessageEqual(tgMsg, text.c_str()));
+    std::string changed = text + "!";
+    TEST_ASSERT(!tgMessageEqual(tgMsg, changed.c_str()));
+    tgMsg = tgMessageUnpack(tgMsg);
+    TEST_ASSERT(tgMsg != nullptr);
+    TEST_ASSERT_EQ(0, tgMsg->packed);
+    TEST_ASSERT_EQ(1000 + i, tgMsg->timestamp);
+    TEST_ASSERT(text == tgMsg->message);
+    tgMessageFree(tgMsg);
+  };
+}
+
+// Truncated and corrupted data must neither crash the decoder nor reach before the start of the window
+static void test_damaged_data()
+{
+  std::string decoded;
+  std::vector<uint8_t> data = encodeText(templateText());
+  for (size_t size = 0; size < data.size(); size++) {
+    std::vector<uint8_t> truncated(data.begin(), data.begin() + size);
+    decodeText(truncated, decoded);
+  };
+  // A reference further back than the dictionary and the text decoded so far
+  std::vector<uint8_t> invalid = { 0x01, 0xFF, 0x01 };
+  TEST_ASSERT(!decodeText(invalid, decoded));
+  for (int i = 0; i < 10000; i++) {
+    std::vector<uint8_t> noise(_random() % 64);
+    for (uint8_t& byte : noise) {
+      byte = (uint8_t)_random();
+    };
+    decodeText(noise, decoded);
+  };
+}
+
+// ------------------------------------------------------------------------------------------------------------------------
+
+static void appendUtf8(std::string& text, uint32_t code)
+{
+  if (code < 0x80) {
+    text += (char)code;
+  } else if (code < 0x800) {
+    text += (char)(0xC0 | (code >> 6));
+    text += (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    text += (char)(0xE0 | (code >> 12));
+    text += (char)(0x80 | ((code >> 6) & 0x3F));
+    text += (char)(0x80 | (code & 0x3F));
+  } else {
+    text += (char)(0xF0 | (code >> 18));
+    text += (char)(0x80 | ((code >> 12) & 0x3F));
+    text += (char)(0x80 | ((code >> 6) & 0x3F));
+    text += (char)(0x80 | (code & 0x3F));
+  };
+}
+
+static uint32_t hexValue(const char* hex)
+{
+  char digits[5] = { hex[0], hex[1], hex[2], hex[3], 0 };
+  return (uint32_t)strtoul(digits, nullptr, 16);
+}
+
+// Decodes the JSON string starting after the opening quote, returns the position after the closing quote
+static const char* decodeJsonString(const char* json, std::string& text)
+{
+  text.clear();
+  while (*json && (*json != '"')) {
+    if (*json != '\\') {
+      text += *json++;
+      continue;
+    };
+    json++;
+    switch (*json) {
+      case 'n': text += '\n'; break;
+      case 'r': text += '\r'; break;
+      case 't': text += '\t'; break;
+      case 'u': {
+        uint32_t code = hexValue(json + 1);
+        json += 4;
+        if ((code >= 0xD800) && (code < 0xDC00) && (json[1] == '\\') && (json[2] == 'u')) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (hexValue(json + 3) - 0xDC00);
+          json += 6;
+        };
+        appendUtf8(text, code);
+        break;
+      };
+      default: text += *json; break;
+    };
+    json++;
+  };
+  return *json ? json + 1 : json;
+}
+
+// Texts received by the server, without the timestamp that follows them
+static std::vector<std::string> receivedTexts()
+{
+  static char json[512 * 1024];
+  std::vector<std::string> texts;
+  if (!hostFakeGet("/_messages", json, sizeof(json))) return texts;
+  const char* pos = json;
+  while ((pos = strstr(pos, "\"text\":\"")) != nullptr) {
+    std::string text;
+    pos = decodeJsonString(pos + 8, text);
+    size_t timestamp = text.rfind("\r\n\r\n<code>");
+    texts.push_back(text.substr(0, timestamp));
+  };
+  return texts;
+}
+
+// The messages wait compressed while the network is down and are decompressed into the request body
+static void test_outage_through_server()
+{
+  hostFakeControl("reset=1");
+  hostNetworkSet(false);
+  tg_stats_t stats;
+  tgGetStats(&stats);
+  uint32_t heapBefore = stats.heap_bytes;
+  size_t plain = 0;
+  std::vector<std::string> sent;
+  for (int i = 0; i < TEST_QUEUED; i++) {
+    std::string text = templateText();
+    sent.push_back(text);
+    plain += sizeof(tgMessage_t) + text.size() + 1;
+    tg_send_params_t params = {};
+    params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+    params.callback = hostOnResult;
+    TEST_ASSERT(tgSendMsgEx(&params, nullptr, "%s", text.c_str()));
+    // The worker moves the messages from the ring to the outbox, where they are compressed; the ring is smaller
+    if ((i + 1) % 32 == 0) {
+      TEST_ASSERT(hostWaitFor([i] { tg_stats_t s; tgGetStats(&s); return s.outbox_high > i; }, 5000));
+    };
+  };
+  TEST_ASSERT(hostWaitFor([] { tg_stats_t s; tgGetStats(&s); return s.outbox_high >= TEST_QUEUED; }, 5000));
+  usleep(100000);
+  tgGetStats(&stats);
+  uint32_t held = stats.heap_bytes - heapBefore;
+  fprintf(stderr, "  %d typical messages held in %u bytes instead of %u (x%.2f with the headers)\n",
+    TEST_QUEUED, (unsigned)held, (unsigned)plain, held > 0 ? (double)plain / held : 0);
+  TEST_ASSERT(held < plain);
+  hostNetworkSet(true);
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= TEST_QUEUED; }, 30000));
+  TEST_ASSERT_EQ(TEST_QUEUED, _hostDelivered.load());
+  // All the messages go to one chat, so they arrive in the order they were sent
+  TEST_ASSERT(receivedTexts() == sent);
+}
+
+// Keeps the compiler from dropping the benchmark loops
+volatile size_t _packSink;
+
+static void test_ratio_benchmark()
+{
+  std::vector<std::string> texts;
+  for (int i = 0; i < 256; i++) {
+    texts.push_back(templateText());
+  };
+  size_t plain = 0, packed = 0;
+  std::vector<std::vector<uint8_t>> encoded;
+  for (const std::string& text : texts) {
+    encoded.push_back(encodeText(text));
+    plain += text.size();
+    packed += encoded.back().size();
+  };
+  size_t sink = 0;
+  int64_t started = esp_timer_get_time();
+  for (int i = 0; i < TEST_BENCH; i++) {
+    const std::string& text = texts[i & 255];
+    sink += tgPackEncode(text.c_str(), text.size(), nullptr);
+  };
+  int64_t encodeTime = esp_timer_get_time() - started;
+  std::string decoded;
+  started = esp_timer_get_time();
+  for (int i = 0; i < TEST_BENCH; i++) {
+    decodeText(encoded[i & 255], decoded);
+    sink += decoded.size();
+  };
+  int64_t decodeTime = esp_timer_get_time() - started;
+  _packSink = sink;
+  fprintf(stderr, "  typical text of %zu bytes on average: %zu bytes compressed (x%.2f), encoding %.2f us, decoding %.2f us\n",
+    plain / texts.size(), packed / texts.size(), (double)plain / packed,
+    (double)encodeTime / TEST_BENCH, (double)decodeTime / TEST_BENCH);
+  TEST_ASSERT(plain > packed * 2);
+  // Random bytes do not compress, the message is then kept as it is
+  std::string noise = randomText(300);
+  for (char& c : noise) {
+    c = (char)(1 + _random() % 255);
+  };
+  tgMessage_t* tgMsg = tgMessageAlloc(noise.size() + 1);
+  memcpy(tgMsg->message, noise.c_str(), noise.size() + 1);
+  tgMsg = tgMessagePack(tgMsg);
+  TEST_ASSERT_EQ(0, tgMsg->packed);
+  tgMessageFree(tgMsg);
+}
+
+int main()
+{
+  TEST_RUN(test_round_trip);
+  TEST_RUN(test_pack_unpack);
+  TEST_RUN(test_damaged_data);
+  TEST_RUN(test_ratio_benchmark);
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_outage_through_server);
+  return TEST_RESULT();
+}
@@ -0,0 +1,163 @@
+/*
+   EN: Connection reuse: handshakes per message, idle timeout and TLS session resumption, built with
+   CONFIG_TELEGRAM_KEEP_ALIVE on and off. The fake server delays the first response on every new connection
+   by connect_ms, as the TLS handshake does on the device
+   RU: Повторное использование соединения: рукопожатия на сообщение, таймаут простоя и возобновление TLS-сессии,
+   с CONFIG_TELEGRAM_KEEP_ALIVE и без. Имитатор задерживает первый ответ на каждом новом соединении на connect_ms,
+   как это делает TLS-рукопожатие на устройстве
+*/
+
+#include <stdlib.h>
+#include <algorithm>
+#include <vector>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#if defined(CONFIG_TELEGRAM_KEEP_ALIVE) && !CONFIG_TELEGRAM_KEEP_ALIVE
+  #define TEST_KEEP_ALIVE 0
+#else
+  #define TEST_KEEP_ALIVE 1
+#endif // CONFIG_TELEGRAM_KEEP_ALIVE
+
+#if defined(CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS) && CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  #define TEST_RESUMPTION 1
+#else
+  #define TEST_RESUMPTION 0
+#endif // CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+
+#define TEST_CONNECT_MS 50
+#define TEST_MESSAGES 20
+
+static void resetCounters()
+{
+  hostResetCounters();
+  hostHttpReset();
+}
+
+// Sends one message and waits for its result, returns the time from tgSendMsgEx() to the callback in us, -1 - not delivered
+static int64_t sendAndWait(const char* text)
+{
+  int before = _hostDelivered + _hostFailed;
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+  params.callback = hostOnResult;
+  int64_t started = esp_timer_get_time();
+  if (!tgSendMsgEx(&params, "Connection", "%s", text)) return -1;
+  if (!hostWaitFor([before] { return _hostDelivered + _hostFailed > before; }, 15000)) return -1;
+  int64_t elapsed = esp_timer_get_time() - started;
+  return _hostFailed > 0 ? -1 : elapsed;
+}
+
+static int64_t percentile(std::vector<int64_t> values, int p)
+{
+  std::sort(values.begin(), values.end());
+  return values[(values.size() - 1) * p / 100];
+}
+
+// With keep-alive the whole series costs one handshake (none if the connection is already open), without it one per message
+static void test_handshakes_per_message()
+{
+  resetCounters();
+  char control[64];
+  snprintf(control, sizeof(control), "connect_ms=%d", TEST_CONNECT_MS);
+  hostFakeControl(control);
+  std::vector<int64_t> latency;
+  for (int i = 0; i < TEST_MESSAGES; i++) {
+    int64_t elapsed = sendAndWait("handshake");
+    TEST_ASSERT(elapsed >= 0);
+    latency.push_back(elapsed);
+  };
+  host_http_t http;
+  hostHttpGet(&http);
+  fprintf(stderr, "  %d messages: %u handshakes, %u requests, latency p50 %.1f ms, p99 %.1f ms\n",
+    TEST_MESSAGES, http.handshakes, http.requests, percentile(latency, 50) / 1000.0, percentile(latency, 99) / 1000.0);
+  TEST_ASSERT_EQ(TEST_MESSAGES, hostFakeCounter("delivered"));
+  #if TEST_KEEP_ALIVE
+    TEST_ASSERT(http.handshakes <= 1);
+    TEST_ASSERT(hostFakeCounter("connections") <= 1);
+    TEST_ASSERT(percentile(latency, 50) < TEST_CONNECT_MS * 1000);
+  #else
+    TEST_ASSERT_EQ(TEST_MESSAGES, http.handshakes);
+    TEST_ASSERT_EQ(TEST_MESSAGES, hostFakeCounter("connections"));
+    TEST_ASSERT(percentile(latency, 50) >= TEST_CONNECT_MS * 1000);
+  #endif // TEST_KEEP_ALIVE
+}
+
+// The idle connection is closed after CONFIG_TELEGRAM_IDLE_TIMEOUT, the next message opens a new one (resuming the session if kept)
+static void test_idle_timeout()
+{
+  resetCounters();
+  TEST_ASSERT(sendAndWait("before idle") >= 0);
+  #if TEST_KEEP_ALIVE
+    TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("open") == 0; }, CONFIG_TELEGRAM_IDLE_TIMEOUT * 3));
+  #else
+    TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("open") == 0; }, 1000));
+  #endif // TEST_KEEP_ALIVE
+  host_http_t before;
+  hostHttpGet(&before);
+  TEST_ASSERT(sendAndWait("after idle") >= 0);
+  host_http_t after;
+  hostHttpGet(&after);
+  TEST_ASSERT_EQ(1, after.handshakes - before.handshakes);
+  #if TEST_RESUMPTION
+    TEST_ASSERT_EQ(1, after.resumed - before.resumed);
+  #else
+    TEST_ASSERT_EQ(0, after.resumed - before.resumed);
+  #endif // TEST_RESUMPTION
+}
+
+/**
+ * The server closes the kept connection between messages: the next message is sent again at once over a new 
+ * connection, at the cost of one more handshake but without a failed attempt, a backoff or an error event
+ * */
+static void test_server_close()
+{
+  resetCounters();
+  TEST_ASSERT(sendAndWait("before close") >= 0);
+  hostFakeControl("close_all=1");
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("open") == 0; }, 1000));
+  host_http_t before;
+  hostHttpGet(&before);
+  uint32_t retriedBefore = hostStatsCounter(TG_COUNTER_RETRIED);
+  int64_t elapsed = sendAndWait("after close");
+  host_http_t after;
+  hostHttpGet(&after);
+  fprintf(stderr, "  after the server has closed the connection: %.1f ms, %u handshakes, %u retries\n",
+    elapsed / 1000.0, after.handshakes - before.handshakes, hostStatsCounter(TG_COUNTER_RETRIED) - retriedBefore);
+  TEST_ASSERT(elapsed >= 0);
+  TEST_ASSERT_EQ(2, _hostDelivered.load());
+  TEST_ASSERT_EQ(2, hostFakeCounter("delivered"));
+  TEST_ASSERT_EQ(1, after.handshakes - before.handshakes);
+  TEST_ASSERT_EQ(0, hostStatsCounter(TG_COUNTER_RETRIED) - retriedBefore);
+  TEST_ASSERT_EQ(ESP_OK, hostEventsLastError());
+  // The shortest backoff is half of CONFIG_TELEGRAM_SEND_INTERVAL
+  TEST_ASSERT(elapsed < CONFIG_TELEGRAM_SEND_INTERVAL * 1000 / 2);
+}
+
+/**
+ * The server resets the connection after it has received the message, while the response is on its way: the 
+ * message may have been posted, so it is not sent again at once but after a failed attempt and its backoff
+ * */
+static void test_reset_after_request()
+{
+  resetCounters();
+  TEST_ASSERT(sendAndWait("before reset") >= 0);
+  uint32_t retriedBefore = hostStatsCounter(TG_COUNTER_RETRIED);
+  hostFakeControl("latency_ms=300&fail=reset&fail_count=1");
+  int64_t elapsed = sendAndWait("reset");
+  fprintf(stderr, "  after a reset in the middle of the request: %.1f ms, %u retries\n", elapsed / 1000.0, hostStatsCounter(TG_COUNTER_RETRIED) - retriedBefore);
+  TEST_ASSERT(elapsed >= 0);
+  TEST_ASSERT_EQ(1, hostFakeCounter("resets"));
+  TEST_ASSERT_EQ(1, hostStatsCounter(TG_COUNTER_RETRIED) - retriedBefore);
+  TEST_ASSERT(elapsed >= CONFIG_TELEGRAM_SEND_INTERVAL * 1000 / 2);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_handshakes_per_message);
+  TEST_RUN(test_idle_timeout);
+  TEST_RUN(test_server_close);
+  TEST_RUN(test_reset_after_request);
+  return TEST_RESULT();
+}
@@ -0,0 +1,67 @@
+/*
+   EN: Repeats of a pending message (CONFIG_TELEGRAM_DEDUP_SIZE): a flapping sensor queued while the network is down
+   reaches the server as one request with the number of repeats, other messages are not affected
+   RU: Повторы ожидающего сообщения (CONFIG_TELEGRAM_DEDUP_SIZE): "дребезжащий" датчик, пока нет сети, доходит до
+   сервера одним запросом с числом повторов, другие сообщения это не затрагивает
+*/
+
+#include <string.h>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#define TEST_REPEATS 20
+
+static void test_flapping_sensor()
+{
+  hostResetCounters();
+  uint32_t before = hostStatsCounter(TG_COUNTER_COLLAPSED);
+  hostNetworkSet(false);
+  for (int i = 0; i < TEST_REPEATS; i++) {
+    TEST_ASSERT(tgSend(MK_MAIN, MP_ORDINARY, false, "Door", "The door is open"));
+  };
+  TEST_ASSERT(tgSend(MK_SECURITY, MP_ORDINARY, false, "Door", "The door is open"));
+  TEST_ASSERT(hostWaitFor([before] { return hostStatsCounter(TG_COUNTER_COLLAPSED) - before >= TEST_REPEATS - 1; }, 5000));
+  hostNetworkSet(true);
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("delivered") >= 2; }, 15000));
+  // Nothing else is on its way
+  usleep(500000);
+  TEST_ASSERT_EQ(TEST_REPEATS - 1, hostStatsCounter(TG_COUNTER_COLLAPSED) - before);
+  TEST_ASSERT_EQ(2, hostFakeCounter("method_sendMessage"));
+  TEST_ASSERT_EQ(2, hostFakeCounter("delivered"));
+
+  static char json[16 * 1024];
+  TEST_ASSERT(hostFakeGet("/_messages", json, sizeof(json)));
+  char repeats[32];
+  snprintf(repeats, sizeof(repeats), "\\u00d7%d, first seen", TEST_REPEATS);
+  const char* found = strstr(json, repeats);
+  TEST_ASSERT(found != nullptr);
+  // Only the repeated message has the suffix
+  TEST_ASSERT(found == nullptr || strstr(found + strlen(repeats), "first seen") == nullptr);
+}
+
+// A message with a callback is reported on its own, so it is never collapsed
+static void test_callback_not_collapsed()
+{
+  hostResetCounters();
+  uint32_t before = hostStatsCounter(TG_COUNTER_COLLAPSED);
+  hostNetworkSet(false);
+  for (int i = 0; i < 3; i++) {
+    tg_send_params_t params = {};
+    params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+    params.callback = hostOnResult;
+    TEST_ASSERT(tgSendMsgEx(&params, "Door", "The door is closed"));
+  };
+  usleep(200000);
+  hostNetworkSet(true);
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 3; }, 15000));
+  TEST_ASSERT_EQ(3, _hostDelivered.load());
+  TEST_ASSERT_EQ(0, hostStatsCounter(TG_COUNTER_COLLAPSED) - before);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_flapping_sensor);
+  TEST_RUN(test_callback_not_collapsed);
+  return TEST_RESULT();
+}
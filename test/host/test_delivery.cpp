@@ -0,0 +1,105 @@
+/* 
+   EN: End-to-end delivery through the fake Bot API server, built for the direct and the outbox mode
+   RU: Доставка сообщений через имитатор Bot API, в прямом режиме и с очередью отправки
+*/
+
+#include "reTgSend.h"
+#include "host_test.h"
+
+static bool sendTracked(msg_kind_t kind, const char* text)
+{
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(kind, true, MP_ORDINARY);
+  params.callback = hostOnResult;
+  return tgSendMsgEx(&params, "Host", "%s", text);
+}
+
+static void test_messages_are_delivered()
+{
+  hostResetCounters();
+  for (int i = 0; i < 10; i++) {
+    TEST_ASSERT(sendTracked(i % 2 ? MK_MAIN : MK_SECURITY, "delivery"));
+  };
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 10; }, 10000));
+  TEST_ASSERT_EQ(10, _hostDelivered.load());
+  TEST_ASSERT_EQ(10, hostFakeCounter("delivered"));
+}
+
+static void test_retry_after_429()
+{
+  hostResetCounters();
+  hostFakeControl("fail=429&fail_count=1&retry_after=1");
+  TEST_ASSERT(sendTracked(MK_MAIN, "throttled"));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 10000));
+  TEST_ASSERT_EQ(1, _hostDelivered.load());
+  TEST_ASSERT_EQ(1, hostFakeCounter("injected_429"));
+  TEST_ASSERT_EQ(2, hostFakeCounter("method_sendMessage"));
+}
+
+static void test_retry_after_reset()
+{
+  hostResetCounters();
+  hostFakeControl("fail=reset&fail_count=1");
+  TEST_ASSERT(sendTracked(MK_MAIN, "reset"));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 10000));
+  TEST_ASSERT_EQ(1, _hostDelivered.load());
+  TEST_ASSERT_EQ(1, hostFakeCounter("resets"));
+}
+
+// The outage is shorter than the backoff of CONFIG_TELEGRAM_MAX_ATTEMPTS attempts
+static void test_delivery_after_outage()
+{
+  hostResetCounters();
+  hostFakeControl("outage_ms=150");
+  TEST_ASSERT(sendTracked(MK_MAIN, "outage"));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 15000));
+  TEST_ASSERT_EQ(1, _hostDelivered.load());
+  TEST_ASSERT(hostFakeCounter("resets") >= 1);
+}
+
+// Attempts made while the network is down are not counted, the message waits for the network however long it takes
+static void test_delivery_after_network_loss()
+{
+  hostResetCounters();
+  hostNetworkSet(false);
+  TEST_ASSERT(sendTracked(MK_MAIN, "network"));
+  usleep(1000000);
+  TEST_ASSERT_EQ(0, _hostDelivered + _hostFailed);
+  hostNetworkSet(true);
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 15000));
+  TEST_ASSERT_EQ(1, _hostDelivered.load());
+}
+
+// The task is deleted while a request is waiting for its response: the workers stop without holding the lock or
+// losing the message, which is delivered after the task has been created again
+static void test_delete_while_sending()
+{
+  hostResetCounters();
+  hostFakeControl("latency_ms=2000");
+  TEST_ASSERT(sendTracked(MK_MAIN, "deleted"));
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("method_sendMessage") >= 1; }, 5000));
+  int64_t started = esp_timer_get_time();
+  TEST_ASSERT(tgTaskDelete());
+  int64_t elapsed = esp_timer_get_time() - started;
+  fprintf(stderr, "  the task was deleted in %.1f ms\n", elapsed / 1000.0);
+  TEST_ASSERT(elapsed < 1000000);
+  TEST_ASSERT_EQ(0, _hostDelivered + _hostFailed);
+
+  hostFakeControl("latency_ms=0");
+  TEST_ASSERT(tgTaskCreate());
+  TEST_ASSERT(sendTracked(MK_SECURITY, "created"));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 2; }, 15000));
+  TEST_ASSERT_EQ(2, _hostDelivered.load());
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_messages_are_delivered);
+  TEST_RUN(test_retry_after_429);
+  TEST_RUN(test_retry_after_reset);
+  TEST_RUN(test_delivery_after_outage);
+  TEST_RUN(test_delivery_after_network_loss);
+  TEST_RUN(test_delete_while_sending);
+  return TEST_RESULT();
+}
@@ -0,0 +1,217 @@
+/*
+   EN: The C++ API (tg::send()) against the printf path (tgSendMsg()): the same title and values must give the same
+   text at the fake server, and the time of formatting alone is compared: the pieces written in one pass versus
+   vsnprintf() for the length, vsnprintf() for the text and snprintf() for the title
+   RU: C++ API (tg::send()) в сравнении с printf (tgSendMsg()): одинаковые заголовок и значения должны давать одинаковый
+   текст на имитаторе, и сравнивается время одного форматирования: запись частей за один проход против vsnprintf()
+   для длины, vsnprintf() для текста и snprintf() для заголовка
+*/
+
+#include <stdarg.h>
+#include <string.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#define TEST_ROUNDS 200
+#define TEST_BENCH 200000
+
+static constexpr auto _title = tg::title("🌦 Weather");
+static const char* _titleText = "🌦 Weather";
+
+static std::mt19937 _random(20211105);
+
+// A value whose last decimal is not a tie, so that rounding to nearest cannot differ from printf
+static double randomValue(uint8_t decimals)
+{
+  double scale = 1;
+  for (uint8_t i = 0; i < decimals; i++) scale *= 10;
+  long long units = (long long)(_random() % 20000000) - 10000000;
+  return ((double)units + 0.3) / scale;
+}
+
+static bool sendAndWait(long long delivered, bool sent)
+{
+  return sent && hostWaitFor([delivered] { return hostFakeCounter("delivered") > delivered; }, 10000);
+}
+
+// Texts received by the server as they appear in the JSON, up to the timestamp
+static std::vector<std::string> receivedTexts()
+{
+  static char json[512 * 1024];
+  std::vector<std::string> texts;
+  if (!hostFakeGet("/_messages", json, sizeof(json))) return texts;
+  const char* pos = json;
+  while ((pos = strstr(pos, "\"text\":\"")) != nullptr) {
+    pos += 8;
+    const char* end = strstr(pos, "<code>");
+    if (end == nullptr) break;
+    texts.push_back(std::string(pos, end - pos));
+    pos = end;
+  };
+  return texts;
+}
+
+static void test_same_text_as_printf()
+{
+  hostFakeControl("reset=1");
+  long long delivered = 0;
+  for (int round = 0; round < TEST_ROUNDS; round++) {
+    msg_options_t options = encMsgOptions(MK_MAIN, round % 2, MP_ORDINARY);
+    int i = (int)_random() - (int)(_random() >> 1);
+    long long ll = round == 0 ? std::numeric_limits<long long>::min() : (long long)(((uint64_t)_random() << 32) | _random());
+    unsigned u = round == 1 ? std::numeric_limits<unsigned>::max() : (unsigned)_random();
+    bool b = _random() % 2;
+    char c = (char)('A' + _random() % 26);
+    uint8_t decimals = (uint8_t)(_random() % 7);
+    double fixed = randomValue(decimals);
+    double plain = randomValue(2);
+    const char* name = round % 3 ? "датчик" : "sensor";
+    TEST_ASSERT(sendAndWait(delivered++, tg::send(options, _title, "i=", i, ", ll=", ll, ", u=", u, ", b=", b,
+      ", c=", c, ", ", name, ": ", tg::fixed(fixed, decimals), " °C, ", plain, " %")));
+    TEST_ASSERT(sendAndWait(delivered++, tgSendMsg(options, _titleText, "i=%d, ll=%lld, u=%u, b=%s, c=%c, %s: %.*f °C, %.2f %%",
+      i, ll, u, b ? "true" : "false", c, name, (int)decimals, fixed, plain)));
+  };
+  // Without a title
+  TEST_ASSERT(sendAndWait(delivered++, tg::send(encMsgOptions(MK_MAIN, false, MP_ORDINARY), nullptr, "uptime ", 12345u, " s")));
+  TEST_ASSERT(sendAndWait(delivered++, tgSendMsg(encMsgOptions(MK_MAIN, false, MP_ORDINARY), nullptr, "uptime %u s", 12345u)));
+  std::vector<std::string> texts = receivedTexts();
+  TEST_ASSERT_EQ(delivered, texts.size());
+  for (size_t i = 0; i < texts.size(); i += 2) {
+    if (texts[i] != texts[i + 1]) {
+      fprintf(stderr, "  tg::send: %s\n  printf:   %s\n", texts[i].c_str(), texts[i + 1].c_str());
+    };
+    TEST_ASSERT(texts[i] == texts[i + 1]);
+  };
+  fprintf(stderr, "  %d pairs of messages are the same\n", (int)texts.size() / 2);
+}
+
+// Values beyond the range of the integer conversion are printed the same way as by printf
+static void test_large_values()
+{
+  const double values[] = { 1e18, -2.5e19, 123456789012345678901.0, 1e300, -1e308, INFINITY, -INFINITY, 9.99e17 };
+  char expected[512];
+  char buffer[512];
+  for (double value : values) {
+    for (uint8_t decimals = 0; decimals <= 6; decimals += 3) {
+      snprintf(expected, sizeof(expected), "%.*f", (int)decimals, value);
+      size_t size = tg::detail::bound(tg::fixed(value, decimals)) + 1;
+      TEST_ASSERT(size <= sizeof(buffer));
+      TEST_ASSERT(size > strlen(expected));
+      tg::detail::writer_t w = { buffer, buffer + size - 1 };
+      tg::detail::write(w, tg::fixed(value, decimals));
+      *w.pos = 0;
+      if (strcmp(buffer, expected) != 0) {
+        fprintf(stderr, "  tg::fixed: %s\n  printf:    %s\n", buffer, expected);
+      };
+      TEST_ASSERT(strcmp(buffer, expected) == 0);
+    };
+  };
+  // A buffer that is too short is filled up to its end
+  tg::detail::writer_t w = { buffer, buffer + 8 };
+  tg::detail::write(w, tg::fixed(1e20, 0));
+  *w.pos = 0;
+  TEST_ASSERT(strcmp(buffer, "10000000") == 0);
+}
+
+// Text from outside is escaped the same way by tg::html() and by tgHtmlEscape() for a %s argument
+static void test_html_escape()
+{
+  static const char* const name = "<b>Pump & \"Co\"</b>";
+  static const char* const escaped = "&lt;b&gt;Pump &amp; \"Co\"&lt;/b&gt;";
+  char buffer[128];
+  TEST_ASSERT(strcmp(tgHtmlEscape(name, buffer, sizeof(buffer)), escaped) == 0);
+  TEST_ASSERT(strcmp(tgHtmlEscape(nullptr, buffer, sizeof(buffer)), "") == 0);
+  // An entity is never cut
+  TEST_ASSERT(strcmp(tgHtmlEscape("a&b", buffer, 5), "a") == 0);
+  TEST_ASSERT(strcmp(tgHtmlEscape("a&b", buffer, 7), "a&amp;") == 0);
+
+  size_t size = tg::detail::bound(tg::html(name)) + 1;
+  TEST_ASSERT(size <= sizeof(buffer));
+  tg::detail::writer_t w = { buffer, buffer + size - 1 };
+  tg::detail::write(w, tg::html(name), tg::html(nullptr));
+  *w.pos = 0;
+  TEST_ASSERT(strcmp(buffer, escaped) == 0);
+
+  hostFakeControl("reset=1");
+  msg_options_t options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+  TEST_ASSERT(sendAndWait(0, tg::send(options, _title, "Device ", tg::html(name), " is on")));
+  TEST_ASSERT(sendAndWait(1, tgSendMsg(options, _titleText, "Device %s is on", tgHtmlEscape(name, buffer, sizeof(buffer)))));
+  std::vector<std::string> texts = receivedTexts();
+  TEST_ASSERT_EQ(2, texts.size());
+  TEST_ASSERT(texts.size() == 2 && texts[0] == texts[1]);
+  TEST_ASSERT(texts.size() == 2 && texts[0].find("&lt;b&gt;Pump &amp;") != std::string::npos);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------
+// Formatting alone, into a local buffer, the way tgSendMsgV() and tg::detail::send() do it
+
+static char _buffer[512];
+
+static size_t printfFormat(const char* title, const char* format, ...)
+{
+  va_list args, args_len;
+  va_start(args, format);
+  va_copy(args_len, args);
+  size_t size = vsnprintf(nullptr, 0, format, args_len) + 1;
+  va_end(args_len);
+  size += snprintf(nullptr, 0, API_TELEGRAM_TITLE_BEGIN "%s" API_TELEGRAM_TITLE_END, title);
+  if (size > sizeof(_buffer)) size = sizeof(_buffer);
+  size_t len = snprintf(_buffer, size, API_TELEGRAM_TITLE_BEGIN "%s" API_TELEGRAM_TITLE_END, title);
+  if (len >= size) len = size - 1;
+  vsnprintf(_buffer + len, size - len, format, args);
+  va_end(args);
+  return size;
+}
+
+template <size_t N, typename... Args>
+static size_t piecesFormat(const tg::title_t<N>& title, const Args&... args)
+{
+  size_t size = title.length + tg::detail::bound(args...) + 1;
+  if (size > sizeof(_buffer)) size = sizeof(_buffer);
+  tg::detail::writer_t w = { _buffer, _buffer + size - 1 };
+  tg::detail::put(w, title.text, title.length);
+  tg::detail::write(w, args...);
+  *w.pos = 0;
+  return size;
+}
+
+// Keeps the compiler from dropping the benchmark loops
+volatile size_t _formatSink;
+
+static void test_format_benchmark()
+{
+  std::vector<double> temperatures, humidities;
+  for (int i = 0; i < 64; i++) {
+    temperatures.push_back(randomValue(1));
+    humidities.push_back(randomValue(0));
+  };
+  size_t sink = 0;
+  int64_t started = esp_timer_get_time();
+  for (int i = 0; i < TEST_BENCH; i++) {
+    sink += printfFormat(_titleText, "Temperature: %.1f °C, humidity: %.0f %%, uptime %d s",
+      temperatures[i & 63], humidities[i & 63], i);
+  };
+  int64_t printfTime = esp_timer_get_time() - started;
+  started = esp_timer_get_time();
+  for (int i = 0; i < TEST_BENCH; i++) {
+    sink += piecesFormat(_title, "Temperature: ", tg::fixed(temperatures[i & 63], 1), " °C, humidity: ",
+      tg::fixed(humidities[i & 63], 0), " %, uptime ", i, " s");
+  };
+  int64_t piecesTime = esp_timer_get_time() - started;
+  _formatSink = sink;
+  fprintf(stderr, "  printf path %.1f ns, tg::send pieces %.1f ns per message (x%.2f)\n",
+    printfTime * 1000.0 / TEST_BENCH, piecesTime * 1000.0 / TEST_BENCH, piecesTime > 0 ? (double)printfTime / piecesTime : 0);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_same_text_as_printf);
+  TEST_RUN(test_large_values);
+  TEST_RUN(test_html_escape);
+  TEST_RUN(test_format_benchmark);
+  return TEST_RESULT();
+}
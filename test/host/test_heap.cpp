@@ -0,0 +1,69 @@
+/*
+   EN: Heap use of the send path. With CONFIG_TELEGRAM_MESSAGE_SIZE the steady state makes no malloc() or free()
+   calls at all, without it every message costs one heap block and nothing leaks
+   RU: Использование кучи при отправке. С CONFIG_TELEGRAM_MESSAGE_SIZE в установившемся режиме нет ни одного вызова
+   malloc() или free(), без него каждое сообщение занимает один блок и ничего не теряется
+*/
+
+#include "reTgSend.h"
+#include "host_test.h"
+
+#define TEST_WARMUP 20
+#define TEST_MESSAGES 200
+
+// Messages finished by the send task, delivered or dropped, with or without a callback
+static uint32_t finishedMessages()
+{
+  return hostStatsCounter(TG_COUNTER_SENT) + hostStatsCounter(TG_COUNTER_DROPPED);
+}
+
+// Sends the messages in groups small enough for the queue and waits until all of them are finished
+static bool sendSeries(int count)
+{
+  uint32_t queued = finishedMessages();
+  for (int i = 0; i < count; i++) {
+    tg_send_params_t params = {};
+    params.options = encMsgOptions((msg_kind_t)(i % 4), false, MP_ORDINARY);
+    params.callback = hostOnResult;
+    if (!tgSendMsgEx(&params, "Heap", "Message %d of the series, value %.2f", i, i * 0.25)) return false;
+    queued++;
+    #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+      // Without formatting, as from an interrupt handler
+      if (!tgSendMsgFromISR(encMsgOptions(MK_MAIN, false, MP_ORDINARY), "Heap", "From ISR")) return false;
+      queued++;
+    #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    if ((i % 8 == 7) && !hostWaitFor([queued] { return finishedMessages() >= queued; }, 15000)) return false;
+  };
+  return hostWaitFor([queued] { return finishedMessages() >= queued; }, 15000);
+}
+
+static void test_steady_state_heap()
+{
+  hostFakeControl("reset=1");
+  // The client, the DNS cache and the rest of the lazily created state appear during the warm-up
+  TEST_ASSERT(sendSeries(TEST_WARMUP));
+  host_heap_t before;
+  hostHeapGet(&before);
+  hostHeapReset();
+  TEST_ASSERT(sendSeries(TEST_MESSAGES));
+  host_heap_t heap;
+  hostHeapGet(&heap);
+  fprintf(stderr, "  %d messages: %llu allocs, %llu frees, %lld bytes in use (%lld before), peak %lld\n", TEST_MESSAGES,
+    (unsigned long long)heap.allocs, (unsigned long long)heap.frees, (long long)heap.bytes, (long long)before.bytes, (long long)heap.peak);
+  TEST_ASSERT_EQ(0, _hostFailed.load());
+  #if CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+    TEST_ASSERT_EQ(0, heap.allocs);
+    TEST_ASSERT_EQ(0, heap.frees);
+  #else
+    TEST_ASSERT(heap.allocs >= TEST_MESSAGES);
+    TEST_ASSERT_EQ(heap.allocs, heap.frees);
+  #endif // CONFIG_TELEGRAM_STATIC_MESSAGE_BUFFER
+  TEST_ASSERT_EQ(before.bytes, heap.bytes);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_steady_state_heap);
+  return TEST_RESULT();
+}
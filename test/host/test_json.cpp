@@ -0,0 +1,264 @@
+/*
+   EN: JSON escaping of the message text. Random UTF-8 texts full of quotes, backslashes and control characters
+   must arrive at the fake server unchanged (Python's json module is the reference decoder), the word-at-a-time
+   scan must agree with a byte-by-byte one at every alignment, and both are timed. Includes the library source
+   RU: Экранирование текста сообщения в JSON. Случайные тексты UTF-8 с кавычками, обратной косой чертой и
+   управляющими символами должны дойти до имитатора без изменений (эталонный декодер - модуль json Python),
+   сканирование словами должно совпадать с побайтовым при любом выравнивании, и оба замеряются. Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <random>
+#include <string>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_ROUNDS 20
+#define TEST_ROUND_MESSAGES 50
+#define TEST_MAX_LENGTH 200
+
+static std::mt19937 _random(20211012);
+
+static void appendUtf8(std::string& text, uint32_t code)
+{
+  if (code < 0x80) {
+    text += (char)code;
+  } else if (code < 0x800) {
+    text += (char)(0xC0 | (code >> 6));
+    text += (char)(0x80 | (code & 0x3F));
+  } else if (code < 0x10000) {
+    text += (char)(0xE0 | (code >> 12));
+    text += (char)(0x80 | ((code >> 6) & 0x3F));
+    text += (char)(0x80 | (code & 0x3F));
+  } else {
+    text += (char)(0xF0 | (code >> 18));
+    text += (char)(0x80 | ((code >> 12) & 0x3F));
+    text += (char)(0x80 | ((code >> 6) & 0x3F));
+    text += (char)(0x80 | (code & 0x3F));
+  };
+}
+
+// Valid UTF-8 without zero bytes, mostly plain text with every kind of character that needs escaping
+static std::string randomText(size_t length)
+{
+  static const uint32_t special[] = { '"', '\\', '/', '\n', '\r', '\t', '\b', '\f', 0x7F, 0x2028, 0x2029 };
+  static const uint32_t wide[] = { 0x0442, 0x00B0, 0x20AC, 0xFFFD, 0x1F321, 0x1F525 };
+  std::string text;
+  while (text.size() < length) {
+    uint32_t kind = _random() % 16;
+    if (kind < 9) {
+      text += (char)(0x20 + _random() % 0x5F);
+    } else if (kind < 11) {
+      text += (char)(1 + _random() % 0x1F);
+    } else if (kind < 14) {
+      appendUtf8(text, special[_random() % (sizeof(special) / sizeof(special[0]))]);
+    } else {
+      appendUtf8(text, wide[_random() % (sizeof(wide) / sizeof(wide[0]))]);
+    };
+  };
+  return text;
+}
+
+static uint32_t hexValue(const char* hex)
+{
+  char digits[5] = { hex[0], hex[1], hex[2], hex[3], 0 };
+  return (uint32_t)strtoul(digits, nullptr, 16);
+}
+
+// Decodes the JSON string starting after the opening quote, returns the position after the closing quote
+static const char* decodeJsonString(const char* json, std::string& text)
+{
+  text.clear();
+  while (*json && (*json != '"')) {
+    if (*json != '\\') {
+      text += *json++;
+      continue;
+    };
+    json++;
+    switch (*json) {
+      case 'n': text += '\n'; break;
+      case 'r': text += '\r'; break;
+      case 't': text += '\t'; break;
+      case 'b': text += '\b'; break;
+      case 'f': text += '\f'; break;
+      case 'u': {
+        uint32_t code = hexValue(json + 1);
+        json += 4;
+        if ((code >= 0xD800) && (code < 0xDC00) && (json[1] == '\\') && (json[2] == 'u')) {
+          code = 0x10000 + ((code - 0xD800) << 10) + (hexValue(json + 3) - 0xDC00);
+          json += 6;
+        };
+        appendUtf8(text, code);
+        break;
+      };
+      default: text += *json; break;
+    };
+    json++;
+  };
+  return *json ? json + 1 : json;
+}
+
+// Reference: the length of the text escaped one byte at a time, the same escapes as tgJsonPutEscaped()
+static size_t referenceEscapedLength(const char* text)
+{
+  size_t length = 0;
+  for (; *text; text++) {
+    switch (*text) {
+      case '"': case '\\': case '\n': case '\r': case '\t': length += 2; break;
+      default: length += (uint8_t)*text < 0x20 ? 6 : 1; break;
+    };
+  };
+  return length;
+}
+
+static size_t referenceSafeSpan(const char* text)
+{
+  const char* ptr = text;
+  while (*ptr && ((uint8_t)*ptr >= 0x20) && (*ptr != '"') && (*ptr != '\\')) ptr++;
+  return ptr - text;
+}
+
+// Byte-by-byte version of tgJsonPutEscaped(), the baseline of the benchmark
+static void referencePutEscaped(tgBodyWriter_t* writer, const char* text, size_t length)
+{
+  char escape[8];
+  const char* end = text + length;
+  while (text < end) {
+    size_t span = referenceSafeSpan(text);
+    if (span > (size_t)(end - text)) span = end - text;
+    if (span > 0) {
+      tgBodyPut(writer, text, span);
+      text += span;
+    };
+    if (text < end) {
+      switch (*text) {
+        case '"':  tgBodyPut(writer, "\\\"", 2); break;
+        case '\\': tgBodyPut(writer, "\\\\", 2); break;
+        case '\n': tgBodyPut(writer, "\\n", 2); break;
+        case '\r': tgBodyPut(writer, "\\r", 2); break;
+        case '\t': tgBodyPut(writer, "\\t", 2); break;
+        default:
+          tgBodyPut(writer, escape, snprintf(escape, sizeof(escape), "\\u%04x", (uint8_t)*text));
+          break;
+      };
+      text++;
+    };
+  };
+}
+
+static void test_safe_span_matches_reference()
+{
+  // Texts are placed at every offset from an aligned buffer, so that the special character falls on every byte of a word
+  alignas(8) static char buffer[TEST_MAX_LENGTH + 16];
+  for (int i = 0; i < 20000; i++) {
+    std::string text = randomText(_random() % TEST_MAX_LENGTH);
+    if (_random() % 2) {
+      // Long clean runs, to get into the word loop
+      text = std::string(_random() % 64, 'a') + text;
+      text.resize(std::min(text.size(), (size_t)TEST_MAX_LENGTH));
+    };
+    size_t offset = _random() % 8;
+    memcpy(buffer + offset, text.c_str(), text.size() + 1);
+    const char* start = buffer + offset;
+    TEST_ASSERT_EQ(referenceSafeSpan(start), tgJsonSafeSpan(start, text.size()));
+    tgBodyWriter_t writer;
+    tgBodyInit(&writer, nullptr);
+    tgJsonPutEscaped(&writer, start, text.size());
+    TEST_ASSERT_EQ(referenceEscapedLength(start), writer.length);
+  };
+}
+
+// The scan stops at the given length, whatever follows it: a chunk of a decompressed message has no terminating zero
+static void test_safe_span_stops_at_length()
+{
+  alignas(8) static char buffer[64];
+  memset(buffer, 'a', sizeof(buffer) - 1);
+  buffer[sizeof(buffer) - 1] = 0;
+  for (size_t offset = 0; offset < 8; offset++) {
+    for (size_t length = 0; length < 40; length++) {
+      TEST_ASSERT_EQ(length, tgJsonSafeSpan(buffer + offset, length));
+      tgBodyWriter_t writer;
+      tgBodyInit(&writer, nullptr);
+      tgJsonPutEscaped(&writer, buffer + offset, length);
+      TEST_ASSERT_EQ(length, writer.length);
+    };
+  };
+}
+
+static void test_round_trip_through_server()
+{
+  static char json[512 * 1024];
+  std::vector<std::string> texts;
+  int checked = 0;
+  for (int round = 0; round < TEST_ROUNDS; round++) {
+    hostResetCounters();
+    texts.clear();
+    for (int i = 0; i < TEST_ROUND_MESSAGES; i++) {
+      texts.push_back(randomText(1 + _random() % TEST_MAX_LENGTH));
+      tg_send_params_t params = {};
+      params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+      params.callback = hostOnResult;
+      TEST_ASSERT(tgSendMsgEx(&params, nullptr, "%s", texts.back().c_str()));
+      // One by one, so that the order of /_messages is the order of sending
+      TEST_ASSERT(hostWaitFor([i] { return _hostDelivered + _hostFailed > i; }, 10000));
+    };
+    TEST_ASSERT_EQ(0, _hostFailed.load());
+    TEST_ASSERT(hostFakeGet("/_messages", json, sizeof(json)));
+    const char* pos = json;
+    for (const std::string& expected : texts) {
+      pos = strstr(pos, "\"text\":\"");
+      TEST_ASSERT(pos != nullptr);
+      std::string actual;
+      pos = decodeJsonString(pos + 8, actual);
+      // The timestamp follows the text
+      TEST_ASSERT(actual.compare(0, expected.size(), expected) == 0);
+      TEST_ASSERT(actual.compare(expected.size(), 10, "\r\n\r\n<code>") == 0);
+      checked++;
+    };
+  };
+  fprintf(stderr, "  %d random texts arrived unchanged\n", checked);
+}
+
+// Keeps the compiler from dropping the benchmark loops
+volatile size_t _escapeSink;
+
+static double escapeThroughput(void (*escape)(tgBodyWriter_t*, const char*, size_t), const std::string& text, int repeats)
+{
+  tgBodyWriter_t writer;
+  tgBodyInit(&writer, nullptr);
+  int64_t started = esp_timer_get_time();
+  for (int i = 0; i < repeats; i++) {
+    escape(&writer, text.c_str(), text.size());
+  };
+  int64_t elapsed = esp_timer_get_time() - started;
+  _escapeSink = writer.length;
+  return elapsed > 0 ? (double)text.size() * repeats / elapsed : 0;
+}
+
+// Throughput of the scan and the escapes (the writer only counts the length, so the copy is left out), MB/s
+static void test_escape_throughput()
+{
+  std::string plain;
+  while (plain.size() < 4000) plain += "Temperature 21.5 C, humidity 45 %, pressure 1013 hPa. ";
+  std::string cyrillic;
+  while (cyrillic.size() < 4000) cyrillic += "Температура 21.5 °C, влажность 45 %. ";
+  std::string mixed = randomText(4000);
+  const struct { const char* name; const std::string* text; } cases[] = {
+    { "plain ASCII", &plain }, { "Cyrillic", &cyrillic }, { "random, many escapes", &mixed } };
+  for (const auto& item : cases) {
+    double reference = escapeThroughput(referencePutEscaped, *item.text, 2000);
+    double words = escapeThroughput(tgJsonPutEscaped, *item.text, 2000);
+    fprintf(stderr, "  %-22s byte by byte %7.1f MB/s, word at a time %7.1f MB/s (x%.2f)\n", item.name, reference, words,
+      reference > 0 ? words / reference : 0);
+  };
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_safe_span_matches_reference);
+  TEST_RUN(test_safe_span_stops_at_length);
+  TEST_RUN(test_round_trip_through_server);
+  TEST_RUN(test_escape_throughput);
+  return TEST_RESULT();
+}
@@ -0,0 +1,150 @@
+/*
+   EN: Per-chat lanes: a slow chat does not hold up the others when there are several workers (and does with one),
+   a throttled chat does not block the others, and messages of each chat arrive in the order they were sent.
+   Built with CONFIG_TELEGRAM_WORKERS 1 and 2 and without the outbox
+   RU: Очереди по чатам: медленный чат не задерживает остальные при нескольких исполнителях (и задерживает при одном),
+   ограничение скорости одного чата не блокирует другие, сообщения каждого чата приходят в порядке отправки.
+   Собирается с CONFIG_TELEGRAM_WORKERS 1 и 2 и без очереди отправки
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+#include <map>
+#include <vector>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#ifndef CONFIG_TELEGRAM_WORKERS
+  #define CONFIG_TELEGRAM_WORKERS 1
+#endif // CONFIG_TELEGRAM_WORKERS
+
+#define TEST_SLOW_MS 1000
+#define TEST_ORDER_MESSAGES 30
+
+// Delivery time of every message by its number, 0 - not yet
+static std::atomic<int64_t> _done[256];
+static int64_t _started = 0;
+
+static void onResult(esp_err_t result, int64_t message_id, void* ctx)
+{
+  _done[(intptr_t)ctx] = esp_timer_get_time() - _started;
+  hostOnResult(result, message_id, ctx);
+}
+
+static void resetCounters()
+{
+  hostResetCounters();
+  for (std::atomic<int64_t>& done : _done) {
+    done = 0;
+  };
+  _started = esp_timer_get_time();
+}
+
+static bool sendNumbered(msg_kind_t kind, msg_priority_t priority, int number)
+{
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(kind, false, priority);
+  params.callback = onResult;
+  params.ctx = (void*)(intptr_t)number;
+  return tgSendMsgEx(&params, nullptr, "#%d", number);
+}
+
+/**
+ * Messages 0..2 go to the slow chat first, 3..7 are alerts to another chat. If the first worker (the only reader of 
+ * the ring) is the one waiting for the slow chat, it passes new messages on between slices of CONFIG_TELEGRAM_POLL_INTERVAL, 
+ * so with two workers the alerts may wait that long, but not for the slow responses
+ * */
+static void test_slow_chat_head_of_line()
+{
+  resetCounters();
+  char control[64];
+  snprintf(control, sizeof(control), "chat_latency=%s:%d", CONFIG_TELEGRAM_CHAT_ID_PARAMS, TEST_SLOW_MS);
+  hostFakeControl(control);
+  for (int i = 0; i < 3; i++) {
+    TEST_ASSERT(sendNumbered(MK_PARAMS, MP_ORDINARY, i));
+  };
+  usleep(20000);
+  for (int i = 3; i < 8; i++) {
+    TEST_ASSERT(sendNumbered(MK_SECURITY, MP_ORDINARY, i));
+  };
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 8; }, 3 * TEST_SLOW_MS + 10000));
+  TEST_ASSERT_EQ(0, _hostFailed.load());
+  int64_t alerts = 0;
+  for (int i = 3; i < 8; i++) {
+    if (_done[i] > alerts) alerts = _done[i];
+  };
+  fprintf(stderr, "  %d worker(s): the alerts were delivered after %.1f ms, the slow chat after %.1f ms\n",
+    CONFIG_TELEGRAM_WORKERS, alerts / 1000.0, _done[2] / 1000.0);
+  #if CONFIG_TELEGRAM_WORKERS > 1
+    TEST_ASSERT(alerts < TEST_SLOW_MS * 1000 / 2);
+  #else
+    TEST_ASSERT(alerts >= TEST_SLOW_MS * 1000);
+  #endif // CONFIG_TELEGRAM_WORKERS
+}
+
+// A 429 with retry_after holds back only the chat that has received it
+static void test_throttled_chat_does_not_block()
+{
+  resetCounters();
+  hostFakeControl("fail=429&fail_count=1&retry_after=2");
+  TEST_ASSERT(sendNumbered(MK_PARAMS, MP_ORDINARY, 0));
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("injected_429") >= 1; }, 5000));
+  TEST_ASSERT(sendNumbered(MK_PARAMS, MP_ORDINARY, 1));
+  TEST_ASSERT(sendNumbered(MK_SECURITY, MP_ORDINARY, 2));
+  TEST_ASSERT(hostWaitFor([] { return _done[2] != 0; }, 5000));
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= 3; }, 10000));
+  fprintf(stderr, "  the alert was delivered after %.1f ms, the throttled chat after %.1f ms\n", _done[2] / 1000.0, _done[1] / 1000.0);
+  TEST_ASSERT_EQ(3, _hostDelivered.load());
+  TEST_ASSERT(_done[2] < 1000000);
+  TEST_ASSERT(_done[0] >= 2000000);
+  TEST_ASSERT(_done[1] > _done[0]);
+}
+
+// Numbers in the texts of the messages received by the server, by chat
+static std::map<long long, std::vector<int>> receivedByChat()
+{
+  static char json[128 * 1024];
+  std::map<long long, std::vector<int>> chats;
+  if (!hostFakeGet("/_messages", json, sizeof(json))) return chats;
+  const char* pos = json;
+  while ((pos = strstr(pos, "\"chat_id\":")) != nullptr) {
+    long long chat = strtoll(pos + 10, nullptr, 10);
+    pos = strstr(pos, "\"text\":\"#");
+    if (pos == nullptr) break;
+    pos += 9;
+    chats[chat].push_back(atoi(pos));
+  };
+  return chats;
+}
+
+// Responses of random latency, two chats sent in turns: each chat keeps its order whichever worker takes the message
+static void test_order_within_lane()
+{
+  resetCounters();
+  hostFakeControl("latency_ms=1&jitter_ms=10");
+  for (int i = 0; i < TEST_ORDER_MESSAGES; i++) {
+    TEST_ASSERT(sendNumbered(i % 3 ? MK_MAIN : MK_SERVICE, MP_ORDINARY, i));
+  };
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= TEST_ORDER_MESSAGES; }, 20000));
+  TEST_ASSERT_EQ(TEST_ORDER_MESSAGES, _hostDelivered.load());
+  std::map<long long, std::vector<int>> chats = receivedByChat();
+  TEST_ASSERT_EQ(2, chats.size());
+  size_t total = 0;
+  for (const auto& chat : chats) {
+    for (size_t i = 1; i < chat.second.size(); i++) {
+      TEST_ASSERT(chat.second[i - 1] < chat.second[i]);
+    };
+    total += chat.second.size();
+  };
+  TEST_ASSERT_EQ(TEST_ORDER_MESSAGES, total);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_slow_chat_head_of_line);
+  TEST_RUN(test_throttled_chat_does_not_block);
+  TEST_RUN(test_order_within_lane);
+  return TEST_RESULT();
+}
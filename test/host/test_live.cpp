@@ -0,0 +1,129 @@
+/*
+   EN: Live messages (CONFIG_TELEGRAM_LIVE_SLOTS): the first update is sent, the next ones edit it, updates that
+   are superseded while waiting for the interval are dropped, and a message deleted from the chat is sent again
+   RU: Обновляемые сообщения (CONFIG_TELEGRAM_LIVE_SLOTS): первое обновление отправляется, следующие его
+   редактируют, обновления, замененные более новыми за время ожидания, отбрасываются, а сообщение, удаленное из
+   чата, отправляется заново
+*/
+
+#include <string.h>
+#include <string>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#define TEST_INTERVAL_MS CONFIG_TELEGRAM_LIVE_INTERVAL
+
+typedef struct {
+  std::string method;
+  long long message_id;
+  std::string body;
+} received_t;
+
+// The last request received by the server
+static received_t lastReceived()
+{
+  static char json[16 * 1024];
+  received_t received = { "", -1, "" };
+  if (!hostFakeGet("/_messages", json, sizeof(json))) return received;
+  const char* last = nullptr;
+  for (const char* pos = json; (pos = strstr(pos, "{\"bot\":")) != nullptr; pos++) {
+    last = pos;
+  };
+  if (last == nullptr) return received;
+  received.body = last;
+  const char* method = strstr(last, "\"method\":\"");
+  if (method) {
+    method += 10;
+    received.method.assign(method, strcspn(method, "\""));
+  };
+  received.message_id = hostJsonInt(last, "message_id");
+  return received;
+}
+
+static bool update(int value)
+{
+  return tgSendLive(0, encMsgOptions(MK_MAIN, false, MP_ORDINARY), "Pump", "Pressure %d kPa", value);
+}
+
+static bool waitDelivered(long long count)
+{
+  return hostWaitFor([count] { return hostFakeCounter("delivered") >= count; }, 10000);
+}
+
+static void test_send_then_edit()
+{
+  hostResetCounters();
+  TEST_ASSERT(update(100));
+  TEST_ASSERT(waitDelivered(1));
+  received_t sent = lastReceived();
+  TEST_ASSERT(sent.method == "sendMessage");
+  TEST_ASSERT(sent.message_id > 0);
+
+  TEST_ASSERT(update(110));
+  TEST_ASSERT(waitDelivered(2));
+  received_t edited = lastReceived();
+  TEST_ASSERT(edited.method == "editMessageText");
+  TEST_ASSERT_EQ(sent.message_id, edited.message_id);
+  TEST_ASSERT(edited.body.find("Pressure 110 kPa") != std::string::npos);
+  TEST_ASSERT_EQ(1, hostFakeCounter("method_sendMessage"));
+}
+
+// Updates made before the interval has passed replace each other, only the newest one edits the message
+static void test_superseded_updates()
+{
+  hostResetCounters();
+  usleep(TEST_INTERVAL_MS * 1000);
+  TEST_ASSERT(update(120));
+  TEST_ASSERT(waitDelivered(1));
+  uint32_t before = hostStatsCounter(TG_COUNTER_SUPERSEDED);
+  int64_t started = esp_timer_get_time();
+  TEST_ASSERT(update(130));
+  TEST_ASSERT(update(140));
+  TEST_ASSERT(update(150));
+  TEST_ASSERT(waitDelivered(2));
+  int64_t elapsed = esp_timer_get_time() - started;
+  usleep(TEST_INTERVAL_MS * 1000);
+  fprintf(stderr, "  the newest update was shown after %.1f ms\n", elapsed / 1000.0);
+  TEST_ASSERT_EQ(2, hostStatsCounter(TG_COUNTER_SUPERSEDED) - before);
+  TEST_ASSERT_EQ(2, hostFakeCounter("method_editMessageText"));
+  TEST_ASSERT_EQ(0, hostFakeCounter("method_sendMessage"));
+  TEST_ASSERT(lastReceived().body.find("Pressure 150 kPa") != std::string::npos);
+  TEST_ASSERT(elapsed >= (TEST_INTERVAL_MS - 50) * 1000);
+}
+
+// The message has been deleted from the chat: the update is sent as a new message, and the next one edits that
+static void test_edit_not_found()
+{
+  hostResetCounters();
+  usleep(TEST_INTERVAL_MS * 1000);
+  TEST_ASSERT(update(160));
+  TEST_ASSERT(waitDelivered(1));
+  long long deleted = lastReceived().message_id;
+  usleep(TEST_INTERVAL_MS * 1000);
+
+  hostFakeControl("fail=edit_not_found&fail_count=1");
+  TEST_ASSERT(update(170));
+  TEST_ASSERT(waitDelivered(2));
+  received_t resent = lastReceived();
+  TEST_ASSERT_EQ(1, hostFakeCounter("injected_edit_not_found"));
+  TEST_ASSERT(resent.method == "sendMessage");
+  TEST_ASSERT(resent.message_id != deleted);
+  TEST_ASSERT(resent.body.find("Pressure 170 kPa") != std::string::npos);
+  TEST_ASSERT_EQ(ESP_OK, hostEventsLastError());
+
+  usleep(TEST_INTERVAL_MS * 1000);
+  TEST_ASSERT(update(180));
+  TEST_ASSERT(waitDelivered(3));
+  received_t edited = lastReceived();
+  TEST_ASSERT(edited.method == "editMessageText");
+  TEST_ASSERT_EQ(resent.message_id, edited.message_id);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_send_then_edit);
+  TEST_RUN(test_superseded_updates);
+  TEST_RUN(test_edit_not_found);
+  return TEST_RESULT();
+}
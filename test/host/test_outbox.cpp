@@ -0,0 +1,244 @@
+/*
+   EN: The outbox: FIFO order within a priority level, eviction of the oldest message of the lowest priority, the
+   busy head that must not be evicted, and a micro-benchmark against the linear scan it has replaced. Built for
+   CONFIG_TELEGRAM_OUTBOX_SIZE 8, 64 and 512. Includes the library source
+   RU: Очередь отправки: порядок FIFO внутри уровня приоритета, вытеснение самого старого сообщения с самым низким
+   приоритетом, занятая голова очереди, которую нельзя вытеснить, и сравнение скорости с прежним линейным поиском.
+   Собирается для CONFIG_TELEGRAM_OUTBOX_SIZE 8, 64 и 512. Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <random>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_CHURN 100000
+
+static std::vector<tgMessage_t*> _messages;
+
+static tgMessage_t* testMessage(msg_kind_t kind, msg_priority_t priority, time_t timestamp)
+{
+  tgMessage_t* tgMsg = tgMessageAlloc(16);
+  tgMsg->options = encMsgOptions(kind, false, priority);
+  tgMsg->timestamp = timestamp;
+  tgMsg->queued = (int64_t)timestamp * 1000000;
+  tgMessageSchedule(tgMsg, 0, TG_LATENCY_DEFAULT);
+  _messages.push_back(tgMsg);
+  return tgMsg;
+}
+
+static void resetOutbox()
+{
+  tgOutboxInit();
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    _tgLaneBusy[lane] = false;
+  };
+  for (tgMessage_t* tgMsg : _messages) {
+    tgMessageFree(tgMsg);
+  };
+  _messages.clear();
+}
+
+// Removes the next message the way a worker takes it
+static tgMessage_t* takeNext()
+{
+  uint8_t lane, level;
+  int64_t wait;
+  if (!tgOutboxNext(&lane, &level, &wait)) return nullptr;
+  return tgOutboxPop(lane, level);
+}
+
+static void test_fifo_within_level()
+{
+  resetOutbox();
+  int count = CONFIG_TELEGRAM_OUTBOX_SIZE < 8 ? CONFIG_TELEGRAM_OUTBOX_SIZE : 8;
+  for (int i = 0; i < count; i++) {
+    TEST_ASSERT(tgOutboxPush(testMessage(MK_MAIN, MP_ORDINARY, 100 + i)));
+  };
+  for (int i = 0; i < count; i++) {
+    tgMessage_t* tgMsg = takeNext();
+    TEST_ASSERT(tgMsg != nullptr);
+    TEST_ASSERT_EQ(100 + i, tgMsg->timestamp);
+  };
+  TEST_ASSERT(takeNext() == nullptr);
+  TEST_ASSERT_EQ(0, _tgOutbox.count);
+}
+
+// A higher priority has an earlier deadline, so it goes first even if it has come later
+static void test_priority_goes_first()
+{
+  resetOutbox();
+  TEST_ASSERT(tgOutboxPush(testMessage(MK_MAIN, MP_LOW, 100)));
+  TEST_ASSERT(tgOutboxPush(testMessage(MK_PARAMS, MP_ORDINARY, 101)));
+  TEST_ASSERT(tgOutboxPush(testMessage(MK_SERVICE, MP_CRITICAL, 102)));
+  TEST_ASSERT(tgOutboxPush(testMessage(MK_SECURITY, MP_HIGH, 103)));
+  static const time_t expected[] = { 102, 103, 101, 100 };
+  for (time_t timestamp : expected) {
+    tgMessage_t* tgMsg = takeNext();
+    TEST_ASSERT(tgMsg != nullptr);
+    TEST_ASSERT_EQ(timestamp, tgMsg->timestamp);
+  };
+}
+
+// In a full outbox the oldest message of the lowest priority across all lanes makes room, nothing lower - nothing is evicted
+static void test_evict_lowest_oldest()
+{
+  resetOutbox();
+  for (int i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    msg_priority_t priority = i % 4 == 3 ? MP_LOW : MP_ORDINARY;
+    TEST_ASSERT(tgOutboxPush(testMessage((msg_kind_t)((CONFIG_TELEGRAM_OUTBOX_SIZE - i) % 4), priority, 1000 + i)));
+  };
+  TEST_ASSERT(!tgOutboxPush(testMessage(MK_MAIN, MP_HIGH, 5000)));
+  time_t previous = 0;
+  for (int i = 3; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i += 4) {
+    tgMessage_t* evicted = tgOutboxEvict(testMessage(MK_MAIN, MP_ORDINARY, 5000 + i));
+    TEST_ASSERT(evicted != nullptr);
+    TEST_ASSERT_EQ(MP_LOW, decMsgOptionsPriority(evicted->options));
+    TEST_ASSERT(evicted->timestamp > previous);
+    previous = evicted->timestamp;
+    TEST_ASSERT(tgOutboxPush(_messages.back()));
+  };
+  // Only ordinary messages are left, an ordinary one cannot push them out
+  TEST_ASSERT(tgOutboxEvict(testMessage(MK_MAIN, MP_ORDINARY, 9000)) == nullptr);
+  tgMessage_t* evicted = tgOutboxEvict(testMessage(MK_MAIN, MP_CRITICAL, 9001));
+  TEST_ASSERT(evicted != nullptr);
+  TEST_ASSERT_EQ(MP_ORDINARY, decMsgOptionsPriority(evicted->options));
+  TEST_ASSERT_EQ(1000, evicted->timestamp);
+}
+
+// The head of a busy lane may be in flight: it is neither evicted nor replaced, the message behind it can be evicted
+static void test_busy_head_is_kept()
+{
+  resetOutbox();
+  tgMessage_t* head = testMessage(MK_MAIN, MP_LOW, 100);
+  TEST_ASSERT(tgOutboxPush(head));
+  _tgLaneBusy[tgLane(head->options)] = true;
+  TEST_ASSERT(tgOutboxEvict(testMessage(MK_MAIN, MP_HIGH, 200)) == nullptr);
+  TEST_ASSERT(!tgOutboxReplace(head, testMessage(MK_MAIN, MP_LOW, 201)));
+  tgMessage_t* behind = testMessage(MK_MAIN, MP_LOW, 101);
+  TEST_ASSERT(tgOutboxPush(behind));
+  TEST_ASSERT(tgOutboxEvict(testMessage(MK_MAIN, MP_HIGH, 202)) == behind);
+  TEST_ASSERT(tgOutboxHead(tgLane(head->options), MP_LOW) == head);
+  // A retried message returns behind the busy head, in the order of its timestamp
+  tgMessage_t* second = testMessage(MK_MAIN, MP_LOW, 300);
+  TEST_ASSERT(tgOutboxPush(second));
+  tgMessage_t* retried = testMessage(MK_MAIN, MP_LOW, 50);
+  retried->attempts = 1;
+  TEST_ASSERT(tgOutboxPush(retried));
+  _tgLaneBusy[tgLane(head->options)] = false;
+  TEST_ASSERT(takeNext() == head);
+  TEST_ASSERT(takeNext() == retried);
+  TEST_ASSERT(takeNext() == second);
+}
+
+// ------------------------------------------------------------------------------------------------------------------------
+// Reference: the outbox before the lists, an array of slots scanned for a free slot, a victim and the next message
+
+static tgMessage_t* _scanSlots[CONFIG_TELEGRAM_OUTBOX_SIZE];
+
+static bool scanPush(tgMessage_t* tgMsg)
+{
+  for (int i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    if (_scanSlots[i] == nullptr) {
+      _scanSlots[i] = tgMsg;
+      return true;
+    };
+  };
+  return false;
+}
+
+static tgMessage_t* scanEvict(tgMessage_t* tgMsg)
+{
+  int victim = -1;
+  uint8_t limit = decMsgOptionsPriority(tgMsg->options);
+  for (int i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    if (_scanSlots[i]) {
+      uint8_t level = decMsgOptionsPriority(_scanSlots[i]->options);
+      if ((level < limit) && ((victim < 0)
+        || (level < decMsgOptionsPriority(_scanSlots[victim]->options))
+        || ((level == decMsgOptionsPriority(_scanSlots[victim]->options)) && (_scanSlots[i]->timestamp < _scanSlots[victim]->timestamp)))) {
+        victim = i;
+      };
+    };
+  };
+  if (victim < 0) return nullptr;
+  tgMessage_t* evicted = _scanSlots[victim];
+  _scanSlots[victim] = nullptr;
+  return evicted;
+}
+
+static tgMessage_t* scanNext()
+{
+  int next = -1;
+  for (int i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    if ((_scanSlots[i]) && (tgRateWait(tgLane(_scanSlots[i]->options)) == 0)
+     && ((next < 0) || (_scanSlots[i]->deadline < _scanSlots[next]->deadline))) {
+      next = i;
+    };
+  };
+  if (next < 0) return nullptr;
+  tgMessage_t* tgMsg = _scanSlots[next];
+  _scanSlots[next] = nullptr;
+  return tgMsg;
+}
+
+// Turns the spare message into a new one with a random kind and priority
+static void renewMessage(std::mt19937& random, tgMessage_t* tgMsg, time_t timestamp)
+{
+  tgMsg->options = encMsgOptions((msg_kind_t)(random() % 4), false, (msg_priority_t)(random() % 4));
+  tgMsg->timestamp = timestamp;
+  tgMsg->queued = (int64_t)timestamp * 1000;
+  tgMsg->attempts = 0;
+  tgMessageSchedule(tgMsg, 0, TG_LATENCY_DEFAULT);
+}
+
+/**
+ * The outbox is kept full, every round a new message either pushes out a less important one or, if there is none,
+ * waits until the next message is taken for sending. Returns ns per round
+ * */
+template <typename Push, typename Evict, typename Next>
+static double churn(Push push, Evict evict, Next next)
+{
+  std::mt19937 random(5);
+  time_t timestamp = 1;
+  for (int i = 0; i < CONFIG_TELEGRAM_OUTBOX_SIZE; i++) {
+    tgMessage_t* tgMsg = testMessage(MK_MAIN, MP_ORDINARY, 0);
+    renewMessage(random, tgMsg, timestamp++);
+    push(tgMsg);
+  };
+  tgMessage_t* spare = testMessage(MK_MAIN, MP_ORDINARY, 0);
+  int64_t started = esp_timer_get_time();
+  for (int round = 0; round < TEST_CHURN; round++) {
+    renewMessage(random, spare, timestamp++);
+    tgMessage_t* freed = evict(spare);
+    if (freed == nullptr) freed = next();
+    push(spare);
+    spare = freed;
+  };
+  return (double)(esp_timer_get_time() - started) * 1000 / TEST_CHURN;
+}
+
+static void test_churn_benchmark()
+{
+  resetOutbox();
+  double lists = churn(tgOutboxPush, tgOutboxEvict, takeNext);
+  TEST_ASSERT_EQ(CONFIG_TELEGRAM_OUTBOX_SIZE, _tgOutbox.count);
+  resetOutbox();
+  memset(_scanSlots, 0, sizeof(_scanSlots));
+  double scan = churn(scanPush, scanEvict, scanNext);
+  fprintf(stderr, "  outbox of %d: linear scan %.1f ns, lists %.1f ns per insert (x%.1f)\n",
+    CONFIG_TELEGRAM_OUTBOX_SIZE, scan, lists, lists > 0 ? scan / lists : 0);
+}
+
+int main()
+{
+  tgLanesInit();
+  tgRateInit();
+  TEST_RUN(test_fifo_within_level);
+  TEST_RUN(test_priority_goes_first);
+  TEST_RUN(test_evict_lowest_oldest);
+  TEST_RUN(test_busy_head_is_kept);
+  TEST_RUN(test_churn_benchmark);
+  resetOutbox();
+  return TEST_RESULT();
+}
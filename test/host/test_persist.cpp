@@ -0,0 +1,110 @@
+/*
+   EN: The outbox log in flash (CONFIG_TELEGRAM_OUTBOX_PERSISTENT): messages come back after a restart, and a write
+   cut by a power failure anywhere in a record loses only that record, not the ones appended after the restart.
+   Includes the library source
+   RU: Журнал очереди отправки во flash (CONFIG_TELEGRAM_OUTBOX_PERSISTENT): сообщения восстанавливаются после
+   перезапуска, а запись, прерванная отключением питания в любом месте, теряет только эту запись, но не те, что
+   добавлены после перезапуска. Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_AREA 8192
+
+static void appendMessage(const char* text)
+{
+  tgMessage_t* tgMsg = tgMessageAlloc(strlen(text) + 1);
+  strcpy(tgMsg->message, text);
+  tgMsg->options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+  tgMsg->timestamp = 1000;
+  tgMsg->queued = esp_timer_get_time();
+  tgMessageSchedule(tgMsg, 0, TG_LATENCY_DEFAULT);
+  if (tgOutboxPush(tgMsg)) {
+    tgLogAppend(tgMsg);
+  } else {
+    tgMessageFree(tgMsg);
+  };
+}
+
+// Drops the outbox as a restart does and recovers it from the log, returns the texts in the order of the outbox
+static std::vector<std::string> restart()
+{
+  for (uint8_t lane = 0; lane < TELEGRAM_LANES; lane++) {
+    for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+      while (tgMessage_t* tgMsg = tgOutboxPop(lane, level)) {
+        tgMessageFree(tgMsg);
+      };
+    };
+  };
+  tgOutboxInit();
+  tgLogRecover();
+  std::vector<std::string> texts;
+  for (uint8_t level = 0; level < TELEGRAM_OUTBOX_LEVELS; level++) {
+    for (uint16_t index = _tgOutbox.lists[MK_MAIN][level].head; index != TELEGRAM_OUTBOX_NONE; index = _tgOutbox.items[index].next) {
+      texts.push_back(_tgOutbox.items[index].message->message);
+    };
+  };
+  return texts;
+}
+
+static void test_restart()
+{
+  hostFlashInit(CONFIG_TELEGRAM_OUTBOX_PARTITION, 2 * TEST_AREA);
+  TEST_ASSERT(restart().empty());
+  TEST_ASSERT(_tgLog.partition != nullptr);
+  appendMessage("first");
+  appendMessage("second");
+  std::vector<std::string> texts = restart();
+  TEST_ASSERT_EQ(2, texts.size());
+  TEST_ASSERT(texts[0] == "first");
+  TEST_ASSERT(texts[1] == "second");
+}
+
+/**
+ * The power fails while "cut" is written: in the middle of its text, between the text and the header, and in the
+ * middle of the header. After the restart only "cut" is missing, and the message appended then survives the next one
+ * */
+static void test_power_cut()
+{
+  static const char* const text = "this record is cut by a power failure";
+  const size_t length = strlen(text);
+  const int64_t cuts[] = { (int64_t)length / 2, (int64_t)length, (int64_t)(length + sizeof(tgLogRecord_t) / 2) };
+  for (int64_t cut : cuts) {
+    hostFlashInit(CONFIG_TELEGRAM_OUTBOX_PARTITION, 2 * TEST_AREA);
+    TEST_ASSERT(restart().empty());
+    appendMessage("first");
+    appendMessage("second");
+    uint32_t generation = _tgLog.generation;
+
+    hostFlashCut(cut);
+    appendMessage(text);
+    hostFlashCut(-1);
+    std::vector<std::string> texts = restart();
+    fprintf(stderr, "  cut after %lld bytes: %d messages recovered, generation %u -> %u\n",
+      (long long)cut, (int)texts.size(), generation, _tgLog.generation);
+    TEST_ASSERT(_tgLog.partition != nullptr);
+    TEST_ASSERT_EQ(2, texts.size());
+    TEST_ASSERT(std::find(texts.begin(), texts.end(), text) == texts.end());
+    // The damaged tail has been left behind by compaction
+    TEST_ASSERT(_tgLog.generation != generation);
+
+    appendMessage("third");
+    texts = restart();
+    TEST_ASSERT_EQ(3, texts.size());
+    TEST_ASSERT(texts[0] == "first");
+    TEST_ASSERT(texts[1] == "second");
+    TEST_ASSERT(texts[2] == "third");
+  };
+}
+
+int main()
+{
+  if (!tgSlabInit()) return 1;
+  TEST_RUN(test_restart);
+  TEST_RUN(test_power_cut);
+  return TEST_RESULT();
+}
@@ -0,0 +1,248 @@
+/*
+   EN: The MPSC message ring: every message pushed by several producer threads is received exactly once and in
+   the order of its producer, a filling ring refuses low priorities first, and the enqueue latency and throughput
+   are compared with a queue guarded by a mutex (the way xQueueSend() serializes producers). Includes the library source
+   RU: Кольцевой буфер сообщений MPSC: каждое сообщение от нескольких потоков-производителей принимается ровно один
+   раз и в порядке своего производителя, заполняющийся буфер отказывает сначала низким приоритетам, задержка и
+   пропускная способность постановки в очередь сравниваются с очередью под мьютексом (так xQueueSend() упорядочивает
+   производителей). Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_PER_PRODUCER 20000
+
+// The producer and its sequence number are kept in the context of the message
+#define TEST_CTX(producer, seq) ((void*)(((uintptr_t)(producer) << 24) | (uintptr_t)(seq)))
+#define TEST_CTX_PRODUCER(ctx) ((uint32_t)((uintptr_t)(ctx) >> 24))
+#define TEST_CTX_SEQ(ctx) ((uint32_t)((uintptr_t)(ctx) & 0xFFFFFF))
+
+// Enqueue calls take less than the microsecond of esp_timer_get_time()
+static int64_t nowNs()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Only the headers travel through the ring, so the test keeps its own instead of taking slots of the arena
+static std::vector<tgMessage_t> preparedMessages(uint32_t producer, uint32_t count, msg_priority_t priority)
+{
+  std::vector<tgMessage_t> messages(count);
+  for (uint32_t seq = 0; seq < count; seq++) {
+    messages[seq].options = encMsgOptions(MK_MAIN, false, priority);
+    messages[seq].timestamp = 1;
+    messages[seq].queued = esp_timer_get_time();
+    messages[seq].ctx = TEST_CTX(producer, seq);
+  };
+  return messages;
+}
+
+static void test_priority_reserve()
+{
+  tgRingInit();
+  static const msg_priority_t levels[] = { MP_LOW, MP_ORDINARY, MP_HIGH, MP_CRITICAL };
+  std::vector<tgMessage_t> messages = preparedMessages(0, CONFIG_TELEGRAM_QUEUE_SIZE + 1, MP_CRITICAL);
+  tgMessage_t refused = messages[0];
+  int accepted = 0;
+  for (msg_priority_t level : levels) {
+    // Each level fills the ring up to its own reserve
+    messages[accepted].options = encMsgOptions(MK_MAIN, false, level);
+    while (tgRingPush(&messages[accepted])) {
+      accepted++;
+      messages[accepted].options = encMsgOptions(MK_MAIN, false, level);
+    };
+    TEST_ASSERT_EQ(CONFIG_TELEGRAM_QUEUE_SIZE - TELEGRAM_RING_RESERVE(level), accepted);
+  };
+  TEST_ASSERT_EQ(CONFIG_TELEGRAM_QUEUE_SIZE, accepted);
+  // Taking one message gives one credit back
+  TEST_ASSERT(tgRingPeek() == &messages[0]);
+  tgRingAdvance();
+  TEST_ASSERT(tgRingPush(&refused));
+}
+
+/**
+ * Producers push their messages as fast as they can (retrying while the ring is full), the consumer takes them
+ * as they are committed. Returns false if a message is lost, duplicated or out of its producer's order
+ * */
+static bool ringRun(uint32_t producers, std::vector<int64_t>* latency, uint64_t* rejected, int64_t* elapsed)
+{
+  tgRingInit();
+  std::vector<std::vector<tgMessage_t>> messages;
+  for (uint32_t p = 0; p < producers; p++) {
+    messages.push_back(preparedMessages(p, TEST_PER_PRODUCER, MP_CRITICAL));
+  };
+  std::vector<std::vector<int64_t>> latencies(producers);
+  std::atomic<uint64_t> refused(0);
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (uint32_t p = 0; p < producers; p++) {
+    threads.emplace_back([&, p] {
+      while (!start) std::this_thread::yield();
+      latencies[p].reserve(TEST_PER_PRODUCER);
+      for (tgMessage_t& tgMsg : messages[p]) {
+        while (true) {
+          int64_t begin = nowNs();
+          bool pushed = tgRingPush(&tgMsg);
+          int64_t end = nowNs();
+          if (pushed) {
+            latencies[p].push_back(end - begin);
+            break;
+          };
+          refused++;
+          std::this_thread::yield();
+        };
+      };
+    });
+  };
+  std::vector<uint32_t> next(producers, 0);
+  bool ordered = true;
+  uint32_t total = producers * TEST_PER_PRODUCER;
+  int64_t started = esp_timer_get_time();
+  start = true;
+  for (uint32_t received = 0; received < total; ) {
+    tgMessage_t* tgMsg = tgRingPeek();
+    if (tgMsg == nullptr) {
+      std::this_thread::yield();
+      continue;
+    };
+    tgRingAdvance();
+    uint32_t producer = TEST_CTX_PRODUCER(tgMsg->ctx);
+    if ((producer >= producers) || (TEST_CTX_SEQ(tgMsg->ctx) != next[producer])) ordered = false;
+    if (producer < producers) next[producer]++;
+    received++;
+  };
+  *elapsed = esp_timer_get_time() - started;
+  for (std::thread& thread : threads) {
+    thread.join();
+  };
+  ordered = ordered && (tgRingPeek() == nullptr) && (__atomic_load_n(&_tgRing.credits, __ATOMIC_RELAXED) == CONFIG_TELEGRAM_QUEUE_SIZE);
+  for (uint32_t p = 0; p < producers; p++) {
+    ordered = ordered && (next[p] == TEST_PER_PRODUCER);
+    latency->insert(latency->end(), latencies[p].begin(), latencies[p].end());
+  };
+  *rejected = refused;
+  return ordered;
+}
+
+// ------------------------------------------------------------------------------------------------------------------------
+// Reference: a bounded queue of pointers guarded by a mutex
+
+static std::mutex _queueLock;
+static tgMessage_t* _queueSlots[CONFIG_TELEGRAM_QUEUE_SIZE];
+static uint32_t _queueHead = 0;
+static uint32_t _queueCount = 0;
+
+static bool queueSend(tgMessage_t* tgMsg)
+{
+  std::lock_guard<std::mutex> guard(_queueLock);
+  if (_queueCount >= CONFIG_TELEGRAM_QUEUE_SIZE) return false;
+  _queueSlots[(_queueHead + _queueCount) % CONFIG_TELEGRAM_QUEUE_SIZE] = tgMsg;
+  _queueCount++;
+  return true;
+}
+
+static tgMessage_t* queueReceive()
+{
+  std::lock_guard<std::mutex> guard(_queueLock);
+  if (_queueCount == 0) return nullptr;
+  tgMessage_t* tgMsg = _queueSlots[_queueHead];
+  _queueHead = (_queueHead + 1) % CONFIG_TELEGRAM_QUEUE_SIZE;
+  _queueCount--;
+  return tgMsg;
+}
+
+static void queueRun(uint32_t producers, std::vector<int64_t>* latency, int64_t* elapsed)
+{
+  std::vector<std::vector<tgMessage_t>> messages;
+  for (uint32_t p = 0; p < producers; p++) {
+    messages.push_back(preparedMessages(p, TEST_PER_PRODUCER, MP_CRITICAL));
+  };
+  std::vector<std::vector<int64_t>> latencies(producers);
+  std::atomic<bool> start(false);
+  std::vector<std::thread> threads;
+  for (uint32_t p = 0; p < producers; p++) {
+    threads.emplace_back([&, p] {
+      while (!start) std::this_thread::yield();
+      latencies[p].reserve(TEST_PER_PRODUCER);
+      for (tgMessage_t& tgMsg : messages[p]) {
+        while (true) {
+          int64_t begin = nowNs();
+          bool pushed = queueSend(&tgMsg);
+          int64_t end = nowNs();
+          if (pushed) {
+            latencies[p].push_back(end - begin);
+            break;
+          };
+          std::this_thread::yield();
+        };
+      };
+    });
+  };
+  uint32_t total = producers * TEST_PER_PRODUCER;
+  int64_t started = esp_timer_get_time();
+  start = true;
+  for (uint32_t received = 0; received < total; ) {
+    if (queueReceive()) {
+      received++;
+    } else {
+      std::this_thread::yield();
+    };
+  };
+  *elapsed = esp_timer_get_time() - started;
+  for (std::thread& thread : threads) {
+    thread.join();
+  };
+  for (uint32_t p = 0; p < producers; p++) {
+    latency->insert(latency->end(), latencies[p].begin(), latencies[p].end());
+  };
+}
+
+static int64_t percentile(std::vector<int64_t>& values, int p)
+{
+  std::sort(values.begin(), values.end());
+  return values.empty() ? 0 : values[(values.size() - 1) * p / 100];
+}
+
+static void test_producers_exactly_once()
+{
+  static const uint32_t counts[] = { 1, 2, 4, 8 };
+  for (uint32_t producers : counts) {
+    std::vector<int64_t> ring, queue;
+    uint64_t rejected;
+    int64_t ringElapsed, queueElapsed;
+    TEST_ASSERT(ringRun(producers, &ring, &rejected, &ringElapsed));
+    queueRun(producers, &queue, &queueElapsed);
+    fprintf(stderr, "  %u producer(s): ring %5.2f M msg/s, enqueue p50 %lld ns, p99 %lld ns, max %lld ns (%llu times full); "
+      "mutex queue %5.2f M msg/s, p50 %lld ns, p99 %lld ns, max %lld ns\n", producers,
+      (double)producers * TEST_PER_PRODUCER / ringElapsed, (long long)percentile(ring, 50), (long long)percentile(ring, 99),
+      (long long)percentile(ring, 100), (unsigned long long)rejected,
+      (double)producers * TEST_PER_PRODUCER / queueElapsed, (long long)percentile(queue, 50), (long long)percentile(queue, 99),
+      (long long)percentile(queue, 100));
+  };
+}
+
+// Messages dropped in interrupts are reported as an error, and the next delivered message clears it
+static void test_isr_drop_error_cleared()
+{
+  tgRingInit();
+  tgSendResult(ESP_OK);
+  _tgRing.isr_dropped = 1;
+  TEST_ASSERT(tgRingWait(0) == nullptr);
+  TEST_ASSERT_EQ(ESP_ERR_NO_MEM, hostEventsLastError());
+  tgSendResult(ESP_OK);
+  TEST_ASSERT_EQ(ESP_OK, hostEventsLastError());
+}
+
+int main()
+{
+  TEST_RUN(test_priority_reserve);
+  TEST_RUN(test_isr_drop_error_cleared);
+  TEST_RUN(test_producers_exactly_once);
+  return TEST_RESULT();
+}
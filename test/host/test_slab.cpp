@@ -0,0 +1,104 @@
+/*
+   EN: Message arena under contention: threads take and return slots concurrently, no slot is ever given to two
+   owners and none is lost. Includes the library source to reach tgMessageAlloc() and tgMessageFree()
+   RU: Арена сообщений под нагрузкой: потоки одновременно берут и возвращают слоты, ни один слот не выдается двум
+   владельцам и не теряется. Включает исходник библиотеки, чтобы вызывать tgMessageAlloc() и tgMessageFree()
+*/
+
+#include "reTgSend.cpp"
+#include <atomic>
+#include <thread>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_THREADS 8
+#define TEST_ROUNDS 200000
+#define TEST_HOLD 3
+
+static std::atomic<uint32_t> _owners[TELEGRAM_SLAB_SIZE];
+static std::atomic<int> _conflicts(0);
+static std::atomic<int> _empty(0);
+
+static uint16_t slotIndex(tgMessage_t* tgMsg)
+{
+  return (uint16_t)(tgMsg - _tgSlab->headers);
+}
+
+// Every thread holds up to TEST_HOLD slots at a time and marks them as its own while it holds them
+static void slabWorker(uint32_t thread)
+{
+  tgMessage_t* held[TEST_HOLD] = {};
+  for (uint32_t round = 0; round < TEST_ROUNDS; round++) {
+    uint32_t i = round % TEST_HOLD;
+    if (held[i]) {
+      uint16_t index = slotIndex(held[i]);
+      if ((held[i]->message[0] != (char)('A' + thread)) || (_owners[index].exchange(0) != thread + 1)) _conflicts++;
+      tgMessageFree(held[i]);
+      held[i] = nullptr;
+    };
+    held[i] = tgMessageAlloc(CONFIG_TELEGRAM_MESSAGE_SIZE);
+    if (held[i]) {
+      uint32_t free_owner = 0;
+      if (!_owners[slotIndex(held[i])].compare_exchange_strong(free_owner, thread + 1)) _conflicts++;
+      held[i]->message[0] = (char)('A' + thread);
+    } else {
+      _empty++;
+    };
+  };
+  for (uint32_t i = 0; i < TEST_HOLD; i++) {
+    if (held[i]) {
+      _owners[slotIndex(held[i])] = 0;
+      tgMessageFree(held[i]);
+    };
+  };
+}
+
+// Counts the slots on the free stack, checking that it has no cycles
+static uint32_t freeSlots()
+{
+  uint32_t count = 0;
+  uint16_t index = (uint16_t)(_tgSlab->free_top & 0xFFFF);
+  while ((index != TELEGRAM_SLAB_NONE) && (count <= TELEGRAM_SLAB_SIZE)) {
+    count++;
+    index = _tgSlab->next[index];
+  };
+  return count;
+}
+
+static void test_exhaustion()
+{
+  std::vector<tgMessage_t*> taken;
+  while (tgMessage_t* tgMsg = tgMessageAlloc(CONFIG_TELEGRAM_MESSAGE_SIZE)) {
+    taken.push_back(tgMsg);
+    TEST_ASSERT(taken.size() <= TELEGRAM_SLAB_SIZE);
+  };
+  TEST_ASSERT_EQ(TELEGRAM_SLAB_SIZE, taken.size());
+  TEST_ASSERT_EQ(0, freeSlots());
+  for (tgMessage_t* tgMsg : taken) {
+    tgMessageFree(tgMsg);
+  };
+  TEST_ASSERT_EQ(TELEGRAM_SLAB_SIZE, freeSlots());
+}
+
+static void test_concurrent_alloc_free()
+{
+  std::vector<std::thread> threads;
+  for (uint32_t i = 0; i < TEST_THREADS; i++) {
+    threads.emplace_back(slabWorker, i);
+  };
+  for (std::thread& thread : threads) {
+    thread.join();
+  };
+  fprintf(stderr, "  %d threads x %d rounds over %d slots: %d times the arena was empty\n",
+    TEST_THREADS, TEST_ROUNDS, TELEGRAM_SLAB_SIZE, _empty.load());
+  TEST_ASSERT_EQ(0, _conflicts.load());
+  TEST_ASSERT_EQ(TELEGRAM_SLAB_SIZE, freeSlots());
+}
+
+int main()
+{
+  if (!tgSlabInit()) return 1;
+  TEST_RUN(test_exhaustion);
+  TEST_RUN(test_concurrent_alloc_free);
+  return TEST_RESULT();
+}
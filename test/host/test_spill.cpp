@@ -0,0 +1,87 @@
+/*
+   EN: The spill buffer (CONFIG_TELEGRAM_SPILL_SIZE): messages that do not fit into the full outbox during an outage
+   are uploaded as one document with sendDocument when the network is back, and their records are released.
+   Includes the library source
+   RU: Буфер вытеснения (CONFIG_TELEGRAM_SPILL_SIZE): сообщения, не поместившиеся в заполненную очередь во время
+   отсутствия сети, после ее появления загружаются одним документом через sendDocument, а их записи освобождаются.
+   Включает исходник библиотеки
+*/
+
+#include "reTgSend.cpp"
+#include <string.h>
+#include <vector>
+#include "host_test.h"
+
+#define TEST_MESSAGES 40
+
+// Bytes of the spill buffer in use, count receives the records of the lane not delivered yet
+static uint32_t spillUsed(uint8_t lane, uint16_t* count)
+{
+  xSemaphoreTake(_tgLock, portMAX_DELAY);
+  uint32_t used = _tgSpill.used;
+  *count = _tgSpill.count[lane];
+  xSemaphoreGive(_tgLock);
+  return used;
+}
+
+// How many times every numbered message has reached the server, in a message or in a document
+static std::vector<int> receivedNumbers(int* documents)
+{
+  static char json[64 * 1024];
+  std::vector<int> received(TEST_MESSAGES, 0);
+  *documents = 0;
+  if (!hostFakeGet("/_messages", json, sizeof(json))) return received;
+  for (const char* pos = json; (pos = strstr(pos, "\"method\":\"sendDocument\"")) != nullptr; pos++) {
+    (*documents)++;
+  };
+  for (const char* pos = json; (pos = strstr(pos, "Reading #")) != nullptr; ) {
+    pos += 9;
+    int number = atoi(pos);
+    if ((number >= 0) && (number < TEST_MESSAGES)) {
+      received[number]++;
+    };
+  };
+  return received;
+}
+
+static void test_outage_overflow()
+{
+  hostResetCounters();
+  uint32_t before = hostStatsCounter(TG_COUNTER_SPILLED);
+  uint8_t lane = tgLane(encMsgOptions(MK_MAIN, false, MP_ORDINARY));
+  hostNetworkSet(false);
+  // Every other message with a notification, so that they are not merged into batches
+  for (int i = 0; i < TEST_MESSAGES; i++) {
+    TEST_ASSERT(tgSend(MK_MAIN, MP_ORDINARY, i % 2, nullptr, "Reading #%d;", i));
+  };
+  const uint32_t overflow = TEST_MESSAGES - CONFIG_TELEGRAM_OUTBOX_SIZE;
+  TEST_ASSERT(hostWaitFor([before, overflow] { return hostStatsCounter(TG_COUNTER_SPILLED) - before >= overflow; }, 5000));
+  TEST_ASSERT_EQ(overflow, hostStatsCounter(TG_COUNTER_SPILLED) - before);
+  uint16_t count = 0;
+  TEST_ASSERT(spillUsed(lane, &count) > 0);
+  TEST_ASSERT_EQ(overflow, count);
+
+  hostNetworkSet(true);
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("method_sendDocument") >= 1; }, 15000));
+  // The records are released once the upload has been accepted
+  TEST_ASSERT(hostWaitFor([lane, &count] { return spillUsed(lane, &count) == 0; }, 5000));
+  TEST_ASSERT_EQ(0, count);
+  TEST_ASSERT_EQ(0, _tgSpill.upload_used);
+  TEST_ASSERT(hostWaitFor([] { return hostFakeCounter("delivered") >= 1 + CONFIG_TELEGRAM_OUTBOX_SIZE; }, 15000));
+
+  int documents = 0;
+  std::vector<int> received = receivedNumbers(&documents);
+  fprintf(stderr, "  %u messages spilled, %d document(s), %lld requests\n", overflow, documents, hostFakeCounter("requests"));
+  TEST_ASSERT_EQ(1, documents);
+  TEST_ASSERT_EQ(1, hostFakeCounter("method_sendDocument"));
+  for (int i = 0; i < TEST_MESSAGES; i++) {
+    TEST_ASSERT_EQ(1, received[i]);
+  };
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_outage_overflow);
+  return TEST_RESULT();
+}
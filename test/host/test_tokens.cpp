@@ -0,0 +1,137 @@
+/*
+   EN: A pool of bot tokens, built with one and three bots: the fake server limits every bot on its own, the
+   aggregate throughput grows with the pool while no bot goes over its limit, and a chat whose bot is throttled
+   (429) or denied access (403) is taken over by another bot of the pool
+   RU: Пул токенов ботов, с одним и тремя ботами: имитатор ограничивает каждого бота отдельно, общая пропускная
+   способность растет с размером пула, при этом ни один бот не превышает свой предел, а чат, чей бот ограничен (429)
+   или лишен доступа (403), обслуживает другой бот пула
+*/
+
+#include "reTgSend.h"
+#include "host_test.h"
+
+#if defined(CONFIG_TELEGRAM_TOKEN_3)
+  #define TEST_TOKENS 3
+#elif defined(CONFIG_TELEGRAM_TOKEN_2)
+  #define TEST_TOKENS 2
+#else
+  #define TEST_TOKENS 1
+#endif // CONFIG_TELEGRAM_TOKEN_N
+
+// Bot IDs are the numbers before ':' in the tokens, 1000001 ... 1000003
+#define TEST_BOT_ID(token) (1000001 + (token))
+#define TEST_MESSAGES 90
+// Per bot: the library paces 1000 / CONFIG_TELEGRAM_RATE_GLOBAL messages per second, the server allows a few more for the burst
+#define TEST_BOT_RATE (1000 / CONFIG_TELEGRAM_RATE_GLOBAL)
+#define TEST_SERVER_RATE (TEST_BOT_RATE + CONFIG_TELEGRAM_RATE_BURST + 2)
+#define TEST_RETRY_AFTER 3
+
+static void resetCounters(const char* control)
+{
+  hostResetCounters();
+  if (control) hostFakeControl(control);
+}
+
+static bool send(msg_kind_t kind, int number)
+{
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(kind, false, MP_ORDINARY);
+  params.callback = hostOnResult;
+  return tgSendMsgEx(&params, nullptr, "#%d", number);
+}
+
+static long long botCounter(int token)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "bot_%d", TEST_BOT_ID(token));
+  return hostFakeCounter(key);
+}
+
+// Four chats, each bot of the pool is limited to TEST_SERVER_RATE messages per second by the server
+static void test_throughput_scaling()
+{
+  char control[64];
+  snprintf(control, sizeof(control), "bot_rate=%d", TEST_SERVER_RATE);
+  resetCounters(control);
+  int64_t started = esp_timer_get_time();
+  for (int i = 0; i < TEST_MESSAGES; i++) {
+    TEST_ASSERT(send((msg_kind_t)(i % 4), i));
+  };
+  TEST_ASSERT(hostWaitFor([] { return _hostDelivered + _hostFailed >= TEST_MESSAGES; }, 30000));
+  int64_t elapsed = esp_timer_get_time() - started;
+  TEST_ASSERT_EQ(TEST_MESSAGES, _hostDelivered.load());
+  double rate = (double)TEST_MESSAGES * 1000000 / elapsed;
+  fprintf(stderr, "  %d bot(s) of %d messages per second each: %d messages in %.2f s, %.1f messages per second, %lld over the limit\n",
+    TEST_TOKENS, TEST_BOT_RATE, TEST_MESSAGES, elapsed / 1000000.0, rate, hostFakeCounter("limited"));
+  for (int token = 0; token < TEST_TOKENS; token++) {
+    fprintf(stderr, "    bot %d: %lld messages\n", TEST_BOT_ID(token), botCounter(token));
+    TEST_ASSERT(botCounter(token) >= TEST_MESSAGES / (2 * TEST_TOKENS));
+  };
+  // No bot has been throttled by the server, and together they send as fast as their limits allow
+  TEST_ASSERT_EQ(0, hostFakeCounter("limited"));
+  TEST_ASSERT(rate > 0.7 * TEST_TOKENS * TEST_BOT_RATE);
+  TEST_ASSERT(rate < 1.3 * TEST_TOKENS * TEST_BOT_RATE);
+}
+
+// The bot that sends a message to the main chat when every bot is free is its primary one
+static int primaryToken()
+{
+  // The buckets charged by the previous test have to drain first
+  usleep(1000000);
+  resetCounters(nullptr);
+  if (!send(MK_MAIN, 0) || !hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 5000)) return -1;
+  for (int token = 0; token < TEST_TOKENS; token++) {
+    if (botCounter(token) == 1) return token;
+  };
+  return -1;
+}
+
+/**
+ * The primary bot of the chat is refused once with the specified failure. With a pool another bot delivers the message
+ * right away, with a single bot it waits out the penalty. Returns the delivery time in us, -1 - not delivered
+ * */
+static int64_t deliverAfterFailure(int primary, const char* failure)
+{
+  char control[128];
+  snprintf(control, sizeof(control), "fail=%s&fail_count=1&fail_bot=%d&retry_after=%d", failure, TEST_BOT_ID(primary), TEST_RETRY_AFTER);
+  resetCounters(control);
+  int64_t started = esp_timer_get_time();
+  if (!send(MK_MAIN, 1)) return -1;
+  if (!hostWaitFor([] { return _hostDelivered + _hostFailed >= 1; }, 2 * CONFIG_TELEGRAM_FORBIDDEN_INTERVAL + 10000)) return -1;
+  return _hostDelivered == 1 ? esp_timer_get_time() - started : -1;
+}
+
+static void test_failover()
+{
+  int primary = primaryToken();
+  TEST_ASSERT(primary >= 0);
+  int64_t limited = deliverAfterFailure(primary, "429");
+  TEST_ASSERT(limited >= 0);
+  TEST_ASSERT_EQ(1, hostFakeCounter("injected_429"));
+  fprintf(stderr, "  %d bot(s): delivered %.1f ms after 429 with retry_after %d s\n", TEST_TOKENS, limited / 1000.0, TEST_RETRY_AFTER);
+  #if TEST_TOKENS > 1
+    TEST_ASSERT(limited < 1000000);
+    TEST_ASSERT_EQ(1, botCounter(primary));
+  #else
+    TEST_ASSERT(limited >= TEST_RETRY_AFTER * 1000000);
+  #endif // TEST_TOKENS
+  // The penalty of the primary bot has to pass, otherwise the next message would not even try it
+  usleep((TEST_RETRY_AFTER * 1000 + 200) * 1000);
+  int64_t denied = deliverAfterFailure(primary, "403");
+  TEST_ASSERT(denied >= 0);
+  TEST_ASSERT_EQ(1, hostFakeCounter("injected_403"));
+  fprintf(stderr, "  %d bot(s): delivered %.1f ms after 403\n", TEST_TOKENS, denied / 1000.0);
+  #if TEST_TOKENS > 1
+    TEST_ASSERT(denied < 1000000);
+  #else
+    TEST_ASSERT(denied >= CONFIG_TELEGRAM_FORBIDDEN_INTERVAL * 1000LL);
+  #endif // TEST_TOKENS
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_throughput_scaling);
+  TEST_RUN(test_failover);
+  return TEST_RESULT();
+}
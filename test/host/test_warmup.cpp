@@ -0,0 +1,100 @@
+/*
+   EN: The first message after the network comes back, built with CONFIG_TELEGRAM_WARMUP on and off: the time from
+   tgSendMsgEx() to the delivery callback, with the fake server delaying the first response on every new connection
+   by connect_ms (DNS, TCP and TLS on the device). And the last known address of the API host when DNS does not respond
+   RU: Первое сообщение после восстановления сети, с CONFIG_TELEGRAM_WARMUP и без: время от tgSendMsgEx() до
+   обратного вызова о доставке, имитатор задерживает первый ответ на каждом новом соединении на connect_ms (DNS, TCP
+   и TLS на устройстве). И последний известный адрес сервера API, когда DNS не отвечает
+*/
+
+#include <algorithm>
+#include <vector>
+#include "reTgSend.h"
+#include "host_test.h"
+
+#if defined(CONFIG_TELEGRAM_WARMUP) && !CONFIG_TELEGRAM_WARMUP
+  #define TEST_WARMUP 0
+#else
+  #define TEST_WARMUP 1
+#endif // CONFIG_TELEGRAM_WARMUP
+
+#define TEST_CONNECT_MS 200
+#define TEST_RECONNECTS 5
+// The network state module needs a moment to catch up, the warm-up itself takes TEST_CONNECT_MS
+#define TEST_SETTLE_MS 600
+
+// Sends one message and waits for its result, returns the time from tgSendMsgEx() to the callback in us, -1 - not delivered
+static int64_t sendAndWait(const char* text)
+{
+  int failed = _hostFailed;
+  int before = _hostDelivered + failed;
+  tg_send_params_t params = {};
+  params.options = encMsgOptions(MK_MAIN, false, MP_ORDINARY);
+  params.callback = hostOnResult;
+  int64_t started = esp_timer_get_time();
+  if (!tgSendMsgEx(&params, "Reconnect", "%s", text)) return -1;
+  if (!hostWaitFor([before] { return _hostDelivered + _hostFailed > before; }, 15000)) return -1;
+  int64_t elapsed = esp_timer_get_time() - started;
+  return _hostFailed > failed ? -1 : elapsed;
+}
+
+static void reconnect()
+{
+  hostNetworkSet(false);
+  usleep(50000);
+  hostNetworkSet(true);
+  usleep(TEST_SETTLE_MS * 1000);
+}
+
+static void test_first_message_after_reconnect()
+{
+  hostFakeControl("reset=1");
+  char control[64];
+  snprintf(control, sizeof(control), "connect_ms=%d", TEST_CONNECT_MS);
+  hostFakeControl(control);
+  TEST_ASSERT(sendAndWait("before") >= 0);
+  std::vector<int64_t> latency;
+  for (int i = 0; i < TEST_RECONNECTS; i++) {
+    reconnect();
+    int64_t elapsed = sendAndWait("power restored");
+    TEST_ASSERT(elapsed >= 0);
+    latency.push_back(elapsed);
+  };
+  std::sort(latency.begin(), latency.end());
+  int64_t median = latency[latency.size() / 2];
+  fprintf(stderr, "  warm-up %s: the first message after a reconnect took %.1f ms (median), %.1f ms at most, connect_ms %d\n",
+    TEST_WARMUP ? "on" : "off", median / 1000.0, latency.back() / 1000.0, TEST_CONNECT_MS);
+  #if TEST_WARMUP
+    TEST_ASSERT(median < TEST_CONNECT_MS * 1000 / 2);
+    // One getMe per reconnect
+    TEST_ASSERT_EQ(TEST_RECONNECTS, hostFakeCounter("method_getMe"));
+  #else
+    TEST_ASSERT(median >= TEST_CONNECT_MS * 1000);
+  #endif // TEST_WARMUP
+}
+
+// The address resolved before stays in use while DNS does not respond, the connection is made to it directly
+static void test_dns_fallback()
+{
+  hostFakeControl("reset=1");
+  TEST_ASSERT(sendAndWait("resolved") >= 0);
+  hostDnsSet(false);
+  reconnect();
+  host_http_t before;
+  hostHttpGet(&before);
+  int64_t elapsed = sendAndWait("without DNS");
+  host_http_t after;
+  hostHttpGet(&after);
+  hostDnsSet(true);
+  TEST_ASSERT(elapsed >= 0);
+  TEST_ASSERT_EQ(before.failures, after.failures);
+  fprintf(stderr, "  delivered to the last known address in %.1f ms\n", elapsed / 1000.0);
+}
+
+int main()
+{
+  if (!tgTaskCreate()) return 1;
+  TEST_RUN(test_first_message_after_reconnect);
+  TEST_RUN(test_dns_fallback);
+  return TEST_RESULT();
+}
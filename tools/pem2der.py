@@ -0,0 +1,23 @@
+#!/usr/bin/env python3
+# Converts the certificates of a PEM file into DER, one after another (see CONFIG_TELEGRAM_TLS_DER_START)
+# Usage: pem2der.py certs/api_telegram_org.pem api_telegram_org.der
+
+import re
+import ssl
+import sys
+
+PEM_BLOCK = re.compile(r"-----BEGIN CERTIFICATE-----.+?-----END CERTIFICATE-----", re.DOTALL)
+
+def main():
+  if len(sys.argv) != 3:
+    sys.exit("Usage: pem2der.py <input.pem> <output.der>")
+  with open(sys.argv[1], "r", encoding="ascii") as f:
+    blocks = PEM_BLOCK.findall(f.read())
+  if not blocks:
+    sys.exit("No certificates found in " + sys.argv[1])
+  der = b"".join(ssl.PEM_cert_to_DER_cert(block) for block in blocks)
+  with open(sys.argv[2], "wb") as f:
+    f.write(der)
+
+if __name__ == "__main__":
+  main()